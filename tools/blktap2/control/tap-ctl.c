@@ -536,6 +536,47 @@ usage:
 	return EINVAL;
 }
 
+static void
+tap_cli_stats_usage(FILE *stream)
+{
+	fprintf(stream, "usage: stats <-p pid> <-m minor>\n");
+}
+
+static int
+tap_cli_stats(int argc, char **argv)
+{
+	int c, pid, minor;
+
+	pid   = -1;
+	minor = -1;
+
+	optind = 0;
+	while ((c = getopt(argc, argv, "p:m:h")) != -1) {
+		switch (c) {
+		case 'p':
+			pid = atoi(optarg);
+			break;
+		case 'm':
+			minor = atoi(optarg);
+			break;
+		case '?':
+			goto usage;
+		case 'h':
+			tap_cli_stats_usage(stdout);
+			return 0;
+		}
+	}
+
+	if (pid == -1 || minor == -1)
+		goto usage;
+
+	return -tap_ctl_stats(pid, minor, stdout);
+
+usage:
+	tap_cli_stats_usage(stderr);
+	return EINVAL;
+}
+
 static void
 tap_cli_unpause_usage(FILE *stream)
 {
@@ -717,6 +758,7 @@ struct command commands[] = {
 	{ .name = "unpause",      .func = tap_cli_unpause       },
 	{ .name = "major",        .func = tap_cli_major         },
 	{ .name = "check",        .func = tap_cli_check         },
+	{ .name = "stats",        .func = tap_cli_stats         },
 };
 
 #define print_commands()					\
@@ -28,6 +28,7 @@
 #ifndef __TAP_CTL_H__
 #define __TAP_CTL_H__
 
+#include <stdio.h>
 #include <syslog.h>
 #include <errno.h>
 #include <tapdisk-message.h>
@@ -96,6 +97,8 @@ int tap_ctl_close(const int id, const int minor, const int force);
 int tap_ctl_pause(const int id, const int minor);
 int tap_ctl_unpause(const int id, const int minor, const char *params);
 
+int tap_ctl_stats(const int id, const int minor, FILE *stream);
+
 int tap_ctl_blk_major(void);
 
 #endif
@@ -29,8 +29,12 @@
 #include <fcntl.h>
 #include <unistd.h>
 #include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
 #include <sys/mman.h>
+#include <sys/stat.h>
 
+#include "libvhd.h"
 #include "tapdisk.h"
 #include "tapdisk-utils.h"
 #include "tapdisk-driver.h"
@@ -45,67 +49,112 @@
 
 #define WARN(_f, _a...) tlog_write(TLOG_WARN, _f, ##_a)
 
-#define RADIX_TREE_PAGE_SHIFT           12 /* 4K pages */
-#define RADIX_TREE_PAGE_SIZE            (1 << RADIX_TREE_PAGE_SHIFT)
-
-#define RADIX_TREE_NODE_SHIFT           9 /* 512B nodes */
-#define RADIX_TREE_NODE_SIZE            (1 << RADIX_TREE_NODE_SHIFT)
-#define RADIX_TREE_NODE_MASK            (RADIX_TREE_NODE_SIZE - 1)
-
-#define BLOCK_CACHE_NODES_PER_PAGE      (1 << (RADIX_TREE_PAGE_SHIFT - RADIX_TREE_NODE_SHIFT))
+/*
+ * A read cache of read-only images, shared by all tapdisks on the host.
+ *
+ * The cache lives in a POSIX shared memory segment, created by the first
+ * tapdisk to open a cache and sized from TAPDISK2_BLOCK_CACHE_SIZE (MB) at
+ * that time.  Pages are keyed by the identity of the cached image (see
+ * block_cache_image_key(), so that a replaced or modified image never
+ * matches stale pages) and the page offset, so guests booting from the
+ * same parent share one copy of its hot pages.
+ *
+ * Replacement is ARC: recently used pages (T1) and frequently used pages
+ * (T2) compete for the cache, steered by the ghost lists B1 and B2 of
+ * their recently evicted keys.  Everything in the segment is linked by
+ * index, since each process maps it at its own address, and guarded by
+ * a robust process-shared mutex; if a holder dies, the cache is dropped.
+ */
 
-#define BLOCK_CACHE_MAX_SIZE            (10 << 20) /* 100MB cache */
+#define BLOCK_CACHE_SHM_NAME            "/tapdisk-block-cache"
+#define BLOCK_CACHE_MAGIC               0x74646263 /* "tdbc" */
+#define BLOCK_CACHE_VERSION             2
+
+#define BLOCK_CACHE_PAGE_SHIFT          12 /* 4K pages */
+#define BLOCK_CACHE_PAGE_SIZE           (1 << BLOCK_CACHE_PAGE_SHIFT)
+#define BLOCK_CACHE_SECTOR_SHIFT        9
+#define BLOCK_CACHE_SECTOR_SIZE         (1 << BLOCK_CACHE_SECTOR_SHIFT)
+#define BLOCK_CACHE_PAGE_SECS_SHIFT     (BLOCK_CACHE_PAGE_SHIFT - \
+					 BLOCK_CACHE_SECTOR_SHIFT)
+#define BLOCK_CACHE_PAGE_SECS           (1 << BLOCK_CACHE_PAGE_SECS_SHIFT)
+
+#define BLOCK_CACHE_MAX_SIZE            (100 << 20) /* default, 100MB */
+#define BLOCK_CACHE_MIN_SIZE            (1 << 20)
+#define BLOCK_CACHE_MAX_PAGES           32 /* per request */
 #define BLOCK_CACHE_REQUESTS            (TAPDISK_DATA_REQUESTS << 3)
-#define BLOCK_CACHE_PAGE_IDLETIME       60
+#define BLOCK_CACHE_INIT_WAIT           5000 /* ms, for the creator */
+
+#define BLOCK_CACHE_NIL                 ((uint32_t)-1)
 
-typedef struct radix_tree               radix_tree_t;
-typedef struct radix_tree_node          radix_tree_node_t;
-typedef struct radix_tree_link          radix_tree_link_t;
-typedef struct radix_tree_leaf          radix_tree_leaf_t;
-typedef struct radix_tree_page          radix_tree_page_t;
+#define BLOCK_CACHE_T1                  0 /* resident, seen once */
+#define BLOCK_CACHE_T2                  1 /* resident, seen again */
+#define BLOCK_CACHE_B1                  2 /* evicted from T1 */
+#define BLOCK_CACHE_B2                  3 /* evicted from T2 */
+#define BLOCK_CACHE_LISTS               4
 
 typedef struct block_cache              block_cache_t;
 typedef struct block_cache_request      block_cache_request_t;
 typedef struct block_cache_stats        block_cache_stats_t;
-
-struct radix_tree_page {
-	char                           *buf;
-	size_t                          size;
-	uint64_t                        sec;
-	radix_tree_link_t              *owners[BLOCK_CACHE_NODES_PER_PAGE];
-};
-
-struct radix_tree_leaf {
-	radix_tree_page_t              *page;
-	char                           *buf;
+typedef struct block_cache_shm          block_cache_shm_t;
+typedef struct block_cache_list         block_cache_list_t;
+typedef struct block_cache_entry        block_cache_entry_t;
+typedef struct block_cache_key          block_cache_key_t;
+
+struct block_cache_list {
+	uint32_t                        head;      /* mru */
+	uint32_t                        tail;      /* lru */
+	uint32_t                        size;
 };
 
-struct radix_tree_link {
-	uint32_t                        time;
-	union {
-		radix_tree_node_t      *next;
-		radix_tree_leaf_t       leaf;
-	} u;
+struct block_cache_key {
+	vhd_uuid_t                      uuid;      /* of a vhd, else nil */
+	uint64_t                        dev;
+	uint64_t                        ino;
+	uint64_t                        sectors;
+	uint64_t                        mtime;     /* ns */
+	uint64_t                        ctime;     /* ns */
 };
 
-struct radix_tree_node {
-	int                             height;
-	radix_tree_link_t               links[RADIX_TREE_NODE_SIZE];
+struct block_cache_entry {
+	uint64_t                        image;     /* hash of key */
+	block_cache_key_t               key;
+	uint64_t                        page;
+	uint32_t                        hnext;     /* hash chain, free list */
+	uint32_t                        prev;
+	uint32_t                        next;
+	uint32_t                        slot;      /* data page, if resident */
+	uint32_t                        list;
 };
 
-struct radix_tree {
-	int                             height;
+struct block_cache_shm {
+	uint32_t                        magic;
+	uint32_t                        version;
 	uint64_t                        size;
-	uint32_t                        nodes;
-	radix_tree_node_t              *root;
+	pthread_mutex_t                 lock;
 
-	block_cache_t                  *cache;
+	uint32_t                        pages;     /* resident capacity, c */
+	uint32_t                        entries;   /* directory size, 2c */
+	uint32_t                        hash_mask;
+	uint32_t                        target;    /* arc target size of T1 */
+	block_cache_list_t              lists[BLOCK_CACHE_LISTS];
+	uint32_t                        free_entry;
+	uint32_t                        free_slots;
+
+	uint64_t                        hash_off;
+	uint64_t                        entry_off;
+	uint64_t                        slot_off;  /* stack of free slots */
+	uint64_t                        data_off;
+
+	uint64_t                        hits;
+	uint64_t                        misses;
+	uint64_t                        inserts;
+	uint64_t                        evictions;
 };
 
 struct block_cache_request {
 	int                             err;
-	char                           *buf;
 	uint64_t                        secs;
+	char                           *buf;       /* private copy of the data */
 	td_request_t                    treq;
 	block_cache_t                  *cache;
 };
@@ -114,7 +163,7 @@ struct block_cache_stats {
 	uint64_t                        reads;
 	uint64_t                        hits;
 	uint64_t                        misses;
-	uint64_t                        prunes;
+	uint64_t                        inserts;
 };
 
 struct block_cache {
@@ -122,382 +171,637 @@ struct block_cache {
 	char                           *name;
 
 	uint64_t                        sectors;
+	uint64_t                        id;        /* hash of key */
+	block_cache_key_t               key;       /* image identity */
 
 	block_cache_request_t           requests[BLOCK_CACHE_REQUESTS];
 	block_cache_request_t          *request_free_list[BLOCK_CACHE_REQUESTS];
 	int                             requests_free;
 
-	event_id_t                      timeout_id;
-
-	radix_tree_t                    tree;
-
 	block_cache_stats_t             stats;
 };
 
-static inline uint64_t
-radix_tree_calculate_size(int height)
+/* the segment, mapped once per process */
+static block_cache_shm_t *block_cache_shm;
+static size_t block_cache_shm_size;
+static int block_cache_shm_users;
+
+static inline uint32_t *
+block_cache_shm_hash(block_cache_shm_t *shm)
 {
-	return (uint64_t)RADIX_TREE_NODE_SIZE <<
-	  (height * RADIX_TREE_NODE_SHIFT);
+	return (uint32_t *)((char *)shm + shm->hash_off);
 }
 
-static inline int
-radix_tree_calculate_height(uint64_t sectors)
+static inline block_cache_entry_t *
+block_cache_shm_entry(block_cache_shm_t *shm, uint32_t idx)
 {
-	int height;
-	uint64_t tree_size;
-
-	height = 1;  /* always allocate root node */
-	tree_size = radix_tree_calculate_size(height);
-	while (sectors > tree_size)
-		tree_size = radix_tree_calculate_size(++height);
+	return (block_cache_entry_t *)((char *)shm + shm->entry_off) + idx;
+}
 
-	return height;
+static inline uint32_t *
+block_cache_shm_slots(block_cache_shm_t *shm)
+{
+	return (uint32_t *)((char *)shm + shm->slot_off);
 }
 
-static inline int
-radix_tree_index(radix_tree_node_t *node, uint64_t sector)
+static inline char *
+block_cache_shm_page(block_cache_shm_t *shm, uint32_t slot)
 {
-	return ((sector >> (node->height * RADIX_TREE_NODE_SHIFT)) &
-		RADIX_TREE_NODE_MASK);
+	return (char *)shm + shm->data_off +
+		((uint64_t)slot << BLOCK_CACHE_PAGE_SHIFT);
 }
 
 static inline int
-radix_tree_node_contains_leaves(radix_tree_t *tree, radix_tree_node_t *node)
+block_cache_resident(block_cache_entry_t *e)
 {
-	return (node->height == 0);
+	return (e->list == BLOCK_CACHE_T1 || e->list == BLOCK_CACHE_T2);
 }
 
-static inline int
-radix_tree_node_is_root(radix_tree_t *tree, radix_tree_node_t *node)
+static inline uint32_t
+block_cache_hash_key(block_cache_shm_t *shm, uint64_t image, uint64_t page)
 {
-	return (node->height == tree->height);
+	uint64_t h;
+
+	h  = image ^ (page * 0x9e3779b97f4a7c15ULL);
+	h ^= h >> 29;
+	h *= 0xbf58476d1ce4e5b9ULL;
+	h ^= h >> 32;
+
+	return h & shm->hash_mask;
 }
 
-static inline uint64_t
-radix_tree_size(radix_tree_t *tree)
+static uint32_t
+block_cache_find(block_cache_shm_t *shm, uint64_t image,
+		 const block_cache_key_t *key, uint64_t page)
 {
-	return tree->size + tree->nodes * sizeof(radix_tree_node_t);
+	uint32_t idx;
+	block_cache_entry_t *e;
+
+	idx = block_cache_shm_hash(shm)[block_cache_hash_key(shm, image, page)];
+	while (idx != BLOCK_CACHE_NIL) {
+		e = block_cache_shm_entry(shm, idx);
+		if (e->image == image && e->page == page &&
+		    !memcmp(&e->key, key, sizeof(*key)))
+			return idx;
+		idx = e->hnext;
+	}
+
+	return BLOCK_CACHE_NIL;
 }
 
-static inline void
-radix_tree_clear_link(radix_tree_link_t *link)
+static void
+block_cache_hash_add(block_cache_shm_t *shm, uint32_t idx)
 {
-	if (link)
-		memset(link, 0, sizeof(radix_tree_link_t));
+	uint32_t *bucket;
+	block_cache_entry_t *e;
+
+	e        = block_cache_shm_entry(shm, idx);
+	bucket   = block_cache_shm_hash(shm) +
+		block_cache_hash_key(shm, e->image, e->page);
+	e->hnext = *bucket;
+	*bucket  = idx;
 }
 
-static inline radix_tree_node_t *
-radix_tree_allocate_node(radix_tree_t *tree, int height)
+static void
+block_cache_hash_del(block_cache_shm_t *shm, uint32_t idx)
 {
-	radix_tree_node_t *node;
+	uint32_t *link;
+	block_cache_entry_t *e;
 
-	node = calloc(1, sizeof(radix_tree_node_t));
-	if (!node)
-		return NULL;
+	e    = block_cache_shm_entry(shm, idx);
+	link = block_cache_shm_hash(shm) +
+		block_cache_hash_key(shm, e->image, e->page);
 
-	node->height = height;
-	tree->nodes++;
+	while (*link != BLOCK_CACHE_NIL) {
+		if (*link == idx) {
+			*link = e->hnext;
+			break;
+		}
+		link = &block_cache_shm_entry(shm, *link)->hnext;
+	}
 
-	return node;
+	e->hnext = BLOCK_CACHE_NIL;
 }
 
-static inline radix_tree_node_t *
-radix_tree_allocate_child_node(radix_tree_t *tree, radix_tree_node_t *parent)
+static void
+block_cache_list_del(block_cache_shm_t *shm, uint32_t idx)
 {
-	return radix_tree_allocate_node(tree, parent->height - 1);
-}
+	block_cache_list_t *list;
+	block_cache_entry_t *e;
 
-void
-radix_tree_free_node(radix_tree_t *tree, radix_tree_node_t *node)
-{
-	if (!node)
-		return;
+	e    = block_cache_shm_entry(shm, idx);
+	list = shm->lists + e->list;
+
+	if (e->prev != BLOCK_CACHE_NIL)
+		block_cache_shm_entry(shm, e->prev)->next = e->next;
+	else
+		list->head = e->next;
+
+	if (e->next != BLOCK_CACHE_NIL)
+		block_cache_shm_entry(shm, e->next)->prev = e->prev;
+	else
+		list->tail = e->prev;
 
-	free(node);
-	tree->nodes--;
+	list->size--;
+	e->prev = e->next = BLOCK_CACHE_NIL;
 }
 
-static inline radix_tree_page_t *
-radix_tree_allocate_page(radix_tree_t *tree,
-			 char *buf, uint64_t sec, size_t size)
+/* insert at the mru end */
+static void
+block_cache_list_add(block_cache_shm_t *shm, uint32_t idx, int which)
 {
-	radix_tree_page_t *page;
+	block_cache_list_t *list;
+	block_cache_entry_t *e;
 
-	page = calloc(1, sizeof(radix_tree_page_t));
-	if (!page)
-		return NULL;
+	e    = block_cache_shm_entry(shm, idx);
+	list = shm->lists + which;
+
+	e->list = which;
+	e->prev = BLOCK_CACHE_NIL;
+	e->next = list->head;
 
-	page->buf   = buf;
-	page->sec   = sec;
-	page->size  = size;
-	tree->size += size;
+	if (list->head != BLOCK_CACHE_NIL)
+		block_cache_shm_entry(shm, list->head)->prev = idx;
+	else
+		list->tail = idx;
 
-	return page;
+	list->head = idx;
+	list->size++;
 }
 
-static inline void
-radix_tree_free_page(radix_tree_t *tree, radix_tree_page_t *page)
+/* forget @idx entirely, returning its page, if any, to the free slots */
+static void
+block_cache_drop(block_cache_shm_t *shm, uint32_t idx)
 {
-	int i;
+	block_cache_entry_t *e;
+
+	if (idx == BLOCK_CACHE_NIL)
+		return;
+
+	e = block_cache_shm_entry(shm, idx);
+	if (block_cache_resident(e)) {
+		block_cache_shm_slots(shm)[shm->free_slots++] = e->slot;
+		shm->evictions++;
+	}
 
-	for (i = 0; i < page->size >> RADIX_TREE_NODE_SHIFT; i++)
-		DBG("%s: ejecting sector 0x%llx\n",
-		    tree->cache->name, page->sec + i);
+	block_cache_list_del(shm, idx);
+	block_cache_hash_del(shm, idx);
 
-	tree->cache->stats.prunes += (page->size >> RADIX_TREE_NODE_SHIFT);
-	tree->size -= page->size;
-	free(page->buf);
-	free(page);
+	e->slot         = BLOCK_CACHE_NIL;
+	e->hnext        = shm->free_entry;
+	shm->free_entry = idx;
 }
 
 /*
- * remove a leaf and the shared radix_tree_page_t containing its buffer.
- * leaves are deleted, nodes are not; gc will reap the nodes later.
+ * ARC replace: demote the lru page of T1 or T2 to its ghost list, as
+ * steered by the T1 target, and free its data page.
  */
 static void
-radix_tree_remove_page(radix_tree_t *tree, radix_tree_page_t *page)
+block_cache_replace(block_cache_shm_t *shm, int in_b2)
 {
-	int i;
+	uint32_t idx, t1;
+	block_cache_entry_t *e;
+	int from, to;
+
+	t1 = shm->lists[BLOCK_CACHE_T1].size;
+
+	if (t1 && ((in_b2 && t1 == shm->target) || t1 > shm->target)) {
+		from = BLOCK_CACHE_T1;
+		to   = BLOCK_CACHE_B1;
+	} else {
+		from = BLOCK_CACHE_T2;
+		to   = BLOCK_CACHE_B2;
+	}
 
-	if (!page)
-		return;
+	if (!shm->lists[from].size) {
+		from = (from == BLOCK_CACHE_T1 ? BLOCK_CACHE_T2 : BLOCK_CACHE_T1);
+		to   = (to == BLOCK_CACHE_B1 ? BLOCK_CACHE_B2 : BLOCK_CACHE_B1);
+	}
 
-	for (i = 0; i < BLOCK_CACHE_NODES_PER_PAGE; i++)
-		radix_tree_clear_link(page->owners[i]);
+	idx = shm->lists[from].tail;
+	e   = block_cache_shm_entry(shm, idx);
 
-	radix_tree_free_page(tree, page);
+	block_cache_list_del(shm, idx);
+	block_cache_shm_slots(shm)[shm->free_slots++] = e->slot;
+	e->slot = BLOCK_CACHE_NIL;
+	block_cache_list_add(shm, idx, to);
+	shm->evictions++;
 }
 
-static void
-radix_tree_insert_leaf(radix_tree_t *tree, radix_tree_link_t *link,
-		       radix_tree_page_t *page, off_t off)
+/*
+ * Cache page @page of image @key (hashed to @image) from @buf.  The lookup
+ * side only promotes hits; the rest of ARC runs here, once the data of a
+ * miss has arrived.
+ */
+static int
+block_cache_insert(block_cache_shm_t *shm, uint64_t image,
+		   const block_cache_key_t *key, uint64_t page, const char *buf)
 {
-	int i;
+	int which;
+	uint32_t idx, c, b1, b2, l1, total;
+	block_cache_entry_t *e;
+
+	c   = shm->pages;
+	b1  = shm->lists[BLOCK_CACHE_B1].size;
+	b2  = shm->lists[BLOCK_CACHE_B2].size;
+	idx = block_cache_find(shm, image, key, page);
+
+	if (idx != BLOCK_CACHE_NIL) {
+		e = block_cache_shm_entry(shm, idx);
+
+		if (block_cache_resident(e)) {
+			block_cache_list_del(shm, idx);
+			block_cache_list_add(shm, idx, BLOCK_CACHE_T2);
+			return 0;
+		}
 
-	if (off + RADIX_TREE_NODE_SIZE > page->size)
-		return;
+		/* ghost hit: adapt the target towards the list that missed */
+		if (e->list == BLOCK_CACHE_B1)
+			shm->target = MIN(c, shm->target + MAX(b2 / b1, 1));
+		else
+			shm->target -= MIN(shm->target, MAX(b1 / b2, 1));
 
-	for (i = 0; i < BLOCK_CACHE_NODES_PER_PAGE; i++) {
-		if (page->owners[i])
-			continue;
+		which = e->list;
+		block_cache_list_del(shm, idx);
+		if (!shm->free_slots)
+			block_cache_replace(shm, which == BLOCK_CACHE_B2);
 
-		page->owners[i]   = link;
-		link->u.leaf.page = page;
-		link->u.leaf.buf  = page->buf + off;
+		which = BLOCK_CACHE_T2;
+		goto fill;
+	}
 
-		break;
+	l1    = shm->lists[BLOCK_CACHE_T1].size + b1;
+	total = l1 + shm->lists[BLOCK_CACHE_T2].size + b2;
+
+	if (l1 >= c) {
+		if (shm->lists[BLOCK_CACHE_T1].size < c) {
+			block_cache_drop(shm, shm->lists[BLOCK_CACHE_B1].tail);
+			if (!shm->free_slots)
+				block_cache_replace(shm, 0);
+		} else
+			block_cache_drop(shm, shm->lists[BLOCK_CACHE_T1].tail);
+	} else if (total >= c) {
+		if (total >= 2 * c)
+			block_cache_drop(shm, shm->lists[BLOCK_CACHE_B2].tail);
+		if (!shm->free_slots)
+			block_cache_replace(shm, 0);
 	}
+
+	idx = shm->free_entry;
+	if (idx == BLOCK_CACHE_NIL || !shm->free_slots)
+		return -ENOSPC;
+
+	e               = block_cache_shm_entry(shm, idx);
+	shm->free_entry = e->hnext;
+	e->image        = image;
+	e->key          = *key;
+	e->page         = page;
+	block_cache_hash_add(shm, idx);
+	which           = BLOCK_CACHE_T1;
+
+fill:
+	e->slot = block_cache_shm_slots(shm)[--shm->free_slots];
+	memcpy(block_cache_shm_page(shm, e->slot), buf, BLOCK_CACHE_PAGE_SIZE);
+	block_cache_list_add(shm, idx, which);
+	shm->inserts++;
+
+	return 0;
 }
 
-static char *
-radix_tree_find_leaf(radix_tree_t *tree, uint64_t sector)
+static void
+block_cache_shm_reset(block_cache_shm_t *shm)
 {
-	int idx;
-	struct timeval now;
-	radix_tree_link_t *link;
-	radix_tree_node_t *node;
+	int i;
+	uint32_t *hash, *slots;
+	block_cache_entry_t *e;
+
+	hash  = block_cache_shm_hash(shm);
+	slots = block_cache_shm_slots(shm);
+
+	for (i = 0; i <= shm->hash_mask; i++)
+		hash[i] = BLOCK_CACHE_NIL;
+
+	for (i = 0; i < shm->entries; i++) {
+		e        = block_cache_shm_entry(shm, i);
+		memset(e, 0, sizeof(*e));
+		e->prev  = e->next = e->slot = BLOCK_CACHE_NIL;
+		e->hnext = (i + 1 < shm->entries ? i + 1 : BLOCK_CACHE_NIL);
+	}
+
+	for (i = 0; i < shm->pages; i++)
+		slots[i] = shm->pages - 1 - i;
 
-	node = tree->root;
-	gettimeofday(&now, NULL);
+	for (i = 0; i < BLOCK_CACHE_LISTS; i++) {
+		shm->lists[i].head = shm->lists[i].tail = BLOCK_CACHE_NIL;
+		shm->lists[i].size = 0;
+	}
 
-	do {
-		idx        = radix_tree_index(node, sector);
-		link       = node->links + idx;
-		link->time = now.tv_sec;
+	shm->target     = 0;
+	shm->free_entry = 0;
+	shm->free_slots = shm->pages;
+}
 
-		if (radix_tree_node_contains_leaves(tree, node))
-			return link->u.leaf.buf;
+static int
+block_cache_shm_lock(block_cache_shm_t *shm)
+{
+	int err;
+
+	err = pthread_mutex_lock(&shm->lock);
+	if (err == EOWNERDEAD) {
+		WARN("block cache lock holder died, dropping cache\n");
+		block_cache_shm_reset(shm);
+		pthread_mutex_consistent(&shm->lock);
+		err = 0;
+	}
 
-		if (!link->u.next)
-			return NULL;
+	return -err;
+}
 
-		node = link->u.next;
-	} while (1);
+static inline void
+block_cache_shm_unlock(block_cache_shm_t *shm)
+{
+	pthread_mutex_unlock(&shm->lock);
 }
 
-static char *
-radix_tree_add_leaf(radix_tree_t *tree, uint64_t sector,
-		    radix_tree_page_t *page, off_t off)
+/*
+ * Lay out a cache of @size bytes in @shm: how many pages it holds and
+ * where its tables are.  This is all derived from @size, so an existing
+ * cache is checked against it before anything in it is used.
+ */
+static int
+block_cache_shm_layout(block_cache_shm_t *shm, uint64_t size)
 {
-	int idx;
-	struct timeval now;
-	radix_tree_link_t *link;
-	radix_tree_node_t *node;
+	uint64_t c, buckets, per_page, off;
 
-	node = tree->root;
-	gettimeofday(&now, NULL);
+	per_page = BLOCK_CACHE_PAGE_SIZE + 2 * sizeof(block_cache_entry_t) +
+		3 * sizeof(uint32_t);
+	off      = (sizeof(*shm) + BLOCK_CACHE_PAGE_SIZE - 1) &
+		~(uint64_t)(BLOCK_CACHE_PAGE_SIZE - 1);
 
-	do {
-		idx        = radix_tree_index(node, sector);
-		link       = node->links + idx;
-		link->time = now.tv_sec;
+	if (size < off + BLOCK_CACHE_PAGE_SIZE)
+		return -EINVAL;
 
-		if (radix_tree_node_contains_leaves(tree, node)) {
-			radix_tree_remove_page(tree, link->u.leaf.page);
-			radix_tree_insert_leaf(tree, link, page, off);
-			return link->u.leaf.buf;
-		}
+	c = (size - off - BLOCK_CACHE_PAGE_SIZE) / per_page;
+	if (!c || 2 * c >= BLOCK_CACHE_NIL)
+		return -EINVAL;
 
-		if (!link->u.next) {
-			link->u.next = radix_tree_allocate_child_node(tree,
-								      node);
-			if (!link->u.next)
-				return NULL;
-		}
+	for (buckets = 1; buckets < c; buckets <<= 1)
+		;
+
+	shm->size      = size;
+	shm->pages     = c;
+	shm->entries   = 2 * c;
+	shm->hash_mask = buckets - 1;
+	shm->hash_off  = off;
+	shm->entry_off = (off + buckets * sizeof(uint32_t) + 7) & ~7ULL;
+	shm->slot_off  = shm->entry_off + shm->entries *
+		sizeof(block_cache_entry_t);
+	shm->data_off  = (shm->slot_off + c * sizeof(uint32_t) +
+			  BLOCK_CACHE_PAGE_SIZE - 1) &
+		~(uint64_t)(BLOCK_CACHE_PAGE_SIZE - 1);
 
-		node = link->u.next;
-	} while (1);
+	return 0;
 }
 
 static int
-radix_tree_add_leaves(radix_tree_t *tree, char *buf,
-		      uint64_t sector, uint64_t sectors)
+block_cache_shm_check_layout(const block_cache_shm_t *shm, uint64_t size)
 {
-	int i;
-	radix_tree_page_t *page;
+	block_cache_shm_t l;
 
-	page = radix_tree_allocate_page(tree, buf, sector,
-					sectors << RADIX_TREE_NODE_SHIFT);
-	if (!page)
-		return -ENOMEM;
+	if (block_cache_shm_layout(&l, size))
+		return -EINVAL;
 
-	for (i = 0; i < sectors; i++)
-		if (!radix_tree_add_leaf(tree, sector + i, 
-					 page, (i << RADIX_TREE_NODE_SHIFT)))
-			goto fail;
+	if (shm->size != l.size ||
+	    shm->pages != l.pages ||
+	    shm->entries != l.entries ||
+	    shm->hash_mask != l.hash_mask ||
+	    shm->hash_off != l.hash_off ||
+	    shm->entry_off != l.entry_off ||
+	    shm->slot_off != l.slot_off ||
+	    shm->data_off != l.data_off)
+		return -EINVAL;
 
 	return 0;
-
-fail:
-	page->buf = NULL;
-	radix_tree_remove_page(tree, page);
-	return -ENOMEM;
 }
 
-static void
-radix_tree_delete_branch(radix_tree_t *tree, radix_tree_node_t *node)
+static int
+block_cache_shm_format(block_cache_shm_t *shm, uint64_t size)
 {
-	int i;
-	radix_tree_link_t *link;
-
-	if (!node)
-		return;
+	int err;
+	pthread_mutexattr_t attr;
 
-	for (i = 0; i < RADIX_TREE_NODE_SIZE; i++) {
-		link = node->links + i;
+	err = block_cache_shm_layout(shm, size);
+	if (err)
+		return err;
 
-		if (radix_tree_node_contains_leaves(tree, node))
-			radix_tree_remove_page(tree, link->u.leaf.page);
-		else
-			radix_tree_delete_branch(tree, link->u.next);
+	pthread_mutexattr_init(&attr);
+	pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+	pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST);
+	err = pthread_mutex_init(&shm->lock, &attr);
+	pthread_mutexattr_destroy(&attr);
+	if (err)
+		return -err;
 
-		radix_tree_clear_link(link);
-	}
+	block_cache_shm_reset(shm);
 
-	radix_tree_free_node(tree, node);
+	return 0;
 }
 
-static inline void
-radix_tree_destroy(radix_tree_t *tree)
+static uint64_t
+block_cache_shm_config_size(void)
 {
-	radix_tree_delete_branch(tree, tree->root);
-	tree->root = NULL;
+	char *env;
+	uint64_t size;
+
+	size = BLOCK_CACHE_MAX_SIZE;
+
+	env = getenv("TAPDISK2_BLOCK_CACHE_SIZE");
+	if (env && atoi(env) > 0)
+		size = (uint64_t)atoi(env) << 20;
+
+	return MAX(size, BLOCK_CACHE_MIN_SIZE);
 }
 
-/*
- * returns 1 if @node is empty after pruning, 0 otherwise
- */
 static int
-radix_tree_prune_branch(radix_tree_t *tree,
-			radix_tree_node_t *node, uint32_t now)
+block_cache_shm_attach(void)
 {
-	int i, empty;
-	radix_tree_link_t *link;
+	int fd, err, create, i;
+	uint64_t size;
+	struct stat st;
+	block_cache_shm_t *shm;
+
+	if (block_cache_shm) {
+		block_cache_shm_users++;
+		return 0;
+	}
 
-	empty = 1;
-	if (!node)
-		return empty;
+	create = 1;
+	size   = block_cache_shm_config_size();
 
-	for (i = 0; i < RADIX_TREE_NODE_SIZE; i++) {
-		link = node->links + i;
+	fd = shm_open(BLOCK_CACHE_SHM_NAME, O_RDWR | O_CREAT | O_EXCL, 0600);
+	if (fd == -1 && errno == EEXIST) {
+		create = 0;
+		fd = shm_open(BLOCK_CACHE_SHM_NAME, O_RDWR, 0600);
+	}
+	if (fd == -1)
+		return -errno;
+
+	if (create) {
+		if (ftruncate(fd, size)) {
+			err = -errno;
+			shm_unlink(BLOCK_CACHE_SHM_NAME);
+			goto out;
+		}
+	} else {
+		/*
+		 * anyone can create objects in /dev/shm: only use one which
+		 * only we (i.e., another tapdisk) can have written
+		 */
+		if (fstat(fd, &st)) {
+			err = -errno;
+			goto out;
+		}
+		if (st.st_uid != geteuid() || (st.st_mode & 077)) {
+			WARN("%s: not owned by us or accessible to others, "
+			     "not using it\n", BLOCK_CACHE_SHM_NAME);
+			err = -EACCES;
+			goto out;
+		}
 
-		if (now - link->time < BLOCK_CACHE_PAGE_IDLETIME) {
-			if (radix_tree_node_contains_leaves(tree, node)) {
-				empty = 0;
-				continue;
+		/* the creator may not have sized it yet */
+		for (i = 0; i < BLOCK_CACHE_INIT_WAIT; i++) {
+			if (fstat(fd, &st)) {
+				err = -errno;
+				goto out;
 			}
+			if (st.st_size >= sizeof(*shm))
+				break;
+			usleep(1000);
+		}
 
-			if (radix_tree_prune_branch(tree, link->u.next, now))
-				radix_tree_clear_link(link);
-			else
-				empty = 0;
-
-			continue;
+		size = st.st_size;
+		if (size < sizeof(*shm)) {
+			err = -EAGAIN;
+			goto out;
 		}
+	}
 
-		if (radix_tree_node_contains_leaves(tree, node))
-			radix_tree_remove_page(tree, link->u.leaf.page);
-		else
-			radix_tree_delete_branch(tree, link->u.next);
+	shm = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (shm == MAP_FAILED) {
+		err = -errno;
+		if (create)
+			shm_unlink(BLOCK_CACHE_SHM_NAME);
+		goto out;
+	}
 
-		radix_tree_clear_link(link);
+	if (create) {
+		err = block_cache_shm_format(shm, size);
+		if (err) {
+			munmap(shm, size);
+			shm_unlink(BLOCK_CACHE_SHM_NAME);
+			goto out;
+		}
+
+		shm->version = BLOCK_CACHE_VERSION;
+		__sync_synchronize();
+		shm->magic   = BLOCK_CACHE_MAGIC;
+	} else {
+		for (i = 0; i < BLOCK_CACHE_INIT_WAIT; i++) {
+			if (shm->magic == BLOCK_CACHE_MAGIC)
+				break;
+			usleep(1000);
+		}
+		__sync_synchronize();
+
+		if (shm->magic != BLOCK_CACHE_MAGIC ||
+		    shm->version != BLOCK_CACHE_VERSION ||
+		    block_cache_shm_check_layout(shm, size)) {
+			munmap(shm, size);
+			err = -EINVAL;
+			goto out;
+		}
 	}
 
-	if (empty && !radix_tree_node_is_root(tree, node))
-		radix_tree_free_node(tree, node);
+	DPRINTF("%s block cache: %"PRIu64" bytes, %u pages\n",
+		(create ? "created" : "attached to"), size, shm->pages);
+
+	block_cache_shm      = shm;
+	block_cache_shm_size = size;
+	block_cache_shm_users++;
+	err = 0;
 
-	return empty;
+out:
+	close(fd);
+	return err;
 }
 
-/*
- * walk tree and free any node that has been idle for too long
- */
 static void
-radix_tree_prune(radix_tree_t *tree)
+block_cache_shm_detach(void)
 {
-	struct timeval now;
-
-	if (!tree->root)
+	if (!block_cache_shm || --block_cache_shm_users)
 		return;
 
-	DPRINTF("tree %s has %"PRIu64" bytes\n",
-		tree->cache->name, tree->size);
-
-	gettimeofday(&now, NULL);
-	radix_tree_prune_branch(tree, tree->root, now.tv_sec);
-
-	DPRINTF("tree %s now has %"PRIu64" bytes\n",
-		tree->cache->name, tree->size);
+	munmap(block_cache_shm, block_cache_shm_size);
+	block_cache_shm      = NULL;
+	block_cache_shm_size = 0;
 }
 
-static inline int
-radix_tree_initialize(radix_tree_t *tree, uint64_t sectors)
+static inline uint64_t
+block_cache_timespec_ns(const struct timespec *ts)
 {
-	tree->height = radix_tree_calculate_height(sectors);
-	tree->root   = radix_tree_allocate_node(tree, tree->height);
-	if (!tree->root)
-		return -ENOMEM;
-
-	return 0;
+	return (uint64_t)ts->tv_sec * 1000000000ULL + ts->tv_nsec;
 }
 
-static inline void
-radix_tree_free(radix_tree_t *tree)
+/*
+ * identity of the cached image: a different image, or the same one
+ * modified or recreated, must not hit pages cached from the old contents.
+ * vhds carry a uuid, which is new whenever one is created.  For a block
+ * device (whose number gets reused, and whose st_size is 0) the times are
+ * those of its node, which is made anew along with the device.  Times are
+ * taken to the nanosecond.  Each cached page keeps the full key; @id, its
+ * hash, only picks the bucket.
+ */
+static int
+block_cache_image_key(const char *name, uint64_t sectors,
+		      block_cache_key_t *key, uint64_t *id)
 {
-	radix_tree_destroy(tree);
-}
+	int i;
+	uint64_t h;
+	struct stat st;
+	vhd_context_t vhd;
+	const unsigned char *p;
 
-static void
-block_cache_prune_event(event_id_t id, char mode, void *private)
-{
-	radix_tree_t *tree;
-	block_cache_t *cache;
+	if (stat(name, &st))
+		return -errno;
+
+	memset(key, 0, sizeof(*key));
+
+	if (!vhd_open(&vhd, name, VHD_OPEN_RDONLY)) {
+		vhd_uuid_copy(&key->uuid, &vhd.footer.uuid);
+		vhd_close(&vhd);
+	}
 
-	cache = (block_cache_t *)private;
-	tree  = &cache->tree;
+	if (S_ISBLK(st.st_mode))
+		key->dev = st.st_rdev;
+	else {
+		key->dev = st.st_dev;
+		key->ino = st.st_ino;
+	}
+
+	key->sectors = sectors;
+	key->mtime   = block_cache_timespec_ns(&st.st_mtim);
+	key->ctime   = block_cache_timespec_ns(&st.st_ctim);
+
+	/* fnv-1a */
+	h = 0xcbf29ce484222325ULL;
+	p = (const unsigned char *)key;
+	for (i = 0; i < sizeof(*key); i++) {
+		h ^= p[i];
+		h *= 0x100000001b3ULL;
+	}
 
-	radix_tree_prune(tree);
+	*id = h;
+	return 0;
 }
 
 static inline block_cache_request_t *
@@ -520,13 +824,12 @@ static int
 block_cache_open(td_driver_t *driver, const char *name, td_flag_t flags)
 {
 	int i, err;
-	radix_tree_t *tree;
 	block_cache_t *cache;
 
 	if (!td_flag_test(flags, TD_OPEN_RDONLY))
 		return -EINVAL;
 
-	if (driver->info.sector_size != RADIX_TREE_NODE_SIZE)
+	if (driver->info.sector_size != BLOCK_CACHE_SECTOR_SIZE)
 		return -EINVAL;
 
 	cache = (block_cache_t *)driver->data;
@@ -536,158 +839,174 @@ block_cache_open(td_driver_t *driver, const char *name, td_flag_t flags)
 
 	cache->sectors = driver->info.size;
 
-	tree = &cache->tree;
-	err  = radix_tree_initialize(tree, cache->sectors);
+	err = block_cache_image_key(name, cache->sectors,
+				    &cache->key, &cache->id);
+	if (err)
+		goto fail;
+
+	err = block_cache_shm_attach();
 	if (err)
 		goto fail;
 
-	tree->cache = cache;
 	cache->requests_free = BLOCK_CACHE_REQUESTS;
 	for (i = 0; i < BLOCK_CACHE_REQUESTS; i++)
 		cache->request_free_list[i] = cache->requests + i;
 
-	cache->timeout_id = tapdisk_server_register_event(SCHEDULER_POLL_TIMEOUT,
-							  -1, /* dummy fd */
-							  BLOCK_CACHE_PAGE_IDLETIME << 1,
-							  block_cache_prune_event,
-							  cache);
-	if (cache->timeout_id < 0)
-		goto fail;
-
-	DPRINTF("opening cache for %s, sectors: %"PRIu64", "
-		"tree: %p, height: %d\n",
-		cache->name, cache->sectors, tree, tree->height);
-
-	if (mlockall(MCL_CURRENT | MCL_FUTURE))
-		DPRINTF("mlockall failed: %d\n", -errno);
+	DPRINTF("opening cache for %s, sectors: %"PRIu64", id: 0x%016"PRIx64"\n",
+		cache->name, cache->sectors, cache->id);
 
 	return 0;
 
 fail:
 	free(cache->name);
-	radix_tree_free(&cache->tree);
+	cache->name = NULL;
 	return err;
 }
 
 static int
 block_cache_close(td_driver_t *driver)
 {
-	radix_tree_t *tree;
 	block_cache_t *cache;
 
 	cache = (block_cache_t *)driver->data;
-	tree  = &cache->tree;
 
 	DPRINTF("closing cache for %s\n", cache->name);
 
-	tapdisk_server_unregister_event(cache->timeout_id);
-	radix_tree_free(tree);
+	block_cache_shm_detach();
 	free(cache->name);
 
 	return 0;
 }
 
-static inline uint64_t
-block_cache_hash(block_cache_t *cache, char *buf)
+/*
+ * serve @treq from the cache if every page it touches is resident;
+ * otherwise leave the cache untouched
+ */
+static int
+block_cache_lookup(block_cache_t *cache, td_request_t treq)
 {
 	int i, n;
-	uint64_t cksm, *data;
-
-	return 0;
-
-	cksm = 0;
-	data = (uint64_t *)buf;
-	n    = RADIX_TREE_NODE_SIZE / sizeof(uint64_t);
-
-	for (i = 0; i < n; i++)
-		cksm += data[i];
-
-	return ~cksm;
-}
-
-static void
-block_cache_hit(block_cache_t *cache, td_request_t treq, char *iov[])
-{
-	int i;
-	off_t off;
+	char *page;
+	uint64_t first, start, from, to, end;
+	uint32_t idx[BLOCK_CACHE_MAX_PAGES];
+	block_cache_entry_t *e;
+	block_cache_shm_t *shm = block_cache_shm;
+
+	end   = treq.sec + treq.secs;
+	first = treq.sec >> BLOCK_CACHE_PAGE_SECS_SHIFT;
+	n     = ((end - 1) >> BLOCK_CACHE_PAGE_SECS_SHIFT) - first + 1;
+	if (n > BLOCK_CACHE_MAX_PAGES)
+		return 0;
+
+	if (block_cache_shm_lock(shm))
+		return 0;
+
+	for (i = 0; i < n; i++) {
+		idx[i] = block_cache_find(shm, cache->id, &cache->key,
+					  first + i);
+		if (idx[i] == BLOCK_CACHE_NIL ||
+		    !block_cache_resident(block_cache_shm_entry(shm, idx[i]))) {
+			shm->misses++;
+			block_cache_shm_unlock(shm);
+			return 0;
+		}
+	}
 
-	cache->stats.hits += treq.secs;
+	for (i = 0; i < n; i++) {
+		e     = block_cache_shm_entry(shm, idx[i]);
+		page  = block_cache_shm_page(shm, e->slot);
+		start = (first + i) << BLOCK_CACHE_PAGE_SECS_SHIFT;
+		from  = MAX(treq.sec, start);
+		to    = MIN(end, start + BLOCK_CACHE_PAGE_SECS);
 
-	for (i = 0; i < treq.secs; i++) {
-		DBG("%s: block cache hit: sec 0x%08llx, hash: 0x%08llx\n",
-		    cache->name, treq.sec + i, block_cache_hash(cache, iov[i]));
+		memcpy(treq.buf + ((from - treq.sec) << BLOCK_CACHE_SECTOR_SHIFT),
+		       page + ((from - start) << BLOCK_CACHE_SECTOR_SHIFT),
+		       (to - from) << BLOCK_CACHE_SECTOR_SHIFT);
 
-		off = i << RADIX_TREE_NODE_SHIFT;
-		memcpy(treq.buf + off, iov[i], RADIX_TREE_NODE_SIZE);
+		block_cache_list_del(shm, idx[i]);
+		block_cache_list_add(shm, idx[i], BLOCK_CACHE_T2);
 	}
 
-	td_complete_request(treq, 0);
+	shm->hits++;
+	block_cache_shm_unlock(shm);
+
+	return 1;
 }
 
 static void
 block_cache_populate_cache(td_request_t clone, int err)
 {
-	int i;
-	radix_tree_t *tree;
+	td_request_t treq;
 	block_cache_t *cache;
+	block_cache_shm_t *shm;
 	block_cache_request_t *breq;
+	uint64_t page, last, off;
 
 	breq        = (block_cache_request_t *)clone.cb_data;
 	cache       = breq->cache;
-	tree        = &cache->tree;
+	shm         = block_cache_shm;
+	treq        = breq->treq;
 	breq->secs -= clone.secs;
 	breq->err   = (breq->err ? breq->err : err);
 
 	if (breq->secs)
 		return;
 
-	if (breq->err) {
-		free(breq->buf);
+	if (breq->err)
 		goto out;
-	}
 
-	for (i = 0; i < breq->treq.secs; i++) {
-		off_t off = i << RADIX_TREE_NODE_SHIFT;
-		DBG("%s: populating sec 0x%08llx\n",
-		    cache->name, breq->treq.sec + i);
-		memcpy(breq->treq.buf + off,
-		       breq->buf + off, RADIX_TREE_NODE_SIZE);
+	/* only pages the request covers entirely */
+	page = (treq.sec + BLOCK_CACHE_PAGE_SECS - 1) >>
+		BLOCK_CACHE_PAGE_SECS_SHIFT;
+	last = (treq.sec + treq.secs) >> BLOCK_CACHE_PAGE_SECS_SHIFT;
+
+	if (page < last && !block_cache_shm_lock(shm)) {
+		for (; page < last; page++) {
+			off = ((page << BLOCK_CACHE_PAGE_SECS_SHIFT) -
+			       treq.sec) << BLOCK_CACHE_SECTOR_SHIFT;
+			DBG("%s: populating page 0x%08"PRIx64"\n",
+			    cache->name, page);
+			if (block_cache_insert(shm, cache->id, &cache->key,
+					       page, breq->buf + off))
+				break;
+			cache->stats.inserts++;
+		}
+
+		block_cache_shm_unlock(shm);
 	}
 
-	if (radix_tree_add_leaves(tree, breq->buf,
-				  breq->treq.sec, breq->treq.secs))
-		free(breq->buf);
+	memcpy(treq.buf, breq->buf, treq.secs << BLOCK_CACHE_SECTOR_SHIFT);
 
 out:
-	td_complete_request(breq->treq, breq->err);
+	err = breq->err;
+	free(breq->buf);
 	block_cache_put_request(cache, breq);
+	td_complete_request(treq, err);
 }
 
 static void
 block_cache_miss(block_cache_t *cache, td_request_t treq)
 {
-	char *buf;
-	size_t size;
 	td_request_t clone;
-	radix_tree_t *tree;
 	block_cache_request_t *breq;
 
-	DBG("%s: block cache miss: sec 0x%08llx\n", cache->name, treq.sec);
+	DBG("%s: block cache miss: sec 0x%08"PRIx64"\n", cache->name, treq.sec);
 
 	clone = treq;
-	tree  = &cache->tree;
-	size  = treq.secs << RADIX_TREE_NODE_SHIFT;
-
 	cache->stats.misses += treq.secs;
 
-	if (radix_tree_size(tree) + size >= BLOCK_CACHE_MAX_SIZE)
-		goto out;
-
 	breq = block_cache_get_request(cache);
 	if (!breq)
 		goto out;
 
-	if (posix_memalign((void **)&buf, RADIX_TREE_NODE_SIZE, size)) {
+	/*
+	 * Read misses into a buffer of our own, and fill the cache from
+	 * that.  The request's buffer is granted by the guest, which could
+	 * rewrite it before we copy it, and so feed its own data to every
+	 * other reader of the image.
+	 */
+	if (posix_memalign((void **)&breq->buf, BLOCK_CACHE_PAGE_SIZE,
+			   treq.secs << BLOCK_CACHE_SECTOR_SHIFT)) {
 		block_cache_put_request(cache, breq);
 		goto out;
 	}
@@ -695,10 +1014,9 @@ block_cache_miss(block_cache_t *cache, td_request_t treq)
 	breq->treq    = treq;
 	breq->secs    = treq.secs;
 	breq->err     = 0;
-	breq->buf     = buf;
 	breq->cache   = cache;
 
-	clone.buf     = buf;
+	clone.buf     = breq->buf;
 	clone.cb      = block_cache_populate_cache;
 	clone.cb_data = breq;
 
@@ -709,26 +1027,17 @@ out:
 static void
 block_cache_queue_read(td_driver_t *driver, td_request_t treq)
 {
-	int i;
-	radix_tree_t *tree;
 	block_cache_t *cache;
-	char *iov[BLOCK_CACHE_NODES_PER_PAGE];
 
 	cache = (block_cache_t *)driver->data;
-	tree  = &cache->tree;
 
 	cache->stats.reads += treq.secs;
 
-	if (treq.secs > BLOCK_CACHE_NODES_PER_PAGE)
-		return td_forward_request(treq);
-
-	for (i = 0; i < treq.secs; i++) {
-		iov[i] = radix_tree_find_leaf(tree, treq.sec + i);
-		if (!iov[i])
-			return block_cache_miss(cache, treq);
-	}
+	if (!block_cache_lookup(cache, treq))
+		return block_cache_miss(cache, treq);
 
-	return block_cache_hit(cache, treq, iov);
+	cache->stats.hits += treq.secs;
+	td_complete_request(treq, 0);
 }
 
 static void
@@ -764,13 +1073,44 @@ block_cache_debug(td_driver_t *driver)
 {
 	block_cache_t *cache;
 	block_cache_stats_t *stats;
+	block_cache_shm_t *shm = block_cache_shm;
 
 	cache = (block_cache_t *)driver->data;
 	stats = &cache->stats;
 
 	WARN("BLOCK CACHE %s\n", cache->name);
-	WARN("reads: %"PRIu64", hits: %"PRIu64", misses: %"PRIu64", prunes: %"PRIu64"\n",
-	     stats->reads, stats->hits, stats->misses, stats->prunes);
+	WARN("reads: %"PRIu64", hits: %"PRIu64", misses: %"PRIu64", "
+	     "inserts: %"PRIu64"\n", stats->reads, stats->hits,
+	     stats->misses, stats->inserts);
+	WARN("shared: pages: %u, t1: %u, t2: %u, b1: %u, b2: %u, "
+	     "target: %u\n", shm->pages,
+	     shm->lists[BLOCK_CACHE_T1].size, shm->lists[BLOCK_CACHE_T2].size,
+	     shm->lists[BLOCK_CACHE_B1].size, shm->lists[BLOCK_CACHE_B2].size,
+	     shm->target);
+}
+
+static int
+block_cache_stats(td_driver_t *driver, char *buf, size_t size)
+{
+	block_cache_t *cache;
+	block_cache_stats_t *stats;
+	block_cache_shm_t *shm = block_cache_shm;
+
+	cache = (block_cache_t *)driver->data;
+	stats = &cache->stats;
+
+	return snprintf(buf, size, "block cache: reads: %"PRIu64", "
+			"hits: %"PRIu64", misses: %"PRIu64", "
+			"inserts: %"PRIu64", host: %u/%u pages "
+			"(t1: %u, t2: %u, target: %u), hits: %"PRIu64", "
+			"misses: %"PRIu64", evictions: %"PRIu64", file: %s",
+			stats->reads, stats->hits, stats->misses,
+			stats->inserts,
+			shm->lists[BLOCK_CACHE_T1].size +
+			shm->lists[BLOCK_CACHE_T2].size, shm->pages,
+			shm->lists[BLOCK_CACHE_T1].size,
+			shm->lists[BLOCK_CACHE_T2].size, shm->target,
+			shm->hits, shm->misses, shm->evictions, cache->name);
 }
 
 struct tap_disk tapdisk_block_cache = {
@@ -784,4 +1124,5 @@ struct tap_disk tapdisk_block_cache = {
 	.td_get_parent_id           = block_cache_get_parent_id,
 	.td_validate_parent         = block_cache_validate_parent,
 	.td_debug                   = block_cache_debug,
+	.td_stats                   = block_cache_stats,
 };
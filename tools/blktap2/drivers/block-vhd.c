@@ -72,10 +72,10 @@ unsigned int SPB;
 	do {								\
 		DBG(TLOG_DBG, "%s: QUEUED: %" PRIu64 ", COMPLETED: %"	\
 		    PRIu64", RETURNED: %" PRIu64 ", DATA_ALLOCATED: "	\
-		    "%lu, BBLK: 0x%04x\n",				\
+		    "%lu, ALLOCS: %d\n",				\
 		    s->vhd.file, s->queued, s->completed, s->returned,	\
 		    VHD_REQS_DATA - s->vreq_free_count,			\
-		    s->bat.pbw_blk);					\
+		    s->bat.nr_allocs);					\
 	} while(0)
 
 #define __ASSERT(_p)							\
@@ -109,7 +109,17 @@ unsigned int SPB;
 #endif
 
 /******VHD DEFINES******/
-#define VHD_CACHE_SIZE               32
+#define VHD_CACHE_SIZE               32       /* minimum bitmap cache */
+#define VHD_CACHE_MAX                65536
+#define VHD_CACHE_MEM                (1 << 20)  /* default budget, bytes */
+
+/* sequential blocks seen before their successors' bitmaps are read */
+#define VHD_BM_PREFETCH_RUN          2
+#define VHD_BM_PREFETCH_MAX          8
+
+/* block allocations in flight, and BAT sectors per metadata write */
+#define VHD_BAT_ALLOC_MAX            32
+#define VHD_BAT_FLUSH_SECS           8
 
 #define VHD_REQS_DATA                TAPDISK_DATA_REQUESTS
 #define VHD_REQS_META                (VHD_CACHE_SIZE + 2)
@@ -136,13 +146,18 @@ unsigned int SPB;
 #define VHD_FLAG_OPEN_QUERY          16
 #define VHD_FLAG_OPEN_PREALLOCATE    32
 
-#define VHD_FLAG_BAT_LOCKED          1
 #define VHD_FLAG_BAT_WRITE_STARTED   2
 
+#define VHD_FLAG_ALLOC_USED          1
+#define VHD_FLAG_ALLOC_ZEROED        2
+#define VHD_FLAG_ALLOC_FLUSHING      4
+#define VHD_FLAG_ALLOC_WAITING       8
+
 #define VHD_FLAG_BM_UPDATE_BAT       1
 #define VHD_FLAG_BM_WRITE_PENDING    2
 #define VHD_FLAG_BM_READ_PENDING     4
 #define VHD_FLAG_BM_LOCKED           8
+#define VHD_FLAG_BM_PREFETCHED       16
 
 #define VHD_FLAG_REQ_UPDATE_BAT      1
 #define VHD_FLAG_REQ_UPDATE_BITMAP   2
@@ -182,20 +197,30 @@ struct vhd_request {
 	struct vhd_transaction   *tx;
 };
 
+struct vhd_bat_alloc {
+	uint32_t                  blk;         /* blk num of pending write */
+	vhd_flag_t                status;
+	uint64_t                  lb_end;      /* next_db before reservation */
+	uint64_t                  offset;      /* file offset of block */
+	struct vhd_request        zero_req;    /* for initializing bitmap */
+};
+
 struct vhd_bat_state {
 	vhd_bat_t                 bat;
 	vhd_batmap_t              batmap;
 	vhd_flag_t                status;
-	uint32_t                  pbw_blk;     /* blk num of pending write */
-	uint64_t                  pbw_offset;  /* file offset of same */
+	int                       nr_allocs;
+	struct vhd_bat_alloc      allocs[VHD_BAT_ALLOC_MAX];
 	struct vhd_request        req;         /* for writing bat table */
-	struct vhd_request        zero_req;    /* for initializing bitmaps */
-	char                     *bat_buf;
+	char                     *bat_buf;     /* VHD_BAT_FLUSH_SECS sectors */
+	uint64_t                  writes;      /* bat writes issued */
+	uint64_t                  committed;   /* allocations they carried */
 };
 
 struct vhd_bitmap {
 	u32                       blk;
-	u64                       seqno;       /* lru sequence number */
+	int                       slot;        /* index in s->bitmap */
+	struct list_head          lru;         /* on s->bm_lru while cached */
 	vhd_flag_t                status;
 
 	char                     *map;         /* map should only be modified
@@ -213,6 +238,16 @@ struct vhd_bitmap {
 					        * be serviced until this bitmap
 					        * is read from disk */
 	struct vhd_request        req;
+	struct vhd_bitmap        *hnext;       /* bm_hash chain */
+};
+
+struct vhd_bitmap_stats {
+	uint64_t                  hits;
+	uint64_t                  misses;
+	uint64_t                  pending;     /* hit a read in flight */
+	uint64_t                  evictions;
+	uint64_t                  prefetched;
+	uint64_t                  prefetch_hits;
 };
 
 struct vhd_state {
@@ -227,13 +262,22 @@ struct vhd_state {
 
 	struct vhd_bat_state      bat;
 
-	u64                       bm_lru;      /* lru sequence number */
+	struct list_head          bm_lru;      /* cached bitmaps, coldest
+						* first */
 	u32                       bm_secs;     /* size of bitmap, in sectors */
-	struct vhd_bitmap        *bitmap[VHD_CACHE_SIZE];
+	int                       bm_cache_size;
+	struct vhd_bitmap       **bitmap;
+	struct vhd_bitmap       **bm_hash;     /* cached bitmaps, by blk */
+	u32                       bm_hash_mask;
 
 	int                       bm_free_count;
-	struct vhd_bitmap        *bitmap_free[VHD_CACHE_SIZE];
-	struct vhd_bitmap         bitmap_list[VHD_CACHE_SIZE];
+	struct vhd_bitmap       **bitmap_free;
+	struct vhd_bitmap        *bitmap_list;
+
+	u32                       bm_last_blk; /* sequential access detection */
+	int                       bm_run;
+	int                       bm_prefetch;
+	struct vhd_bitmap_stats   bm_stats;
 
 	int                       vreq_free_count;
 	struct vhd_request       *vreq_free[VHD_REQS_DATA];
@@ -392,7 +436,7 @@ vhd_free_bat(struct vhd_state *s)
 	free(s->bat.bat.bat);
 	free(s->bat.batmap.map);
 	free(s->bat.bat_buf);
-	memset(&s->bat, 0, sizeof(struct vhd_bat));
+	memset(&s->bat, 0, sizeof(s->bat));
 }
 
 static int
@@ -400,7 +444,7 @@ vhd_initialize_bat(struct vhd_state *s)
 {
 	int err, psize, batmap_required, i;
 
-	memset(&s->bat, 0, sizeof(struct vhd_bat));
+	memset(&s->bat, 0, sizeof(s->bat));
 
 	psize = getpagesize();
 
@@ -436,8 +480,8 @@ vhd_initialize_bat(struct vhd_state *s)
 					s->vhd.file);
 	}
 
-	err = posix_memalign((void **)&s->bat.bat_buf,
-			     VHD_SECTOR_SIZE, VHD_SECTOR_SIZE);
+	err = posix_memalign((void **)&s->bat.bat_buf, VHD_SECTOR_SIZE,
+			     VHD_SECTOR_SIZE * VHD_BAT_FLUSH_SECS);
 	if (err) {
 		s->bat.bat_buf = NULL;
 		goto fail;
@@ -456,45 +500,103 @@ vhd_free_bitmap_cache(struct vhd_state *s)
 	int i;
 	struct vhd_bitmap *bm;
 
-	for (i = 0; i < VHD_CACHE_SIZE; i++) {
+	for (i = 0; s->bitmap_list && i < s->bm_cache_size; i++) {
 		bm = s->bitmap_list + i;
 		free(bm->map);
 		free(bm->shadow);
-		s->bitmap_free[i] = NULL;
 	}
 
-	memset(s->bitmap_list, 0, sizeof(struct vhd_bitmap) * VHD_CACHE_SIZE);
+	free(s->bitmap_list);
+	free(s->bitmap_free);
+	free(s->bitmap);
+	free(s->bm_hash);
+
+	s->bitmap_list   = NULL;
+	s->bitmap_free   = NULL;
+	s->bitmap        = NULL;
+	s->bm_hash       = NULL;
+	s->bm_cache_size = 0;
+	s->bm_free_count = 0;
+}
+
+/*
+ * The cache holds as many bitmaps as fit in TAPDISK2_VHD_BITMAP_MEM
+ * kilobytes (VHD_CACHE_MEM by default).  Each entry costs a map and its
+ * shadow, so images with large blocks get fewer entries.
+ */
+static int
+vhd_bitmap_cache_size(struct vhd_state *s)
+{
+	size_t budget, entry;
+	const char *env;
+	int n;
+
+	budget = VHD_CACHE_MEM;
+	env    = getenv("TAPDISK2_VHD_BITMAP_MEM");
+	if (env)
+		budget = strtoull(env, NULL, 0) << 10;
+
+	entry = sizeof(struct vhd_bitmap) +
+		2 * vhd_sectors_to_bytes(s->bm_secs);
+
+	n = MIN(budget / entry, VHD_CACHE_MAX);
+
+	return MAX(n, VHD_CACHE_SIZE);
 }
 
 static int
 vhd_initialize_bitmap_cache(struct vhd_state *s)
 {
-	int i, err, map_size;
+	int i, err, map_size, n;
 	struct vhd_bitmap *bm;
 
-	memset(s->bitmap_list, 0, sizeof(struct vhd_bitmap) * VHD_CACHE_SIZE);
+	n        = vhd_bitmap_cache_size(s);
+	map_size = vhd_sectors_to_bytes(s->bm_secs);
+
+	s->bm_hash_mask = 1;
+	while (s->bm_hash_mask < n)
+		s->bm_hash_mask <<= 1;
 
-	s->bm_lru        = 0;
-	map_size         = vhd_sectors_to_bytes(s->bm_secs);
-	s->bm_free_count = VHD_CACHE_SIZE;
+	s->bitmap_list = calloc(n, sizeof(struct vhd_bitmap));
+	s->bitmap_free = calloc(n, sizeof(struct vhd_bitmap *));
+	s->bitmap      = calloc(n, sizeof(struct vhd_bitmap *));
+	s->bm_hash     = calloc(s->bm_hash_mask, sizeof(struct vhd_bitmap *));
+	s->bm_hash_mask--;
 
-	for (i = 0; i < VHD_CACHE_SIZE; i++) {
+	if (!s->bitmap_list || !s->bitmap_free || !s->bitmap || !s->bm_hash) {
+		err = -ENOMEM;
+		goto fail;
+	}
+
+	INIT_LIST_HEAD(&s->bm_lru);
+	s->bm_cache_size = n;
+	s->bm_free_count = n;
+	s->bm_last_blk   = (u32)-1;
+	s->bm_run        = 0;
+	s->bm_prefetch   = MIN(VHD_BM_PREFETCH_MAX, n / 4);
+	memset(&s->bm_stats, 0, sizeof(s->bm_stats));
+
+	for (i = 0; i < n; i++) {
 		bm = s->bitmap_list + i;
 
 		err = posix_memalign((void **)&bm->map, 512, map_size);
 		if (err) {
 			bm->map = NULL;
+			err = -err;
 			goto fail;
 		}
 
 		err = posix_memalign((void **)&bm->shadow, 512, map_size);
 		if (err) {
 			bm->shadow = NULL;
+			err = -err;
 			goto fail;
 		}
 
 		memset(bm->map, 0, map_size);
 		memset(bm->shadow, 0, map_size);
+		bm->slot = i;
+		INIT_LIST_HEAD(&bm->lru);
 		s->bitmap_free[i] = bm;
 	}
 
@@ -664,6 +766,8 @@ __vhd_open(td_driver_t *driver, const char *name, vhd_flag_t flags)
 		s->writes++;
 	}
 
+	td_register_file(s->vhd.fd);
+
         return 0;
 
  fail:
@@ -760,6 +864,7 @@ _vhd_close(td_driver_t *driver)
 	vhd_log_close(s);
 	vhd_free_bat(s);
 	vhd_free_bitmap_cache(s);
+	td_unregister_file(s->vhd.fd);
 	vhd_close(&s->vhd);
 	vhd_free(s);
 
@@ -925,40 +1030,33 @@ transaction_completed(struct vhd_transaction *tx)
 	return (tx->started == tx->finished);
 }
 
-static inline void
-init_bat(struct vhd_state *s)
+static inline struct vhd_bat_alloc *
+find_bat_alloc(struct vhd_state *s, uint32_t blk)
 {
-	s->bat.req.tx     = NULL;
-	s->bat.req.next   = NULL;
-	s->bat.req.error  = 0;
-	s->bat.pbw_blk    = 0;
-	s->bat.pbw_offset = 0;
-	s->bat.status     = 0;
-}
+	int i;
+	struct vhd_bat_alloc *a;
 
-static inline void
-lock_bat(struct vhd_state *s)
-{
-	set_vhd_flag(s->bat.status, VHD_FLAG_BAT_LOCKED);
-}
+	for (i = 0; i < VHD_BAT_ALLOC_MAX; i++) {
+		a = s->bat.allocs + i;
+		if (test_vhd_flag(a->status, VHD_FLAG_ALLOC_USED) &&
+		    a->blk == blk)
+			return a;
+	}
 
-static inline void
-unlock_bat(struct vhd_state *s)
-{
-	clear_vhd_flag(s->bat.status, VHD_FLAG_BAT_LOCKED);
+	return NULL;
 }
 
+/* each pending allocation pins a bitmap; leave room for the rest */
 static inline int
-bat_locked(struct vhd_state *s)
+bat_alloc_max(struct vhd_state *s)
 {
-	return test_vhd_flag(s->bat.status, VHD_FLAG_BAT_LOCKED);
+	return MIN(VHD_BAT_ALLOC_MAX, s->bm_cache_size / 2);
 }
 
 static inline void
 init_vhd_bitmap(struct vhd_state *s, struct vhd_bitmap *bm)
 {
 	bm->blk    = 0;
-	bm->seqno  = 0;
 	bm->status = 0;
 	init_tx(&bm->tx);
 	clear_req_list(&bm->queue);
@@ -971,18 +1069,40 @@ init_vhd_bitmap(struct vhd_state *s, struct vhd_bitmap *bm)
 static inline struct vhd_bitmap *
 get_bitmap(struct vhd_state *s, uint32_t block)
 {
-	int i;
 	struct vhd_bitmap *bm;
 
-	for (i = 0; i < VHD_CACHE_SIZE; i++) {
-		bm = s->bitmap[i];
-		if (bm && bm->blk == block)
+	if (!s->bm_hash)
+		return NULL;
+
+	for (bm = s->bm_hash[block & s->bm_hash_mask]; bm; bm = bm->hnext)
+		if (bm->blk == block)
 			return bm;
-	}
 
 	return NULL;
 }
 
+static inline void
+hash_bitmap(struct vhd_state *s, struct vhd_bitmap *bm)
+{
+	struct vhd_bitmap **head = &s->bm_hash[bm->blk & s->bm_hash_mask];
+
+	bm->hnext = *head;
+	*head     = bm;
+}
+
+static inline void
+unhash_bitmap(struct vhd_state *s, struct vhd_bitmap *bm)
+{
+	struct vhd_bitmap **pp = &s->bm_hash[bm->blk & s->bm_hash_mask];
+
+	while (*pp && *pp != bm)
+		pp = &(*pp)->hnext;
+
+	ASSERT(*pp);
+	*pp       = bm->hnext;
+	bm->hnext = NULL;
+}
+
 static inline void
 lock_bitmap(struct vhd_bitmap *bm)
 {
@@ -1030,28 +1150,31 @@ bitmap_full(struct vhd_state *s, struct vhd_bitmap *bm)
 	return 1;
 }
 
+/*
+ * Evict the least recently used bitmap which is not locked.  The most
+ * recently used one is never taken.  Locked bitmaps are bounded by the
+ * outstanding transactions, so this only ever looks at a few entries.
+ */
 static struct vhd_bitmap *
 remove_lru_bitmap(struct vhd_state *s)
 {
-	int i, idx = 0;
-	u64 seq = s->bm_lru;
-	struct vhd_bitmap *bm, *lru = NULL;
+	struct vhd_bitmap *bm;
 
-	for (i = 0; i < VHD_CACHE_SIZE; i++) {
-		bm = s->bitmap[i];
-		if (bm && bm->seqno < seq && !bitmap_locked(bm)) {
-			idx = i;
-			lru = bm;
-			seq = lru->seqno;
-		}
-	}
+	list_for_each_entry(bm, &s->bm_lru, lru) {
+		if (list_is_last(&bm->lru, &s->bm_lru))
+			break;
+		if (bitmap_locked(bm))
+			continue;
 
-	if (lru) {
-		s->bitmap[idx] = NULL;
-		ASSERT(!bitmap_in_use(lru));
+		s->bitmap[bm->slot] = NULL;
+		list_del_init(&bm->lru);
+		unhash_bitmap(s, bm);
+		ASSERT(!bitmap_in_use(bm));
+		s->bm_stats.evictions++;
+		return bm;
 	}
 
-	return  lru;
+	return NULL;
 }
 
 static int
@@ -1076,65 +1199,56 @@ alloc_vhd_bitmap(struct vhd_state *s, struct vhd_bitmap **bitmap, uint32_t blk)
 	return 0;
 }
 
-static inline uint64_t
-__bitmap_lru_seqno(struct vhd_state *s)
-{
-	int i;
-	struct vhd_bitmap *bm;
-
-	if (s->bm_lru == 0xffffffff) {
-		s->bm_lru = 0;
-		for (i = 0; i < VHD_CACHE_SIZE; i++) {
-			bm = s->bitmap[i];
-			if (bm) {
-				bm->seqno >>= 1;
-				if (bm->seqno > s->bm_lru)
-					s->bm_lru = bm->seqno;
-			}
-		}
-	}
-
-	return ++s->bm_lru;
-}
-
 static inline void
 touch_bitmap(struct vhd_state *s, struct vhd_bitmap *bm)
 {
-	bm->seqno = __bitmap_lru_seqno(s);
+	list_del(&bm->lru);
+	list_add_tail(&bm->lru, &s->bm_lru);
 }
 
 static inline void
 install_bitmap(struct vhd_state *s, struct vhd_bitmap *bm)
 {
-	int i;
-	for (i = 0; i < VHD_CACHE_SIZE; i++) {
-		if (!s->bitmap[i]) {
-			touch_bitmap(s, bm);
-			s->bitmap[i] = bm;
-			return;
-		}
-	}
+	ASSERT(!s->bitmap[bm->slot]);
 
-	ASSERT(0);
+	touch_bitmap(s, bm);
+	s->bitmap[bm->slot] = bm;
+	hash_bitmap(s, bm);
 }
 
 static inline void
 free_vhd_bitmap(struct vhd_state *s, struct vhd_bitmap *bm)
 {
-	int i;
-
-	for (i = 0; i < VHD_CACHE_SIZE; i++)
-		if (s->bitmap[i] == bm)
-			break;
-
 	ASSERT(!bitmap_locked(bm));
 	ASSERT(!bitmap_in_use(bm));
-	ASSERT(i < VHD_CACHE_SIZE);
+	ASSERT(s->bitmap[bm->slot] == bm);
 
-	s->bitmap[i] = NULL;
+	s->bitmap[bm->slot] = NULL;
+	list_del_init(&bm->lru);
+	unhash_bitmap(s, bm);
 	s->bitmap_free[s->bm_free_count++] = bm;
 }
 
+/*
+ * A write to an unallocated block may start a new allocation unless too
+ * many are pending already, or a failed allocation of the same block is
+ * still draining its transaction.
+ */
+static inline int
+bat_alloc_blocked(struct vhd_state *s, uint32_t blk)
+{
+	struct vhd_bitmap *bm;
+
+	if (find_bat_alloc(s, blk))
+		return 0;
+
+	if (s->bat.nr_allocs >= bat_alloc_max(s))
+		return 1;
+
+	bm = get_bitmap(s, blk);
+	return (bm && test_vhd_flag(bm->tx.status, VHD_FLAG_TX_LIVE));
+}
+
 static int
 read_bitmap_cache(struct vhd_state *s, uint64_t sector, uint8_t op)
 {
@@ -1155,8 +1269,7 @@ read_bitmap_cache(struct vhd_state *s, uint64_t sector, uint8_t op)
 	}
 
 	if (bat_entry(s, blk) == DD_BLK_UNUSED) {
-		if (op == VHD_OP_DATA_WRITE &&
-		    s->bat.pbw_blk != blk && bat_locked(s))
+		if (op == VHD_OP_DATA_WRITE && bat_alloc_blocked(s, blk))
 			return VHD_BM_BAT_LOCKED;
 
 		return VHD_BM_BAT_CLEAR;
@@ -1168,14 +1281,25 @@ read_bitmap_cache(struct vhd_state *s, uint64_t sector, uint8_t op)
 	}
 
 	bm = get_bitmap(s, blk);
-	if (!bm)
+	if (!bm) {
+		s->bm_stats.misses++;
 		return VHD_BM_NOT_CACHED;
+	}
 
 	/* bump lru count */
 	touch_bitmap(s, bm);
 
-	if (test_vhd_flag(bm->status, VHD_FLAG_BM_READ_PENDING))
+	if (test_vhd_flag(bm->status, VHD_FLAG_BM_PREFETCHED)) {
+		clear_vhd_flag(bm->status, VHD_FLAG_BM_PREFETCHED);
+		s->bm_stats.prefetch_hits++;
+	}
+
+	if (test_vhd_flag(bm->status, VHD_FLAG_BM_READ_PENDING)) {
+		s->bm_stats.pending++;
 		return VHD_BM_READ_PENDING;
+	}
+
+	s->bm_stats.hits++;
 
 	return ((vhd_bitmap_test(&s->vhd, bm->map, sec)) ? 
 		VHD_BM_BIT_SET : VHD_BM_BIT_CLEAR);
@@ -1264,79 +1388,141 @@ aio_write(struct vhd_state *s, struct vhd_request *req, uint64_t offset)
 	TRACE(s);
 }
 
-static inline uint64_t
+static struct vhd_bat_alloc *
 reserve_new_block(struct vhd_state *s, uint32_t blk)
 {
-	int gap = 0;
+	int i, gap = 0;
+	struct vhd_bat_alloc *a = NULL;
 
-	ASSERT(!test_vhd_flag(s->bat.status, VHD_FLAG_BAT_WRITE_STARTED));
+	for (i = 0; i < VHD_BAT_ALLOC_MAX; i++)
+		if (!test_vhd_flag(s->bat.allocs[i].status,
+				   VHD_FLAG_ALLOC_USED)) {
+			a = s->bat.allocs + i;
+			break;
+		}
+
+	ASSERT(a);
 
 	/* data region of segment should begin on page boundary */
 	if ((s->next_db + s->bm_secs) % s->spp)
 		gap = (s->spp - ((s->next_db + s->bm_secs) % s->spp));
 
-	s->bat.pbw_blk    = blk;
-	s->bat.pbw_offset = s->next_db + gap;
+	a->blk     = blk;
+	a->status  = VHD_FLAG_ALLOC_USED;
+	a->lb_end  = s->next_db;
+	a->offset  = s->next_db + gap;
+	s->next_db = a->offset + s->spb + s->bm_secs;
+	s->bat.nr_allocs++;
+
+	DBG(TLOG_DBG, "blk: 0x%04x, pbwo: 0x%08"PRIx64"\n", blk, a->offset);
 
-	return s->next_db;
+	return a;
 }
 
-static int
+static void
+release_bat_alloc(struct vhd_state *s, struct vhd_bat_alloc *a, int error)
+{
+	/* give back the space of a failed allocation if nothing follows it */
+	if (error && a->offset + s->spb + s->bm_secs == s->next_db)
+		s->next_db = a->lb_end;
+
+	a->status = 0;
+	s->bat.nr_allocs--;
+}
+
+/*
+ * Commit the pending allocations whose bitmaps have been zeroed with one
+ * write of the BAT sectors covering them.  Allocations which become ready
+ * while that write is in flight are picked up when it completes, so an
+ * allocation burst costs one BAT write per group rather than per block.
+ */
+static void
 schedule_bat_write(struct vhd_state *s)
 {
-	int i;
-	u32 blk;
+	int i, n;
 	char *buf;
 	u64 offset;
+	u32 first, last, sec;
 	struct vhd_request *req;
+	struct vhd_bat_alloc *a;
+
+	if (test_vhd_flag(s->bat.status, VHD_FLAG_BAT_WRITE_STARTED))
+		return;
+
+	first = (u32)-1;
+	for (i = 0; i < VHD_BAT_ALLOC_MAX; i++) {
+		a = s->bat.allocs + i;
+		if (test_vhd_flag(a->status, VHD_FLAG_ALLOC_ZEROED))
+			first = MIN(first, a->blk / 128);
+	}
+
+	if (first == (u32)-1)
+		return;
+
+	last = first;
+	for (i = 0; i < VHD_BAT_ALLOC_MAX; i++) {
+		a = s->bat.allocs + i;
+		if (!test_vhd_flag(a->status, VHD_FLAG_ALLOC_ZEROED))
+			continue;
+
+		sec = a->blk / 128;
+		if (sec >= first + VHD_BAT_FLUSH_SECS)
+			continue;
 
-	ASSERT(bat_locked(s));
+		last = MAX(last, sec);
+		set_vhd_flag(a->status, VHD_FLAG_ALLOC_FLUSHING);
+	}
 
+	n   = last - first + 1;
 	req = &s->bat.req;
 	buf = s->bat.bat_buf;
-	blk = s->bat.pbw_blk;
 
 	init_vhd_request(s, req);
-	memcpy(buf, &bat_entry(s, blk - (blk % 128)), 512);
+	memcpy(buf, &bat_entry(s, first * 128), n * 512);
 
-	((u32 *)buf)[blk % 128] = s->bat.pbw_offset;
+	for (i = 0; i < VHD_BAT_ALLOC_MAX; i++) {
+		a = s->bat.allocs + i;
+		if (test_vhd_flag(a->status, VHD_FLAG_ALLOC_FLUSHING)) {
+			((u32 *)buf)[a->blk - first * 128] = a->offset;
+			s->bat.committed++;
+		}
+	}
 
-	for (i = 0; i < 128; i++)
+	for (i = 0; i < n * 128; i++)
 		BE32_OUT(&((u32 *)buf)[i]);
 
-	offset         = s->vhd.header.table_offset + (blk - (blk % 128)) * 4;
-	req->treq.secs = 1;
+	offset         = s->vhd.header.table_offset + first * 512;
+	req->treq.secs = n;
 	req->treq.buf  = buf;
 	req->op        = VHD_OP_BAT_WRITE;
 	req->next      = NULL;
 
 	aio_write(s, req, offset);
 	set_vhd_flag(s->bat.status, VHD_FLAG_BAT_WRITE_STARTED);
+	s->bat.writes++;
 
-	DBG(TLOG_DBG, "blk: 0x%04x, pbwo: 0x%08"PRIx64", "
-	    "table_offset: 0x%08"PRIx64"\n", blk, s->bat.pbw_offset, offset);
-
-	return 0;
+	DBG(TLOG_DBG, "bat secs: 0x%04x-0x%04x, "
+	    "table_offset: 0x%08"PRIx64"\n", first, last, offset);
 }
 
 static void
 schedule_zero_bm_write(struct vhd_state *s,
-		       struct vhd_bitmap *bm, uint64_t lb_end)
+		       struct vhd_bitmap *bm, struct vhd_bat_alloc *a)
 {
 	uint64_t offset;
-	struct vhd_request *req = &s->bat.zero_req;
+	struct vhd_request *req = &a->zero_req;
 
 	init_vhd_request(s, req);
 
-	offset         = vhd_sectors_to_bytes(lb_end);
+	offset         = vhd_sectors_to_bytes(a->lb_end);
 	req->op        = VHD_OP_ZERO_BM_WRITE;
-	req->treq.sec  = s->bat.pbw_blk * s->spb;
-	req->treq.secs = (s->bat.pbw_offset - lb_end) + s->bm_secs;
+	req->treq.sec  = a->blk * s->spb;
+	req->treq.secs = (a->offset - a->lb_end) + s->bm_secs;
 	req->treq.buf  = vhd_zeros(vhd_sectors_to_bytes(req->treq.secs));
 	req->next      = NULL;
 
 	DBG(TLOG_DBG, "blk: 0x%04x, writing zero bitmap at 0x%08"PRIx64"\n",
-	    s->bat.pbw_blk, offset);
+	    a->blk, offset);
 
 	lock_bitmap(bm);
 	add_to_transaction(&bm->tx, req);
@@ -1347,15 +1533,16 @@ static int
 update_bat(struct vhd_state *s, uint32_t blk)
 {
 	int err;
-	uint64_t lb_end;
 	struct vhd_bitmap *bm;
+	struct vhd_bat_alloc *a;
 
 	ASSERT(bat_entry(s, blk) == DD_BLK_UNUSED);
 	
-	if (bat_locked(s)) {
-		ASSERT(s->bat.pbw_blk == blk);
+	if (find_bat_alloc(s, blk))
 		return 0;
-	}
+
+	if (bat_alloc_blocked(s, blk))
+		return -EBUSY;
 
 	/* empty bitmap could already be in
 	 * cache if earlier bat update failed */
@@ -1369,9 +1556,8 @@ update_bat(struct vhd_state *s, uint32_t blk)
 		install_bitmap(s, bm);
 	}
 
-	lock_bat(s);
-	lb_end = reserve_new_block(s, blk);
-	schedule_zero_bm_write(s, bm, lb_end);
+	a = reserve_new_block(s, blk);
+	schedule_zero_bm_write(s, bm, a);
 	set_vhd_flag(bm->tx.status, VHD_FLAG_TX_UPDATE_BAT);
 
 	return 0;
@@ -1380,47 +1566,18 @@ update_bat(struct vhd_state *s, uint32_t blk)
 static int
 allocate_block(struct vhd_state *s, uint32_t blk)
 {
-	char *zeros;
-	int err, gap;
+	int err;
 	uint64_t offset, size;
 	struct vhd_bitmap *bm;
+	struct vhd_bat_alloc *a;
 
 	ASSERT(bat_entry(s, blk) == DD_BLK_UNUSED);
 
-	if (bat_locked(s)) {
-		ASSERT(s->bat.pbw_blk == blk);
-		if (s->bat.req.error)
-			return -EBUSY;
+	if (find_bat_alloc(s, blk))
 		return 0;
-	}
-
-	gap            = 0;
-	s->bat.pbw_blk = blk;
-	offset         = vhd_sectors_to_bytes(s->next_db);
-
-	/* data region of segment should begin on page boundary */
-	if ((s->next_db + s->bm_secs) % s->spp) {
-		gap = (s->spp - ((s->next_db + s->bm_secs) % s->spp));
-		s->next_db += gap;
-	}
-
-	s->bat.pbw_offset = s->next_db;
-
-	DBG(TLOG_DBG, "blk: 0x%04x, pbwo: 0x%08"PRIx64"\n",
-	    blk, s->bat.pbw_offset);
-
-	if (lseek(s->vhd.fd, offset, SEEK_SET) == (off_t)-1) {
-		ERR(errno, "lseek failed\n");
-		return -errno;
-	}
 
-	size = vhd_sectors_to_bytes(s->spb + s->bm_secs + gap);
-	err  = write(s->vhd.fd, vhd_zeros(size), size);
-	if (err != size) {
-		err = (err == -1 ? -errno : -EIO);
-		ERR(err, "write failed");
-		return err;
-	}
+	if (bat_alloc_blocked(s, blk))
+		return -EBUSY;
 
 	/* empty bitmap could already be in
 	 * cache if earlier bat update failed */
@@ -1434,12 +1591,33 @@ allocate_block(struct vhd_state *s, uint32_t blk)
 		install_bitmap(s, bm);
 	}
 
-	lock_bat(s);
+	a      = reserve_new_block(s, blk);
+	offset = vhd_sectors_to_bytes(a->lb_end);
+	size   = vhd_sectors_to_bytes(s->next_db - a->lb_end);
+
+	if (lseek(s->vhd.fd, offset, SEEK_SET) == (off_t)-1) {
+		err = -errno;
+		ERR(err, "lseek failed\n");
+		goto fail;
+	}
+
+	err = write(s->vhd.fd, vhd_zeros(size), size);
+	if (err != size) {
+		err = (err == -1 ? -errno : -EIO);
+		ERR(err, "write failed");
+		goto fail;
+	}
+
 	lock_bitmap(bm);
+	set_vhd_flag(a->status, VHD_FLAG_ALLOC_ZEROED);
+	set_vhd_flag(bm->tx.status, VHD_FLAG_TX_UPDATE_BAT);
 	schedule_bat_write(s);
-	add_to_transaction(&bm->tx, &s->bat.req);
 
 	return 0;
+
+fail:
+	release_bat_alloc(s, a, err);
+	return err;
 }
 
 static int 
@@ -1513,7 +1691,7 @@ schedule_data_write(struct vhd_state *s, td_request_t treq, vhd_flag_t flags)
 		if (err)
 			return err;
 
-		offset = s->bat.pbw_offset;
+		offset = find_bat_alloc(s, blk)->offset;
 	}
 
 	offset += s->bm_secs + sec;
@@ -1593,6 +1771,50 @@ schedule_bitmap_read(struct vhd_state *s, uint32_t blk)
 	return 0;
 }
 
+/*
+ * Once a run of accesses has moved through VHD_BM_PREFETCH_RUN
+ * consecutive blocks, read the bitmaps of the next few allocated blocks
+ * ahead of the requests which will need them.
+ */
+static void
+vhd_prefetch_bitmaps(struct vhd_state *s, uint64_t sector)
+{
+	u32 blk, next, end;
+	struct vhd_bitmap *bm;
+
+	if (!vhd_type_dynamic(&s->vhd) || !s->bm_prefetch)
+		return;
+
+	blk = sector / s->spb;
+	if (blk == s->bm_last_blk)
+		return;
+
+	s->bm_run      = (blk == s->bm_last_blk + 1 ? s->bm_run + 1 : 0);
+	s->bm_last_blk = blk;
+
+	if (s->bm_run < VHD_BM_PREFETCH_RUN)
+		return;
+
+	/* keep the current block's bitmap from being evicted below */
+	bm = get_bitmap(s, blk);
+	if (bm)
+		touch_bitmap(s, bm);
+
+	end = MIN(blk + 1 + s->bm_prefetch, s->bat.bat.entries);
+	for (next = blk + 1; next < end; next++) {
+		if (bat_entry(s, next) == DD_BLK_UNUSED ||
+		    test_batmap(s, next) || get_bitmap(s, next))
+			continue;
+
+		if (schedule_bitmap_read(s, next))
+			break;
+
+		bm = get_bitmap(s, next);
+		set_vhd_flag(bm->status, VHD_FLAG_BM_PREFETCHED);
+		s->bm_stats.prefetched++;
+	}
+}
+
 static void
 schedule_bitmap_write(struct vhd_state *s, uint32_t blk)
 {
@@ -1608,8 +1830,9 @@ schedule_bitmap_write(struct vhd_state *s, uint32_t blk)
 	       !test_vhd_flag(bm->status, VHD_FLAG_BM_WRITE_PENDING));
 
 	if (offset == DD_BLK_UNUSED) {
-		ASSERT(bat_locked(s) && s->bat.pbw_blk == blk);
-		offset = s->bat.pbw_offset;
+		struct vhd_bat_alloc *a = find_bat_alloc(s, blk);
+		ASSERT(a);
+		offset = a->offset;
 	}
 	
 	offset = vhd_sectors_to_bytes(offset);
@@ -1674,6 +1897,7 @@ static void
 vhd_queue_read(td_driver_t *driver, td_request_t treq)
 {
 	struct vhd_state *s = (struct vhd_state *)driver->data;
+	uint64_t sec = treq.sec;
 
 	DBG(TLOG_DBG, "%s: lsec: 0x%08"PRIx64", secs: 0x%04x (seg: %d)\n",
 	    s->vhd.file, treq.sec, treq.secs, treq.sidx);
@@ -1741,12 +1965,15 @@ vhd_queue_read(td_driver_t *driver, td_request_t treq)
 		td_complete_request(clone, err);
 		break;
 	}
+
+	vhd_prefetch_bitmaps(s, sec);
 }
 
 static void
 vhd_queue_write(td_driver_t *driver, td_request_t treq)
 {
 	struct vhd_state *s = (struct vhd_state *)driver->data;
+	uint64_t sec = treq.sec;
 
 	DBG(TLOG_DBG, "%s: lsec: 0x%08"PRIx64", secs: 0x%04x, (seg: %d)\n",
 	    s->vhd.file, treq.sec, treq.secs, treq.sidx);
@@ -1827,6 +2054,8 @@ vhd_queue_write(td_driver_t *driver, td_request_t treq)
 		td_complete_request(clone, err);
 		break;
 	}
+
+	vhd_prefetch_bitmaps(s, sec);
 }
 
 static inline void
@@ -1899,32 +2128,6 @@ start_new_bitmap_transaction(struct vhd_state *s, struct vhd_bitmap *bm)
 		finish_data_transaction(s, bm);
 }
 
-static void
-finish_bat_transaction(struct vhd_state *s, struct vhd_bitmap *bm)
-{
-	struct vhd_transaction *tx = &bm->tx;
-
-	if (!bat_locked(s))
-		return;
-
-	if (s->bat.pbw_blk != bm->blk)
-		return;
-
-	if (!s->bat.req.error)
-		goto release;
-
-	if (!test_vhd_flag(tx->status, VHD_FLAG_TX_LIVE))
-		goto release;
-
-	tx->closed = 1;
-	return;
-
- release:
-	DBG(TLOG_DBG, "blk: 0x%04x\n", bm->blk);
-	unlock_bat(s);
-	init_bat(s);
-}
-
 static void
 finish_bitmap_transaction(struct vhd_state *s,
 			  struct vhd_bitmap *bm, int error)
@@ -1936,15 +2139,12 @@ finish_bitmap_transaction(struct vhd_state *s,
 	tx->error = (tx->error ? tx->error : error);
 	map_size  = vhd_sectors_to_bytes(s->bm_secs);
 
-	if (!test_vhd_flag(s->flags, VHD_FLAG_OPEN_PREALLOCATE)) {
-		if (test_vhd_flag(tx->status, VHD_FLAG_TX_UPDATE_BAT)) {
-			/* still waiting for bat write */
-			ASSERT(bm->blk == s->bat.pbw_blk);
-			ASSERT(test_vhd_flag(s->bat.status, 
-					     VHD_FLAG_BAT_WRITE_STARTED));
-			s->bat.req.tx = tx;
-			return;
-		}
+	if (test_vhd_flag(tx->status, VHD_FLAG_TX_UPDATE_BAT)) {
+		/* still waiting for bat write */
+		struct vhd_bat_alloc *a = find_bat_alloc(s, bm->blk);
+		ASSERT(a);
+		set_vhd_flag(a->status, VHD_FLAG_ALLOC_WAITING);
+		return;
 	}
 
 	if (tx->error) {
@@ -1964,8 +2164,6 @@ finish_bitmap_transaction(struct vhd_state *s,
 
 	if (!bitmap_in_use(bm))
 		unlock_bitmap(bm);
-
-	finish_bat_transaction(s, bm);
 }
 
 static void
@@ -1983,45 +2181,65 @@ finish_data_transaction(struct vhd_state *s, struct vhd_bitmap *bm)
 	return finish_bitmap_transaction(s, bm, 0);
 }
 
+/* the last reserved first, so that failed allocations unwind in order */
+static struct vhd_bat_alloc *
+next_flushed_alloc(struct vhd_state *s)
+{
+	int i;
+	struct vhd_bat_alloc *a, *next = NULL;
+
+	for (i = 0; i < VHD_BAT_ALLOC_MAX; i++) {
+		a = s->bat.allocs + i;
+		if (test_vhd_flag(a->status, VHD_FLAG_ALLOC_FLUSHING) &&
+		    (!next || a->offset > next->offset))
+			next = a;
+	}
+
+	return next;
+}
+
 static void
 finish_bat_write(struct vhd_request *req)
 {
+	int waiting;
 	struct vhd_bitmap *bm;
+	struct vhd_bat_alloc *a;
 	struct vhd_transaction *tx;
 	struct vhd_state *s = req->state;
 
 	s->returned++;
 	TRACE(s);
 
-	bm = get_bitmap(s, s->bat.pbw_blk);
+	DBG(TLOG_DBG, "err %d\n", req->error);
+	ASSERT(test_vhd_flag(s->bat.status, VHD_FLAG_BAT_WRITE_STARTED));
+	clear_vhd_flag(s->bat.status, VHD_FLAG_BAT_WRITE_STARTED);
 
-	DBG(TLOG_DBG, "blk 0x%04x, pbwo: 0x%08"PRIx64", err %d\n",
-	    s->bat.pbw_blk, s->bat.pbw_offset, req->error);
-	ASSERT(bm && bitmap_valid(bm));
-	ASSERT(bat_locked(s) &&
-	       test_vhd_flag(s->bat.status, VHD_FLAG_BAT_WRITE_STARTED));
+	while ((a = next_flushed_alloc(s))) {
+		bm = get_bitmap(s, a->blk);
+		ASSERT(bm && bitmap_valid(bm));
 
-	tx = &bm->tx;
-	ASSERT(test_vhd_flag(tx->status, VHD_FLAG_TX_LIVE));
+		DBG(TLOG_DBG, "blk 0x%04x, pbwo: 0x%08"PRIx64"\n",
+		    a->blk, a->offset);
 
-	if (!req->error) {
-		bat_entry(s, s->bat.pbw_blk) = s->bat.pbw_offset;
-		s->next_db = s->bat.pbw_offset + s->spb + s->bm_secs;
-	} else
-		tx->error = req->error;
+		tx = &bm->tx;
+		ASSERT(test_vhd_flag(tx->status, VHD_FLAG_TX_UPDATE_BAT));
 
-	if (test_vhd_flag(s->flags, VHD_FLAG_OPEN_PREALLOCATE)) {
-		tx->finished++;
-		remove_from_req_list(&tx->requests, req);
-		if (transaction_completed(tx))
-			finish_data_transaction(s, bm);
-	} else {
+		if (!req->error)
+			bat_entry(s, a->blk) = a->offset;
+		else
+			tx->error = req->error;
+
+		waiting = test_vhd_flag(a->status, VHD_FLAG_ALLOC_WAITING);
 		clear_vhd_flag(tx->status, VHD_FLAG_TX_UPDATE_BAT);
-		if (s->bat.req.tx)
+		release_bat_alloc(s, a, req->error);
+
+		if (waiting)
 			finish_bitmap_transaction(s, bm, req->error);
+		else if (!bitmap_in_use(bm))
+			unlock_bitmap(bm);
 	}
 
-	finish_bat_transaction(s, bm);
+	schedule_bat_write(s);
 }
 
 static void
@@ -2029,6 +2247,7 @@ finish_zero_bm_write(struct vhd_request *req)
 {
 	u32 blk;
 	struct vhd_bitmap *bm;
+	struct vhd_bat_alloc *a;
 	struct vhd_transaction *tx = req->tx;
 	struct vhd_state *s = req->state;
 
@@ -2037,22 +2256,23 @@ finish_zero_bm_write(struct vhd_request *req)
 
 	blk = req->treq.sec / s->spb;
 	bm  = get_bitmap(s, blk);
+	a   = find_bat_alloc(s, blk);
 
 	DBG(TLOG_DBG, "blk: 0x%04x\n", blk);
-	ASSERT(bat_locked(s));
-	ASSERT(s->bat.pbw_blk == blk);
+	ASSERT(a && !test_vhd_flag(a->status, VHD_FLAG_ALLOC_ZEROED));
 	ASSERT(bm && bitmap_valid(bm) && bitmap_locked(bm));
 
 	tx->finished++;
 	remove_from_req_list(&tx->requests, req);
 
 	if (req->error) {
-		unlock_bat(s);
-		init_bat(s);
+		release_bat_alloc(s, a, req->error);
 		tx->error = req->error;
 		clear_vhd_flag(tx->status, VHD_FLAG_TX_UPDATE_BAT);
-	} else
+	} else {
+		set_vhd_flag(a->status, VHD_FLAG_ALLOC_ZEROED);
 		schedule_bat_write(s);
+	}
 
 	if (transaction_completed(tx))
 		finish_data_transaction(s, bm);
@@ -2261,8 +2481,8 @@ vhd_debug(td_driver_t *driver)
 			    t->sec, r->flags, r, r->next, r->tx);
 	}
 
-	DBG(TLOG_WARN, "BITMAP CACHE:\n");
-	for (i = 0; i < VHD_CACHE_SIZE; i++) {
+	DBG(TLOG_WARN, "BITMAP CACHE: (%d entries)\n", s->bm_cache_size);
+	for (i = 0; i < s->bm_cache_size; i++) {
 		int qnum = 0, wnum = 0, rnum = 0;
 		struct vhd_bitmap *bm = s->bitmap[i];
 		struct vhd_transaction *tx;
@@ -2298,9 +2518,15 @@ vhd_debug(td_driver_t *driver)
 		    tx->started, tx->finished, tx->status, tx->requests.head, rnum);
 	}
 
-	DBG(TLOG_WARN, "BAT: status: 0x%08x, pbw_blk: 0x%04x, "
-	    "pbw_off: 0x%08"PRIx64", tx: %p\n", s->bat.status, s->bat.pbw_blk,
-	    s->bat.pbw_offset, s->bat.req.tx);
+	DBG(TLOG_WARN, "BAT: status: 0x%08x, allocs: %d\n",
+	    s->bat.status, s->bat.nr_allocs);
+	for (i = 0; i < VHD_BAT_ALLOC_MAX; i++) {
+		struct vhd_bat_alloc *a = s->bat.allocs + i;
+		if (a->status)
+			DBG(TLOG_WARN, "%d: blk: 0x%04x, status: 0x%02x, "
+			    "pbw_off: 0x%08"PRIx64"\n", i, a->blk, a->status,
+			    a->offset);
+	}
 
 /*
 	for (i = 0; i < s->hdr.max_bat_size; i++)
@@ -2308,6 +2534,26 @@ vhd_debug(td_driver_t *driver)
 */
 }
 
+static int
+vhd_stats(td_driver_t *driver, char *buf, size_t size)
+{
+	struct vhd_state *s = (struct vhd_state *)driver->data;
+	struct vhd_bitmap_stats *st = &s->bm_stats;
+
+	if (!s->bm_cache_size)
+		return 0;
+
+	return snprintf(buf, size, "vhd bitmaps: %d/%d, hits: %"PRIu64", "
+			"pending: %"PRIu64", misses: %"PRIu64", "
+			"evictions: %"PRIu64", prefetched: %"PRIu64", "
+			"prefetch hits: %"PRIu64", bat writes: %"PRIu64", "
+			"allocations: %"PRIu64", file: %s",
+			s->bm_cache_size - s->bm_free_count,
+			s->bm_cache_size, st->hits, st->pending, st->misses,
+			st->evictions, st->prefetched, st->prefetch_hits,
+			s->bat.writes, s->bat.committed, s->vhd.file);
+}
+
 struct tap_disk tapdisk_vhd = {
 	.disk_type          = "tapdisk_vhd",
 	.flags              = 0,
@@ -2319,4 +2565,5 @@ struct tap_disk tapdisk_vhd = {
 	.td_get_parent_id   = vhd_get_parent_id,
 	.td_validate_parent = vhd_validate_parent,
 	.td_debug           = vhd_debug,
+	.td_stats           = vhd_stats,
 };
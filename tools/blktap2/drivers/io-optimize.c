@@ -61,6 +61,9 @@ opio_free(struct opioctx *ctx)
 
 	free(ctx->event_queue);
 	ctx->event_queue = NULL;
+
+	free(ctx->iovs);
+	ctx->iovs = NULL;
 }
 
 int
@@ -76,9 +79,12 @@ opio_init(struct opioctx *ctx, int num_iocbs)
 	ctx->free_opios    = calloc(1, sizeof(struct opio *) * num_iocbs);
 	ctx->iocb_queue    = calloc(1, sizeof(struct iocb *) * num_iocbs);
 	ctx->event_queue   = calloc(1, sizeof(struct io_event) * num_iocbs);
+	ctx->iovs          = calloc(1, sizeof(struct iovec) *
+				    num_iocbs * OPIO_MAX_IOVS);
+	ctx->max_bytes     = (unsigned long)-1;
 
 	if (!ctx->opios || !ctx->free_opios ||
-	    !ctx->iocb_queue || !ctx->event_queue)
+	    !ctx->iocb_queue || !ctx->event_queue || !ctx->iovs)
 		goto fail;
 
 	for (i = 0; i < num_iocbs; i++)
@@ -111,9 +117,10 @@ restore_iocb(struct opio *op)
 {
 	struct iocb *io = op->iocb;
 
-	io->data        = op->data;
-	io->u.c.buf     = op->buf;
-	io->u.c.nbytes  = op->nbytes;
+	io->data           = op->data;
+	io->u.c.buf        = op->buf;
+	io->u.c.nbytes     = op->nbytes;
+	io->aio_lio_opcode = op->opcode;
 }
 
 static inline int
@@ -132,18 +139,11 @@ contiguous_sectors(struct iocb *l, struct iocb *r)
 	return (l->u.c.offset + l->u.c.nbytes == r->u.c.offset);
 }
 
-static inline int
-contiguous_buffers(struct iocb *l, struct iocb *r)
-{
-	return (l->u.c.buf + l->u.c.nbytes == r->u.c.buf);
-}
-
 static inline int
 contiguous_iocbs(struct iocb *l, struct iocb *r)
 {
 	return ((l->aio_fildes == r->aio_fildes) &&
-		contiguous_sectors(l, r) &&
-		contiguous_buffers(l, r));
+		contiguous_sectors(l, r));
 }
 
 static inline void
@@ -164,6 +164,7 @@ opio_iocb_init(struct opioctx *ctx, struct iocb *io)
 	op->buf    = io->u.c.buf;
 	op->nbytes = io->u.c.nbytes;
 	op->offset = io->u.c.offset;
+	op->opcode = io->aio_lio_opcode;
 	op->data   = io->data;
 	op->iocb   = io;
 	io->data   = op;
@@ -182,12 +183,56 @@ opio_get(struct opioctx *ctx, struct iocb *io)
 	        return opio_iocb_init(ctx, io);
 }
 
+/*
+ * A merge head gathers the buffers of its members in an iovec, extending
+ * the last entry while they are contiguous in memory.
+ */
+static struct opio *
+opio_head(struct opioctx *ctx, struct iocb *head)
+{
+	struct opio *op;
+
+	if (iocb_optimized(ctx, head))
+		return (struct opio *)head->data;
+
+	op = opio_iocb_init(ctx, head);
+	if (!op)
+		return NULL;
+
+	op->iov  = ctx->iovs + (op - ctx->opios) * OPIO_MAX_IOVS;
+	op->niov = 1;
+	op->iov[0].iov_base = op->buf;
+	op->iov[0].iov_len  = op->nbytes;
+
+	return op;
+}
+
+static inline char *
+merge_buf_end(struct opioctx *ctx, struct iocb *head, int *niov)
+{
+	struct opio *op;
+	struct iovec *iov;
+
+	if (!iocb_optimized(ctx, head)) {
+		*niov = 1;
+		return (char *)head->u.c.buf + head->u.c.nbytes;
+	}
+
+	op    = (struct opio *)head->data;
+	iov   = &op->iov[op->niov - 1];
+	*niov = op->niov;
+
+	return (char *)iov->iov_base + iov->iov_len;
+}
+
 static int
-merge_tail(struct opioctx *ctx, struct iocb *head, struct iocb *io)
+merge_tail(struct opioctx *ctx, struct iocb *head, struct iocb *io,
+	   int contiguous)
 {
 	struct opio *ophead, *opio;
+	struct iovec *iov;
 
-	ophead = opio_get(ctx, head);
+	ophead = opio_head(ctx, head);
 	if (!ophead)
 		return -ENOMEM;
 
@@ -198,20 +243,61 @@ merge_tail(struct opioctx *ctx, struct iocb *head, struct iocb *io)
 	opio->head        = ophead;
 	head->u.c.nbytes += io->u.c.nbytes;
 	ophead->list.tail = ophead->list.tail->next = opio;
-	
+
+	if (contiguous)
+		ophead->iov[ophead->niov - 1].iov_len += io->u.c.nbytes;
+	else {
+		iov = &ophead->iov[ophead->niov++];
+		iov->iov_base = io->u.c.buf;
+		iov->iov_len  = io->u.c.nbytes;
+	}
+
 	return 0;
 }
 
 static int
 merge(struct opioctx *ctx, struct iocb *head, struct iocb *io)
 {
+	int niov;
+	char *end;
+
 	if (head->aio_lio_opcode != io->aio_lio_opcode)
 		return -EINVAL;
 
 	if (!contiguous_iocbs(head, io))
 		return -EINVAL;
 
-	return merge_tail(ctx, head, io);		
+	if (head->u.c.nbytes + io->u.c.nbytes > ctx->max_bytes)
+		return -EINVAL;
+
+	end = merge_buf_end(ctx, head, &niov);
+	if (end != io->u.c.buf && niov == OPIO_MAX_IOVS)
+		return -EINVAL;
+
+	return merge_tail(ctx, head, io, end == io->u.c.buf);
+}
+
+/*
+ * Merges of scattered buffers are submitted as vectored requests.
+ */
+static void
+merge_finish(struct opioctx *ctx, struct iocb *io)
+{
+	struct opio *op;
+
+	if (!iocb_optimized(ctx, io))
+		return;
+
+	op       = (struct opio *)io->data;
+	op->size = io->u.c.nbytes;
+
+	if (op->niov > 1) {
+		io->aio_lio_opcode = (op->opcode == IO_CMD_PWRITE ?
+				      IO_CMD_PWRITEV : IO_CMD_PREADV);
+		io->u.c.buf        = op->iov;
+		io->u.c.nbytes     = op->niov;
+		ctx->vectored++;
+	}
 }
 
 int
@@ -234,6 +320,11 @@ io_merge(struct opioctx *ctx, struct iocb **queue, int num)
 			queue[++on_queue] = io;
 	}
 
+	for (i = 0; i <= on_queue; i++)
+		merge_finish(ctx, queue[i]);
+
+	ctx->merged += num - (on_queue + 1);
+
 #if (defined(TEST) || defined(DEBUG))
 	print_merged_iocbs(ctx, queue, on_queue + 1);
 #endif
@@ -241,6 +332,112 @@ io_merge(struct opioctx *ctx, struct iocb **queue, int num)
 	return ++on_queue;
 }
 
+/*
+ * Split an iocb in n pieces of at most ctx->max_bytes.  The iocb itself
+ * is completed once all of its pieces have.
+ */
+static int
+chunk_iocb(struct opioctx *ctx, struct iocb **queue, struct iocb *io, int n)
+{
+	int i;
+	unsigned long off;
+	struct iocb *piece;
+	struct opio *ophead, *op;
+
+	ophead = opio_iocb_init(ctx, io);
+	if (!ophead)
+		return -ENOMEM;
+
+	ophead->flags  = OPIO_SPLIT;
+	ophead->pieces = n;
+
+	for (i = 0, off = 0; i < n; i++, off += ctx->max_bytes) {
+		op          = alloc_opio(ctx);
+		op->flags   = OPIO_PIECE;
+		op->head    = ophead;
+		op->iocb    = &op->piece;
+
+		piece       = &op->piece;
+		*piece      = *io;
+		piece->data = op;
+		piece->u.c.buf    = ophead->buf + off;
+		piece->u.c.offset = ophead->offset + off;
+		piece->u.c.nbytes = ophead->nbytes - off;
+		if (piece->u.c.nbytes > ctx->max_bytes)
+			piece->u.c.nbytes = ctx->max_bytes;
+
+		queue[i] = piece;
+	}
+
+	ctx->splits++;
+	ctx->pieces += n;
+
+	return n;
+}
+
+/*
+ * Split the reads and writes of queue larger than ctx->max_bytes, adding
+ * at most room iocbs to the queue, which must have space for them.
+ */
+int
+io_chunk(struct opioctx *ctx, struct iocb **queue, int num, int room)
+{
+	int i, n, on_queue;
+	struct iocb *io, **q;
+
+	if (!num)
+		return 0;
+
+	on_queue = 0;
+	q = ctx->iocb_queue;
+	memcpy(q, queue, num * sizeof(struct iocb *));
+
+	for (i = 0; i < num; i++) {
+		io = q[i];
+		n  = 0;
+
+		if (!iocb_optimized(ctx, io) &&
+		    (io->aio_lio_opcode == IO_CMD_PREAD ||
+		     io->aio_lio_opcode == IO_CMD_PWRITE) &&
+		    io->u.c.nbytes > ctx->max_bytes) {
+			n = (io->u.c.nbytes + ctx->max_bytes - 1) /
+				ctx->max_bytes;
+			if (n - 1 > room || n + 1 > ctx->free_opio_cnt)
+				n = 0;
+		}
+
+		if (n) {
+			on_queue += chunk_iocb(ctx, queue + on_queue, io, n);
+			room     -= n - 1;
+		} else
+			queue[on_queue++] = io;
+	}
+
+	return on_queue;
+}
+
+/*
+ * An unsubmitted piece fails its split iocb, which is handed back once
+ * none of its pieces remain in flight.
+ */
+static int
+expand_piece(struct opioctx *ctx, struct iocb **queue, struct opio *op)
+{
+	struct opio *ophead = op->head;
+
+	ophead->res = (ophead->res ? : -EIO);
+	free_opio(ctx, op);
+
+	if (--ophead->pieces)
+		return 0;
+
+	queue[0] = ophead->iocb;
+	restore_iocb(ophead);
+	free_opio(ctx, ophead);
+
+	return 1;
+}
+
 static int
 expand_iocb(struct opioctx *ctx, struct iocb **queue, struct iocb *io)
 {
@@ -277,6 +474,9 @@ io_expand_iocbs(struct opioctx *ctx, struct iocb **queue, int idx, int num)
 		io = q[i];
 		if (!iocb_optimized(ctx, io))
 			queue[on_queue++] = io;
+		else if (((struct opio *)io->data)->flags & OPIO_PIECE)
+			on_queue += expand_piece(ctx, queue + on_queue,
+						 io->data);
 		else
 			on_queue += expand_iocb(ctx, queue + on_queue, io);
 	}
@@ -297,7 +497,7 @@ expand_event(struct opioctx *ctx,
 	ophead = (struct opio *)io->data;
 	op     = ophead;
 
-	if (event->res == io->u.c.nbytes)
+	if (event->res == ophead->size)
 		err = 0;
 	else if ((int)event->res < 0)
 		err = (int)event->res;
@@ -317,6 +517,34 @@ expand_event(struct opioctx *ctx,
 	return idx;
 }
 
+static int
+expand_piece_event(struct opioctx *ctx,
+		   struct io_event *event, struct io_event *queue, int idx)
+{
+	struct iocb *io;
+	struct io_event *ep;
+	struct opio *ophead, *op;
+
+	io     = event->obj;
+	op     = (struct opio *)io->data;
+	ophead = op->head;
+
+	if (event->res != io->u.c.nbytes && !ophead->res)
+		ophead->res = ((int)event->res < 0 ? (int)event->res : -EIO);
+	free_opio(ctx, op);
+
+	if (--ophead->pieces)
+		return idx;
+
+	ep      = &queue[idx++];
+	ep->obj = ophead->iocb;
+	ep->res = (ophead->res ? ophead->res : ophead->nbytes);
+	restore_iocb(ophead);
+	free_opio(ctx, ophead);
+
+	return idx;
+}
+
 int
 io_split(struct opioctx *ctx, struct io_event *events, int num)
 {
@@ -335,6 +563,8 @@ io_split(struct opioctx *ctx, struct io_event *events, int num)
 		io = ep->obj;
 		if (!iocb_optimized(ctx, io))
 			events[on_queue++] = *ep;
+		else if (((struct opio *)io->data)->flags & OPIO_PIECE)
+			on_queue = expand_piece_event(ctx, ep, events, on_queue);
 		else
 			on_queue = expand_event(ctx, ep, events, on_queue);
 	}
@@ -350,7 +580,8 @@ __print_iocb(struct opioctx *ctx, struct iocb *io, char *prefix)
 {
 	char *type;
 
-	type = (io->aio_lio_opcode == IO_CMD_PREAD ? "read" : "write");
+	type = (io->aio_lio_opcode == IO_CMD_PREAD ||
+		io->aio_lio_opcode == IO_CMD_PREADV ? "read" : "write");
 
 	DBG(ctx, "%soff: %08llx, nbytes: %04lx, buf: %p, type: %s, data: %08lx,"
 	    " optimized: %d\n", prefix, io->u.c.offset, io->u.c.nbytes, 
@@ -438,7 +669,8 @@ static void
 usage(void)
 {
 	fprintf(stderr, "usage: io_optimize [-n num_runs] "
-		"[-i num_iocbs] [-s num_secs] [-r random_seed]\n");
+		"[-i num_iocbs] [-s num_secs] [-r random_seed] "
+		"[-m max_bytes]\n");
 	exit(-1);
 }
 
@@ -516,11 +748,14 @@ randomize_iocbs(struct iocb **iocbs, int num_iocbs, int num_secs)
 }
 
 static int
-simulate_io(struct iocb **iocbs, struct io_event *events, int num_iocbs)
+simulate_io(struct opioctx *ctx,
+	    struct iocb **iocbs, struct io_event *events, int num_iocbs)
 {
 	int i, done;
+	unsigned long size;
 	struct iocb *io;
 	struct io_event *ep;
+	struct opio *op;
 
 	if (num_iocbs > 1)
 		done = (random() % (num_iocbs - 1)) + 1;
@@ -531,7 +766,13 @@ simulate_io(struct iocb **iocbs, struct io_event *events, int num_iocbs)
 		io      = iocbs[i];
 		ep      = &events[i];
 		ep->obj = io;
-		ep->res = (random() % 10 < 8 ? io->u.c.nbytes : 0);
+
+		size    = io->u.c.nbytes;
+		op      = (struct opio *)io->data;
+		if (iocb_optimized(ctx, io) && !(op->flags & OPIO_PIECE))
+			size = op->size;
+
+		ep->res = (random() % 10 < 8 ? size : 0);
 	}
 
 	return done;
@@ -578,14 +819,16 @@ main(int argc, char **argv)
 	struct opioctx ctx;
 	struct io_event *events;
 	int i, c, num_runs, num_iocbs, seed;
+	unsigned long max_bytes;
 	struct iocb *iocb_list, **iocbs, **ioqueue;
 
 	num_runs  = 1;
 	num_iocbs = 300;
 	seed      = time(NULL);
 	num_secs  = ((4ULL << 20) >> 9); /* 4GB disk */
+	max_bytes = (unsigned long)-1;
 
-	while ((c = getopt(argc, argv, "n:i:s:r:h")) != -1) {
+	while ((c = getopt(argc, argv, "n:i:s:r:m:h")) != -1) {
 		switch (c) {
 		case 'n':
 			num_runs  = atoi(optarg);
@@ -599,6 +842,9 @@ main(int argc, char **argv)
 		case 'r':
 			seed      = atoi(optarg);
 			break;
+		case 'm':
+			max_bytes = strtoul(optarg, NULL, 10);
+			break;
 		case 'h':
 			usage();
 		case '?':
@@ -613,14 +859,17 @@ main(int argc, char **argv)
 	srand(seed);
 
 	iocb_list = malloc(num_iocbs * sizeof(struct iocb));
-	iocbs     = malloc(num_iocbs * sizeof(struct iocb *));
-	events    = malloc(num_iocbs * sizeof(struct io_event));
+	iocbs     = malloc(2 * num_iocbs * sizeof(struct iocb *));
+	events    = malloc(2 * num_iocbs * sizeof(struct io_event));
 	
-	if (!iocb_list || !iocbs || !events || opio_init(&ctx, num_iocbs)) {
+	if (!iocb_list || !iocbs || !events ||
+	    opio_init(&ctx, 2 * num_iocbs)) {
 		fprintf(stderr, "initialization failed\n");
 		exit(ENOMEM);
 	}
 
+	ctx.max_bytes = max_bytes;
+
 	for (i = 0; i < num_runs; i++) {
 		int op_rem, op_done, num_split, num_events, num_done;
 
@@ -632,6 +881,8 @@ main(int argc, char **argv)
 		op_done  = 0;
 		num_done = 0;
 		op_rem   = io_merge(&ctx, ioqueue, num_iocbs);
+		op_rem   = io_chunk(&ctx, ioqueue, op_rem,
+				    2 * num_iocbs - op_rem);
 		print_iocbs(&ctx, ioqueue, op_rem);
 		print_merged_iocbs(&ctx, ioqueue, op_rem);
 		
@@ -639,7 +890,8 @@ main(int argc, char **argv)
 			DBG(&ctx, "optimized remaining: %d\n", op_rem);
 
 			DBG(&ctx, "simulating\n");
-			num_events = simulate_io(ioqueue + op_done, events, op_rem);
+			num_events = simulate_io(&ctx, ioqueue + op_done,
+						 events, op_rem);
 			print_events(&ctx, events, num_events);
 
 			DBG(&ctx, "splitting %d\n", num_events);
@@ -656,7 +908,8 @@ main(int argc, char **argv)
 
 		DBG(&ctx, "run %d: processed: %d, xallocs: %d, xfrees: %d\n", 
 		    i, num_done, xalloc_cnt, xfree_cnt);
-		if (xalloc_cnt != xfree_cnt)
+		if (xalloc_cnt != xfree_cnt ||
+		    ctx.free_opio_cnt != ctx.num_opios)
 			exit(-1);
 		xalloc_cnt = xfree_cnt = 0;
 	}
@@ -30,6 +30,14 @@
 #define __IO_OPTIMIZE_H__
 
 #include <libaio.h>
+#include <stdint.h>
+#include <sys/uio.h>
+
+/* most buffers a merged iocb may gather, as a vectored request */
+#define OPIO_MAX_IOVS       32
+
+#define OPIO_SPLIT          0x1  /* iocb split in pieces */
+#define OPIO_PIECE          0x2  /* one piece of a split iocb */
 
 struct opio;
 
@@ -42,12 +50,21 @@ struct opio {
 	char               *buf;
 	unsigned long       nbytes;
 	long long           offset;
+	short               opcode;
 	void               *data;
 	struct iocb        *iocb;
 	struct io_event     event;
 	struct opio        *head;
 	struct opio        *next;
 	struct opio_list    list;
+
+	int                 flags;
+	struct iovec       *iov;      /* merge head: buffers gathered */
+	int                 niov;
+	unsigned long       size;     /* merge head: bytes covered */
+	int                 pieces;   /* split head: pieces in flight */
+	long                res;      /* split head: first piece error */
+	struct iocb         piece;    /* piece: the iocb submitted */
 };
 
 struct opioctx {
@@ -57,6 +74,15 @@ struct opioctx {
 	struct opio       **free_opios;
 	struct iocb       **iocb_queue;
 	struct io_event    *event_queue;
+	struct iovec       *iovs;
+
+	/* largest request io_merge may build; larger ones io_chunk splits */
+	unsigned long       max_bytes;
+
+	uint64_t            merged;
+	uint64_t            vectored;
+	uint64_t            splits;
+	uint64_t            pieces;
 };
 
 int opio_init(struct opioctx *ctx, int num_iocbs);
@@ -64,5 +90,6 @@ void opio_free(struct opioctx *ctx);
 int io_merge(struct opioctx *ctx, struct iocb **queue, int num);
 int io_split(struct opioctx *ctx, struct io_event *events, int num);
 int io_expand_iocbs(struct opioctx *ctx, struct iocb **queue, int idx, int num);
+int io_chunk(struct opioctx *ctx, struct iocb **queue, int num, int room);
 
 #endif
@@ -0,0 +1,569 @@
+/*
+ * Copyright (c) 2008, XenSource Inc.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of XenSource Inc. nor the names of its contributors
+ *       may be used to endorse or promote products derived from this software
+ *       without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER
+ * OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Write (or, with -r, read) throughput of an image through the tapdisk
+ * driver stack.  Run on a freshly created dynamic vhd, every request is a
+ * first write, and with a stride of a whole block (-S 4096 for 2MB blocks)
+ * every request allocates one, which measures the cost of block
+ * allocation.  Run on the same image with -e lio and -e uring, it compares
+ * the aio engines.
+ */
+#include <stdio.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <unistd.h>
+#include <sys/time.h>
+
+#include "list.h"
+#include "scheduler.h"
+#include "tapdisk-vbd.h"
+#include "tapdisk-server.h"
+#include "tapdisk-disktype.h"
+#include "tapdisk-interface.h"
+#include "tapdisk-utils.h"
+
+#define POLL_READ                        0
+#define POLL_WRITE                       1
+
+#define MIN(a, b)                        ((a) < (b) ? (a) : (b))
+
+struct tapdisk_bench_poll {
+	int                              pipe[2];
+	int                              set;
+};
+
+struct tapdisk_bench_request {
+	uint64_t                         sec;
+	uint32_t                         secs;
+	blkif_request_t                  blkif_req;
+	struct list_head                 next;
+};
+
+struct tapdisk_bench {
+	td_vbd_t                        *vbd;
+
+	unsigned int                     id;
+	int                              err;
+
+	uint64_t                         cur;
+	uint64_t                         end;
+	uint32_t                         secs;
+	uint32_t                         stride;
+	int                              depth;
+	int                              op;
+
+	uint64_t                         started;
+	uint64_t                         completed;
+	uint64_t                         transferred;
+	int                              pending;
+	struct timeval                   start_time;
+	struct timeval                   stop_time;
+
+	struct tapdisk_bench_poll        poll;
+	event_id_t                       enqueue_event_id;
+
+	struct list_head                 free_list;
+
+	struct tapdisk_bench_request     requests[MAX_REQUESTS];
+};
+
+static void tapdisk_bench_close_image(struct tapdisk_bench *);
+
+static void
+usage(const char *app, int err)
+{
+	printf("usage: %s <-n type:/path/to/image> [-c sector count] "
+	       "[-s skip sectors] [-b sectors per request] "
+	       "[-S stride sectors] [-q queue depth] [-r] "
+	       "[-e aio engine]\n", app);
+	exit(err);
+}
+
+static inline void
+tapdisk_bench_poll_initialize(struct tapdisk_bench_poll *p)
+{
+	p->set = 0;
+	p->pipe[POLL_READ] = p->pipe[POLL_WRITE] = -1;
+}
+
+static int
+tapdisk_bench_poll_open(struct tapdisk_bench_poll *p)
+{
+	int err;
+
+	tapdisk_bench_poll_initialize(p);
+
+	err = pipe(p->pipe);
+	if (err)
+		return -errno;
+
+	err = fcntl(p->pipe[POLL_READ], F_SETFL, O_NONBLOCK);
+	if (err)
+		goto out;
+
+	err = fcntl(p->pipe[POLL_WRITE], F_SETFL, O_NONBLOCK);
+	if (err)
+		goto out;
+
+	return 0;
+
+out:
+	close(p->pipe[POLL_READ]);
+	close(p->pipe[POLL_WRITE]);
+	tapdisk_bench_poll_initialize(p);
+	return -errno;
+}
+
+static void
+tapdisk_bench_poll_close(struct tapdisk_bench_poll *p)
+{
+	if (p->pipe[POLL_READ] != -1)
+		close(p->pipe[POLL_READ]);
+	if (p->pipe[POLL_WRITE] != -1)
+		close(p->pipe[POLL_WRITE]);
+	tapdisk_bench_poll_initialize(p);
+}
+
+static inline void
+tapdisk_bench_poll_clear(struct tapdisk_bench_poll *p)
+{
+	int dummy;
+
+	read_exact(p->pipe[POLL_READ], &dummy, sizeof(dummy));
+	p->set = 0;
+}
+
+static inline void
+tapdisk_bench_poll_set(struct tapdisk_bench_poll *p)
+{
+	int dummy = 0;
+
+	if (!p->set) {
+		write_exact(p->pipe[POLL_WRITE], &dummy, sizeof(dummy));
+		p->set = 1;
+	}
+}
+
+static inline int
+tapdisk_bench_stop(struct tapdisk_bench *b)
+{
+	return (!b->pending && (b->cur >= b->end || b->err));
+}
+
+static inline struct tapdisk_bench_request *
+tapdisk_bench_get_request(struct tapdisk_bench *b)
+{
+	struct tapdisk_bench_request *req;
+
+	if (list_empty(&b->free_list))
+		return NULL;
+
+	req = list_entry(b->free_list.next,
+			 struct tapdisk_bench_request, next);
+	list_del_init(&req->next);
+
+	return req;
+}
+
+static void
+tapdisk_bench_dequeue(void *arg, blkif_response_t *rsp)
+{
+	struct tapdisk_bench *b = (struct tapdisk_bench *)arg;
+	struct tapdisk_bench_request *breq = b->requests + rsp->id;
+
+	b->pending--;
+	b->completed++;
+
+	if (rsp->status == BLKIF_RSP_OKAY)
+		b->transferred += breq->secs;
+	else {
+		b->err = EIO;
+		fprintf(stderr, "error %s sector 0x%"PRIx64"\n",
+			(b->op == BLKIF_OP_READ ? "reading" : "writing"),
+			breq->sec);
+	}
+
+	list_add_tail(&breq->next, &b->free_list);
+	tapdisk_bench_poll_set(&b->poll);
+}
+
+static void
+tapdisk_bench_enqueue(event_id_t id, char mode, void *arg)
+{
+	td_vbd_t *vbd;
+	int i, idx, psize;
+	struct tapdisk_bench *b = (struct tapdisk_bench *)arg;
+
+	vbd = b->vbd;
+	tapdisk_bench_poll_clear(&b->poll);
+
+	if (tapdisk_bench_stop(b)) {
+		gettimeofday(&b->stop_time, NULL);
+		tapdisk_bench_close_image(b);
+		return;
+	}
+
+	psize = getpagesize();
+
+	while (b->cur < b->end && !b->err && b->pending < b->depth) {
+		uint32_t left;
+		blkif_request_t *breq;
+		td_vbd_request_t *vreq;
+		struct tapdisk_bench_request *req;
+
+		req = tapdisk_bench_get_request(b);
+		if (!req)
+			break;
+
+		idx                 = req - b->requests;
+
+		req->sec            = b->cur;
+		req->secs           = MIN(b->end - b->cur, b->secs);
+		b->cur             += b->stride;
+
+		breq                = &req->blkif_req;
+		memset(breq, 0, sizeof(*breq));
+		breq->id            = idx;
+		breq->sector_number = req->sec;
+		breq->operation     = b->op;
+
+		for (left = req->secs, i = 0; left; i++) {
+			uint32_t secs = MIN(left, psize >> SECTOR_SHIFT);
+			struct blkif_request_segment *seg = breq->seg + i;
+
+			seg->first_sect = 0;
+			seg->last_sect  = secs - 1;
+			breq->nr_segments++;
+			left -= secs;
+		}
+
+		vreq = vbd->request_list + idx;
+
+		assert(list_empty(&vreq->next));
+		assert(vreq->secs_pending == 0);
+
+		memcpy(&vreq->req, breq, sizeof(*breq));
+		vbd->received++;
+		vreq->vbd = vbd;
+
+		tapdisk_vbd_move_request(vreq, &vbd->new_requests);
+		b->started++;
+		b->pending++;
+	}
+
+	tapdisk_vbd_issue_requests(vbd);
+}
+
+static int
+tapdisk_bench_open_image(struct tapdisk_bench *b, const char *engine,
+			 const char *params, const char *path, int type)
+{
+	int err;
+
+	tapdisk_server_init();
+
+	/* the server takes its defaults from the environment */
+	if (engine && tapdisk_server_set_aio_engine(engine)) {
+		fprintf(stderr, "unknown aio engine %s\n", engine);
+		return -EINVAL;
+	}
+
+	err = tapdisk_server_complete();
+	if (err)
+		goto out;
+
+	err = tapdisk_vbd_initialize(b->id);
+	if (err)
+		goto out;
+
+	b->vbd = tapdisk_server_get_vbd(b->id);
+	if (!b->vbd) {
+		err = ENODEV;
+		goto out;
+	}
+
+	tapdisk_vbd_set_callback(b->vbd, tapdisk_bench_dequeue, b);
+
+	err = tapdisk_vbd_parse_stack(b->vbd, params);
+	if (err)
+		goto out;
+
+	err = tapdisk_vbd_open_vdi(b->vbd, path, type,
+				   TAPDISK_STORAGE_TYPE_DEFAULT, 0);
+	if (err)
+		goto out;
+
+	b->vbd->reopened = 1;
+	err = 0;
+
+out:
+	if (err)
+		fprintf(stderr, "failed to open %s: %d\n", path, err);
+	return err;
+}
+
+static void
+tapdisk_bench_close_image(struct tapdisk_bench *b)
+{
+	td_vbd_t *vbd;
+	td_image_t *image, *tmp;
+	char buf[512];
+
+	vbd = tapdisk_server_get_vbd(b->id);
+	if (vbd) {
+		tapdisk_vbd_for_each_image(vbd, image, tmp)
+			if (td_stats(image, buf, sizeof(buf)) > 0)
+				printf("%s\n", buf);
+
+		tapdisk_vbd_close_vdi(vbd);
+		tapdisk_server_remove_vbd(vbd);
+		free((void *)vbd->ring.vstart);
+		free(vbd->name);
+		free(vbd);
+		b->vbd = NULL;
+	}
+}
+
+static int
+tapdisk_bench_set_position(struct tapdisk_bench *b,
+			   uint64_t count, uint64_t skip)
+{
+	int err;
+	image_t image;
+
+	err = tapdisk_vbd_get_image_info(b->vbd, &image);
+	if (err) {
+		fprintf(stderr, "failed getting image size: %d\n", err);
+		return err;
+	}
+
+	if (count == (uint64_t)-1)
+		count = image.size - skip;
+
+	if (count + skip > image.size) {
+		fprintf(stderr, "0x%"PRIx64" past end of image 0x%"PRIx64"\n",
+			(uint64_t) (count + skip), (uint64_t) image.size);
+		return -EINVAL;
+	}
+
+	b->cur = skip;
+	b->end = skip + count;
+
+	return 0;
+}
+
+static int
+tapdisk_bench_initialize_requests(struct tapdisk_bench *b)
+{
+	size_t size;
+	td_ring_t *ring;
+	int err, i, psize;
+
+	ring  = &b->vbd->ring;
+	psize = getpagesize();
+	size  = psize * BLKTAP_MMAP_REGION_SIZE;
+
+	/* as tapdisk-stream, have tapdisk_vbd use our buffers */
+	err = posix_memalign((void **)&ring->vstart, psize, size);
+	if (err) {
+		fprintf(stderr, "failed to allocate buffers: %d\n", err);
+		ring->vstart = 0;
+		return err;
+	}
+
+	/* first writes of zeroes would read back the same as no writes */
+	memset((void *)ring->vstart, 0x5a, size);
+
+	for (i = 0; i < MAX_REQUESTS; i++) {
+		struct tapdisk_bench_request *req = b->requests + i;
+		INIT_LIST_HEAD(&req->next);
+		list_add_tail(&req->next, &b->free_list);
+	}
+
+	return 0;
+}
+
+static int
+tapdisk_bench_register_enqueue_event(struct tapdisk_bench *b)
+{
+	int err;
+	struct tapdisk_bench_poll *p = &b->poll;
+
+	err = tapdisk_bench_poll_open(p);
+	if (err)
+		goto out;
+
+	err = tapdisk_server_register_event(SCHEDULER_POLL_READ_FD,
+					    p->pipe[POLL_READ], 0,
+					    tapdisk_bench_enqueue, b);
+	if (err < 0)
+		goto out;
+
+	b->enqueue_event_id = err;
+	err = 0;
+
+out:
+	if (err)
+		fprintf(stderr, "failed to register event: %d\n", err);
+	return err;
+}
+
+static void
+tapdisk_bench_unregister_enqueue_event(struct tapdisk_bench *b)
+{
+	if (b->enqueue_event_id) {
+		tapdisk_server_unregister_event(b->enqueue_event_id);
+		b->enqueue_event_id = 0;
+	}
+	tapdisk_bench_poll_close(&b->poll);
+}
+
+static int
+tapdisk_bench_run(struct tapdisk_bench *b)
+{
+	double secs;
+
+	gettimeofday(&b->start_time, NULL);
+	tapdisk_bench_enqueue(b->enqueue_event_id, SCHEDULER_POLL_READ_FD, b);
+	tapdisk_server_run();
+
+	secs = (b->stop_time.tv_sec - b->start_time.tv_sec) +
+		(b->stop_time.tv_usec - b->start_time.tv_usec) / 1000000.0;
+	if (secs <= 0)
+		secs = 1e-6;
+
+	printf("%"PRIu64" requests, %"PRIu64" sectors in %.3fs: "
+	       "%.2f MB/s, %.0f requests/s\n", b->completed, b->transferred,
+	       secs, (b->transferred << SECTOR_SHIFT) / secs / (1 << 20),
+	       b->completed / secs);
+
+	return b->err;
+}
+
+int
+main(int argc, char *argv[])
+{
+	int c, err, type, psize;
+	const char *params;
+	const char *engine;
+	const char *path;
+	uint64_t count, skip;
+	struct tapdisk_bench bench;
+
+	memset(&bench, 0, sizeof(bench));
+	INIT_LIST_HEAD(&bench.free_list);
+
+	err          = 0;
+	skip         = 0;
+	count        = (uint64_t)-1;
+	params       = NULL;
+	engine       = NULL;
+	psize        = getpagesize();
+	bench.secs   = psize >> SECTOR_SHIFT;
+	bench.depth  = MAX_REQUESTS;
+	bench.op     = BLKIF_OP_WRITE;
+
+	while ((c = getopt(argc, argv, "n:c:s:b:S:q:re:h")) != -1) {
+		switch (c) {
+		case 'n':
+			params = optarg;
+			break;
+		case 'c':
+			count = strtoull(optarg, NULL, 10);
+			break;
+		case 's':
+			skip = strtoull(optarg, NULL, 10);
+			break;
+		case 'b':
+			bench.secs = strtoul(optarg, NULL, 10);
+			break;
+		case 'S':
+			bench.stride = strtoul(optarg, NULL, 10);
+			break;
+		case 'q':
+			bench.depth = strtol(optarg, NULL, 10);
+			break;
+		case 'r':
+			bench.op = BLKIF_OP_READ;
+			break;
+		case 'e':
+			engine = optarg;
+			break;
+		default:
+			err = EINVAL;
+		case 'h':
+			usage(argv[0], err);
+		}
+	}
+
+	if (!params || !bench.secs ||
+	    bench.secs > BLKIF_MAX_SEGMENTS_PER_REQUEST *
+	    (psize >> SECTOR_SHIFT) ||
+	    bench.depth < 1 || bench.depth > MAX_REQUESTS)
+		usage(argv[0], EINVAL);
+
+	if (bench.stride < bench.secs)
+		bench.stride = bench.secs;
+
+	type = tapdisk_disktype_parse_params(params, &path);
+	if (type < 0) {
+		err = type;
+		fprintf(stderr, "invalid argument %s: %d\n", params, err);
+		return err;
+	}
+
+	tapdisk_start_logging("tapdisk-bench");
+
+	err = tapdisk_bench_open_image(&bench, engine, params, path, type);
+	if (err)
+		goto out;
+
+	err = tapdisk_bench_set_position(&bench, count, skip);
+	if (err)
+		goto out;
+
+	err = tapdisk_bench_initialize_requests(&bench);
+	if (err)
+		goto out;
+
+	err = tapdisk_bench_register_enqueue_event(&bench);
+	if (err)
+		goto out;
+
+	err = tapdisk_bench_run(&bench);
+
+out:
+	tapdisk_bench_close_image(&bench);
+	tapdisk_bench_unregister_enqueue_event(&bench);
+	tapdisk_stop_logging();
+	return err;
+}
@@ -43,6 +43,7 @@
 #include "blktap2.h"
 #include "blktaplib.h"
 #include "tapdisk-vbd.h"
+#include "tapdisk-interface.h"
 #include "tapdisk-utils.h"
 #include "tapdisk-server.h"
 #include "tapdisk-message.h"
@@ -627,6 +628,50 @@ out:
 	tapdisk_control_close_connection(connection);
 }
 
+/*
+ * One response per line of statistics, each image of the vbd reporting
+ * its own, then the aio queue, and a final response with an empty line.
+ */
+static void
+tapdisk_control_stats(struct tapdisk_control_connection *connection,
+		      tapdisk_message_t *request)
+{
+	td_vbd_t *vbd;
+	td_image_t *image, *tmp;
+	tapdisk_message_t response;
+
+	memset(&response, 0, sizeof(response));
+	response.cookie = request->cookie;
+
+	vbd = tapdisk_server_get_vbd(request->cookie);
+	if (!vbd) {
+		response.type = TAPDISK_MESSAGE_ERROR;
+		response.u.response.error = EINVAL;
+		goto out;
+	}
+
+	response.type = TAPDISK_MESSAGE_STATS_RSP;
+
+	tapdisk_vbd_for_each_image(vbd, image, tmp) {
+		if (td_stats(image, response.u.string.text,
+			     sizeof(response.u.string.text)) <= 0)
+			continue;
+
+		tapdisk_control_write_message(connection->socket, &response, 2);
+		memset(&response.u, 0, sizeof(response.u));
+	}
+
+	if (tapdisk_server_queue_stats(response.u.string.text,
+				       sizeof(response.u.string.text)) > 0) {
+		tapdisk_control_write_message(connection->socket, &response, 2);
+		memset(&response.u, 0, sizeof(response.u));
+	}
+
+out:
+	tapdisk_control_write_message(connection->socket, &response, 2);
+	tapdisk_control_close_connection(connection);
+}
+
 static void
 tapdisk_control_handle_request(event_id_t id, char mode, void *private)
 {
@@ -664,6 +709,8 @@ tapdisk_control_handle_request(event_id_t id, char mode, void *private)
 		return tapdisk_control_resume_vbd(connection, &message);
 	case TAPDISK_MESSAGE_CLOSE:
 		return tapdisk_control_close_image(connection, &message);
+	case TAPDISK_MESSAGE_STATS:
+		return tapdisk_control_stats(connection, &message);
 	default: {
 		tapdisk_message_t response;
 	fail:
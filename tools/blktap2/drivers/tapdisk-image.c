@@ -35,6 +35,8 @@
 #include "tapdisk-image.h"
 #include "tapdisk-driver.h"
 #include "tapdisk-server.h"
+#include "tapdisk-disktype.h"
+#include "tapdisk-interface.h"
 
 #define ERR(_err, _f, _a...) tlog_error(_err, _f, ##_a)
 
@@ -83,6 +85,47 @@ tapdisk_image_free(td_image_t *image)
 	free(image);
 }
 
+/*
+ * Put a block cache in front of @image, which must be open read-only.
+ * Reads reaching @image are then served from the host-wide cache of its
+ * contents where possible; other images sharing this tapdisk reuse the
+ * same cache driver.
+ */
+int
+tapdisk_image_attach_cache(td_image_t *image)
+{
+	int err;
+	td_image_t *cache;
+
+	if (!td_flag_test(image->flags, TD_OPEN_RDONLY))
+		return -EINVAL;
+
+	if (!image->driver)
+		return -ENODEV;
+
+	cache = tapdisk_image_allocate(image->name,
+				       DISK_TYPE_BLOCK_CACHE,
+				       image->storage,
+				       image->flags,
+				       image->private);
+	if (!cache)
+		return -ENOMEM;
+
+	/* try to load existing cache */
+	err = td_load(cache);
+	if (err)
+		/* the cache needs the size of the image it fronts */
+		err = __td_open(cache, &image->driver->info);
+	if (err) {
+		tapdisk_image_free(cache);
+		return err;
+	}
+
+	/* insert cache before image */
+	list_add(&cache->next, image->next.prev);
+	return 0;
+}
+
 int
 tapdisk_image_check_td_request(td_image_t *image, td_request_t treq)
 {
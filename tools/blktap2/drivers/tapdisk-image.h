@@ -49,6 +49,7 @@ struct td_image_handle {
 
 td_image_t *tapdisk_image_allocate(const char *, int, int, td_flag_t, void *);
 void tapdisk_image_free(td_image_t *);
+int tapdisk_image_attach_cache(td_image_t *);
 
 int tapdisk_image_check_td_request(td_image_t *, td_request_t);
 int tapdisk_image_check_ring_request(td_image_t *, blkif_request_t *);
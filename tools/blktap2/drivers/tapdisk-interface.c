@@ -245,6 +245,22 @@ td_prep_write(struct tiocb *tiocb, int fd, char *buf, size_t bytes,
 	tapdisk_prep_tiocb(tiocb, fd, 1, buf, bytes, offset, cb, arg);
 }
 
+/*
+ * Image files may be pre-registered with the aio engine, saving it a
+ * lookup per request.  Drivers must unregister a file before closing it.
+ */
+int
+td_register_file(int fd)
+{
+	return tapdisk_server_register_file(fd);
+}
+
+void
+td_unregister_file(int fd)
+{
+	tapdisk_server_unregister_file(fd);
+}
+
 void
 td_debug(td_image_t *image)
 {
@@ -257,3 +273,15 @@ td_debug(td_image_t *image)
 
 	tapdisk_driver_debug(driver);
 }
+
+int
+td_stats(td_image_t *image, char *buf, size_t size)
+{
+	td_driver_t *driver;
+
+	driver = image->driver;
+	if (!driver || !td_flag_test(driver->state, TD_DRIVER_OPEN))
+		return 0;
+
+	return tapdisk_driver_stats(driver, buf, size);
+}
@@ -44,11 +44,14 @@ void td_forward_request(td_request_t);
 void td_complete_request(td_request_t, int);
 
 void td_debug(td_image_t *);
+int td_stats(td_image_t *, char *, size_t);
 
 void td_queue_tiocb(td_driver_t *, struct tiocb *);
 void td_prep_read(struct tiocb *, int, char *, size_t,
 		  long long, td_queue_callback_t, void *);
 void td_prep_write(struct tiocb *, int, char *, size_t,
 		   long long, td_queue_callback_t, void *);
+int td_register_file(int);
+void td_unregister_file(int);
 
 #endif
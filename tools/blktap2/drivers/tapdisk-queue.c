@@ -26,10 +26,16 @@
  * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 */
 
+#include <time.h>
 #include <errno.h>
+#include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <unistd.h>
+#include <signal.h>
+#include <pthread.h>
 #include <libaio.h>
+#include <sys/uio.h>
 #ifdef __linux__
 #include <linux/version.h>
 #endif
@@ -60,6 +66,8 @@ queue_tiocb(struct tqueue *queue, struct tiocb *tiocb)
 {
 	struct iocb *iocb = &tiocb->iocb;
 
+	tiocb->next = NULL;
+
 	if (queue->queued) {
 		struct tiocb *prev = (struct tiocb *)
 			queue->iocbs[queue->queued - 1]->data;
@@ -160,6 +168,9 @@ cancel_tiocbs(struct tqueue *queue, int err)
 static int
 fail_tiocbs(struct tqueue *queue, int succeeded, int total, int err)
 {
+	int i;
+	struct tiocb *tiocb;
+
 	ERR(err, "io_submit error: %d of %d failed",
 	    total - succeeded, total);
 
@@ -168,9 +179,127 @@ fail_tiocbs(struct tqueue *queue, int succeeded, int total, int err)
 	queue->queued = io_expand_iocbs(&queue->opioctx,
 					queue->iocbs, succeeded, total);
 
+	/* the elevator reordered them: relink what is left */
+	for (i = 0; i < queue->queued; i++) {
+		tiocb       = queue->iocbs[i]->data;
+		tiocb->next = (i + 1 < queue->queued ?
+			       queue->iocbs[i + 1]->data : NULL);
+	}
+
 	return cancel_tiocbs(queue, err);
 }
 
+/*
+ * elevator
+ *
+ * Each batch is sorted by file and offset before merging, so that
+ * requests which arrived out of order, from different rings or drivers,
+ * still coalesce; merges of scattered buffers become vectored requests,
+ * and requests larger than the device limit are split.  Requests which
+ * waited longer than expire_us (deferred on a full queue) are not
+ * reordered but go first, and no request is moved past another one it
+ * overlaps, unless both are reads.
+ */
+
+static inline uint64_t
+tapdisk_queue_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static inline int
+tiocb_expired(struct tqueue *queue, const struct iocb *iocb, uint64_t now)
+{
+	const struct tiocb *tiocb = iocb->data;
+
+	return (now - tiocb->stamp >= queue->expire_us);
+}
+
+static inline int
+iocbs_conflict(const struct iocb *a, const struct iocb *b)
+{
+	if (a->aio_fildes != b->aio_fildes)
+		return 0;
+
+	if (a->aio_lio_opcode == IO_CMD_PREAD &&
+	    b->aio_lio_opcode == IO_CMD_PREAD)
+		return 0;
+
+	return (a->u.c.offset < b->u.c.offset + (long long)b->u.c.nbytes &&
+		b->u.c.offset < a->u.c.offset + (long long)a->u.c.nbytes);
+}
+
+static inline int
+iocb_before(const struct iocb *a, int a_expired,
+	    const struct iocb *b, int b_expired)
+{
+	if (a_expired || b_expired)
+		return (a_expired && !b_expired);
+
+	if (a->aio_fildes != b->aio_fildes)
+		return (a->aio_fildes < b->aio_fildes);
+
+	return (a->u.c.offset < b->u.c.offset);
+}
+
+static void
+tapdisk_queue_sort(struct tqueue *queue)
+{
+	int i, j, expired;
+	uint64_t now;
+	struct iocb *iocb, *prev, **q = queue->iocbs;
+
+	if (!queue->expire_us)
+		return;
+
+	now = tapdisk_queue_now();
+
+	for (i = 0; i < queue->queued; i++) {
+		iocb    = q[i];
+		expired = tiocb_expired(queue, iocb, now);
+		queue->expired += expired;
+
+		for (j = i; j > 0; j--) {
+			prev = q[j - 1];
+			if (!iocb_before(iocb, expired,
+					 prev, tiocb_expired(queue, prev, now)) ||
+			    iocbs_conflict(iocb, prev))
+				break;
+			q[j] = prev;
+		}
+
+		if (j != i) {
+			q[j] = iocb;
+			queue->reordered++;
+		}
+	}
+}
+
+/*
+ * Returns the number of iocbs to submit in place of the queued tiocbs,
+ * keeping no more in flight than the queue size.
+ */
+static int
+tapdisk_queue_elevator(struct tqueue *queue)
+{
+	int merged, room;
+
+	tapdisk_queue_sort(queue);
+
+	merged = io_merge(&queue->opioctx, queue->iocbs, queue->queued);
+
+	room = queue->size - queue->iocbs_pending - merged;
+	if (room > 0)
+		merged = io_chunk(&queue->opioctx, queue->iocbs, merged, room);
+
+	queue->batches++;
+
+	return merged;
+}
+
 /*
  * rwio
  */
@@ -212,6 +341,16 @@ tapdisk_rwio_rw(const struct iocb *iocb)
 	size_t size   = iocb->u.c.nbytes;
 	ssize_t (*func)(int, void *, size_t) = 
 		(iocb->aio_lio_opcode == IO_CMD_PWRITE ? vwrite : read);
+	ssize_t ret;
+
+	switch (iocb->aio_lio_opcode) {
+	case IO_CMD_PREADV:
+		ret = preadv(fd, iocb->u.c.buf, size, off);
+		return (ret < 0 ? -errno : ret);
+	case IO_CMD_PWRITEV:
+		ret = pwritev(fd, iocb->u.c.buf, size, off);
+		return (ret < 0 ? -errno : ret);
+	}
 
 	if (lseek(fd, off, SEEK_SET) == (off_t)-1)
 		return -errno;
@@ -235,7 +374,7 @@ tapdisk_rwio_submit(struct tqueue *queue)
 		return 0;
 
 	tapdisk_filter_iocbs(queue->filter, queue->iocbs, queue->queued);
-	merged = io_merge(&queue->opioctx, queue->iocbs, queue->queued);
+	merged = tapdisk_queue_elevator(queue);
 
 	queue->queued = 0;
 
@@ -515,7 +654,7 @@ tapdisk_lio_submit(struct tqueue *queue)
 		return 0;
 
 	tapdisk_filter_iocbs(queue->filter, queue->iocbs, queue->queued);
-	merged    = io_merge(&queue->opioctx, queue->iocbs, queue->queued);
+	merged    = tapdisk_queue_elevator(queue);
 	tapdisk_lio_set_eventfd(queue, merged, queue->iocbs);
 	submitted = io_submit(lio->aio_ctx, merged, queue->iocbs);
 
@@ -547,6 +686,937 @@ static const struct tio td_tio_lio = {
 	.tio_submit  = tapdisk_lio_submit,
 };
 
+/*
+ * multi-queue libaio
+ *
+ * Like lio, but spread over several lanes, each with its own aio context,
+ * eventfd and submission thread.  The main loop still does all the
+ * bookkeeping: it merges the queued iocbs, deals them out to the lanes and
+ * reaps completions, so callbacks run on the main thread, exactly as with
+ * lio.  Only io_submit(), where the kernel does most of its work for a
+ * request, moves to the lane threads, so that a single busy VBD is not
+ * limited to one core.
+ *
+ * iocbs which a lane fails to submit are handed back through the lane's
+ * failed list and completed with the error by the main loop.
+ */
+
+struct mlio_lane {
+	struct tqueue   *queue;
+	int              id;
+
+	io_context_t     aio_ctx;
+	struct io_event *aio_events;
+	int              event_fd;
+	int              event_id;
+
+	pthread_t        thread;
+	int              running;
+
+	pthread_mutex_t  lock;
+	pthread_cond_t   cond;
+	int              stop;
+
+	/* iocbs handed over by the main loop, not yet submitted */
+	struct iocb    **pending;
+	int              n_pending;
+	/* batch being submitted by the lane thread */
+	struct iocb    **batch;
+
+	/* iocbs the lane thread failed to submit */
+	struct io_event *failed;
+	int              n_failed;
+
+	uint64_t         submitted;
+};
+
+struct mlio {
+	int               n_lanes;
+	int               next;
+	struct mlio_lane *lanes;
+};
+
+static void
+tapdisk_mlio_signal(struct mlio_lane *lane)
+{
+	uint64_t val = 1;
+
+	write_exact(lane->event_fd, &val, sizeof(val));
+}
+
+static void *
+tapdisk_mlio_thread(void *arg)
+{
+	struct mlio_lane *lane = arg;
+	struct iocb **batch;
+	int i, n, submitted, err;
+
+	for (;;) {
+		pthread_mutex_lock(&lane->lock);
+
+		while (!lane->n_pending && !lane->stop)
+			pthread_cond_wait(&lane->cond, &lane->lock);
+
+		if (!lane->n_pending) {
+			pthread_mutex_unlock(&lane->lock);
+			break;
+		}
+
+		batch           = lane->pending;
+		n               = lane->n_pending;
+		lane->pending   = lane->batch;
+		lane->batch     = batch;
+		lane->n_pending = 0;
+
+		pthread_mutex_unlock(&lane->lock);
+
+		submitted = io_submit(lane->aio_ctx, n, batch);
+
+		err = 0;
+		if (submitted < 0) {
+			err = submitted;
+			submitted = 0;
+		} else if (submitted < n)
+			err = -EIO;
+
+		if (!err)
+			continue;
+
+		pthread_mutex_lock(&lane->lock);
+		for (i = submitted; i < n; i++) {
+			struct io_event *ep = &lane->failed[lane->n_failed++];
+
+			memset(ep, 0, sizeof(*ep));
+			ep->obj = batch[i];
+			ep->res = err;
+		}
+		pthread_mutex_unlock(&lane->lock);
+
+		tapdisk_mlio_signal(lane);
+	}
+
+	return NULL;
+}
+
+static void
+tapdisk_mlio_event(event_id_t id, char mode, void *private)
+{
+	struct mlio_lane *lane = private;
+	struct tqueue *queue = lane->queue;
+	int i, ret, failed, split;
+	struct iocb *iocb;
+	struct tiocb *tiocb;
+	struct io_event *ep;
+	uint64_t val;
+
+	read_exact(lane->event_fd, &val, sizeof(val));
+
+	pthread_mutex_lock(&lane->lock);
+	failed = lane->n_failed;
+	memcpy(lane->aio_events, lane->failed, failed * sizeof(*ep));
+	lane->n_failed = 0;
+	pthread_mutex_unlock(&lane->lock);
+
+	if (failed)
+		ERR((int)lane->aio_events[0].res,
+		    "io_submit error: %d failed on lane %d", failed, lane->id);
+
+	ret = io_getevents(lane->aio_ctx, 0, queue->size - failed,
+			   lane->aio_events + failed, NULL);
+	if (ret < 0)
+		ret = 0;
+	ret  += failed;
+	split = io_split(&queue->opioctx, lane->aio_events, ret);
+	tapdisk_filter_events(queue->filter, lane->aio_events, split);
+
+	DBG("lane %d events: %d, tiocbs: %d\n", lane->id, ret, split);
+
+	queue->iocbs_pending  -= ret;
+	queue->tiocbs_pending -= split;
+
+	for (i = split, ep = lane->aio_events; i-- > 0; ep++) {
+		iocb  = ep->obj;
+		tiocb = iocb->data;
+		complete_tiocb(queue, tiocb, ep->res);
+	}
+
+	queue_deferred_tiocbs(queue);
+}
+
+static void
+tapdisk_mlio_destroy(struct tqueue *queue)
+{
+	struct mlio *mlio = queue->tio_data;
+	struct mlio_lane *lane;
+	int i;
+
+	if (!mlio || !mlio->lanes)
+		return;
+
+	for (i = 0; i < mlio->n_lanes; i++) {
+		lane = &mlio->lanes[i];
+
+		if (lane->running) {
+			pthread_mutex_lock(&lane->lock);
+			lane->stop = 1;
+			pthread_cond_signal(&lane->cond);
+			pthread_mutex_unlock(&lane->lock);
+
+			pthread_join(lane->thread, NULL);
+			lane->running = 0;
+		}
+
+		if (lane->event_id >= 0)
+			tapdisk_server_unregister_event(lane->event_id);
+
+		if (lane->event_fd >= 0)
+			close(lane->event_fd);
+
+		if (lane->aio_ctx)
+			io_destroy(lane->aio_ctx);
+
+		pthread_cond_destroy(&lane->cond);
+		pthread_mutex_destroy(&lane->lock);
+
+		free(lane->aio_events);
+		free(lane->pending);
+		free(lane->batch);
+		free(lane->failed);
+	}
+
+	free(mlio->lanes);
+	mlio->lanes = NULL;
+}
+
+static int
+tapdisk_mlio_setup_lane(struct tqueue *queue, struct mlio_lane *lane,
+			int id, int qlen)
+{
+	int err;
+
+	lane->queue    = queue;
+	lane->id       = id;
+	lane->event_fd = -1;
+	lane->event_id = -1;
+
+	pthread_mutex_init(&lane->lock, NULL);
+	pthread_cond_init(&lane->cond, NULL);
+
+	lane->aio_events = calloc(qlen, sizeof(struct io_event));
+	lane->failed     = calloc(qlen, sizeof(struct io_event));
+	lane->pending    = calloc(qlen, sizeof(struct iocb *));
+	lane->batch      = calloc(qlen, sizeof(struct iocb *));
+	if (!lane->aio_events || !lane->failed ||
+	    !lane->pending || !lane->batch)
+		return -ENOMEM;
+
+	err = io_setup(qlen, &lane->aio_ctx);
+	if (err < 0) {
+		lane->aio_ctx = 0;
+		return err;
+	}
+
+	lane->event_fd = tapdisk_sys_eventfd(0);
+	if (lane->event_fd < 0)
+		return -errno;
+
+	lane->event_id =
+		tapdisk_server_register_event(SCHEDULER_POLL_READ_FD,
+					      lane->event_fd, 0,
+					      tapdisk_mlio_event,
+					      lane);
+	if (lane->event_id < 0)
+		return lane->event_id;
+
+	err = pthread_create(&lane->thread, NULL, tapdisk_mlio_thread, lane);
+	if (err)
+		return -err;
+	lane->running = 1;
+
+	return 0;
+}
+
+static int
+tapdisk_mlio_setup(struct tqueue *queue, int qlen)
+{
+	struct mlio *mlio = queue->tio_data;
+	sigset_t set, old;
+	int i, err = 0;
+
+	/* completions are only signalled through eventfds */
+	if (!tapdisk_lio_check_resfd())
+		return -ENOSYS;
+
+	mlio->n_lanes = tapdisk_server_get_aio_lanes();
+	if (mlio->n_lanes < 1)
+		mlio->n_lanes = 1;
+
+	mlio->lanes = calloc(mlio->n_lanes, sizeof(struct mlio_lane));
+	if (!mlio->lanes)
+		return -errno;
+
+	/* signals are for the main loop only */
+	sigfillset(&set);
+	pthread_sigmask(SIG_BLOCK, &set, &old);
+
+	for (i = 0; i < mlio->n_lanes; i++) {
+		err = tapdisk_mlio_setup_lane(queue, &mlio->lanes[i], i, qlen);
+		if (err)
+			break;
+	}
+
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
+
+	if (err) {
+		if (err == -EAGAIN)
+			DPRINTF("Couldn't setup AIO contexts for %d lanes. You "
+				"may need to increase the system-wide aio request "
+				"limit. (e.g. 'echo 1048576 > "
+				"/proc/sys/fs/aio-max-nr')\n", mlio->n_lanes);
+		tapdisk_mlio_destroy(queue);
+		return err;
+	}
+
+	DPRINTF("I/O queue lanes: %d\n", mlio->n_lanes);
+
+	return 0;
+}
+
+static int
+tapdisk_mlio_submit(struct tqueue *queue)
+{
+	struct mlio *mlio = queue->tio_data;
+	struct mlio_lane *lane;
+	int i, j, merged, per_lane, n;
+
+	if (!queue->queued)
+		return 0;
+
+	tapdisk_filter_iocbs(queue->filter, queue->iocbs, queue->queued);
+	merged = tapdisk_queue_elevator(queue);
+
+	/*
+	 * deal the merged iocbs out to the lanes in contiguous runs, so
+	 * each lane still submits in batches.
+	 */
+	per_lane = (merged + mlio->n_lanes - 1) / mlio->n_lanes;
+
+	for (i = 0; i < merged; i += n) {
+		lane = &mlio->lanes[mlio->next];
+		mlio->next = (mlio->next + 1) % mlio->n_lanes;
+
+		n = merged - i;
+		if (n > per_lane)
+			n = per_lane;
+
+		for (j = i; j < i + n; j++)
+			__io_set_eventfd(queue->iocbs[j], lane->event_fd);
+
+		pthread_mutex_lock(&lane->lock);
+		memcpy(lane->pending + lane->n_pending, queue->iocbs + i,
+		       n * sizeof(struct iocb *));
+		lane->n_pending += n;
+		lane->submitted += n;
+		pthread_cond_signal(&lane->cond);
+		pthread_mutex_unlock(&lane->lock);
+	}
+
+	DBG("queued: %d, merged: %d\n", queue->queued, merged);
+
+	queue->iocbs_pending  += merged;
+	queue->tiocbs_pending += queue->queued;
+	queue->queued          = 0;
+
+	return merged;
+}
+
+static void
+tapdisk_mlio_debug(struct tqueue *queue)
+{
+	struct mlio *mlio = queue->tio_data;
+	int i;
+
+	for (i = 0; i < mlio->n_lanes; i++)
+		WARN("lane %d: submitted: %"PRIu64"\n",
+		     i, mlio->lanes[i].submitted);
+}
+
+static const struct tio td_tio_mlio = {
+	.name        = "mlio",
+	.data_size   = sizeof(struct mlio),
+	.tio_setup   = tapdisk_mlio_setup,
+	.tio_destroy = tapdisk_mlio_destroy,
+	.tio_submit  = tapdisk_mlio_submit,
+	.tio_debug   = tapdisk_mlio_debug,
+};
+
+/*
+ * io_uring
+ *
+ * Requests go into the submission ring and one io_uring_enter() submits
+ * the whole merged batch.  With SQ polling, a kernel thread picks them up
+ * instead, and the syscall is only made to wake that thread after it has
+ * gone idle.  Completions are read straight out of the completion ring
+ * when the ring's eventfd fires.
+ *
+ * Image files which their drivers register with td_register_file() are
+ * used as fixed files.  The data area of each VBD is offered as a fixed
+ * buffer; if the kernel will not pin those pages, requests on them are
+ * issued as plain reads and writes.
+ */
+
+#if defined(HAVE_LINUX_IO_URING_H) && defined(__NR_io_uring_setup)
+
+#include <sys/mman.h>
+#include <sys/uio.h>
+#include <linux/io_uring.h>
+
+#define URING_MAX_FILES         64
+#define URING_MAX_BUFFERS       16
+#define URING_SQ_THREAD_IDLE    1000 /* ms */
+
+#ifndef IORING_FEAT_SQPOLL_NONFIXED
+#define IORING_FEAT_SQPOLL_NONFIXED (1U << 7)
+#endif
+
+#define URING_FLAG_SQPOLL       (1<<0)
+#define URING_FLAG_FIXED_FILES  (1<<1)
+#define URING_FLAG_FIXED_BUFS   (1<<2)
+
+struct uring {
+	int                  ring_fd;
+	int                  flags;
+
+	void                *sq_ptr;
+	size_t               sq_size;
+	unsigned            *sq_head;
+	unsigned            *sq_tail;
+	unsigned            *sq_mask;
+	unsigned            *sq_flags;
+	unsigned            *sq_array;
+	struct io_uring_sqe *sqes;
+	size_t               sqes_size;
+
+	void                *cq_ptr;
+	size_t               cq_size;
+	unsigned            *cq_head;
+	unsigned            *cq_tail;
+	unsigned            *cq_mask;
+	struct io_uring_cqe *cqes;
+
+	int                  event_fd;
+	int                  event_id;
+	struct io_event     *aio_events;
+
+	int                  files[URING_MAX_FILES];
+	struct iovec         bufs[URING_MAX_BUFFERS];
+	int                  n_bufs;
+
+	uint64_t             enters;
+};
+
+static inline int
+uring_setup(unsigned entries, struct io_uring_params *p)
+{
+	return syscall(__NR_io_uring_setup, entries, p);
+}
+
+static inline int
+uring_enter(int fd, unsigned to_submit, unsigned min_complete, unsigned flags)
+{
+	return syscall(__NR_io_uring_enter, fd, to_submit, min_complete,
+		       flags, NULL, 0);
+}
+
+static inline int
+uring_register(int fd, unsigned opcode, void *arg, unsigned nr_args)
+{
+	return syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+static void
+tapdisk_uring_destroy(struct tqueue *queue)
+{
+	struct uring *ur = queue->tio_data;
+
+	if (!ur)
+		return;
+
+	if (ur->event_id >= 0) {
+		tapdisk_server_unregister_event(ur->event_id);
+		ur->event_id = -1;
+	}
+
+	if (ur->sqes) {
+		munmap(ur->sqes, ur->sqes_size);
+		ur->sqes = NULL;
+	}
+
+	if (ur->cq_ptr && ur->cq_ptr != ur->sq_ptr)
+		munmap(ur->cq_ptr, ur->cq_size);
+	ur->cq_ptr = NULL;
+
+	if (ur->sq_ptr) {
+		munmap(ur->sq_ptr, ur->sq_size);
+		ur->sq_ptr = NULL;
+	}
+
+	if (ur->ring_fd >= 0) {
+		close(ur->ring_fd);
+		ur->ring_fd = -1;
+	}
+
+	if (ur->event_fd >= 0) {
+		close(ur->event_fd);
+		ur->event_fd = -1;
+	}
+
+	free(ur->aio_events);
+	ur->aio_events = NULL;
+}
+
+static int
+tapdisk_uring_map(struct uring *ur, struct io_uring_params *p)
+{
+	char *sq, *cq;
+
+	ur->sq_size   = p->sq_off.array + p->sq_entries * sizeof(unsigned);
+	ur->cq_size   = p->cq_off.cqes +
+		p->cq_entries * sizeof(struct io_uring_cqe);
+	ur->sqes_size = p->sq_entries * sizeof(struct io_uring_sqe);
+
+	if (p->features & IORING_FEAT_SINGLE_MMAP) {
+		if (ur->cq_size > ur->sq_size)
+			ur->sq_size = ur->cq_size;
+		ur->cq_size = ur->sq_size;
+	}
+
+	ur->sq_ptr = mmap(NULL, ur->sq_size, PROT_READ | PROT_WRITE,
+			  MAP_SHARED | MAP_POPULATE, ur->ring_fd,
+			  IORING_OFF_SQ_RING);
+	if (ur->sq_ptr == MAP_FAILED) {
+		ur->sq_ptr = NULL;
+		return -errno;
+	}
+
+	if (p->features & IORING_FEAT_SINGLE_MMAP)
+		ur->cq_ptr = ur->sq_ptr;
+	else {
+		ur->cq_ptr = mmap(NULL, ur->cq_size, PROT_READ | PROT_WRITE,
+				  MAP_SHARED | MAP_POPULATE, ur->ring_fd,
+				  IORING_OFF_CQ_RING);
+		if (ur->cq_ptr == MAP_FAILED) {
+			ur->cq_ptr = NULL;
+			return -errno;
+		}
+	}
+
+	ur->sqes = mmap(NULL, ur->sqes_size, PROT_READ | PROT_WRITE,
+			MAP_SHARED | MAP_POPULATE, ur->ring_fd,
+			IORING_OFF_SQES);
+	if (ur->sqes == MAP_FAILED) {
+		ur->sqes = NULL;
+		return -errno;
+	}
+
+	sq = ur->sq_ptr;
+	ur->sq_head  = (unsigned *)(sq + p->sq_off.head);
+	ur->sq_tail  = (unsigned *)(sq + p->sq_off.tail);
+	ur->sq_mask  = (unsigned *)(sq + p->sq_off.ring_mask);
+	ur->sq_flags = (unsigned *)(sq + p->sq_off.flags);
+	ur->sq_array = (unsigned *)(sq + p->sq_off.array);
+
+	cq = ur->cq_ptr;
+	ur->cq_head  = (unsigned *)(cq + p->cq_off.head);
+	ur->cq_tail  = (unsigned *)(cq + p->cq_off.tail);
+	ur->cq_mask  = (unsigned *)(cq + p->cq_off.ring_mask);
+	ur->cqes     = (struct io_uring_cqe *)(cq + p->cq_off.cqes);
+
+	return 0;
+}
+
+static void
+tapdisk_uring_event(event_id_t id, char mode, void *private)
+{
+	struct tqueue *queue = private;
+	struct uring *ur = queue->tio_data;
+	struct io_uring_cqe *cqe;
+	struct io_event *ep;
+	struct iocb *iocb;
+	struct tiocb *tiocb;
+	unsigned head, tail;
+	int i, ret, split;
+	uint64_t val;
+
+	read_exact(ur->event_fd, &val, sizeof(val));
+
+	head = *ur->cq_head;
+	tail = __atomic_load_n(ur->cq_tail, __ATOMIC_ACQUIRE);
+
+	for (ret = 0; head != tail && ret < queue->size; head++, ret++) {
+		cqe = &ur->cqes[head & *ur->cq_mask];
+		ep  = &ur->aio_events[ret];
+
+		ep->obj = (struct iocb *)(uintptr_t)cqe->user_data;
+		ep->res = (long)cqe->res;
+	}
+
+	__atomic_store_n(ur->cq_head, head, __ATOMIC_RELEASE);
+
+	split = io_split(&queue->opioctx, ur->aio_events, ret);
+	tapdisk_filter_events(queue->filter, ur->aio_events, split);
+
+	DBG("events: %d, tiocbs: %d\n", ret, split);
+
+	queue->iocbs_pending  -= ret;
+	queue->tiocbs_pending -= split;
+
+	for (i = split, ep = ur->aio_events; i-- > 0; ep++) {
+		iocb  = ep->obj;
+		tiocb = iocb->data;
+		complete_tiocb(queue, tiocb, ep->res);
+	}
+
+	queue_deferred_tiocbs(queue);
+}
+
+static int
+tapdisk_uring_setup(struct tqueue *queue, int qlen)
+{
+	struct uring *ur = queue->tio_data;
+	struct io_uring_params p;
+	int i, err;
+
+	ur->ring_fd  = -1;
+	ur->event_fd = -1;
+	ur->event_id = -1;
+
+	memset(&p, 0, sizeof(p));
+	if (tapdisk_server_get_aio_sqpoll()) {
+		p.flags |= IORING_SETUP_SQPOLL;
+		p.sq_thread_idle = URING_SQ_THREAD_IDLE;
+	}
+
+	ur->ring_fd = uring_setup(qlen, &p);
+	if (ur->ring_fd >= 0 && (p.flags & IORING_SETUP_SQPOLL) &&
+	    !(p.features & IORING_FEAT_SQPOLL_NONFIXED)) {
+		/*
+		 * before 5.11, a polled ring only does I/O on fixed files,
+		 * and only some drivers register theirs: rather not poll
+		 * than fail the requests of the others.
+		 */
+		close(ur->ring_fd);
+		ur->ring_fd = -1;
+		errno = EOPNOTSUPP;
+	}
+	if (ur->ring_fd < 0 && (p.flags & IORING_SETUP_SQPOLL)) {
+		DPRINTF("io_uring SQ polling unavailable (%d), "
+			"not polling\n", -errno);
+		memset(&p, 0, sizeof(p));
+		ur->ring_fd = uring_setup(qlen, &p);
+	}
+	if (ur->ring_fd < 0) {
+		err = -errno;
+		goto fail;
+	}
+
+	if (p.flags & IORING_SETUP_SQPOLL)
+		ur->flags |= URING_FLAG_SQPOLL;
+
+	/* IORING_OP_READ and IORING_OP_WRITE came with this feature */
+	if (!(p.features & IORING_FEAT_RW_CUR_POS)) {
+		err = -ENOSYS;
+		goto fail;
+	}
+
+	err = tapdisk_uring_map(ur, &p);
+	if (err)
+		goto fail;
+
+	ur->event_fd = tapdisk_sys_eventfd(0);
+	if (ur->event_fd < 0) {
+		err = -errno;
+		goto fail;
+	}
+
+	if (uring_register(ur->ring_fd, IORING_REGISTER_EVENTFD,
+			   &ur->event_fd, 1) < 0) {
+		err = -errno;
+		goto fail;
+	}
+
+	/* a sparse table, filled in as drivers register their files */
+	for (i = 0; i < URING_MAX_FILES; i++)
+		ur->files[i] = -1;
+	if (!uring_register(ur->ring_fd, IORING_REGISTER_FILES,
+			    ur->files, URING_MAX_FILES))
+		ur->flags |= URING_FLAG_FIXED_FILES;
+
+	ur->event_id =
+		tapdisk_server_register_event(SCHEDULER_POLL_READ_FD,
+					      ur->event_fd, 0,
+					      tapdisk_uring_event,
+					      queue);
+	err = ur->event_id;
+	if (err < 0)
+		goto fail;
+
+	ur->aio_events = calloc(qlen, sizeof(struct io_event));
+	if (!ur->aio_events) {
+		err = -errno;
+		goto fail;
+	}
+
+	DPRINTF("io_uring: %u entries%s%s\n", p.sq_entries,
+		ur->flags & URING_FLAG_SQPOLL ? ", SQ polling" : "",
+		ur->flags & URING_FLAG_FIXED_FILES ? ", fixed files" : "");
+
+	return 0;
+
+fail:
+	tapdisk_uring_destroy(queue);
+	return err;
+}
+
+static int
+tapdisk_uring_register_file(struct tqueue *queue, int fd)
+{
+	struct uring *ur = queue->tio_data;
+	struct io_uring_files_update up;
+	int i;
+
+	if (!(ur->flags & URING_FLAG_FIXED_FILES))
+		return -ENOSYS;
+
+	for (i = 0; i < URING_MAX_FILES; i++)
+		if (ur->files[i] == -1)
+			break;
+	if (i == URING_MAX_FILES)
+		return -ENOSPC;
+
+	memset(&up, 0, sizeof(up));
+	up.offset = i;
+	up.fds    = (unsigned long)&fd;
+
+	if (uring_register(ur->ring_fd, IORING_REGISTER_FILES_UPDATE,
+			   &up, 1) < 0)
+		return -errno;
+
+	ur->files[i] = fd;
+
+	return 0;
+}
+
+static void
+tapdisk_uring_unregister_file(struct tqueue *queue, int fd)
+{
+	struct uring *ur = queue->tio_data;
+	struct io_uring_files_update up;
+	int i, none = -1;
+
+	for (i = 0; i < URING_MAX_FILES; i++)
+		if (ur->files[i] == fd)
+			break;
+	if (i == URING_MAX_FILES)
+		return;
+
+	memset(&up, 0, sizeof(up));
+	up.offset = i;
+	up.fds    = (unsigned long)&none;
+
+	uring_register(ur->ring_fd, IORING_REGISTER_FILES_UPDATE, &up, 1);
+	ur->files[i] = -1;
+}
+
+static int
+tapdisk_uring_update_buffers(struct uring *ur)
+{
+	uring_register(ur->ring_fd, IORING_UNREGISTER_BUFFERS, NULL, 0);
+	ur->flags &= ~URING_FLAG_FIXED_BUFS;
+
+	if (!ur->n_bufs)
+		return 0;
+
+	if (uring_register(ur->ring_fd, IORING_REGISTER_BUFFERS,
+			   ur->bufs, ur->n_bufs) < 0)
+		return -errno;
+
+	ur->flags |= URING_FLAG_FIXED_BUFS;
+
+	return 0;
+}
+
+static int
+tapdisk_uring_register_buffer(struct tqueue *queue, void *buf, size_t size)
+{
+	struct uring *ur = queue->tio_data;
+	int err;
+
+	if (ur->n_bufs == URING_MAX_BUFFERS)
+		return -ENOSPC;
+
+	ur->bufs[ur->n_bufs].iov_base = buf;
+	ur->bufs[ur->n_bufs].iov_len  = size;
+	ur->n_bufs++;
+
+	err = tapdisk_uring_update_buffers(ur);
+	if (err)
+		DPRINTF("io_uring: not using fixed buffers: %d\n", err);
+
+	return err;
+}
+
+static void
+tapdisk_uring_unregister_buffer(struct tqueue *queue, void *buf)
+{
+	struct uring *ur = queue->tio_data;
+	int i;
+
+	for (i = 0; i < ur->n_bufs; i++)
+		if (ur->bufs[i].iov_base == buf)
+			break;
+	if (i == ur->n_bufs)
+		return;
+
+	ur->bufs[i] = ur->bufs[--ur->n_bufs];
+
+	tapdisk_uring_update_buffers(ur);
+}
+
+static void
+tapdisk_uring_prep_sqe(struct uring *ur, struct io_uring_sqe *sqe,
+		       struct iocb *iocb)
+{
+	int i, write, vector;
+	char *buf = iocb->u.c.buf;
+
+	write  = (iocb->aio_lio_opcode == IO_CMD_PWRITE ||
+		  iocb->aio_lio_opcode == IO_CMD_PWRITEV);
+	vector = (iocb->aio_lio_opcode == IO_CMD_PREADV ||
+		  iocb->aio_lio_opcode == IO_CMD_PWRITEV);
+
+	memset(sqe, 0, sizeof(*sqe));
+
+	if (vector)
+		sqe->opcode = write ? IORING_OP_WRITEV : IORING_OP_READV;
+	else
+		sqe->opcode = write ? IORING_OP_WRITE : IORING_OP_READ;
+	sqe->fd        = iocb->aio_fildes;
+	sqe->addr      = (unsigned long)buf;
+	sqe->len       = iocb->u.c.nbytes;
+	sqe->off       = iocb->u.c.offset;
+	sqe->user_data = (uintptr_t)iocb;
+
+	if (ur->flags & URING_FLAG_FIXED_FILES)
+		for (i = 0; i < URING_MAX_FILES; i++)
+			if (ur->files[i] == iocb->aio_fildes) {
+				sqe->fd     = i;
+				sqe->flags |= IOSQE_FIXED_FILE;
+				break;
+			}
+
+	/* the buffers of a vectored request are not fixed */
+	if ((ur->flags & URING_FLAG_FIXED_BUFS) && !vector)
+		for (i = 0; i < ur->n_bufs; i++) {
+			char *base = ur->bufs[i].iov_base;
+
+			if (buf >= base &&
+			    buf + iocb->u.c.nbytes <= base + ur->bufs[i].iov_len) {
+				sqe->opcode    = write ?
+					IORING_OP_WRITE_FIXED :
+					IORING_OP_READ_FIXED;
+				sqe->buf_index = i;
+				break;
+			}
+		}
+}
+
+static int
+tapdisk_uring_submit(struct tqueue *queue)
+{
+	struct uring *ur = queue->tio_data;
+	unsigned tail, idx;
+	int i, merged, submitted, err = 0;
+
+	if (!queue->queued)
+		return 0;
+
+	tapdisk_filter_iocbs(queue->filter, queue->iocbs, queue->queued);
+	merged = tapdisk_queue_elevator(queue);
+
+	/*
+	 * the queue never has more requests in flight than the ring has
+	 * entries, so there is always room for the whole batch.
+	 */
+	tail = *ur->sq_tail;
+	for (i = 0; i < merged; i++, tail++) {
+		idx = tail & *ur->sq_mask;
+		tapdisk_uring_prep_sqe(ur, &ur->sqes[idx], queue->iocbs[i]);
+		ur->sq_array[idx] = idx;
+	}
+	__atomic_store_n(ur->sq_tail, tail, __ATOMIC_RELEASE);
+
+	if (ur->flags & URING_FLAG_SQPOLL) {
+		submitted = merged;
+		__atomic_thread_fence(__ATOMIC_SEQ_CST);
+		if (*ur->sq_flags & IORING_SQ_NEED_WAKEUP) {
+			uring_enter(ur->ring_fd, 0, 0, IORING_ENTER_SQ_WAKEUP);
+			ur->enters++;
+		}
+	} else {
+		submitted = uring_enter(ur->ring_fd, merged, 0, 0);
+		ur->enters++;
+
+		if (submitted < 0) {
+			err = -errno;
+			submitted = 0;
+		} else if (submitted < merged)
+			err = -EIO;
+
+		/* take back whatever the kernel did not consume */
+		if (err)
+			__atomic_store_n(ur->sq_tail, *ur->sq_head,
+					 __ATOMIC_RELEASE);
+	}
+
+	DBG("queued: %d, merged: %d, submitted: %d\n",
+	    queue->queued, merged, submitted);
+
+	queue->iocbs_pending  += submitted;
+	queue->tiocbs_pending += queue->queued;
+	queue->queued          = 0;
+
+	if (err)
+		queue->tiocbs_pending -=
+			fail_tiocbs(queue, submitted, merged, err);
+
+	return submitted;
+}
+
+static void
+tapdisk_uring_debug(struct tqueue *queue)
+{
+	struct uring *ur = queue->tio_data;
+
+	WARN("io_uring: flags: %#x, enters: %"PRIu64", buffers: %d\n",
+	     ur->flags, ur->enters, ur->n_bufs);
+}
+
+static const struct tio td_tio_uring = {
+	.name                 = "uring",
+	.data_size            = sizeof(struct uring),
+	.tio_setup            = tapdisk_uring_setup,
+	.tio_destroy          = tapdisk_uring_destroy,
+	.tio_submit           = tapdisk_uring_submit,
+	.tio_debug            = tapdisk_uring_debug,
+	.tio_register_file    = tapdisk_uring_register_file,
+	.tio_unregister_file  = tapdisk_uring_unregister_file,
+	.tio_register_buffer  = tapdisk_uring_register_buffer,
+	.tio_unregister_buffer = tapdisk_uring_unregister_buffer,
+};
+
+#endif /* HAVE_LINUX_IO_URING_H */
+
 static void
 tapdisk_queue_free_io(struct tqueue *queue)
 {
@@ -575,6 +1645,14 @@ tapdisk_queue_init_io(struct tqueue *queue, int drv)
 	case TIO_DRV_RWIO:
 		tio = &td_tio_rwio;
 		break;
+	case TIO_DRV_MLIO:
+		tio = &td_tio_mlio;
+		break;
+#if defined(HAVE_LINUX_IO_URING_H) && defined(__NR_io_uring_setup)
+	case TIO_DRV_URING:
+		tio = &td_tio_uring;
+		break;
+#endif
 	default:
 		err = -EINVAL;
 		goto fail;
@@ -628,10 +1706,16 @@ tapdisk_init_queue(struct tqueue *queue, int size,
 		goto fail;
 	}
 
-	err = opio_init(&queue->opioctx, size);
+	/* room for splitting as many iocbs as are merged */
+	err = opio_init(&queue->opioctx, 2 * size);
 	if (err)
 		goto fail;
 
+	if (tapdisk_server_get_aio_max_kb() > 0)
+		queue->opioctx.max_bytes =
+			(unsigned long)tapdisk_server_get_aio_max_kb() << 10;
+	queue->expire_us = tapdisk_server_get_aio_expire_ms() * 1000ULL;
+
 	return 0;
 
  fail:
@@ -661,6 +1745,15 @@ tapdisk_debug_queue(struct tqueue *queue)
 	     queue->size, queue->tio->name, queue->queued, queue->iocbs_pending,
 	     queue->tiocbs_pending, queue->tiocbs_deferred, queue->deferrals);
 
+	WARN("batches: %"PRIu64", reordered: %"PRIu64", expired: %"PRIu64", "
+	     "merged: %"PRIu64", vectored: %"PRIu64", split: %"PRIu64" "
+	     "into %"PRIu64"\n", queue->batches, queue->reordered,
+	     queue->expired, queue->opioctx.merged, queue->opioctx.vectored,
+	     queue->opioctx.splits, queue->opioctx.pieces);
+
+	if (queue->tio->tio_debug)
+		queue->tio->tio_debug(queue);
+
 	if (tiocb) {
 		WARN("deferred:\n");
 		for (; tiocb != NULL; tiocb = tiocb->next) {
@@ -673,6 +1766,55 @@ tapdisk_debug_queue(struct tqueue *queue)
 	}
 }
 
+int
+tapdisk_queue_stats(struct tqueue *queue, char *buf, size_t size)
+{
+	if (!queue->tio)
+		return 0;
+
+	return snprintf(buf, size, "aio queue: %s, batches: %"PRIu64", "
+			"reordered: %"PRIu64", expired: %"PRIu64", "
+			"merged: %"PRIu64", vectored: %"PRIu64", "
+			"split: %"PRIu64" into %"PRIu64", "
+			"deferrals: %"PRIu64,
+			queue->tio->name, queue->batches, queue->reordered,
+			queue->expired, queue->opioctx.merged,
+			queue->opioctx.vectored, queue->opioctx.splits,
+			queue->opioctx.pieces, queue->deferrals);
+}
+
+int
+tapdisk_queue_register_file(struct tqueue *queue, int fd)
+{
+	if (!queue->tio || !queue->tio->tio_register_file)
+		return -ENOSYS;
+
+	return queue->tio->tio_register_file(queue, fd);
+}
+
+void
+tapdisk_queue_unregister_file(struct tqueue *queue, int fd)
+{
+	if (queue->tio && queue->tio->tio_unregister_file)
+		queue->tio->tio_unregister_file(queue, fd);
+}
+
+int
+tapdisk_queue_register_buffer(struct tqueue *queue, void *buf, size_t size)
+{
+	if (!queue->tio || !queue->tio->tio_register_buffer)
+		return -ENOSYS;
+
+	return queue->tio->tio_register_buffer(queue, buf, size);
+}
+
+void
+tapdisk_queue_unregister_buffer(struct tqueue *queue, void *buf)
+{
+	if (queue->tio && queue->tio->tio_unregister_buffer)
+		queue->tio->tio_unregister_buffer(queue, buf);
+}
+
 void
 tapdisk_prep_tiocb(struct tiocb *tiocb, int fd, int rw, char *buf, size_t size,
 		   long long offset, td_queue_callback_t cb, void *arg)
@@ -693,6 +1835,9 @@ tapdisk_prep_tiocb(struct tiocb *tiocb, int fd, int rw, char *buf, size_t size,
 void
 tapdisk_queue_tiocb(struct tqueue *queue, struct tiocb *tiocb)
 {
+	if (queue->expire_us)
+		tiocb->stamp = tapdisk_queue_now();
+
 	if (!tapdisk_queue_full(queue))
 		queue_tiocb(queue, tiocb);
 	else
@@ -46,6 +46,9 @@ struct tiocb {
 
 	struct iocb           iocb;
 	struct tiocb         *next;
+
+	/* when the tiocb was queued, in usecs */
+	uint64_t              stamp;
 };
 
 struct tlist {
@@ -82,6 +85,12 @@ struct tqueue {
 	struct tfilter       *filter;
 
 	uint64_t              deferrals;
+
+	/* elevator: tiocbs queued longer than this are not reordered */
+	uint64_t              expire_us;
+	uint64_t              batches;
+	uint64_t              reordered;
+	uint64_t              expired;
 };
 
 struct tio {
@@ -91,11 +100,21 @@ struct tio {
 	int  (*tio_setup)    (struct tqueue *queue, int qlen);
 	void (*tio_destroy)  (struct tqueue *queue);
 	int  (*tio_submit)   (struct tqueue *queue);
+	void (*tio_debug)    (struct tqueue *queue);
+
+	/* optional: files and buffers the engine may pre-register */
+	int  (*tio_register_file)     (struct tqueue *queue, int fd);
+	void (*tio_unregister_file)   (struct tqueue *queue, int fd);
+	int  (*tio_register_buffer)   (struct tqueue *queue,
+				       void *buf, size_t size);
+	void (*tio_unregister_buffer) (struct tqueue *queue, void *buf);
 };
 
 enum {
 	TIO_DRV_LIO     = 1,
 	TIO_DRV_RWIO    = 2,
+	TIO_DRV_MLIO    = 3,
+	TIO_DRV_URING   = 4,
 };
 
 /*
@@ -114,11 +133,16 @@ enum {
 int tapdisk_init_queue(struct tqueue *, int size, int drv, struct tfilter *);
 void tapdisk_free_queue(struct tqueue *);
 void tapdisk_debug_queue(struct tqueue *);
+int tapdisk_queue_stats(struct tqueue *, char *buf, size_t size);
 void tapdisk_queue_tiocb(struct tqueue *, struct tiocb *);
 int tapdisk_submit_tiocbs(struct tqueue *);
 int tapdisk_submit_all_tiocbs(struct tqueue *);
 int tapdisk_cancel_tiocbs(struct tqueue *);
 int tapdisk_cancel_all_tiocbs(struct tqueue *);
+int tapdisk_queue_register_file(struct tqueue *, int fd);
+void tapdisk_queue_unregister_file(struct tqueue *, int fd);
+int tapdisk_queue_register_buffer(struct tqueue *, void *buf, size_t size);
+void tapdisk_queue_unregister_buffer(struct tqueue *, void *buf);
 void tapdisk_prep_tiocb(struct tiocb *, int, int, char *, size_t,
 			long long, td_queue_callback_t, void *);
 
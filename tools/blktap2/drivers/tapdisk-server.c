@@ -29,6 +29,7 @@
 #include <errno.h>
 #include <unistd.h>
 #include <stdlib.h>
+#include <string.h>
 #include <sys/ioctl.h>
 #include <sys/signal.h>
 
@@ -39,6 +40,7 @@
 
 #define DBG(_level, _f, _a...)       tlog_write(_level, _f, ##_a)
 #define ERR(_err, _f, _a...)         tlog_error(_err, _f, ##_a)
+#define ARRAY_SIZE(a)                (sizeof (a) / sizeof *(a))
 
  tapdisk_server_t server;
 
@@ -141,6 +143,98 @@ tapdisk_server_set_max_timeout(int seconds)
 	scheduler_set_max_timeout(&server.scheduler, seconds);
 }
 
+/*
+ * With more than one lane, the aio queue submits through that many
+ * threads, each with its own aio context (see tapdisk-queue.c).
+ */
+void
+tapdisk_server_set_aio_lanes(int lanes)
+{
+	server.aio_lanes = lanes;
+}
+
+int
+tapdisk_server_get_aio_lanes(void)
+{
+	return server.aio_lanes;
+}
+
+static const struct {
+	const char *name;
+	int         drv;
+} tapdisk_server_aio_engines[] = {
+	{ "lio",   TIO_DRV_LIO   },
+	{ "rwio",  TIO_DRV_RWIO  },
+	{ "mlio",  TIO_DRV_MLIO  },
+	{ "uring", TIO_DRV_URING },
+};
+
+int
+tapdisk_server_set_aio_engine(const char *name)
+{
+	size_t i;
+
+	for (i = 0; i < ARRAY_SIZE(tapdisk_server_aio_engines); i++)
+		if (!strcmp(name, tapdisk_server_aio_engines[i].name)) {
+			server.aio_drv = tapdisk_server_aio_engines[i].drv;
+			return 0;
+		}
+
+	return -EINVAL;
+}
+
+int
+tapdisk_server_get_aio_sqpoll(void)
+{
+	return server.aio_sqpoll;
+}
+
+/*
+ * The aio queue merges requests up to aio_max_kb and splits larger ones,
+ * and sorts them unless queued for longer than aio_expire_ms.
+ */
+int
+tapdisk_server_get_aio_max_kb(void)
+{
+	return server.aio_max_kb;
+}
+
+int
+tapdisk_server_get_aio_expire_ms(void)
+{
+	return server.aio_expire_ms;
+}
+
+int
+tapdisk_server_queue_stats(char *buf, size_t size)
+{
+	return tapdisk_queue_stats(&server.aio_queue, buf, size);
+}
+
+int
+tapdisk_server_register_file(int fd)
+{
+	return tapdisk_queue_register_file(&server.aio_queue, fd);
+}
+
+void
+tapdisk_server_unregister_file(int fd)
+{
+	tapdisk_queue_unregister_file(&server.aio_queue, fd);
+}
+
+int
+tapdisk_server_register_buffer(void *buf, size_t size)
+{
+	return tapdisk_queue_register_buffer(&server.aio_queue, buf, size);
+}
+
+void
+tapdisk_server_unregister_buffer(void *buf)
+{
+	tapdisk_queue_unregister_buffer(&server.aio_queue, buf);
+}
+
 static void
 tapdisk_server_assert_locks(void)
 {
@@ -208,6 +302,22 @@ tapdisk_server_stop_vbds(void)
 static int
 tapdisk_server_init_aio(void)
 {
+	int err, drv;
+
+	drv = server.aio_drv;
+	if (!drv)
+		drv = server.aio_lanes > 1 ? TIO_DRV_MLIO : TIO_DRV_LIO;
+
+	if (drv != TIO_DRV_LIO) {
+		err = tapdisk_init_queue(&server.aio_queue, TAPDISK_TIOCBS,
+					 drv, NULL);
+		if (!err)
+			return 0;
+
+		DBG(TLOG_WARN, "aio engine %d unavailable (%d), "
+		    "falling back to lio\n", drv, err);
+	}
+
 	return tapdisk_init_queue(&server.aio_queue, TAPDISK_TIOCBS,
 				  TIO_DRV_LIO, NULL);
 }
@@ -285,6 +395,30 @@ tapdisk_server_init(void)
 
 	scheduler_initialize(&server.scheduler);
 
+	/*
+	 * tap-ctl spawns tapdisk2 without arguments, and the utilities
+	 * take none for this, so the aio engine defaults come from the
+	 * environment.
+	 */
+	if (getenv("TAPDISK2_AIO_LANES"))
+		server.aio_lanes = atoi(getenv("TAPDISK2_AIO_LANES"));
+
+	if (getenv("TAPDISK2_TIO") &&
+	    tapdisk_server_set_aio_engine(getenv("TAPDISK2_TIO")))
+		DBG(TLOG_WARN, "unknown aio engine %s\n",
+		    getenv("TAPDISK2_TIO"));
+
+	if (getenv("TAPDISK2_URING_SQPOLL"))
+		server.aio_sqpoll = atoi(getenv("TAPDISK2_URING_SQPOLL"));
+
+	server.aio_max_kb = TAPDISK_AIO_MAX_KB;
+	if (getenv("TAPDISK2_AIO_MAX_KB"))
+		server.aio_max_kb = atoi(getenv("TAPDISK2_AIO_MAX_KB"));
+
+	server.aio_expire_ms = TAPDISK_AIO_EXPIRE_MS;
+	if (getenv("TAPDISK2_AIO_EXPIRE_MS"))
+		server.aio_expire_ms = atoi(getenv("TAPDISK2_AIO_EXPIRE_MS"));
+
 	return 0;
 }
 
@@ -49,6 +49,19 @@ event_id_t tapdisk_server_register_event(char, int, int, event_cb_t, void *);
 void tapdisk_server_unregister_event(event_id_t);
 void tapdisk_server_set_max_timeout(int);
 
+void tapdisk_server_set_aio_lanes(int);
+int tapdisk_server_get_aio_lanes(void);
+int tapdisk_server_set_aio_engine(const char *);
+int tapdisk_server_get_aio_sqpoll(void);
+int tapdisk_server_get_aio_max_kb(void);
+int tapdisk_server_get_aio_expire_ms(void);
+int tapdisk_server_queue_stats(char *, size_t);
+
+int tapdisk_server_register_file(int);
+void tapdisk_server_unregister_file(int);
+int tapdisk_server_register_buffer(void *, size_t);
+void tapdisk_server_unregister_buffer(void *);
+
 int tapdisk_server_init(void);
 int tapdisk_server_initialize(void);
 int tapdisk_server_complete(void);
@@ -56,9 +69,16 @@ int tapdisk_server_run(void);
 void tapdisk_server_iterate(void);
 
 #define TAPDISK_TIOCBS              (TAPDISK_DATA_REQUESTS + 50)
+#define TAPDISK_AIO_MAX_KB          512
+#define TAPDISK_AIO_EXPIRE_MS       5
 
 typedef struct tapdisk_server {
 	int                          run;
+	int                          aio_lanes;
+	int                          aio_drv;
+	int                          aio_sqpoll;
+	int                          aio_max_kb;
+	int                          aio_expire_ms;
 	struct list_head             vbds;
 	scheduler_t                  scheduler;
 	struct tqueue                aio_queue;
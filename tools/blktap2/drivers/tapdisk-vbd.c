@@ -199,8 +199,7 @@ static int
 tapdisk_vbd_add_block_cache(td_vbd_t *vbd)
 {
 	int err;
-	td_driver_t *driver;
-	td_image_t *cache, *image, *target, *tmp;
+	td_image_t *image, *target, *tmp;
 
 	target = NULL;
 
@@ -214,49 +213,12 @@ tapdisk_vbd_add_block_cache(td_vbd_t *vbd)
 	if (!target)
 		return 0;
 
-	cache = tapdisk_image_allocate(target->name,
-				       DISK_TYPE_BLOCK_CACHE,
-				       target->storage,
-				       target->flags,
-				       target->private);
-	if (!cache)
-		return -ENOMEM;
-
-	/* try to load existing cache */
-	err = td_load(cache);
-	if (!err)
-		goto done;
-
-	/* hack driver to send open() correct image size */
-	if (!target->driver) {
-		err = -ENODEV;
-		goto fail;
-	}
-
-	cache->driver = tapdisk_driver_allocate(cache->type,
-						cache->name,
-						cache->flags,
-						cache->storage);
-	if (!cache->driver) {
-		err = -ENOMEM;
-		goto fail;
-	}
-
-	cache->driver->info = target->driver->info;
-
-	/* try to open new cache */
-	err = td_open(cache);
-	if (!err)
-		goto done;
-
-fail:
-	/* give up */
-	tapdisk_image_free(target);
-	return err;
+	/* the cache is an optimization; run without it if need be */
+	err = tapdisk_image_attach_cache(target);
+	if (err)
+		EPRINTF("%s: failed to attach block cache: %d\n",
+			target->name, err);
 
-done:
-	/* insert cache before image */
-	list_add(&cache->next, target->next.prev);
 	return 0;
 }
 
@@ -631,6 +593,10 @@ tapdisk_vbd_map_device(td_vbd_t *vbd, const char *devname)
 
 	ioctl(ring->fd, BLKTAP_IOCTL_SETMODE, BLKTAP_MODE_INTERPOSE);
 
+	/* the aio engine may pin the data area for fixed-buffer i/o */
+	tapdisk_server_register_buffer((void *)ring->vstart,
+				       MMAP_PAGES * psize);
+
 	return 0;
 
 fail:
@@ -650,6 +616,9 @@ tapdisk_vbd_unmap_device(td_vbd_t *vbd)
 
 	psize = getpagesize();
 
+	if (vbd->ring.mem > 0)
+		tapdisk_server_unregister_buffer((void *)vbd->ring.vstart);
+
 	if (vbd->ring.fd != -1)
 		close(vbd->ring.fd);
 	if (vbd->ring.mem > 0)
@@ -823,6 +792,11 @@ tapdisk_vbd_debug(td_vbd_t *vbd)
 	    vbd->ts.tv_sec, (unsigned long long)vbd->ts.tv_usec,
 	    vbd->errors, vbd->retries,
 	    vbd->received, vbd->returned, vbd->kicked);
+#ifdef MEMSHR
+	DBG(TLOG_WARN, "%s: memshr shared: 0x%08"PRIx64", "
+	    "hints: 0x%08"PRIx64"\n",
+	    vbd->name, vbd->memshr_shared, vbd->memshr_hints);
+#endif
 
 	tapdisk_vbd_for_each_image(vbd, image, tmp)
 		td_debug(image);
@@ -1177,26 +1151,57 @@ tapdisk_vbd_complete_vbd_request(td_vbd_t *vbd, td_vbd_request_t *vreq)
 	}
 }
 
-static uint64_t 
-tapdisk_vbd_breq_get_sector(blkif_request_t *breq, td_request_t treq)
+#ifdef MEMSHR
+/*
+ * Whole-page reads from a read-only image are candidates for sharing.  If
+ * another guest already read the same block its page is shared with ours
+ * and the read is skipped; otherwise our page is nominated, and recorded
+ * as the source for the next reader once the read completes.  A request
+ * crossing several read-only images is only nominated at the first one.
+ */
+static int
+tapdisk_vbd_memshr_read(td_vbd_t *vbd, td_vbd_request_t *vreq,
+			td_image_t *image, td_request_t *treq)
 {
-    int seg, nsects; 
-    uint64_t sector_nr = breq->sector_number; 
-    
-    for(seg=0; seg < treq.sidx; seg++) {
-        nsects = breq->seg[seg].last_sect - breq->seg[seg].first_sect + 1;
-        sector_nr += nsects;
-    }
+	int err;
+	blkif_request_t *breq = &vreq->req;
+
+	if (treq->memshr_hnd.handle ||
+	    !td_flag_test(image->flags, TD_OPEN_RDONLY))
+		return -EINVAL;
+
+	/*
+	 * a driver may have redirected the read to a buffer of its own
+	 * (e.g. the block cache); only the granted page can be shared
+	 */
+	if (treq->buf != (char *)MMAP_VADDR(vbd->ring.vstart,
+					    (unsigned long)breq->id,
+					    treq->sidx))
+		return -EINVAL;
 
-    return sector_nr;
+	err = memshr_vbd_issue_ro_request(treq->buf,
+					  breq->seg[treq->sidx].gref,
+					  image->memshr_id,
+					  treq->sec, treq->secs,
+					  &treq->memshr_hnd);
+	if (!err) {
+		/* the page is shared: nothing left to read or record */
+		treq->memshr_hnd.handle = 0;
+		vbd->memshr_shared++;
+		td_complete_request(*treq, 0);
+		return 0;
+	}
+
+	treq->memshr_id = image->memshr_id;
+	return err;
 }
+#endif
 
 static void
 __tapdisk_vbd_complete_td_request(td_vbd_t *vbd, td_vbd_request_t *vreq,
 				  td_request_t treq, int res)
 {
 	int err;
-    td_image_t *image = treq.image;
 
 	err = (res <= 0 ? res : -res);
 	vbd->secs_pending  -= treq.secs;
@@ -1216,18 +1221,12 @@ __tapdisk_vbd_complete_td_request(td_vbd_t *vbd, td_vbd_request_t *vreq,
 		}
 	} else {
 #ifdef MEMSHR
-		if (treq.op == TD_OP_READ
-		   && td_flag_test(image->flags, TD_OPEN_RDONLY)) {
-			share_tuple_t hnd = treq.memshr_hnd;
-			uint16_t uid  = image->memshr_id;
-			blkif_request_t *breq = &vreq->req;
-			uint64_t sec  = tapdisk_vbd_breq_get_sector(breq, treq);
-			int secs = breq->seg[treq.sidx].last_sect -
-			    breq->seg[treq.sidx].first_sect + 1;
-
-			if (hnd.handle != 0)
-				memshr_vbd_complete_ro_request(hnd, uid,
-								sec, secs);
+		if (treq.op == TD_OP_READ && treq.memshr_hnd.handle &&
+		    treq.secs == 8) {
+			memshr_vbd_complete_ro_request(treq.memshr_hnd,
+						       treq.memshr_id,
+						       treq.sec, treq.secs);
+			vbd->memshr_hints++;
 		}
 #endif
 	}
@@ -1283,27 +1282,10 @@ __tapdisk_vbd_reissue_td_request(td_vbd_t *vbd,
 
 	case TD_OP_READ:
 #ifdef MEMSHR
-		if(td_flag_test(parent->flags, TD_OPEN_RDONLY)) {
-			int ret, seg = treq.sidx;
-			blkif_request_t *breq = &vreq->req;
-        
-			ret = memshr_vbd_issue_ro_request(treq.buf,
-			      breq->seg[seg].gref,
-			      parent->memshr_id,
-			      treq.sec,
-			      treq.secs,
-			      &treq.memshr_hnd);
-			if(ret == 0) {
-				/* Reset memshr handle. This'll prevent
-				 * memshr_vbd_complete_ro_request being called
-				 */
-				treq.memshr_hnd.handle = 0;
-				td_complete_request(treq, 0);
-			} else
-				td_queue_read(parent, treq);
-		} else
+		if (!tapdisk_vbd_memshr_read(vbd, vreq, parent, &treq))
+			break;
 #endif
-			td_queue_read(parent, treq);
+		td_queue_read(parent, treq);
 		break;
 	}
 
@@ -1400,6 +1382,9 @@ tapdisk_vbd_issue_request(td_vbd_t *vbd, td_vbd_request_t *vreq)
 		treq.cb             = tapdisk_vbd_complete_td_request;
 		treq.cb_data        = NULL;
 		treq.private        = vreq;
+#ifdef MEMSHR
+		treq.memshr_hnd.handle = 0;
+#endif
 
 		DBG(TLOG_DBG, "%s: req %d seg %d sec 0x%08"PRIx64" secs 0x%04x "
 		    "buf %p op %d\n", image->name, id, i, treq.sec, treq.secs,
@@ -1416,6 +1401,10 @@ tapdisk_vbd_issue_request(td_vbd_t *vbd, td_vbd_request_t *vreq)
 
 		case BLKIF_OP_READ:
 			treq.op = TD_OP_READ;
+#ifdef MEMSHR
+			if (!tapdisk_vbd_memshr_read(vbd, vreq, image, &treq))
+				break;
+#endif
 			td_queue_read(image, treq);
 			break;
 		}
@@ -125,6 +125,10 @@ struct td_vbd_handle {
 	uint64_t                    secs_pending;
 	uint64_t                    retries;
 	uint64_t                    errors;
+#ifdef MEMSHR
+	uint64_t                    memshr_shared;
+	uint64_t                    memshr_hints;
+#endif
 };
 
 #define tapdisk_vbd_for_each_request(vreq, tmp, list)	                \
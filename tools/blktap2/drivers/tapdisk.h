@@ -141,6 +141,7 @@ struct td_request {
     
 #ifdef MEMSHR
 	share_tuple_t                memshr_hnd;
+	uint16_t                     memshr_id;
 #endif
 };
 
@@ -164,6 +165,7 @@ struct tap_disk {
 	void (*td_queue_read)        (td_driver_t *, td_request_t);
 	void (*td_queue_write)       (td_driver_t *, td_request_t);
 	void (*td_debug)             (td_driver_t *);
+	int (*td_stats)              (td_driver_t *, char *, size_t);
 };
 
 #endif
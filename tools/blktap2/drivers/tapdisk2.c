@@ -42,24 +42,34 @@
 static void
 usage(const char *app, int err)
 {
-	fprintf(stderr, "usage: %s [-D] <-u uuid> <-c control socket>\n", app);
+	fprintf(stderr, "usage: %s [-D] [-q lanes] [-e engine] <-u uuid> <-c control socket>\n", app);
 	exit(err);
 }
 
 int
 main(int argc, char *argv[])
 {
-	char *control;
-	int c, err, nodaemon;
+	char *control, *engine;
+	int c, err, nodaemon, lanes;
 
 	control  = NULL;
 	nodaemon = 0;
+	lanes    = 0;
+	engine   = NULL;
 
-	while ((c = getopt(argc, argv, "s:Dh")) != -1) {
+	while ((c = getopt(argc, argv, "s:q:e:Dh")) != -1) {
 		switch (c) {
 		case 'D':
 			nodaemon = 1;
 			break;
+		case 'q':
+			lanes = atoi(optarg);
+			if (lanes < 1)
+				usage(argv[0], EINVAL);
+			break;
+		case 'e':
+			engine = optarg;
+			break;
 		case 'h':
 			usage(argv[0], 0);
 			break;
@@ -93,6 +103,16 @@ main(int argc, char *argv[])
 		goto out;
 	}
 
+	/* the server takes its defaults from the environment */
+	if (lanes)
+		tapdisk_server_set_aio_lanes(lanes);
+
+	if (engine && tapdisk_server_set_aio_engine(engine)) {
+		fprintf(stderr, "unknown aio engine %s\n", engine);
+		err = EINVAL;
+		goto out;
+	}
+
 	if (!nodaemon) {
 		err = daemon(0, 1);
 		if (err) {
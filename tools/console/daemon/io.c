@@ -49,6 +49,10 @@
 #include <sys/ioctl.h>
 #include <libutil.h>
 #endif
+#ifdef __linux__
+#define USE_EPOLL
+#include <sys/epoll.h>
+#endif
 
 #define MAX(a, b) (((a) > (b)) ? (a) : (b))
 #define MIN(a, b) (((a) < (b)) ? (a) : (b))
@@ -61,6 +65,13 @@
 /* Duration of each time period in ms */
 #define RATE_LIMIT_PERIOD 200
 
+/* Most bytes taken from a ring per event, so the others get their turn */
+#define RING_DRAIN_BATCH (64 * 1024)
+/* Guest logs are written once per wakeup, or whenever they reach this */
+#define LOG_FLUSH_SIZE (64 * 1024)
+/* Most ready fds handled per wakeup */
+#define IO_BATCH 256
+
 extern int log_reload;
 extern int log_guest;
 extern int log_hv;
@@ -68,6 +79,7 @@ extern int log_time_hv;
 extern int log_time_guest;
 extern char *log_dir;
 extern int discard_overflowed_data;
+extern unsigned long ring_rate_limit;
 
 static int log_time_hv_needts = 1;
 static int log_time_guest_needts = 1;
@@ -75,10 +87,6 @@ static int log_hv_fd = -1;
 
 static xengnttab_handle *xgt_handle = NULL;
 
-static struct pollfd  *fds;
-static unsigned int current_array_size;
-static unsigned int nr_fds;
-
 #define ROUNDUP(_x,_w) (((unsigned long)(_x)+(1UL<<(_w))-1) & ~((1UL<<(_w))-1))
 
 struct buffer {
@@ -89,12 +97,43 @@ struct buffer {
 	size_t max_capacity;
 };
 
+/*
+ * Each fd the daemon waits on is an io_source, which stays registered
+ * until what it waits for changes, so that a wakeup costs in proportion
+ * to the fds which are ready rather than to the number of domains.
+ */
+enum io_kind {
+	IO_XS,
+	IO_HV_LOG,
+	IO_RING,
+	IO_TTY,
+};
+
+struct io_source {
+	enum io_kind kind;
+	struct domain *dom;
+	int fd;
+	short events;
+#ifndef USE_EPOLL
+	unsigned int idx;
+#endif
+};
+
+struct io_ready {
+	struct io_source *src;
+	int fd;
+	short revents;
+};
+
 struct domain {
 	int domid;
 	int master_fd;
-	int master_pollfd_idx;
+	struct io_source tty_src;
 	int slave_fd;
 	int log_fd;
+	struct buffer log_buffer;
+	bool log_dirty;
+	struct domain *log_next;
 	bool is_dead;
 	unsigned last_seen;
 	struct buffer buffer;
@@ -104,13 +143,212 @@ struct domain {
 	xenevtchn_port_or_error_t local_port;
 	xenevtchn_port_or_error_t remote_port;
 	xenevtchn_handle *xce_handle;
-	int xce_pollfd_idx;
+	struct io_source ring_src;
 	struct xencons_interface *interface;
 	int event_count;
+	size_t period_bytes;
 	long long next_period;
+	bool throttled;
+	struct domain *throttled_next;
 };
 
 static struct domain *dom_head;
+/* domains with guest output waiting to be written to their log */
+static struct domain *log_dirty_head;
+/* rate limited domains, with their port masked until next_period */
+static struct domain *throttled_head;
+/* set when some domains may be gone or dead */
+static bool reap_pending;
+
+static void domain_update_events(struct domain *dom);
+
+#ifdef USE_EPOLL
+static int epoll_fd = -1;
+
+static int io_init(void)
+{
+	epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+	return epoll_fd == -1 ? -1 : 0;
+}
+
+static void io_fini(void)
+{
+	if (epoll_fd != -1) {
+		close(epoll_fd);
+		epoll_fd = -1;
+	}
+}
+
+/* Wait for events on fd (-1 or no events: none at all). */
+static void io_set(struct io_source *src, int fd, short events)
+{
+	struct epoll_event ev;
+	int op;
+
+	if (src->fd != -1 && (fd != src->fd || !events)) {
+		epoll_ctl(epoll_fd, EPOLL_CTL_DEL, src->fd, NULL);
+		src->fd = -1;
+		src->events = 0;
+	}
+
+	if (fd == -1 || !events || events == src->events)
+		return;
+
+	/* the poll and epoll event bits are the same */
+	memset(&ev, 0, sizeof(ev));
+	ev.events = events;
+	ev.data.ptr = src;
+
+	op = src->fd == -1 ? EPOLL_CTL_ADD : EPOLL_CTL_MOD;
+	if (epoll_ctl(epoll_fd, op, fd, &ev) == -1 &&
+	    (op == EPOLL_CTL_ADD || errno != ENOENT ||
+	     epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &ev) == -1)) {
+		dolog(LOG_ERR, "epoll_ctl failed, ignoring fd %d: %d (%s)",
+		      fd, errno, strerror(errno));
+		src->fd = -1;
+		src->events = 0;
+		return;
+	}
+
+	src->fd = fd;
+	src->events = events;
+}
+
+static int io_wait(struct io_ready *ready, int max, int timeout)
+{
+	struct epoll_event evs[IO_BATCH];
+	int i, n;
+
+	n = epoll_wait(epoll_fd, evs, MIN(max, IO_BATCH), timeout);
+
+	for (i = 0; i < n; i++) {
+		ready[i].src = evs[i].data.ptr;
+		ready[i].fd = ready[i].src->fd;
+		ready[i].revents = evs[i].events;
+	}
+
+	return n;
+}
+#else
+static struct pollfd  *fds;
+static struct io_source **fd_srcs;
+static unsigned int current_array_size;
+static unsigned int nr_fds;
+
+static int io_init(void)
+{
+	return 0;
+}
+
+static void io_fini(void)
+{
+	free(fds);
+	free(fd_srcs);
+	fds = NULL;
+	fd_srcs = NULL;
+	current_array_size = nr_fds = 0;
+}
+
+static void io_set(struct io_source *src, int fd, short events)
+{
+	if (src->fd != -1 && (fd != src->fd || !events)) {
+		/* Fill the hole with the last entry. */
+		nr_fds--;
+		fds[src->idx] = fds[nr_fds];
+		fd_srcs[src->idx] = fd_srcs[nr_fds];
+		fd_srcs[src->idx]->idx = src->idx;
+		src->fd = -1;
+		src->events = 0;
+	}
+
+	if (fd == -1 || !events)
+		return;
+
+	if (src->fd == -1) {
+		if (current_array_size < nr_fds + 1) {
+			struct pollfd *new_fds;
+			struct io_source **new_srcs;
+			unsigned long newsize;
+
+			/* Round up to 2^8 boundary, in practice this just
+			 * make newsize larger than current_array_size.
+			 */
+			newsize = ROUNDUP(nr_fds + 1, 8);
+
+			new_fds = realloc(fds, sizeof(struct pollfd)*newsize);
+			if (!new_fds)
+				goto fail;
+			fds = new_fds;
+
+			new_srcs = realloc(fd_srcs, sizeof(*fd_srcs)*newsize);
+			if (!new_srcs)
+				goto fail;
+			fd_srcs = new_srcs;
+
+			current_array_size = newsize;
+		}
+
+		src->idx = nr_fds++;
+		fd_srcs[src->idx] = src;
+	}
+
+	fds[src->idx].fd = fd;
+	fds[src->idx].events = events;
+	fds[src->idx].revents = 0;
+	src->fd = fd;
+	src->events = events;
+	return;
+
+fail:
+	dolog(LOG_ERR, "realloc failed, ignoring fd %d\n", fd);
+}
+
+static int io_wait(struct io_ready *ready, int max, int timeout)
+{
+	unsigned int i;
+	int n;
+
+	n = poll(fds, nr_fds, timeout);
+	if (n <= 0)
+		return n;
+
+	for (i = 0, n = 0; i < nr_fds && n < max; i++) {
+		if (!fds[i].revents)
+			continue;
+		ready[n].src = fd_srcs[i];
+		ready[n].fd = fds[i].fd;
+		ready[n].revents = fds[i].revents;
+		n++;
+	}
+
+	return n;
+}
+#endif
+
+static void io_source_init(struct io_source *src, enum io_kind kind,
+			   struct domain *dom)
+{
+	src->kind = kind;
+	src->dom = dom;
+	src->fd = -1;
+	src->events = 0;
+}
+
+static void io_clear(struct io_source *src)
+{
+	io_set(src, -1, 0);
+}
+
+static bool monotonic_ms(long long *now)
+{
+	struct timespec ts;
+
+	if (clock_gettime(CLOCK_MONOTONIC, &ts) < 0)
+		return false;
+
+	*now = ((long long)ts.tv_sec * 1000) + (ts.tv_nsec / 1000000);
+	return true;
+}
 
 static int write_all(int fd, const char* buf, size_t len)
 {
@@ -127,8 +365,28 @@ static int write_all(int fd, const char* buf, size_t len)
 	return 0;
 }
 
-static int write_with_timestamp(int fd, const char *data, size_t sz,
-				int *needts)
+static void buffer_reserve(struct buffer *buffer, size_t len)
+{
+	if ((buffer->capacity - buffer->size) < len) {
+		buffer->capacity += (len + 1024);
+		buffer->data = realloc(buffer->data, buffer->capacity);
+		if (buffer->data == NULL) {
+			dolog(LOG_ERR, "Memory allocation failed");
+			exit(ENOMEM);
+		}
+	}
+}
+
+static void buffer_put(struct buffer *buffer, const char *data, size_t len)
+{
+	buffer_reserve(buffer, len);
+	memcpy(buffer->data + buffer->size, data, len);
+	buffer->size += len;
+}
+
+static void buffer_put_with_timestamp(struct buffer *buffer,
+				      const char *data, size_t sz,
+				      int *needts)
 {
 	char ts[32];
 	time_t now = time(NULL);
@@ -142,9 +400,9 @@ static int write_with_timestamp(int fd, const char *data, size_t sz,
 		if (!found_nl)
 			nl = last_byte;
 
-		if ((*needts && write_all(fd, ts, tslen))
-		    || write_all(fd, data, nl + 1 - data))
-			return -1;
+		if (*needts)
+			buffer_put(buffer, ts, tslen);
+		buffer_put(buffer, data, nl + 1 - data);
 
 		*needts = found_nl;
 		data = nl + 1;
@@ -154,11 +412,81 @@ static int write_with_timestamp(int fd, const char *data, size_t sz,
 				data++;
 		}
 	}
+}
 
-	return 0;
+/* Write out and empty the buffer: one write for any number of lines. */
+static int buffer_flush(struct buffer *buffer, int fd)
+{
+	int ret;
+
+	ret = write_all(fd, buffer->data, buffer->size);
+	buffer->size = 0;
+
+	return ret;
+}
+
+static int write_with_timestamp(int fd, const char *data, size_t sz,
+				int *needts)
+{
+	struct buffer buffer = { 0 };
+	int ret;
+
+	buffer_put_with_timestamp(&buffer, data, sz, needts);
+	ret = buffer_flush(&buffer, fd);
+	free(buffer.data);
+
+	return ret;
+}
+
+static void domain_flush_log(struct domain *dom)
+{
+	if (dom->log_buffer.size == 0)
+		return;
+
+	if (dom->log_fd == -1) {
+		dom->log_buffer.size = 0;
+		return;
+	}
+
+	if (buffer_flush(&dom->log_buffer, dom->log_fd) < 0)
+		dolog(LOG_ERR, "Write to log failed "
+		      "on domain %d: %d (%s)\n",
+		      dom->domid, errno, strerror(errno));
+}
+
+static void domain_log(struct domain *dom, const char *data, size_t size)
+{
+	if (dom->log_fd == -1)
+		return;
+
+	if (log_time_guest)
+		buffer_put_with_timestamp(&dom->log_buffer, data, size,
+					  &log_time_guest_needts);
+	else
+		buffer_put(&dom->log_buffer, data, size);
+
+	if (dom->log_buffer.size >= LOG_FLUSH_SIZE) {
+		domain_flush_log(dom);
+	} else if (!dom->log_dirty) {
+		dom->log_dirty = true;
+		dom->log_next = log_dirty_head;
+		log_dirty_head = dom;
+	}
+}
+
+static void flush_logs(void)
+{
+	struct domain *d;
+
+	for (d = log_dirty_head; d; d = d->log_next) {
+		domain_flush_log(d);
+		d->log_dirty = false;
+	}
+	log_dirty_head = NULL;
 }
 
-static void buffer_append(struct domain *dom)
+/* Takes at most max bytes off the ring, returns how many it took. */
+static size_t buffer_append(struct domain *dom, size_t max)
 {
 	struct buffer *buffer = &dom->buffer;
 	XENCONS_RING_IDX cons, prod, size;
@@ -170,47 +498,28 @@ static void buffer_append(struct domain *dom)
 
 	size = prod - cons;
 	if ((size == 0) || (size > sizeof(intf->out)))
-		return;
+		return 0;
 
-	if ((buffer->capacity - buffer->size) < size) {
-		buffer->capacity += (size + 1024);
-		buffer->data = realloc(buffer->data, buffer->capacity);
-		if (buffer->data == NULL) {
-			dolog(LOG_ERR, "Memory allocation failed");
-			exit(ENOMEM);
-		}
+	if (size > max) {
+		size = max;
+		prod = cons + size;
 	}
 
+	buffer_reserve(buffer, size);
+
 	while (cons != prod)
 		buffer->data[buffer->size++] = intf->out[
 			MASK_XENCONS_IDX(cons++, intf->out)];
 
 	xen_mb();
 	intf->out_cons = cons;
-	xenevtchn_notify(dom->xce_handle, dom->local_port);
 
 	/* Get the data to the logfile as early as possible because if
 	 * no one is listening on the console pty then it will fill up
-	 * and handle_tty_write will stop being called.
+	 * and handle_tty_write will stop being called.  It is written
+	 * by flush_logs, once per wakeup.
 	 */
-	if (dom->log_fd != -1) {
-		int logret;
-		if (log_time_guest) {
-			logret = write_with_timestamp(
-				dom->log_fd,
-				buffer->data + buffer->size - size,
-				size, &log_time_guest_needts);
-		} else {
-			logret = write_all(
-				dom->log_fd,
-				buffer->data + buffer->size - size,
-				size);
-		}
-		if (logret < 0)
-			dolog(LOG_ERR, "Write to log failed "
-			      "on domain %d: %d (%s)\n",
-			      dom->domid, errno, strerror(errno));
-	}
+	domain_log(dom, buffer->data + buffer->size - size, size);
 
 	if (discard_overflowed_data && buffer->max_capacity &&
 	    buffer->size > 5 * buffer->max_capacity / 4) {
@@ -233,6 +542,8 @@ static void buffer_append(struct domain *dom)
 			buffer->size = buffer->max_capacity / 2 + over;
 		}
 	}
+
+	return size;
 }
 
 static bool buffer_empty(struct buffer *buffer)
@@ -338,6 +649,8 @@ static int create_domain_log(struct domain *dom)
 
 static void domain_close_tty(struct domain *dom)
 {
+	io_clear(&dom->tty_src);
+
 	if (dom->master_fd != -1) {
 		close(dom->master_fd);
 		dom->master_fd = -1;
@@ -585,6 +898,7 @@ static int domain_create_ring(struct domain *dom)
 
 	dom->local_port = -1;
 	dom->remote_port = -1;
+	io_clear(&dom->ring_src);
 	if (dom->xce_handle != NULL)
 		xenevtchn_close(dom->xce_handle);
 
@@ -623,6 +937,7 @@ static int domain_create_ring(struct domain *dom)
 		dom->log_fd = create_domain_log(dom);
 
  out:
+	domain_update_events(dom);
 	return err;
 }
 
@@ -676,10 +991,10 @@ static struct domain *create_domain(int domid)
 	strcat(dom->conspath, "/console");
 
 	dom->master_fd = -1;
-	dom->master_pollfd_idx = -1;
+	io_source_init(&dom->tty_src, IO_TTY, dom);
 	dom->slave_fd = -1;
 	dom->log_fd = -1;
-	dom->xce_pollfd_idx = -1;
+	io_source_init(&dom->ring_src, IO_RING, dom);
 
 	dom->next_period = ((long long)ts.tv_sec * 1000) + (ts.tv_nsec / 1000000) + RATE_LIMIT_PERIOD;
 
@@ -729,16 +1044,32 @@ static void remove_domain(struct domain *dom)
 
 static void cleanup_domain(struct domain *d)
 {
+	struct domain **pp;
+
 	domain_close_tty(d);
 
+	/* flush_logs has run: it is not on log_dirty_head */
+	domain_flush_log(d);
 	if (d->log_fd != -1) {
 		close(d->log_fd);
 		d->log_fd = -1;
 	}
 
+	if (d->throttled) {
+		for (pp = &throttled_head; *pp; pp = &(*pp)->throttled_next)
+			if (*pp == d) {
+				*pp = d->throttled_next;
+				break;
+			}
+		d->throttled = false;
+	}
+
 	free(d->buffer.data);
 	d->buffer.data = NULL;
 
+	free(d->log_buffer.data);
+	d->log_buffer.data = NULL;
+
 	free(d->conspath);
 	d->conspath = NULL;
 
@@ -748,8 +1079,10 @@ static void cleanup_domain(struct domain *d)
 static void shutdown_domain(struct domain *d)
 {
 	d->is_dead = true;
+	reap_pending = true;
 	watch_domain(d, false);
 	domain_unmap_interface(d);
+	io_clear(&d->ring_src);
 	if (d->xce_handle != NULL)
 		xenevtchn_close(d->xce_handle);
 	d->xce_handle = NULL;
@@ -764,6 +1097,7 @@ static void enum_domains(void)
 	struct domain *dom;
 
 	enum_pass++;
+	reap_pending = true;
 
 	while (xc_domain_getinfo(xc, domid, 1, &dominfo) == 1) {
 		dom = lookup_domain(dominfo.domid);
@@ -866,7 +1200,148 @@ static void handle_tty_write(struct domain *dom)
 	}
 }
 
-static void handle_ring_read(struct domain *dom)
+/* Wait for the events dom can handle now, and for no others. */
+static void domain_update_events(struct domain *dom)
+{
+	short events = 0;
+
+	if (dom->xce_handle != NULL && !dom->throttled &&
+	    (discard_overflowed_data ||
+	     !dom->buffer.max_capacity ||
+	     dom->buffer.size < dom->buffer.max_capacity))
+		io_set(&dom->ring_src, xenevtchn_fd(dom->xce_handle),
+		       POLLIN|POLLPRI);
+	else
+		io_clear(&dom->ring_src);
+
+	if (dom->master_fd != -1) {
+		if (!dom->is_dead && dom->interface && ring_free_bytes(dom))
+			events |= POLLIN;
+
+		if (!buffer_empty(&dom->buffer))
+			events |= POLLOUT;
+	}
+
+	if (events)
+		io_set(&dom->tty_src, dom->master_fd, events|POLLPRI);
+	else
+		io_clear(&dom->tty_src);
+}
+
+static size_t rate_limit_budget(void)
+{
+	unsigned long long budget;
+
+	budget = (unsigned long long)ring_rate_limit * RATE_LIMIT_PERIOD / 1000;
+
+	return budget ? budget : 1;
+}
+
+static void domain_refresh_period(struct domain *dom, long long now)
+{
+	/* CS 16257:955ee4fa1345 introduces a 5ms fuzz
+	 * for select(), it is not clear poll() has
+	 * similar behavior (returning a couple of ms
+	 * sooner than requested) as well. Just leave
+	 * the fuzz here. Remove it with a separate
+	 * patch if necessary */
+	if ((now+5) > dom->next_period) {
+		dom->next_period = now + RATE_LIMIT_PERIOD;
+		dom->event_count = 0;
+		dom->period_bytes = 0;
+	}
+}
+
+static bool domain_over_limit(struct domain *dom)
+{
+	return (dom->event_count >= RATE_LIMIT_ALLOWANCE ||
+		(ring_rate_limit &&
+		 dom->period_bytes >= rate_limit_budget()));
+}
+
+/*
+ * Take all the guest has written, and keep taking while it writes more,
+ * notifying it only once.  Past --rate-limit, what is left stays in the
+ * ring, and the guest stalls on it, until the next period.
+ */
+static void domain_drain_ring(struct domain *dom)
+{
+	size_t budget = RING_DRAIN_BATCH, len, total = 0;
+
+	if (dom->is_dead || dom->interface == NULL || dom->xce_handle == NULL)
+		return;
+
+	if (ring_rate_limit)
+		budget = MIN(budget,
+			     rate_limit_budget() - MIN(dom->period_bytes,
+						       rate_limit_budget()));
+
+	while (budget) {
+		len = buffer_append(dom, budget);
+		if (!len)
+			break;
+		budget -= len;
+		total += len;
+
+		if (!discard_overflowed_data && dom->buffer.max_capacity &&
+		    dom->buffer.size >= dom->buffer.max_capacity)
+			break;
+	}
+
+	dom->period_bytes += total;
+
+	if (total)
+		xenevtchn_notify(dom->xce_handle, dom->local_port);
+}
+
+static void domain_throttle(struct domain *dom)
+{
+	dom->throttled = true;
+	dom->throttled_next = throttled_head;
+	throttled_head = dom;
+}
+
+/*
+ * Give the throttled domains whose period is over a new allowance, and
+ * drain what they wrote meanwhile: their event was taken when they were
+ * throttled, and will not come again for it.  Returns when the next
+ * period ends, or 0 if none is throttled.
+ */
+static long long unthrottle_domains(long long now)
+{
+	struct domain *d, **pp = &throttled_head;
+	long long next_timeout = 0;
+
+	while ((d = *pp) != NULL) {
+		if (!d->is_dead && (now+5) <= d->next_period) {
+			/* Determine if we're going to be the next time slice to expire */
+			if (!next_timeout || d->next_period < next_timeout)
+				next_timeout = d->next_period;
+			pp = &d->throttled_next;
+			continue;
+		}
+
+		*pp = d->throttled_next;
+		d->throttled = false;
+		if (d->is_dead)
+			continue;
+
+		domain_refresh_period(d, now);
+		domain_drain_ring(d);
+
+		/* Throttled again: back at the head, found in the next pass */
+		if (domain_over_limit(d))
+			domain_throttle(d);
+		else
+			(void)xenevtchn_unmask(d->xce_handle, d->local_port);
+
+		domain_update_events(d);
+	}
+
+	return next_timeout;
+}
+
+static void handle_ring_read(struct domain *dom, long long now)
 {
 	xenevtchn_port_or_error_t port;
 
@@ -876,14 +1351,40 @@ static void handle_ring_read(struct domain *dom)
 	if ((port = xenevtchn_pending(dom->xce_handle)) == -1)
 		return;
 
+	domain_refresh_period(dom, now);
 	dom->event_count++;
 
-	buffer_append(dom);
+	domain_drain_ring(dom);
 
-	if (dom->event_count < RATE_LIMIT_ALLOWANCE)
+	if (domain_over_limit(dom))
+		domain_throttle(dom);
+	else
 		(void)xenevtchn_unmask(dom->xce_handle, port);
 }
 
+/* Shut down the domains which have gone away, and free the dead ones. */
+static void reap_domains(void)
+{
+	struct domain *d, *n;
+
+	if (!reap_pending)
+		return;
+
+	flush_logs();
+
+	for (d = dom_head; d; d = n) {
+		n = d->next;
+
+		if (d->last_seen != enum_pass)
+			shutdown_domain(d);
+
+		if (d->is_dead)
+			cleanup_domain(d);
+	}
+
+	reap_pending = false;
+}
+
 static void handle_xs(void)
 {
 	char **vec;
@@ -911,6 +1412,7 @@ static void handle_xs(void)
 static void handle_hv_logs(xenevtchn_handle *xce_handle, bool force)
 {
 	static char buffer[1024*16];
+	static struct buffer log_buffer;
 	char *bufptr = buffer;
 	unsigned int size;
 	static uint32_t index = 0;
@@ -921,24 +1423,27 @@ static void handle_hv_logs(xenevtchn_handle *xce_handle, bool force)
 
 	do
 	{
-		int logret;
-
 		size = sizeof(buffer);
 		if (xc_readconsolering(xc, bufptr, &size, 0, 1, &index) != 0 ||
 		    size == 0)
 			break;
 
 		if (log_time_hv)
-			logret = write_with_timestamp(log_hv_fd, buffer, size,
-						      &log_time_hv_needts);
+			buffer_put_with_timestamp(&log_buffer, buffer, size,
+						  &log_time_hv_needts);
 		else
-			logret = write_all(log_hv_fd, buffer, size);
+			buffer_put(&log_buffer, buffer, size);
 
-		if (logret < 0)
+		if (log_buffer.size >= LOG_FLUSH_SIZE &&
+		    buffer_flush(&log_buffer, log_hv_fd) < 0)
 			dolog(LOG_ERR, "Failed to write hypervisor log: "
 				       "%d (%s)", errno, strerror(errno));
 	} while (size == sizeof(buffer));
 
+	if (log_buffer.size && buffer_flush(&log_buffer, log_hv_fd) < 0)
+		dolog(LOG_ERR, "Failed to write hypervisor log: "
+			       "%d (%s)", errno, strerror(errno));
+
 	if (port != -1)
 		(void)xenevtchn_unmask(xce_handle, port);
 }
@@ -947,6 +1452,8 @@ static void handle_log_reload(void)
 {
 	if (log_guest) {
 		struct domain *d;
+
+		flush_logs();
 		for (d = dom_head; d; d = d->next) {
 			if (d->log_fd != -1)
 				close(d->log_fd);
@@ -961,53 +1468,11 @@ static void handle_log_reload(void)
 	}
 }
 
-/* Returns index inside fds array if succees, -1 if fail */
-static int set_fds(int fd, short events)
-{
-	int ret;
-	if (current_array_size < nr_fds + 1) {
-		struct pollfd  *new_fds = NULL;
-		unsigned long newsize;
-
-		/* Round up to 2^8 boundary, in practice this just
-		 * make newsize larger than current_array_size.
-		 */
-		newsize = ROUNDUP(nr_fds + 1, 8);
-
-		new_fds = realloc(fds, sizeof(struct pollfd)*newsize);
-		if (!new_fds)
-			goto fail;
-		fds = new_fds;
-
-		memset(&fds[0] + current_array_size, 0,
-		       sizeof(struct pollfd) * (newsize-current_array_size));
-		current_array_size = newsize;
-	}
-
-	fds[nr_fds].fd = fd;
-	fds[nr_fds].events = events;
-	ret = nr_fds;
-	nr_fds++;
-
-	return ret;
-fail:
-	dolog(LOG_ERR, "realloc failed, ignoring fd %d\n", fd);
-	return -1;
-}
-
-static void reset_fds(void)
-{
-	nr_fds = 0;
-	if (fds)
-		memset(fds, 0, sizeof(struct pollfd) * current_array_size);
-}
-
 void handle_io(void)
 {
 	int ret;
 	xenevtchn_port_or_error_t log_hv_evtchn = -1;
-	int xce_pollfd_idx = -1;
-	int xs_pollfd_idx = -1;
+	struct io_source xs_src, hv_src;
 	xenevtchn_handle *xce_handle = NULL;
 
 	if (log_hv) {
@@ -1036,77 +1501,37 @@ void handle_io(void)
 		      errno, strerror(errno));
 	}
 
-	enum_domains();
-
-	for (;;) {
-		struct domain *d, *n;
-		int poll_timeout; /* timeout in milliseconds */
-		struct timespec ts;
-		long long now, next_timeout = 0;
-
-		reset_fds();
-
-		xs_pollfd_idx = set_fds(xs_fileno(xs), POLLIN|POLLPRI);
+	if (io_init() < 0) {
+		dolog(LOG_ERR, "Failed to set up event polling: %d (%s)",
+		      errno, strerror(errno));
+		goto out;
+	}
 
-		if (log_hv)
-			xce_pollfd_idx = set_fds(xenevtchn_fd(xce_handle),
-						 POLLIN|POLLPRI);
+	io_source_init(&xs_src, IO_XS, NULL);
+	io_set(&xs_src, xs_fileno(xs), POLLIN|POLLPRI);
 
-		if (clock_gettime(CLOCK_MONOTONIC, &ts) < 0)
-			break;
-		now = ((long long)ts.tv_sec * 1000) + (ts.tv_nsec / 1000000);
-
-		/* Re-calculate any event counter allowances & unblock
-		   domains with new allowance */
-		for (d = dom_head; d; d = d->next) {
-			/* CS 16257:955ee4fa1345 introduces a 5ms fuzz
-			 * for select(), it is not clear poll() has
-			 * similar behavior (returning a couple of ms
-			 * sooner than requested) as well. Just leave
-			 * the fuzz here. Remove it with a separate
-			 * patch if necessary */
-			if ((now+5) > d->next_period) {
-				d->next_period = now + RATE_LIMIT_PERIOD;
-				if (d->event_count >= RATE_LIMIT_ALLOWANCE) {
-					(void)xenevtchn_unmask(d->xce_handle, d->local_port);
-				}
-				d->event_count = 0;
-			}
-		}
+	io_source_init(&hv_src, IO_HV_LOG, NULL);
+	if (log_hv)
+		io_set(&hv_src, xenevtchn_fd(xce_handle), POLLIN|POLLPRI);
 
-		for (d = dom_head; d; d = d->next) {
-			if (d->event_count >= RATE_LIMIT_ALLOWANCE) {
-				/* Determine if we're going to be the next time slice to expire */
-				if (!next_timeout ||
-				    d->next_period < next_timeout)
-					next_timeout = d->next_period;
-			} else if (d->xce_handle != NULL) {
-				if (discard_overflowed_data ||
-				    !d->buffer.max_capacity ||
-				    d->buffer.size < d->buffer.max_capacity) {
-					int evtchn_fd = xenevtchn_fd(d->xce_handle);
-					d->xce_pollfd_idx = set_fds(evtchn_fd,
-								    POLLIN|POLLPRI);
-				}
-			}
+	enum_domains();
 
-			if (d->master_fd != -1) {
-				short events = 0;
-				if (!d->is_dead && ring_free_bytes(d))
-					events |= POLLIN;
+	for (;;) {
+		struct io_ready ready[IO_BATCH];
+		struct io_source *src;
+		struct domain *d;
+		int i, poll_timeout = -1; /* timeout in milliseconds */
+		long long now, next_timeout;
+		short revents;
 
-				if (!buffer_empty(&d->buffer))
-					events |= POLLOUT;
+		reap_domains();
 
-				if (events)
-					d->master_pollfd_idx =
-						set_fds(d->master_fd,
-							events|POLLPRI);
-			}
-		}
+		if (!monotonic_ms(&now))
+			break;
 
-		/* If any domain has been rate limited, we need to work
-		   out what timeout to supply to poll */
+		/* Give rate limited domains a new allowance, and work out
+		   what timeout to supply to poll for the others */
+		next_timeout = unthrottle_domains(now);
 		if (next_timeout) {
 			long long duration = (next_timeout - now);
 			if (duration <= 0) /* sanity check */
@@ -1114,7 +1539,9 @@ void handle_io(void)
 			poll_timeout = (int)duration;
 		}
 
-		ret = poll(fds, nr_fds, next_timeout ? poll_timeout : -1);
+		flush_logs();
+
+		ret = io_wait(ready, IO_BATCH, poll_timeout);
 
 		if (log_reload) {
 			handle_log_reload();
@@ -1131,72 +1558,70 @@ void handle_io(void)
 			break;
 		}
 
-		if (log_hv && xce_pollfd_idx != -1) {
-			if (fds[xce_pollfd_idx].revents & ~(POLLIN|POLLOUT|POLLPRI)) {
-				dolog(LOG_ERR,
-				      "Failure in poll xce_handle: %d (%s)",
-				      errno, strerror(errno));
-				break;
-			} else if (fds[xce_pollfd_idx].revents & POLLIN)
-				handle_hv_logs(xce_handle, false);
+		if (!monotonic_ms(&now))
+			break;
 
-			xce_pollfd_idx = -1;
-		}
+		for (i = 0; i < ret; i++) {
+			src = ready[i].src;
+			revents = ready[i].revents;
 
-		if (ret <= 0)
-			continue;
+			/* Changed by an earlier event of this wakeup. */
+			if (src->fd != ready[i].fd)
+				continue;
 
-		if (xs_pollfd_idx != -1) {
-			if (fds[xs_pollfd_idx].revents & ~(POLLIN|POLLOUT|POLLPRI)) {
-				dolog(LOG_ERR,
-				      "Failure in poll xs_handle: %d (%s)",
-				      errno, strerror(errno));
+			d = src->dom;
+
+			switch (src->kind) {
+			case IO_HV_LOG:
+				if (revents & ~(POLLIN|POLLOUT|POLLPRI)) {
+					dolog(LOG_ERR,
+					      "Failure in poll xce_handle: %d (%s)",
+					      errno, strerror(errno));
+					goto out_loop;
+				} else if (revents & POLLIN)
+					handle_hv_logs(xce_handle, false);
 				break;
-			} else if (fds[xs_pollfd_idx].revents & POLLIN)
-				handle_xs();
 
-			xs_pollfd_idx = -1;
-		}
+			case IO_XS:
+				if (revents & ~(POLLIN|POLLOUT|POLLPRI)) {
+					dolog(LOG_ERR,
+					      "Failure in poll xs_handle: %d (%s)",
+					      errno, strerror(errno));
+					goto out_loop;
+				} else if (revents & POLLIN)
+					handle_xs();
+				break;
 
-		for (d = dom_head; d; d = n) {
-			n = d->next;
-			if (d->event_count < RATE_LIMIT_ALLOWANCE) {
-				if (d->xce_handle != NULL &&
-				    d->xce_pollfd_idx != -1 &&
-				    !(fds[d->xce_pollfd_idx].revents &
-				      ~(POLLIN|POLLOUT|POLLPRI)) &&
-				      (fds[d->xce_pollfd_idx].revents &
-				       POLLIN))
-				    handle_ring_read(d);
-			}
+			case IO_RING:
+				if (!(revents & ~(POLLIN|POLLOUT|POLLPRI)) &&
+				    (revents & POLLIN))
+					handle_ring_read(d, now);
+				domain_update_events(d);
+				break;
 
-			if (d->master_fd != -1 && d->master_pollfd_idx != -1) {
-				if (fds[d->master_pollfd_idx].revents &
-				    ~(POLLIN|POLLOUT|POLLPRI))
+			case IO_TTY:
+				if (revents & ~(POLLIN|POLLOUT|POLLPRI))
 					domain_handle_broken_tty(d,
 						   domain_is_valid(d->domid));
 				else {
-					if (fds[d->master_pollfd_idx].revents &
-					    POLLIN)
+					if (revents & POLLIN)
 						handle_tty_read(d);
-					if (fds[d->master_pollfd_idx].revents &
-					    POLLOUT)
+					if (revents & POLLOUT)
 						handle_tty_write(d);
 				}
+				domain_update_events(d);
+				break;
 			}
-
-			d->xce_pollfd_idx = d->master_pollfd_idx = -1;
-
-			if (d->last_seen != enum_pass)
-				shutdown_domain(d);
-
-			if (d->is_dead)
-				cleanup_domain(d);
 		}
+
+		flush_logs();
 	}
 
-	free(fds);
-	current_array_size = 0;
+ out_loop:
+	flush_logs();
+	io_clear(&xs_src);
+	io_clear(&hv_src);
+	io_fini();
 
  out:
 	if (log_hv_fd != -1) {
@@ -890,6 +890,25 @@ long long xc_domain_get_cpu_usage(xc_interface *xch,
                                   domid_t domid,
                                   int vcpu);
 
+/**
+ * This function returns the run delay and slice length histograms of a
+ * vcpu, or of a whole domain (see XEN_DOMCTL_get_sched_hist).
+ *
+ * @parm xch a handle to an open hypervisor interface
+ * @parm domid the domain to get information from
+ * @parm vcpu the vcpu number, or XEN_DOMCTL_SCHED_HIST_ALL for the sum of
+ *            all the vcpus of the domain
+ * @parm run_delay where to store the run delay histogram
+ * @parm slice where to store the slice length histogram
+ * @return 0 on success, -1 on failure
+ */
+typedef xen_sched_hist_t xc_sched_hist_t;
+int xc_domain_get_sched_hist(xc_interface *xch,
+                             uint32_t domid,
+                             uint32_t vcpu,
+                             xc_sched_hist_t *run_delay,
+                             xc_sched_hist_t *slice);
+
 int xc_domain_sethandle(xc_interface *xch, uint32_t domid,
                         xen_domain_handle_t handle);
 
@@ -29,6 +29,9 @@
 #define XCFLAGS_HVM       (1 << 2)
 #define XCFLAGS_STDVGA    (1 << 3)
 #define XCFLAGS_CHECKPOINT_COMPRESS    (1 << 4)
+#define XCFLAGS_PAGE_COMPRESS          (1 << 5)
+#define XCFLAGS_AUTO_THROTTLE          (1 << 6)
+#define XCFLAGS_POSTCOPY               (1 << 7)
 
 #define X86_64_B_SIZE   64 
 #define X86_32_B_SIZE   32
@@ -98,12 +101,27 @@ typedef enum {
  * @parm dom the id of the domain
  * @param stream_type XC_MIG_STREAM_NONE if the far end of the stream
  *        doesn't use checkpointing
+ * @parm page_fds additional file descriptors to send guest memory over in
+ *       parallel, one thread each (only for XC_MIG_STREAM_NONE)
+ * @parm nr_page_fds number of entries in page_fds, 0 for none
+ * @parm max_downtime_ms for live migration, the downtime in milliseconds to
+ *       aim for by iterating until the remaining dirty memory can be sent
+ *       in that time, or until further iterations stop making progress.
+ *       With XCFLAGS_AUTO_THROTTLE, the guest's vcpus are capped (credit
+ *       scheduler only) rather than giving up.  0 for the default heuristic.
+ *
+ * With XCFLAGS_POSTCOPY (live HVM guests only), a single pass over memory
+ * is sent before the guest is suspended.  The pages dirtied meanwhile are
+ * only listed, and sent after the vcpu state, first those requested by the
+ * restorer over recv_fd, then the rest in the background.
  * @return 0 on success, -1 on failure
  */
 int xc_domain_save(xc_interface *xch, int io_fd, uint32_t dom, uint32_t max_iters,
                    uint32_t max_factor, uint32_t flags /* XCFLAGS_xxx */,
                    struct save_callbacks* callbacks, int hvm,
-                   xc_migration_stream_t stream_type, int recv_fd);
+                   xc_migration_stream_t stream_type, int recv_fd,
+                   const int *page_fds, unsigned int nr_page_fds,
+                   uint32_t max_downtime_ms);
 
 /* callbacks provided by xc_domain_restore */
 struct restore_callbacks {
@@ -114,6 +132,9 @@ struct restore_callbacks {
     /* Called after the secondary vm is ready to resume.
      * Callback function resumes the guest & the device model,
      * returns to xc_domain_restore.
+     * Also called for a post-copy migration stream, once the vcpu state
+     * has been restored.  The guest's memory is then paged in on demand
+     * until the stream ends.
      */
     int (*postcopy)(void* data);
 
@@ -161,6 +182,13 @@ struct restore_callbacks {
  * @parm stream_type non-zero if the far end of the stream is using checkpointing
  * @parm callbacks non-NULL to receive a callback to restore toolstack
  *       specific data
+ * @parm page_fds the file descriptors matching the page_fds passed to
+ *       xc_domain_save(), in the same order
+ * @parm nr_page_fds number of entries in page_fds, 0 for none
+ *
+ * Post-copy streams need callbacks->postcopy, which is called to resume the
+ * guest while its outstanding memory is still paged out, and a send_back_fd
+ * to request pages from the sender.
  * @return 0 on success, -1 on failure
  */
 int xc_domain_restore(xc_interface *xch, int io_fd, uint32_t dom,
@@ -169,7 +197,8 @@ int xc_domain_restore(xc_interface *xch, int io_fd, uint32_t dom,
                       unsigned long *console_mfn, domid_t console_domid,
                       unsigned int hvm, unsigned int pae, int superpages,
                       xc_migration_stream_t stream_type,
-                      struct restore_callbacks *callbacks, int send_back_fd);
+                      struct restore_callbacks *callbacks, int send_back_fd,
+                      const int *page_fds, unsigned int nr_page_fds);
 
 /**
  * This function will create a domain for a paravirtualized Linux
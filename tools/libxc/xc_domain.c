@@ -1224,6 +1224,36 @@ int xc_vcpu_getinfo(xc_interface *xch,
     return rc;
 }
 
+int xc_domain_get_sched_hist(xc_interface *xch,
+                             uint32_t domid,
+                             uint32_t vcpu,
+                             xc_sched_hist_t *run_delay,
+                             xc_sched_hist_t *slice)
+{
+    int rc = -1;
+    DECLARE_DOMCTL;
+    DECLARE_HYPERCALL_BOUNCE(run_delay, sizeof(*run_delay), XC_HYPERCALL_BUFFER_BOUNCE_OUT);
+    DECLARE_HYPERCALL_BOUNCE(slice, sizeof(*slice), XC_HYPERCALL_BUFFER_BOUNCE_OUT);
+
+    if ( xc_hypercall_bounce_pre(xch, run_delay) ||
+         xc_hypercall_bounce_pre(xch, slice) )
+        goto out;
+
+    domctl.cmd = XEN_DOMCTL_get_sched_hist;
+    domctl.domain = (domid_t)domid;
+    domctl.u.sched_hist.vcpu = vcpu;
+    set_xen_guest_handle(domctl.u.sched_hist.run_delay, run_delay);
+    set_xen_guest_handle(domctl.u.sched_hist.slice, slice);
+
+    rc = do_domctl(xch, &domctl);
+
+ out:
+    xc_hypercall_bounce_post(xch, run_delay);
+    xc_hypercall_bounce_post(xch, slice);
+
+    return rc;
+}
+
 int xc_domain_ioport_permission(xc_interface *xch,
                                 uint32_t domid,
                                 uint32_t first_port,
@@ -38,6 +38,11 @@ static const char *mandatory_rec_types[] =
     [REC_TYPE_VERIFY]                       = "Verify",
     [REC_TYPE_CHECKPOINT]                   = "Checkpoint",
     [REC_TYPE_CHECKPOINT_DIRTY_PFN_LIST]    = "Checkpoint dirty pfn list",
+    [REC_TYPE_STREAM_SYNC]                  = "Stream sync",
+    [REC_TYPE_COMPRESSED_PAGE_DATA]         = "Compressed page data",
+    [REC_TYPE_POSTCOPY_PFNS]                = "Post-copy pfns",
+    [REC_TYPE_POSTCOPY_TRANSITION]          = "Post-copy transition",
+    [REC_TYPE_POSTCOPY_PAGE_REQUEST]        = "Post-copy page request",
 };
 
 const char *rec_type_to_str(uint32_t type)
@@ -52,8 +57,8 @@ const char *rec_type_to_str(uint32_t type)
     return "Reserved";
 }
 
-int write_split_record(struct xc_sr_context *ctx, struct xc_sr_record *rec,
-                       void *buf, size_t sz)
+int write_split_record_fd(struct xc_sr_context *ctx, int fd,
+                          struct xc_sr_record *rec, void *buf, size_t sz)
 {
     static const char zeroes[(1u << REC_ALIGN_ORDER) - 1] = { 0 };
 
@@ -81,7 +86,7 @@ int write_split_record(struct xc_sr_context *ctx, struct xc_sr_record *rec,
     if ( sz )
         assert(buf);
 
-    if ( writev_exact(ctx->fd, parts, ARRAY_SIZE(parts)) )
+    if ( writev_exact(fd, parts, ARRAY_SIZE(parts)) )
         goto err;
 
     return 0;
@@ -153,6 +158,8 @@ static void __attribute__((unused)) build_assertions(void)
     BUILD_BUG_ON(sizeof(struct xc_sr_rec_tsc_info)          != 24);
     BUILD_BUG_ON(sizeof(struct xc_sr_rec_hvm_params_entry)  != 16);
     BUILD_BUG_ON(sizeof(struct xc_sr_rec_hvm_params)        != 8);
+    BUILD_BUG_ON(sizeof(struct xc_sr_rec_stream_sync)       != 8);
+    BUILD_BUG_ON(sizeof(struct xc_sr_rec_compressed_page_data_header) != 8);
 }
 
 /*
@@ -2,6 +2,10 @@
 #define __COMMON__H
 
 #include <stdbool.h>
+#include <pthread.h>
+
+#include <xenevtchn.h>
+#include <xen/vm_event.h>
 
 #include "xg_private.h"
 #include "xg_save_restore.h"
@@ -165,6 +169,47 @@ struct xc_sr_restore_ops
     int (*cleanup)(struct xc_sr_context *ctx);
 };
 
+/*
+ * Parallel page data streams.  With these, PAGE_DATA records are sent over
+ * additional streams, each served by a thread of its own, while all other
+ * records go to the main stream.  A pfn is always sent on the same stream,
+ * so the records for it are seen in order.  STREAM_SYNC records are sent
+ * on all streams to order the page data against the main stream.
+ */
+struct xc_sr_save_stream
+{
+    struct xc_sr_context *ctx;
+    int fd;
+    pthread_t thread;
+    bool thread_started;
+
+    /* Batch being filled by the main thread. */
+    xen_pfn_t *batch_pfns;
+    unsigned nr_batch_pfns;
+
+    /* Batch being written by the stream thread, none if 0 pfns. */
+    xen_pfn_t *work_pfns;
+    unsigned nr_work_pfns;
+
+    /* Both protected by save.streams_lock. */
+    bool failed;
+    bool stop;
+    pthread_cond_t cond;
+};
+
+struct xc_sr_restore_stream
+{
+    struct xc_sr_context *ctx;
+    int fd;
+    pthread_t thread;
+    bool thread_started;
+
+    /* All protected by restore.streams_lock. */
+    uint32_t seq; /* Of the last STREAM_SYNC record reached. */
+    bool done;
+    bool failed;
+};
+
 /* x86 PV per-vcpu storage structure for blobs heading Xen-wards. */
 struct xc_sr_x86_pv_restore_vcpu
 {
@@ -202,6 +247,15 @@ struct xc_sr_context
             unsigned max_iterations;
             unsigned dirty_threshold;
 
+            /* Downtime to converge to, in ms.  0 for the fixed heuristic. */
+            unsigned max_downtime_ms;
+            /* Cap the guest's vcpus if memory isn't converging. */
+            bool auto_throttle;
+            /* Original credit scheduler parameters, if throttled. */
+            bool throttled;
+            struct xen_domctl_sched_credit sched_credit;
+            unsigned throttle_cap;
+
             unsigned long p2m_size;
 
             xen_pfn_t *batch_pfns;
@@ -209,6 +263,30 @@ struct xc_sr_context
             unsigned long *deferred_pages;
             unsigned long nr_deferred_pages;
             xc_hypercall_buffer_t dirty_bitmap_hbuf;
+
+            /* Parallel page data streams, if any. */
+            const int *stream_fds;
+            struct xc_sr_save_stream *streams;
+            unsigned nr_streams;
+            uint32_t stream_seq;
+            /* Protects the stream state, deferred pages and compress_stats. */
+            pthread_mutex_t streams_lock;
+
+            /* Send COMPRESSED_PAGE_DATA rather than PAGE_DATA records. */
+            bool compress;
+            struct
+            {
+                uint64_t pages, zero_pages;
+                uint64_t in_bytes, out_bytes;
+                uint64_t ns;
+            } compress_stats;
+
+            /* Post-copy: pages listed in POSTCOPY_PFNS but not sent yet. */
+            bool postcopy;
+            /* Serving post-copy pages: nothing may be deferred any more. */
+            bool postcopy_active;
+            unsigned long *postcopy_pfns;
+            unsigned long nr_postcopy_pfns;
         } save;
 
         struct /* Restore data. */
@@ -260,6 +338,48 @@ struct xc_sr_context
 
             /* Sender has invoked verify mode on the stream. */
             bool verify;
+
+            /* Parallel page data streams, if any. */
+            const int *stream_fds;
+            struct xc_sr_restore_stream *streams;
+            unsigned nr_streams;
+            /* Last STREAM_SYNC processed on the main stream. */
+            uint32_t streams_released;
+            bool streams_abort;
+            pthread_mutex_t streams_lock;
+            pthread_cond_t streams_cond;
+            /* Serialises populating the physmap and page type tracking. */
+            pthread_mutex_t populate_lock;
+
+            /* Post-copy migration, from the first POSTCOPY_PFNS record on. */
+            struct
+            {
+                /* Set at POSTCOPY_TRANSITION, the pager is running. */
+                bool active;
+                /* The guest has been resumed. */
+                bool resumed;
+
+                /* Pages yet to arrive, and the subset of them paged out. */
+                unsigned long *outstanding;
+                unsigned long *evicted;
+                unsigned long *requested;
+                unsigned long nr_outstanding;
+                unsigned long nr_unevicted;
+
+                /* Paging ring, as set up by xenpaging. */
+                void *ring_page;
+                vm_event_back_ring_t back_ring;
+                xenevtchn_handle *xce;
+                int port;
+                bool paging_enabled;
+
+                /* Requests waiting for their page to arrive. */
+                vm_event_request_t *waiting;
+                unsigned nr_waiting, max_waiting;
+
+                /* Page aligned buffer for xc_mem_paging_load(). */
+                void *buffer;
+            } postcopy;
         } restore;
     };
 
@@ -351,7 +471,7 @@ struct xc_sr_record
 };
 
 /*
- * Writes a split record to the stream, applying correct padding where
+ * Writes a split record to a stream, applying correct padding where
  * appropriate.  It is common when sending records containing blobs from Xen
  * that the header and blob data are separate.  This function accepts a second
  * buffer and length, and will merge it with the main record when sending.
@@ -361,8 +481,18 @@ struct xc_sr_record
  *
  * Returns 0 on success and non0 on failure.
  */
-int write_split_record(struct xc_sr_context *ctx, struct xc_sr_record *rec,
-                       void *buf, size_t sz);
+int write_split_record_fd(struct xc_sr_context *ctx, int fd,
+                          struct xc_sr_record *rec, void *buf, size_t sz);
+
+/*
+ * Writes a split record to the main stream, see write_split_record_fd().
+ */
+static inline int write_split_record(struct xc_sr_context *ctx,
+                                     struct xc_sr_record *rec,
+                                     void *buf, size_t sz)
+{
+    return write_split_record_fd(ctx, ctx->fd, rec, buf, sz);
+}
 
 /*
  * Writes a record to the stream, applying correct padding where appropriate.
@@ -399,6 +529,25 @@ int read_record(struct xc_sr_context *ctx, int fd, struct xc_sr_record *rec);
 int populate_pfns(struct xc_sr_context *ctx, unsigned count,
                   const xen_pfn_t *original_pfns, const uint32_t *types);
 
+/*
+ * Page compression for COMPRESSED_PAGE_DATA records, see xc_sr_compress.c.
+ */
+bool page_is_zero(const void *page);
+
+/*
+ * Compress len bytes (less than 64k) from src as an LZ4 block into dst.
+ * Returns the compressed size, or 0 if it would not fit in dst_len bytes.
+ */
+size_t lz4_compress_block(const void *src, size_t len,
+                          void *dst, size_t dst_len);
+
+/*
+ * Decompress an LZ4 block of len bytes from src into dst.  Returns the
+ * decompressed size, or -1 if the block is malformed or exceeds dst_len.
+ */
+int lz4_decompress_block(const void *src, size_t len,
+                         void *dst, size_t dst_len);
+
 #endif
 /*
  * Local variables:
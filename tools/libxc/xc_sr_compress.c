@@ -0,0 +1,239 @@
+/******************************************************************************
+ * xc_sr_compress.c
+ *
+ * Compression of page data records in the migration stream.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation;
+ * version 2.1 of the License.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <assert.h>
+
+#include "xc_sr_common.h"
+
+/*
+ * A minimal LZ4 block format encoder and decoder, for compressing single
+ * pages in the migration stream.  The copy of LZ4 under xen/common/lz4 only
+ * has a decompressor, tailored to kernel images and not built for all
+ * configurations of libxenguest.
+ *
+ * The encoder is the simple greedy single-hash variant.  It is tuned for
+ * speed rather than ratio, as it sits in the critical path of migration.
+ */
+
+#define LZ4_HASH_LOG      12
+#define LZ4_MIN_MATCH     4
+/* The last match must start at least 12 bytes before the end of input, */
+#define LZ4_MF_LIMIT      12
+/* and the last 5 bytes are always literals. */
+#define LZ4_LAST_LITERALS 5
+#define LZ4_MAX_OFFSET    65535
+
+static inline uint32_t read32(const uint8_t *p)
+{
+    uint32_t v;
+
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static inline unsigned int lz4_hash(uint32_t v)
+{
+    return (v * 2654435761U) >> (32 - LZ4_HASH_LOG);
+}
+
+/* Bytes needed to encode a length of len with a 4 bit token field. */
+static inline size_t lz4_len_bytes(size_t len)
+{
+    return len < 15 ? 0 : (len - 15) / 255 + 1;
+}
+
+static uint8_t *lz4_put_len(uint8_t *op, size_t len)
+{
+    for ( len -= 15; len >= 255; len -= 255 )
+        *op++ = 255;
+    *op++ = len;
+
+    return op;
+}
+
+bool page_is_zero(const void *page)
+{
+    const uint64_t *p = page;
+    unsigned int i;
+
+    for ( i = 0; i < PAGE_SIZE / sizeof(*p); ++i )
+        if ( p[i] )
+            return false;
+
+    return true;
+}
+
+size_t lz4_compress_block(const void *src, size_t len,
+                          void *dst, size_t dst_len)
+{
+    uint16_t table[1U << LZ4_HASH_LOG];
+    const uint8_t *const in = src, *const end = in + len;
+    const uint8_t *const mf_limit = end - LZ4_MF_LIMIT;
+    const uint8_t *const match_limit = end - LZ4_LAST_LITERALS;
+    const uint8_t *ip = in, *anchor = in, *ref;
+    uint8_t *op = dst, *const oend = op + dst_len, *token;
+    size_t lit, ml;
+    unsigned int h;
+
+    assert(len <= LZ4_MAX_OFFSET);
+
+    if ( len > LZ4_MF_LIMIT )
+    {
+        memset(table, 0, sizeof(table));
+        table[lz4_hash(read32(ip))] = 0;
+        ++ip;
+
+        while ( ip < mf_limit )
+        {
+            h = lz4_hash(read32(ip));
+            ref = in + table[h];
+            table[h] = ip - in;
+
+            if ( read32(ref) != read32(ip) )
+            {
+                ++ip;
+                continue;
+            }
+
+            /* Extend the match backwards into the pending literals... */
+            while ( ip > anchor && ref > in && ip[-1] == ref[-1] )
+            {
+                --ip;
+                --ref;
+            }
+
+            /* ... and forwards, stopping short of the final literals. */
+            for ( ml = LZ4_MIN_MATCH;
+                  ip + ml < match_limit && ref[ml] == ip[ml]; ++ml )
+                ;
+
+            lit = ip - anchor;
+            if ( 1 + lz4_len_bytes(lit) + lit + 2 +
+                 lz4_len_bytes(ml - LZ4_MIN_MATCH) > (size_t)(oend - op) )
+                return 0;
+
+            token = op++;
+            *token = (lit < 15 ? lit : 15) << 4;
+            if ( lit >= 15 )
+                op = lz4_put_len(op, lit);
+            memcpy(op, anchor, lit);
+            op += lit;
+
+            *op++ = (ip - ref) & 0xff;
+            *op++ = (ip - ref) >> 8;
+
+            *token |= ml - LZ4_MIN_MATCH < 15 ? ml - LZ4_MIN_MATCH : 15;
+            if ( ml - LZ4_MIN_MATCH >= 15 )
+                op = lz4_put_len(op, ml - LZ4_MIN_MATCH);
+
+            anchor = ip += ml;
+            if ( ip < mf_limit )
+                table[lz4_hash(read32(ip - 2))] = ip - 2 - in;
+        }
+    }
+
+    /* Final sequence: literals only. */
+    lit = end - anchor;
+    if ( 1 + lz4_len_bytes(lit) + lit > (size_t)(oend - op) )
+        return 0;
+
+    token = op++;
+    *token = (lit < 15 ? lit : 15) << 4;
+    if ( lit >= 15 )
+        op = lz4_put_len(op, lit);
+    memcpy(op, anchor, lit);
+    op += lit;
+
+    return op - (uint8_t *)dst;
+}
+
+int lz4_decompress_block(const void *src, size_t len,
+                         void *dst, size_t dst_len)
+{
+    const uint8_t *ip = src, *const iend = ip + len, *match;
+    uint8_t *op = dst, *const oend = op + dst_len;
+    size_t lit, ml, off;
+    uint8_t token, b;
+
+    for ( ;; )
+    {
+        if ( ip >= iend )
+            return -1;
+        token = *ip++;
+
+        lit = token >> 4;
+        if ( lit == 15 )
+        {
+            do {
+                if ( ip >= iend )
+                    return -1;
+                b = *ip++;
+                lit += b;
+            } while ( b == 255 );
+        }
+
+        if ( lit > (size_t)(iend - ip) || lit > (size_t)(oend - op) )
+            return -1;
+        memcpy(op, ip, lit);
+        op += lit;
+        ip += lit;
+
+        /* The final sequence has no match part. */
+        if ( ip == iend )
+            break;
+
+        if ( iend - ip < 2 )
+            return -1;
+        off = ip[0] | (ip[1] << 8);
+        ip += 2;
+        if ( off == 0 || off > (size_t)(op - (uint8_t *)dst) )
+            return -1;
+
+        ml = token & 15;
+        if ( ml == 15 )
+        {
+            do {
+                if ( ip >= iend )
+                    return -1;
+                b = *ip++;
+                ml += b;
+            } while ( b == 255 );
+        }
+        ml += LZ4_MIN_MATCH;
+
+        if ( ml > (size_t)(oend - op) )
+            return -1;
+
+        /* Matches may overlap their own output, so copy bytewise. */
+        for ( match = op - off; ml; --ml )
+            *op++ = *match++;
+    }
+
+    return op - (uint8_t *)dst;
+}
+
+/*
+ * Local variables:
+ * mode: C
+ * c-file-style: "BSD"
+ * c-basic-offset: 4
+ * tab-width: 4
+ * indent-tabs-mode: nil
+ * End:
+ */
@@ -1,6 +1,7 @@
 #include <arpa/inet.h>
 
 #include <assert.h>
+#include <poll.h>
 
 #include "xc_sr_common.h"
 
@@ -197,7 +198,8 @@ int populate_pfns(struct xc_sr_context *ctx, unsigned count,
 /*
  * Given a list of pfns, their types, and a block of page data from the
  * stream, populate and record their types, map the relevant subset and copy
- * the data into the guest.
+ * the data into the guest.  May be called from the page data stream threads,
+ * so all updates of the physmap tracking are done under populate_lock.
  */
 static int process_page_data(struct xc_sr_context *ctx, unsigned count,
                              xen_pfn_t *pfns, uint32_t *types, void *page_data)
@@ -219,9 +221,12 @@ static int process_page_data(struct xc_sr_context *ctx, unsigned count,
         goto err;
     }
 
+    pthread_mutex_lock(&ctx->restore.populate_lock);
+
     rc = populate_pfns(ctx, count, pfns, types);
     if ( rc )
     {
+        pthread_mutex_unlock(&ctx->restore.populate_lock);
         ERROR("Failed to populate pfns for batch of %u pages", count);
         goto err;
     }
@@ -251,6 +256,8 @@ static int process_page_data(struct xc_sr_context *ctx, unsigned count,
         }
     }
 
+    pthread_mutex_unlock(&ctx->restore.populate_lock);
+
     /* Nothing to do? */
     if ( nr_pages == 0 )
         goto done;
@@ -286,7 +293,9 @@ static int process_page_data(struct xc_sr_context *ctx, unsigned count,
         }
 
         /* Undo page normalisation done by the saver. */
+        pthread_mutex_lock(&ctx->restore.populate_lock);
         rc = ctx->restore.ops.localise_page(ctx, types[i], page_data);
+        pthread_mutex_unlock(&ctx->restore.populate_lock);
         if ( rc )
         {
             ERROR("Failed to localise pfn %#"PRIpfn" (type %#"PRIx32")",
@@ -319,184 +328,1218 @@ static int process_page_data(struct xc_sr_context *ctx, unsigned count,
     if ( mapping )
         xenforeignmemory_unmap(xch->fmem, mapping, nr_pages);
 
-    free(map_errs);
-    free(mfns);
+    free(map_errs);
+    free(mfns);
+
+    return rc;
+}
+
+/*
+ * Validate the pfn list of a (COMPRESSED_)PAGE_DATA record, splitting it into
+ * pfns and types, and counting the pages which should have data.
+ */
+static int decode_page_data_pfns(struct xc_sr_context *ctx, unsigned count,
+                                 const uint64_t *rec_pfns, xen_pfn_t *pfns,
+                                 uint32_t *types, unsigned *pages_of_data)
+{
+    xc_interface *xch = ctx->xch;
+    unsigned i;
+    xen_pfn_t pfn;
+    uint32_t type;
+
+    *pages_of_data = 0;
+
+    for ( i = 0; i < count; ++i )
+    {
+        pfn = rec_pfns[i] & PAGE_DATA_PFN_MASK;
+        if ( !ctx->restore.ops.pfn_is_valid(ctx, pfn) )
+        {
+            ERROR("pfn %#"PRIpfn" (index %u) outside domain maximum", pfn, i);
+            return -1;
+        }
+
+        type = (rec_pfns[i] & PAGE_DATA_TYPE_MASK) >> 32;
+        if ( ((type >> XEN_DOMCTL_PFINFO_LTAB_SHIFT) >= 5) &&
+             ((type >> XEN_DOMCTL_PFINFO_LTAB_SHIFT) <= 8) )
+        {
+            ERROR("Invalid type %#"PRIx32" for pfn %#"PRIpfn" (index %u)",
+                  type, pfn, i);
+            return -1;
+        }
+        else if ( type < XEN_DOMCTL_PFINFO_BROKEN )
+            /* NOTAB and all L1 through L4 tables (including pinned) should
+             * have a page worth of data in the record. */
+            (*pages_of_data)++;
+
+        pfns[i] = pfn;
+        types[i] = type;
+    }
+
+    return 0;
+}
+
+/*
+ * Post-copy migration.  The pages listed in POSTCOPY_PFNS records are paged
+ * out with mem_paging at POSTCOPY_TRANSITION, and the guest is resumed.
+ * Guest accesses to them arrive as requests on the paging ring, and are
+ * passed on to the sender over the back channel, while the sender streams
+ * all other outstanding pages in the background.  The pages are paged back
+ * in as their data arrives.
+ */
+
+/*
+ * Answer a paging request, letting the vcpu (if any) run again.
+ */
+static void postcopy_put_response(struct xc_sr_context *ctx,
+                                  const vm_event_request_t *req)
+{
+    vm_event_back_ring_t *back_ring = &ctx->restore.postcopy.back_ring;
+    vm_event_response_t rsp =
+    {
+        .version = VM_EVENT_INTERFACE_VERSION,
+        .vcpu_id = req->vcpu_id,
+        .flags = req->flags,
+        .reason = req->reason,
+    };
+
+    rsp.u.mem_paging = req->u.mem_paging;
+
+    memcpy(RING_GET_RESPONSE(back_ring, back_ring->rsp_prod_pvt), &rsp,
+           sizeof(rsp));
+    back_ring->rsp_prod_pvt++;
+    RING_PUSH_RESPONSES(back_ring);
+}
+
+/*
+ * Answer the requests waiting for pages which have arrived since.
+ */
+static int postcopy_resume_waiting(struct xc_sr_context *ctx)
+{
+    xc_interface *xch = ctx->xch;
+    vm_event_request_t *req;
+    unsigned i, j;
+
+    for ( i = 0, j = 0; i < ctx->restore.postcopy.nr_waiting; ++i )
+    {
+        req = &ctx->restore.postcopy.waiting[i];
+
+        if ( test_bit(req->u.mem_paging.gfn,
+                      ctx->restore.postcopy.outstanding) )
+            ctx->restore.postcopy.waiting[j++] = *req;
+        else
+            postcopy_put_response(ctx, req);
+    }
+
+    if ( j == ctx->restore.postcopy.nr_waiting )
+        return 0;
+
+    ctx->restore.postcopy.nr_waiting = j;
+
+    if ( xenevtchn_notify(ctx->restore.postcopy.xce,
+                          ctx->restore.postcopy.port) < 0 )
+    {
+        PERROR("Failed to notify the paging event channel");
+        return -1;
+    }
+
+    return 0;
+}
+
+/*
+ * Post-copy counterpart of process_page_data().  Paged out pages are loaded
+ * with mem_paging, the few outstanding pages which couldn't be paged out are
+ * written as usual.  Pages not outstanding (any more) are stale and dropped.
+ */
+static int postcopy_page_data(struct xc_sr_context *ctx, unsigned count,
+                              xen_pfn_t *pfns, uint32_t *types,
+                              void *page_data)
+{
+    xc_interface *xch = ctx->xch;
+    xen_pfn_t *direct_pfns = NULL;
+    uint32_t *direct_types = NULL;
+    uint8_t *direct_data = NULL;
+    unsigned i, nr_direct = 0;
+    int rc = -1;
+
+    if ( ctx->restore.postcopy.nr_unevicted )
+    {
+        direct_pfns = malloc(count * sizeof(*direct_pfns));
+        direct_types = malloc(count * sizeof(*direct_types));
+        direct_data = malloc(count * PAGE_SIZE);
+        if ( !direct_pfns || !direct_types || !direct_data )
+        {
+            ERROR("Unable to allocate memory for %u post-copy pages", count);
+            goto err;
+        }
+    }
+
+    for ( i = 0; i < count; ++i )
+    {
+        if ( types[i] >= XEN_DOMCTL_PFINFO_BROKEN )
+            continue;
+
+        if ( pfns[i] < ctx->restore.p2m_size &&
+             test_bit(pfns[i], ctx->restore.postcopy.outstanding) )
+        {
+            if ( test_bit(pfns[i], ctx->restore.postcopy.evicted) )
+            {
+                memcpy(ctx->restore.postcopy.buffer, page_data, PAGE_SIZE);
+                if ( xc_mem_paging_load(xch, ctx->domid, pfns[i],
+                                        ctx->restore.postcopy.buffer) )
+                {
+                    PERROR("Failed to page in pfn %#"PRIpfn, pfns[i]);
+                    goto err;
+                }
+                clear_bit(pfns[i], ctx->restore.postcopy.evicted);
+            }
+            else
+            {
+                direct_pfns[nr_direct] = pfns[i];
+                direct_types[nr_direct] = types[i];
+                memcpy(direct_data + nr_direct * PAGE_SIZE, page_data,
+                       PAGE_SIZE);
+                ++nr_direct;
+                --ctx->restore.postcopy.nr_unevicted;
+            }
+
+            clear_bit(pfns[i], ctx->restore.postcopy.outstanding);
+            --ctx->restore.postcopy.nr_outstanding;
+        }
+
+        page_data += PAGE_SIZE;
+    }
+
+    if ( nr_direct )
+    {
+        rc = process_page_data(ctx, nr_direct, direct_pfns, direct_types,
+                               direct_data);
+        if ( rc )
+            goto err;
+    }
+
+    rc = postcopy_resume_waiting(ctx);
+
+ err:
+    free(direct_data);
+    free(direct_types);
+    free(direct_pfns);
+
+    return rc;
+}
+
+/*
+ * Validate a PAGE_DATA record from the stream, and pass the results to
+ * process_page_data() to actually perform the legwork.
+ */
+static int handle_page_data(struct xc_sr_context *ctx, struct xc_sr_record *rec)
+{
+    xc_interface *xch = ctx->xch;
+    struct xc_sr_rec_page_data_header *pages = rec->data;
+    unsigned pages_of_data;
+    int rc = -1;
+
+    xen_pfn_t *pfns = NULL;
+    uint32_t *types = NULL;
+
+    if ( rec->length < sizeof(*pages) )
+    {
+        ERROR("PAGE_DATA record truncated: length %u, min %zu",
+              rec->length, sizeof(*pages));
+        goto err;
+    }
+    else if ( pages->count < 1 )
+    {
+        ERROR("Expected at least 1 pfn in PAGE_DATA record");
+        goto err;
+    }
+    else if ( rec->length < sizeof(*pages) + (pages->count * sizeof(uint64_t)) )
+    {
+        ERROR("PAGE_DATA record (length %u) too short to contain %u"
+              " pfns worth of information", rec->length, pages->count);
+        goto err;
+    }
+
+    pfns = malloc(pages->count * sizeof(*pfns));
+    types = malloc(pages->count * sizeof(*types));
+    if ( !pfns || !types )
+    {
+        ERROR("Unable to allocate enough memory for %u pfns",
+              pages->count);
+        goto err;
+    }
+
+    if ( decode_page_data_pfns(ctx, pages->count, pages->pfn,
+                               pfns, types, &pages_of_data) )
+        goto err;
+
+    if ( rec->length != (sizeof(*pages) +
+                         (sizeof(uint64_t) * pages->count) +
+                         (PAGE_SIZE * pages_of_data)) )
+    {
+        ERROR("PAGE_DATA record wrong size: length %u, expected "
+              "%zu + %zu + %lu", rec->length, sizeof(*pages),
+              (sizeof(uint64_t) * pages->count), (PAGE_SIZE * pages_of_data));
+        goto err;
+    }
+
+    if ( ctx->restore.postcopy.active )
+        rc = postcopy_page_data(ctx, pages->count, pfns, types,
+                                &pages->pfn[pages->count]);
+    else
+        rc = process_page_data(ctx, pages->count, pfns, types,
+                               &pages->pfn[pages->count]);
+ err:
+    free(types);
+    free(pfns);
+
+    return rc;
+}
+
+/*
+ * Validate a COMPRESSED_PAGE_DATA record from the stream, expand its pages
+ * and pass them to process_page_data().
+ */
+static int handle_compressed_page_data(struct xc_sr_context *ctx,
+                                       struct xc_sr_record *rec)
+{
+    xc_interface *xch = ctx->xch;
+    struct xc_sr_rec_compressed_page_data_header *pages = rec->data;
+    const uint64_t *zero_bitmap;
+    const uint32_t *lengths;
+    const uint8_t *data, *end = rec->data + rec->length;
+    uint8_t *page_data = NULL, *page;
+    unsigned i, l, pages_of_data, nr_lengths = 0;
+    size_t bitmap_sz, hdr_sz;
+    bool zero;
+    int rc = -1;
+
+    xen_pfn_t *pfns = NULL;
+    uint32_t *types = NULL;
+
+    if ( rec->length < sizeof(*pages) )
+    {
+        ERROR("COMPRESSED_PAGE_DATA record truncated: length %u, min %zu",
+              rec->length, sizeof(*pages));
+        goto err;
+    }
+    else if ( pages->count < 1 )
+    {
+        ERROR("Expected at least 1 pfn in COMPRESSED_PAGE_DATA record");
+        goto err;
+    }
+
+    bitmap_sz = ((pages->count + 63) / 64) * sizeof(*zero_bitmap);
+    hdr_sz = sizeof(*pages) + pages->count * sizeof(uint64_t) + bitmap_sz;
+    if ( rec->length < hdr_sz )
+    {
+        ERROR("COMPRESSED_PAGE_DATA record (length %u) too short to contain"
+              " %u pfns worth of information", rec->length, pages->count);
+        goto err;
+    }
+
+    pfns = malloc(pages->count * sizeof(*pfns));
+    types = malloc(pages->count * sizeof(*types));
+    if ( !pfns || !types )
+    {
+        ERROR("Unable to allocate enough memory for %u pfns",
+              pages->count);
+        goto err;
+    }
+
+    if ( decode_page_data_pfns(ctx, pages->count, pages->pfn,
+                               pfns, types, &pages_of_data) )
+        goto err;
+
+    zero_bitmap = &pages->pfn[pages->count];
+    for ( i = 0; i < pages->count; ++i )
+    {
+        zero = zero_bitmap[i / 64] & (1ULL << (i % 64));
+
+        if ( types[i] >= XEN_DOMCTL_PFINFO_BROKEN )
+        {
+            if ( zero )
+            {
+                ERROR("pfn %#"PRIpfn" (index %u) type %#"PRIx32" has no data"
+                      " but is marked as zero", pfns[i], i, types[i]);
+                goto err;
+            }
+        }
+        else if ( !zero )
+            ++nr_lengths;
+    }
+
+    hdr_sz += ROUNDUP(nr_lengths * sizeof(*lengths), REC_ALIGN_ORDER);
+    if ( rec->length < hdr_sz )
+    {
+        ERROR("COMPRESSED_PAGE_DATA record (length %u) too short to contain"
+              " %u page lengths", rec->length, nr_lengths);
+        goto err;
+    }
+
+    page_data = malloc(pages_of_data * PAGE_SIZE);
+    if ( pages_of_data && !page_data )
+    {
+        ERROR("Unable to allocate %u pages to decompress into",
+              pages_of_data);
+        goto err;
+    }
+
+    lengths = (const uint32_t *)&zero_bitmap[bitmap_sz / sizeof(*zero_bitmap)];
+    data = rec->data + hdr_sz;
+    page = page_data;
+
+    for ( i = 0, l = 0; i < pages->count; ++i )
+    {
+        if ( types[i] >= XEN_DOMCTL_PFINFO_BROKEN )
+            continue;
+
+        if ( zero_bitmap[i / 64] & (1ULL << (i % 64)) )
+            memset(page, 0, PAGE_SIZE);
+        else
+        {
+            if ( lengths[l] == 0 || lengths[l] > PAGE_SIZE ||
+                 lengths[l] > end - data )
+            {
+                ERROR("Bad length %u for pfn %#"PRIpfn" (index %u)",
+                      lengths[l], pfns[i], i);
+                goto err;
+            }
+
+            if ( lengths[l] == PAGE_SIZE )
+                memcpy(page, data, PAGE_SIZE);
+            else if ( lz4_decompress_block(data, lengths[l],
+                                           page, PAGE_SIZE) != PAGE_SIZE )
+            {
+                ERROR("Failed to decompress pfn %#"PRIpfn" (index %u)",
+                      pfns[i], i);
+                goto err;
+            }
+
+            data += lengths[l++];
+        }
+
+        page += PAGE_SIZE;
+    }
+
+    if ( data != end )
+    {
+        ERROR("COMPRESSED_PAGE_DATA record wrong size: length %u, %zu octets"
+              " unused", rec->length, (size_t)(end - data));
+        goto err;
+    }
+
+    if ( ctx->restore.postcopy.active )
+        rc = postcopy_page_data(ctx, pages->count, pfns, types, page_data);
+    else
+        rc = process_page_data(ctx, pages->count, pfns, types, page_data);
+ err:
+    free(page_data);
+    free(types);
+    free(pfns);
+
+    return rc;
+}
+
+/*
+ * Wait for all page data streams to reach the STREAM_SYNC record seq.
+ * Returns 0 on success, -1 if a stream failed or ended early.
+ */
+static int wait_streams(struct xc_sr_context *ctx, uint32_t seq)
+{
+    xc_interface *xch = ctx->xch;
+    struct xc_sr_restore_stream *stream;
+    unsigned i;
+    int rc = 0;
+
+    pthread_mutex_lock(&ctx->restore.streams_lock);
+    for ( i = 0; i < ctx->restore.nr_streams; ++i )
+    {
+        stream = &ctx->restore.streams[i];
+        while ( stream->seq < seq && !stream->done && !stream->failed )
+            pthread_cond_wait(&ctx->restore.streams_cond,
+                              &ctx->restore.streams_lock);
+
+        if ( stream->failed )
+        {
+            ERROR("Page data stream %u failed", i);
+            rc = -1;
+        }
+        else if ( stream->seq < seq )
+        {
+            ERROR("Page data stream %u ended before sync %u", i, seq);
+            rc = -1;
+        }
+    }
+
+    if ( !rc )
+    {
+        ctx->restore.streams_released = seq;
+        pthread_cond_broadcast(&ctx->restore.streams_cond);
+    }
+    pthread_mutex_unlock(&ctx->restore.streams_lock);
+
+    return rc;
+}
+
+/*
+ * Validate a STREAM_SYNC record.
+ */
+static int check_stream_sync(struct xc_sr_context *ctx,
+                             struct xc_sr_record *rec, uint32_t last_seq)
+{
+    xc_interface *xch = ctx->xch;
+    struct xc_sr_rec_stream_sync *sync = rec->data;
+
+    if ( rec->length != sizeof(*sync) )
+    {
+        ERROR("STREAM_SYNC record wrong size: length %u, expected %zu",
+              rec->length, sizeof(*sync));
+        return -1;
+    }
+
+    if ( sync->nr_streams != ctx->restore.nr_streams )
+    {
+        ERROR("Stream uses %u page data streams, %u set up",
+              sync->nr_streams, ctx->restore.nr_streams);
+        return -1;
+    }
+
+    if ( sync->seq != last_seq + 1 )
+    {
+        ERROR("STREAM_SYNC record out of order: seq %u, expected %u",
+              sync->seq, last_seq + 1);
+        return -1;
+    }
+
+    return 0;
+}
+
+/*
+ * Wait for all page data streams to see their END record.
+ */
+static int wait_streams_end(struct xc_sr_context *ctx)
+{
+    xc_interface *xch = ctx->xch;
+    struct xc_sr_restore_stream *stream;
+    unsigned i;
+    int rc = 0;
+
+    if ( ctx->restore.nr_streams && !ctx->restore.streams_released )
+    {
+        ERROR("Stream ended without using the page data streams");
+        return -1;
+    }
+
+    pthread_mutex_lock(&ctx->restore.streams_lock);
+    for ( i = 0; i < ctx->restore.nr_streams; ++i )
+    {
+        stream = &ctx->restore.streams[i];
+        while ( !stream->done && !stream->failed )
+            pthread_cond_wait(&ctx->restore.streams_cond,
+                              &ctx->restore.streams_lock);
+
+        if ( stream->failed )
+        {
+            ERROR("Page data stream %u failed", i);
+            rc = -1;
+        }
+    }
+    pthread_mutex_unlock(&ctx->restore.streams_lock);
+
+    return rc;
+}
+
+/*
+ * STREAM_SYNC on the main stream: all page data sent before has to be
+ * processed, then the page data streams may continue.
+ */
+static int handle_stream_sync(struct xc_sr_context *ctx,
+                              struct xc_sr_record *rec)
+{
+    struct xc_sr_rec_stream_sync *sync = rec->data;
+
+    if ( check_stream_sync(ctx, rec, ctx->restore.streams_released) )
+        return -1;
+
+    return wait_streams(ctx, sync->seq);
+}
+
+/*
+ * Page data stream thread: processes PAGE_DATA records until the END record,
+ * stopping at each STREAM_SYNC record until the main stream has reached it.
+ */
+static void *restore_stream_thread(void *arg)
+{
+    struct xc_sr_restore_stream *stream = arg;
+    struct xc_sr_context *ctx = stream->ctx;
+    xc_interface *xch = ctx->xch;
+    struct xc_sr_rec_stream_sync *sync;
+    struct xc_sr_record rec;
+    int rc;
+
+    for ( ;; )
+    {
+        /* Only reading the stream may be cancelled, see cleanup_streams(). */
+        pthread_setcancelstate(PTHREAD_CANCEL_ENABLE, NULL);
+        rc = read_record(ctx, stream->fd, &rec);
+        pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
+        if ( rc )
+            break;
+
+        switch ( rec.type )
+        {
+        case REC_TYPE_END:
+            break;
+
+        case REC_TYPE_PAGE_DATA:
+            rc = handle_page_data(ctx, &rec);
+            break;
+
+        case REC_TYPE_COMPRESSED_PAGE_DATA:
+            rc = handle_compressed_page_data(ctx, &rec);
+            break;
+
+        case REC_TYPE_STREAM_SYNC:
+            rc = check_stream_sync(ctx, &rec, stream->seq);
+            if ( rc )
+                break;
+
+            sync = rec.data;
+            pthread_mutex_lock(&ctx->restore.streams_lock);
+            stream->seq = sync->seq;
+            pthread_cond_broadcast(&ctx->restore.streams_cond);
+            while ( ctx->restore.streams_released < stream->seq &&
+                    !ctx->restore.streams_abort )
+                pthread_cond_wait(&ctx->restore.streams_cond,
+                                  &ctx->restore.streams_lock);
+            if ( ctx->restore.streams_abort )
+                rc = -1;
+            pthread_mutex_unlock(&ctx->restore.streams_lock);
+            break;
+
+        default:
+            ERROR("Unexpected record %#x (%s) in page data stream",
+                  rec.type, rec_type_to_str(rec.type));
+            rc = -1;
+            break;
+        }
+
+        free(rec.data);
+        if ( rc || rec.type == REC_TYPE_END )
+            break;
+    }
+
+    pthread_mutex_lock(&ctx->restore.streams_lock);
+    if ( rc )
+        stream->failed = true;
+    else
+        stream->done = true;
+    pthread_cond_broadcast(&ctx->restore.streams_cond);
+    pthread_mutex_unlock(&ctx->restore.streams_lock);
+
+    return NULL;
+}
+
+static int setup_streams(struct xc_sr_context *ctx)
+{
+    xc_interface *xch = ctx->xch;
+    struct xc_sr_restore_stream *stream;
+    unsigned i;
+
+    ctx->restore.streams = calloc(ctx->restore.nr_streams,
+                                  sizeof(*ctx->restore.streams));
+    if ( !ctx->restore.streams )
+    {
+        ERROR("Unable to allocate memory for %u page data streams",
+              ctx->restore.nr_streams);
+        return -1;
+    }
+
+    for ( i = 0; i < ctx->restore.nr_streams; ++i )
+    {
+        stream = &ctx->restore.streams[i];
+        stream->ctx = ctx;
+        stream->fd = ctx->restore.stream_fds[i];
+
+        if ( pthread_create(&stream->thread, NULL, restore_stream_thread,
+                            stream) )
+        {
+            PERROR("Unable to create thread for page data stream %u", i);
+            return -1;
+        }
+        stream->thread_started = true;
+    }
+
+    return 0;
+}
+
+/*
+ * Stop the page data stream threads.  Threads blocked in reading their
+ * stream are cancelled, as the sender might never write to it again.
+ */
+static void cleanup_streams(struct xc_sr_context *ctx)
+{
+    struct xc_sr_restore_stream *stream;
+    unsigned i;
+
+    if ( !ctx->restore.streams )
+        return;
+
+    pthread_mutex_lock(&ctx->restore.streams_lock);
+    ctx->restore.streams_abort = true;
+    pthread_cond_broadcast(&ctx->restore.streams_cond);
+    pthread_mutex_unlock(&ctx->restore.streams_lock);
+
+    for ( i = 0; i < ctx->restore.nr_streams; ++i )
+    {
+        stream = &ctx->restore.streams[i];
+        if ( !stream->thread_started )
+            continue;
+        pthread_cancel(stream->thread);
+        pthread_join(stream->thread, NULL);
+    }
+
+    free(ctx->restore.streams);
+    ctx->restore.streams = NULL;
+}
+
+/*
+ * Send checkpoint dirty pfn list to primary.
+ */
+static int send_checkpoint_dirty_pfn_list(struct xc_sr_context *ctx)
+{
+    xc_interface *xch = ctx->xch;
+    int rc = -1;
+    unsigned count, written;
+    uint64_t i, *pfns = NULL;
+    struct iovec *iov = NULL;
+    xc_shadow_op_stats_t stats = { 0, ctx->restore.p2m_size };
+    struct xc_sr_record rec =
+    {
+        .type = REC_TYPE_CHECKPOINT_DIRTY_PFN_LIST,
+    };
+    DECLARE_HYPERCALL_BUFFER_SHADOW(unsigned long, dirty_bitmap,
+                                    &ctx->restore.dirty_bitmap_hbuf);
+
+    if ( xc_shadow_control(
+             xch, ctx->domid, XEN_DOMCTL_SHADOW_OP_CLEAN,
+             HYPERCALL_BUFFER(dirty_bitmap), ctx->restore.p2m_size,
+             NULL, 0, &stats) != ctx->restore.p2m_size )
+    {
+        PERROR("Failed to retrieve logdirty bitmap");
+        goto err;
+    }
+
+    for ( i = 0, count = 0; i < ctx->restore.p2m_size; i++ )
+    {
+        if ( test_bit(i, dirty_bitmap) )
+            count++;
+    }
+
+
+    pfns = malloc(count * sizeof(*pfns));
+    if ( !pfns )
+    {
+        ERROR("Unable to allocate %zu bytes of memory for dirty pfn list",
+              count * sizeof(*pfns));
+        goto err;
+    }
+
+    for ( i = 0, written = 0; i < ctx->restore.p2m_size; ++i )
+    {
+        if ( !test_bit(i, dirty_bitmap) )
+            continue;
+
+        if ( written > count )
+        {
+            ERROR("Dirty pfn list exceed");
+            goto err;
+        }
+
+        pfns[written++] = i;
+    }
+
+    /* iovec[] for writev(). */
+    iov = malloc(3 * sizeof(*iov));
+    if ( !iov )
+    {
+        ERROR("Unable to allocate memory for sending dirty bitmap");
+        goto err;
+    }
+
+    rec.length = count * sizeof(*pfns);
+
+    iov[0].iov_base = &rec.type;
+    iov[0].iov_len = sizeof(rec.type);
+
+    iov[1].iov_base = &rec.length;
+    iov[1].iov_len = sizeof(rec.length);
+
+    iov[2].iov_base = pfns;
+    iov[2].iov_len = count * sizeof(*pfns);
+
+    if ( writev_exact(ctx->restore.send_back_fd, iov, 3) )
+    {
+        PERROR("Failed to write dirty bitmap to stream");
+        goto err;
+    }
+
+    rc = 0;
+ err:
+    free(pfns);
+    free(iov);
+    return rc;
+}
+
+/*
+ * Ask the sender for a list of outstanding pages.
+ */
+static int postcopy_request_pages(struct xc_sr_context *ctx,
+                                  const uint64_t *pfns, unsigned count)
+{
+    struct xc_sr_rec_postcopy_page_request hdr = { 0 };
+    struct xc_sr_record rec =
+    {
+        .type = REC_TYPE_POSTCOPY_PAGE_REQUEST,
+        .length = sizeof(hdr),
+        .data = &hdr,
+    };
+    unsigned n;
+
+    for ( ; count; count -= n, pfns += n )
+    {
+        n = count < MAX_BATCH_SIZE ? count : MAX_BATCH_SIZE;
+        hdr.count = n;
+
+        if ( write_split_record_fd(ctx, ctx->restore.send_back_fd, &rec,
+                                   (void *)pfns, n * sizeof(*pfns)) )
+            return -1;
+    }
+
+    return 0;
+}
+
+/*
+ * Consume the requests on the paging ring.  Requests for outstanding pages
+ * are passed on to the sender, unless already asked for, and wait for the
+ * page to arrive.  All others are answered straight away.
+ */
+static int postcopy_handle_requests(struct xc_sr_context *ctx)
+{
+    xc_interface *xch = ctx->xch;
+    vm_event_back_ring_t *back_ring = &ctx->restore.postcopy.back_ring;
+    vm_event_request_t req, *waiting;
+    uint64_t *pfns = NULL;
+    unsigned nr_pfns = 0, max_pfns = 0;
+    bool notify = false;
+    xen_pfn_t gfn;
+    int rc = -1;
+
+    while ( RING_HAS_UNCONSUMED_REQUESTS(back_ring) )
+    {
+        memcpy(&req, RING_GET_REQUEST(back_ring, back_ring->req_cons),
+               sizeof(req));
+        back_ring->req_cons++;
+        back_ring->sring->req_event = back_ring->req_cons + 1;
+
+        gfn = req.u.mem_paging.gfn;
+
+        if ( gfn >= ctx->restore.p2m_size ||
+             !test_bit(gfn, ctx->restore.postcopy.outstanding) )
+        {
+            postcopy_put_response(ctx, &req);
+            notify = true;
+            continue;
+        }
+
+        if ( req.u.mem_paging.flags & MEM_PAGING_DROP_PAGE )
+        {
+            /* The guest freed the page, whatever its contents. */
+            clear_bit(gfn, ctx->restore.postcopy.outstanding);
+            clear_bit(gfn, ctx->restore.postcopy.evicted);
+            --ctx->restore.postcopy.nr_outstanding;
+            postcopy_put_response(ctx, &req);
+            notify = true;
+            continue;
+        }
+
+        if ( ctx->restore.postcopy.nr_waiting ==
+             ctx->restore.postcopy.max_waiting )
+        {
+            waiting = realloc(ctx->restore.postcopy.waiting,
+                              (ctx->restore.postcopy.max_waiting + 64) *
+                              sizeof(*waiting));
+            if ( !waiting )
+            {
+                ERROR("Unable to allocate memory for paging requests");
+                goto err;
+            }
+            ctx->restore.postcopy.waiting = waiting;
+            ctx->restore.postcopy.max_waiting += 64;
+        }
+        ctx->restore.postcopy.waiting[ctx->restore.postcopy.nr_waiting++] =
+            req;
+
+        if ( test_and_set_bit(gfn, ctx->restore.postcopy.requested) )
+            continue;
+
+        if ( nr_pfns == max_pfns )
+        {
+            uint64_t *p = realloc(pfns, (max_pfns + 64) * sizeof(*pfns));
+
+            if ( !p )
+            {
+                ERROR("Unable to allocate memory for page requests");
+                goto err;
+            }
+            pfns = p;
+            max_pfns += 64;
+        }
+        pfns[nr_pfns++] = gfn;
+    }
+
+    if ( nr_pfns && postcopy_request_pages(ctx, pfns, nr_pfns) )
+        goto err;
+
+    if ( notify && xenevtchn_notify(ctx->restore.postcopy.xce,
+                                    ctx->restore.postcopy.port) < 0 )
+    {
+        PERROR("Failed to notify the paging event channel");
+        goto err;
+    }
+
+    rc = 0;
+
+ err:
+    free(pfns);
+    return rc;
+}
+
+/*
+ * Allocate the post-copy tracking, on the first POSTCOPY_PFNS record.
+ */
+static int postcopy_setup(struct xc_sr_context *ctx)
+{
+    xc_interface *xch = ctx->xch;
+
+    if ( ctx->restore.postcopy.outstanding )
+        return 0;
+
+    if ( ctx->restore.guest_type != DHDR_TYPE_X86_HVM ||
+         ctx->restore.checkpointed != XC_MIG_STREAM_NONE )
+    {
+        ERROR("Post-copy is only supported for plain HVM streams");
+        return -1;
+    }
+
+    if ( !ctx->restore.callbacks || !ctx->restore.callbacks->postcopy ||
+         ctx->restore.send_back_fd < 0 )
+    {
+        ERROR("Post-copy stream needs a postcopy callback and a back"
+              " channel");
+        return -1;
+    }
+
+    ctx->restore.postcopy.outstanding =
+        bitmap_alloc(ctx->restore.p2m_size);
+    ctx->restore.postcopy.evicted = bitmap_alloc(ctx->restore.p2m_size);
+    ctx->restore.postcopy.requested = bitmap_alloc(ctx->restore.p2m_size);
+    ctx->restore.postcopy.buffer = xc_memalign(xch, PAGE_SIZE, PAGE_SIZE);
+    if ( !ctx->restore.postcopy.outstanding ||
+         !ctx->restore.postcopy.evicted ||
+         !ctx->restore.postcopy.requested ||
+         !ctx->restore.postcopy.buffer )
+    {
+        ERROR("Unable to allocate memory for post-copy tracking");
+        return -1;
+    }
+
+    ctx->restore.postcopy.port = -1;
+
+    return 0;
+}
+
+/*
+ * Process a POSTCOPY_PFNS record.  Pages without data are dealt with as for
+ * PAGE_DATA, the others are populated and marked outstanding.
+ */
+static int handle_postcopy_pfns(struct xc_sr_context *ctx,
+                                struct xc_sr_record *rec)
+{
+    xc_interface *xch = ctx->xch;
+    struct xc_sr_rec_postcopy_pfns *hdr = rec->data;
+    xen_pfn_t *pfns = NULL;
+    uint32_t *types = NULL;
+    unsigned i, pages_of_data;
+    int rc = -1;
+
+    if ( postcopy_setup(ctx) )
+        goto err;
+
+    if ( rec->length < sizeof(*hdr) ||
+         rec->length != sizeof(*hdr) + hdr->count * sizeof(*hdr->pfn) )
+    {
+        ERROR("POSTCOPY_PFNS record wrong size: length %u", rec->length);
+        goto err;
+    }
+
+    pfns = malloc(hdr->count * sizeof(*pfns));
+    types = malloc(hdr->count * sizeof(*types));
+    if ( !pfns || !types )
+    {
+        ERROR("Unable to allocate enough memory for %u pfns", hdr->count);
+        goto err;
+    }
+
+    if ( decode_page_data_pfns(ctx, hdr->count, hdr->pfn,
+                               pfns, types, &pages_of_data) )
+        goto err;
+
+    for ( i = 0; i < hdr->count; ++i )
+    {
+        if ( pfns[i] >= ctx->restore.p2m_size )
+        {
+            ERROR("Post-copy pfn %#"PRIpfn" beyond the p2m", pfns[i]);
+            goto err;
+        }
+    }
+
+    pthread_mutex_lock(&ctx->restore.populate_lock);
+    rc = populate_pfns(ctx, hdr->count, pfns, types);
+    pthread_mutex_unlock(&ctx->restore.populate_lock);
+    if ( rc )
+        goto err;
+
+    for ( i = 0; i < hdr->count; ++i )
+    {
+        if ( types[i] < XEN_DOMCTL_PFINFO_BROKEN &&
+             !test_and_set_bit(pfns[i], ctx->restore.postcopy.outstanding) )
+            ++ctx->restore.postcopy.nr_outstanding;
+    }
+
+    rc = 0;
+
+ err:
+    free(types);
+    free(pfns);
 
     return rc;
 }
 
 /*
- * Validate a PAGE_DATA record from the stream, and pass the results to
- * process_page_data() to actually perform the legwork.
+ * Set up the paging ring the way xenpaging does, and enable mem_paging.
  */
-static int handle_page_data(struct xc_sr_context *ctx, struct xc_sr_record *rec)
+static int postcopy_enable_paging(struct xc_sr_context *ctx)
 {
     xc_interface *xch = ctx->xch;
-    struct xc_sr_rec_page_data_header *pages = rec->data;
-    unsigned i, pages_of_data = 0;
-    int rc = -1;
-
-    xen_pfn_t *pfns = NULL, pfn;
-    uint32_t *types = NULL, type;
+    uint64_t ring_pfn;
+    xen_pfn_t mmap_pfn;
+    uint32_t evtchn_port;
 
-    if ( rec->length < sizeof(*pages) )
-    {
-        ERROR("PAGE_DATA record truncated: length %u, min %zu",
-              rec->length, sizeof(*pages));
-        goto err;
-    }
-    else if ( pages->count < 1 )
-    {
-        ERROR("Expected at least 1 pfn in PAGE_DATA record");
-        goto err;
-    }
-    else if ( rec->length < sizeof(*pages) + (pages->count * sizeof(uint64_t)) )
+    if ( xc_hvm_param_get(xch, ctx->domid, HVM_PARAM_PAGING_RING_PFN,
+                          &ring_pfn) )
     {
-        ERROR("PAGE_DATA record (length %u) too short to contain %u"
-              " pfns worth of information", rec->length, pages->count);
-        goto err;
+        PERROR("Failed to get the paging ring pfn");
+        return -1;
     }
 
-    pfns = malloc(pages->count * sizeof(*pfns));
-    types = malloc(pages->count * sizeof(*types));
-    if ( !pfns || !types )
-    {
-        ERROR("Unable to allocate enough memory for %u pfns",
-              pages->count);
-        goto err;
-    }
+    /* The ring page is not part of the guest's memory. */
+    if ( ring_pfn < ctx->restore.p2m_size &&
+         test_and_clear_bit(ring_pfn, ctx->restore.postcopy.outstanding) )
+        --ctx->restore.postcopy.nr_outstanding;
 
-    for ( i = 0; i < pages->count; ++i )
+    mmap_pfn = ring_pfn;
+    ctx->restore.postcopy.ring_page =
+        xenforeignmemory_map(xch->fmem, ctx->domid, PROT_READ | PROT_WRITE,
+                             1, &mmap_pfn, NULL);
+    if ( !ctx->restore.postcopy.ring_page )
     {
-        pfn = pages->pfn[i] & PAGE_DATA_PFN_MASK;
-        if ( !ctx->restore.ops.pfn_is_valid(ctx, pfn) )
+        if ( xc_domain_populate_physmap_exact(xch, ctx->domid, 1, 0, 0,
+                                              &mmap_pfn) )
         {
-            ERROR("pfn %#"PRIpfn" (index %u) outside domain maximum", pfn, i);
-            goto err;
+            PERROR("Failed to populate the paging ring pfn");
+            return -1;
         }
 
-        type = (pages->pfn[i] & PAGE_DATA_TYPE_MASK) >> 32;
-        if ( ((type >> XEN_DOMCTL_PFINFO_LTAB_SHIFT) >= 5) &&
-             ((type >> XEN_DOMCTL_PFINFO_LTAB_SHIFT) <= 8) )
+        mmap_pfn = ring_pfn;
+        ctx->restore.postcopy.ring_page =
+            xenforeignmemory_map(xch->fmem, ctx->domid,
+                                 PROT_READ | PROT_WRITE, 1, &mmap_pfn, NULL);
+        if ( !ctx->restore.postcopy.ring_page )
         {
-            ERROR("Invalid type %#"PRIx32" for pfn %#"PRIpfn" (index %u)",
-                  type, pfn, i);
-            goto err;
+            PERROR("Failed to map the paging ring");
+            return -1;
         }
-        else if ( type < XEN_DOMCTL_PFINFO_BROKEN )
-            /* NOTAB and all L1 through L4 tables (including pinned) should
-             * have a page worth of data in the record. */
-            pages_of_data++;
+    }
 
-        pfns[i] = pfn;
-        types[i] = type;
+    if ( xc_mem_paging_enable(xch, ctx->domid, &evtchn_port) )
+    {
+        PERROR("Failed to enable paging, which post-copy depends on");
+        return -1;
     }
+    ctx->restore.postcopy.paging_enabled = true;
 
-    if ( rec->length != (sizeof(*pages) +
-                         (sizeof(uint64_t) * pages->count) +
-                         (PAGE_SIZE * pages_of_data)) )
+    ctx->restore.postcopy.xce = xenevtchn_open(NULL, 0);
+    if ( !ctx->restore.postcopy.xce )
     {
-        ERROR("PAGE_DATA record wrong size: length %u, expected "
-              "%zu + %zu + %lu", rec->length, sizeof(*pages),
-              (sizeof(uint64_t) * pages->count), (PAGE_SIZE * pages_of_data));
-        goto err;
+        PERROR("Failed to open event channel");
+        return -1;
     }
 
-    rc = process_page_data(ctx, pages->count, pfns, types,
-                           &pages->pfn[pages->count]);
- err:
-    free(types);
-    free(pfns);
+    ctx->restore.postcopy.port =
+        xenevtchn_bind_interdomain(ctx->restore.postcopy.xce, ctx->domid,
+                                   evtchn_port);
+    if ( ctx->restore.postcopy.port < 0 )
+    {
+        PERROR("Failed to bind the paging event channel");
+        return -1;
+    }
 
-    return rc;
+    SHARED_RING_INIT((vm_event_sring_t *)ctx->restore.postcopy.ring_page);
+    BACK_RING_INIT(&ctx->restore.postcopy.back_ring,
+                   (vm_event_sring_t *)ctx->restore.postcopy.ring_page,
+                   PAGE_SIZE);
+
+    mmap_pfn = ring_pfn;
+    if ( xc_domain_decrease_reservation_exact(xch, ctx->domid, 1, 0,
+                                              &mmap_pfn) )
+        PERROR("Failed to remove the paging ring from the guest physmap");
+
+    return 0;
 }
 
 /*
- * Send checkpoint dirty pfn list to primary.
+ * Page out all outstanding pages.  Those which can't be are requested from
+ * the sender straight away, and must arrive before the guest is resumed.
  */
-static int send_checkpoint_dirty_pfn_list(struct xc_sr_context *ctx)
+static int postcopy_evict_pages(struct xc_sr_context *ctx)
 {
     xc_interface *xch = ctx->xch;
+    uint64_t *pfns = NULL, param;
+    unsigned nr_pfns = 0, i;
+    xen_pfn_t pfn;
     int rc = -1;
-    unsigned count, written;
-    uint64_t i, *pfns = NULL;
-    struct iovec *iov = NULL;
-    xc_shadow_op_stats_t stats = { 0, ctx->restore.p2m_size };
-    struct xc_sr_record rec =
+    static const unsigned magic_params[] =
     {
-        .type = REC_TYPE_CHECKPOINT_DIRTY_PFN_LIST,
+        HVM_PARAM_STORE_PFN,
+        HVM_PARAM_CONSOLE_PFN,
+        HVM_PARAM_IOREQ_PFN,
+        HVM_PARAM_BUFIOREQ_PFN,
     };
-    DECLARE_HYPERCALL_BUFFER_SHADOW(unsigned long, dirty_bitmap,
-                                    &ctx->restore.dirty_bitmap_hbuf);
 
-    if ( xc_shadow_control(
-             xch, ctx->domid, XEN_DOMCTL_SHADOW_OP_CLEAN,
-             HYPERCALL_BUFFER(dirty_bitmap), ctx->restore.p2m_size,
-             NULL, 0, &stats) != ctx->restore.p2m_size )
+    /*
+     * The magic pages were cleared by handle_hvm_params(), as in a normal
+     * restore, so their stale contents are not wanted.
+     */
+    for ( i = 0; i < ARRAY_SIZE(magic_params); ++i )
     {
-        PERROR("Failed to retrieve logdirty bitmap");
-        goto err;
-    }
+        if ( xc_hvm_param_get(xch, ctx->domid, magic_params[i], &param) )
+            continue;
 
-    for ( i = 0, count = 0; i < ctx->restore.p2m_size; i++ )
-    {
-        if ( test_bit(i, dirty_bitmap) )
-            count++;
+        if ( param < ctx->restore.p2m_size &&
+             test_and_clear_bit(param, ctx->restore.postcopy.outstanding) )
+            --ctx->restore.postcopy.nr_outstanding;
     }
 
-
-    pfns = malloc(count * sizeof(*pfns));
+    pfns = malloc(MAX_BATCH_SIZE * sizeof(*pfns));
     if ( !pfns )
     {
-        ERROR("Unable to allocate %zu bytes of memory for dirty pfn list",
-              count * sizeof(*pfns));
+        ERROR("Unable to allocate memory for page requests");
         goto err;
     }
 
-    for ( i = 0, written = 0; i < ctx->restore.p2m_size; ++i )
+    for ( pfn = 0; pfn < ctx->restore.p2m_size; ++pfn )
     {
-        if ( !test_bit(i, dirty_bitmap) )
+        if ( !test_bit(pfn, ctx->restore.postcopy.outstanding) )
             continue;
 
-        if ( written > count )
+        if ( !xc_mem_paging_nominate(xch, ctx->domid, pfn) &&
+             !xc_mem_paging_evict(xch, ctx->domid, pfn) )
         {
-            ERROR("Dirty pfn list exceed");
-            goto err;
+            set_bit(pfn, ctx->restore.postcopy.evicted);
+            continue;
         }
 
-        pfns[written++] = i;
+        DPRINTF("Unable to page out pfn %#"PRIpfn": %d", pfn, errno);
+
+        set_bit(pfn, ctx->restore.postcopy.requested);
+        ++ctx->restore.postcopy.nr_unevicted;
+        pfns[nr_pfns++] = pfn;
+
+        if ( nr_pfns == MAX_BATCH_SIZE )
+        {
+            if ( postcopy_request_pages(ctx, pfns, nr_pfns) )
+                goto err;
+            nr_pfns = 0;
+        }
     }
 
-    /* iovec[] for writev(). */
-    iov = malloc(3 * sizeof(*iov));
-    if ( !iov )
-    {
-        ERROR("Unable to allocate memory for sending dirty bitmap");
+    if ( nr_pfns && postcopy_request_pages(ctx, pfns, nr_pfns) )
         goto err;
-    }
 
-    rec.length = count * sizeof(*pfns);
+    rc = 0;
 
-    iov[0].iov_base = &rec.type;
-    iov[0].iov_len = sizeof(rec.type);
+ err:
+    free(pfns);
+    return rc;
+}
 
-    iov[1].iov_base = &rec.length;
-    iov[1].iov_len = sizeof(rec.length);
+/*
+ * Process a POSTCOPY_TRANSITION record.  All records describing the vcpus
+ * have been received, the remaining memory is paged in by postcopy_loop().
+ */
+static int handle_postcopy_transition(struct xc_sr_context *ctx)
+{
+    xc_interface *xch = ctx->xch;
+    int rc;
 
-    iov[2].iov_base = pfns;
-    iov[2].iov_len = count * sizeof(*pfns);
+    rc = postcopy_setup(ctx);
+    if ( rc )
+        return rc;
 
-    if ( writev_exact(ctx->restore.send_back_fd, iov, 3) )
+    rc = postcopy_enable_paging(ctx);
+    if ( rc )
+        return rc;
+
+    rc = postcopy_evict_pages(ctx);
+    if ( rc )
+        return rc;
+
+    IPRINTF("Post-copy: %lu pages outstanding, %lu not paged out",
+            ctx->restore.postcopy.nr_outstanding,
+            ctx->restore.postcopy.nr_unevicted);
+
+    ctx->restore.postcopy.active = true;
+
+    return 0;
+}
+
+static void postcopy_cleanup(struct xc_sr_context *ctx)
+{
+    xc_interface *xch = ctx->xch;
+
+    if ( ctx->restore.postcopy.xce )
     {
-        PERROR("Failed to write dirty bitmap to stream");
-        goto err;
+        if ( ctx->restore.postcopy.port >= 0 &&
+             xenevtchn_unbind(ctx->restore.postcopy.xce,
+                              ctx->restore.postcopy.port) )
+            PERROR("Failed to unbind the paging event channel");
+
+        xenevtchn_close(ctx->restore.postcopy.xce);
     }
 
-    rc = 0;
- err:
-    free(pfns);
-    free(iov);
-    return rc;
+    if ( ctx->restore.postcopy.ring_page )
+        xenforeignmemory_unmap(xch->fmem, ctx->restore.postcopy.ring_page, 1);
+
+    if ( ctx->restore.postcopy.paging_enabled &&
+         xc_mem_paging_disable(xch, ctx->domid) )
+        PERROR("Failed to disable paging");
+
+    free(ctx->restore.postcopy.waiting);
+    free(ctx->restore.postcopy.buffer);
+    free(ctx->restore.postcopy.requested);
+    free(ctx->restore.postcopy.evicted);
+    free(ctx->restore.postcopy.outstanding);
 }
 
 static int process_record(struct xc_sr_context *ctx, struct xc_sr_record *rec);
@@ -640,6 +1683,10 @@ static int process_record(struct xc_sr_context *ctx, struct xc_sr_record *rec)
         rc = handle_page_data(ctx, rec);
         break;
 
+    case REC_TYPE_COMPRESSED_PAGE_DATA:
+        rc = handle_compressed_page_data(ctx, rec);
+        break;
+
     case REC_TYPE_VERIFY:
         DPRINTF("Verify mode enabled");
         ctx->restore.verify = true;
@@ -649,6 +1696,18 @@ static int process_record(struct xc_sr_context *ctx, struct xc_sr_record *rec)
         rc = handle_checkpoint(ctx);
         break;
 
+    case REC_TYPE_STREAM_SYNC:
+        rc = handle_stream_sync(ctx, rec);
+        break;
+
+    case REC_TYPE_POSTCOPY_PFNS:
+        rc = handle_postcopy_pfns(ctx, rec);
+        break;
+
+    case REC_TYPE_POSTCOPY_TRANSITION:
+        rc = handle_postcopy_transition(ctx);
+        break;
+
     default:
         rc = ctx->restore.ops.process_record(ctx, rec);
         break;
@@ -660,6 +1719,127 @@ static int process_record(struct xc_sr_context *ctx, struct xc_sr_record *rec)
     return rc;
 }
 
+/*
+ * Resume the guest, once all the outstanding pages which couldn't be paged
+ * out have arrived.
+ */
+static int postcopy_resume_guest(struct xc_sr_context *ctx)
+{
+    xc_interface *xch = ctx->xch;
+    int rc;
+
+    rc = ctx->restore.ops.stream_complete(ctx);
+    if ( rc )
+        return rc;
+
+    if ( ctx->restore.callbacks->restore_results )
+        ctx->restore.callbacks->restore_results(ctx->restore.xenstore_gfn,
+                                                ctx->restore.console_gfn,
+                                                ctx->restore.callbacks->data);
+
+    if ( ctx->restore.callbacks->postcopy(ctx->restore.callbacks->data) != 1 )
+    {
+        ERROR("Failed to resume the guest for post-copy");
+        return -1;
+    }
+
+    ctx->restore.postcopy.resumed = true;
+    xc_report_progress_single(xch, "Guest resumed for post-copy");
+
+    return 0;
+}
+
+/*
+ * The pager, from POSTCOPY_TRANSITION up to the END record.
+ */
+static int postcopy_loop(struct xc_sr_context *ctx)
+{
+    xc_interface *xch = ctx->xch;
+    struct xc_sr_record rec;
+    struct pollfd pfds[2] =
+    {
+        { .fd = ctx->fd, .events = POLLIN },
+        { .fd = xenevtchn_fd(ctx->restore.postcopy.xce), .events = POLLIN },
+    };
+    int port, rc;
+
+    for ( ;; )
+    {
+        if ( !ctx->restore.postcopy.resumed &&
+             !ctx->restore.postcopy.nr_unevicted )
+        {
+            rc = postcopy_resume_guest(ctx);
+            if ( rc )
+                return rc;
+        }
+
+        rc = poll(pfds, ARRAY_SIZE(pfds), -1);
+        if ( rc < 0 )
+        {
+            if ( errno == EINTR )
+                continue;
+            PERROR("Failed to poll for post-copy events");
+            return -1;
+        }
+
+        if ( pfds[1].revents )
+        {
+            port = xenevtchn_pending(ctx->restore.postcopy.xce);
+            if ( port < 0 )
+            {
+                PERROR("Failed to read the paging event channel");
+                return -1;
+            }
+
+            if ( xenevtchn_unmask(ctx->restore.postcopy.xce, port) < 0 )
+            {
+                PERROR("Failed to unmask the paging event channel");
+                return -1;
+            }
+
+            rc = postcopy_handle_requests(ctx);
+            if ( rc )
+                return rc;
+        }
+
+        if ( !pfds[0].revents )
+            continue;
+
+        rc = read_record(ctx, ctx->fd, &rec);
+        if ( rc )
+            return rc;
+
+        switch ( rec.type )
+        {
+        case REC_TYPE_PAGE_DATA:
+        case REC_TYPE_COMPRESSED_PAGE_DATA:
+            rc = process_record(ctx, &rec);
+            if ( rc )
+                return rc;
+            break;
+
+        case REC_TYPE_END:
+            if ( ctx->restore.postcopy.nr_outstanding )
+            {
+                ERROR("Stream ended with %lu post-copy pages outstanding",
+                      ctx->restore.postcopy.nr_outstanding);
+                return -1;
+            }
+
+            if ( !ctx->restore.postcopy.resumed )
+                return postcopy_resume_guest(ctx);
+
+            return 0;
+
+        default:
+            ERROR("Unexpected record %#x (%s) during post-copy",
+                  rec.type, rec_type_to_str(rec.type));
+            free(rec.data);
+            return -1;
+        }
+    }
+}
+
 static int setup(struct xc_sr_context *ctx)
 {
     xc_interface *xch = ctx->xch;
@@ -667,6 +1847,10 @@ static int setup(struct xc_sr_context *ctx)
     DECLARE_HYPERCALL_BUFFER_SHADOW(unsigned long, dirty_bitmap,
                                     &ctx->restore.dirty_bitmap_hbuf);
 
+    pthread_mutex_init(&ctx->restore.populate_lock, NULL);
+    pthread_mutex_init(&ctx->restore.streams_lock, NULL);
+    pthread_cond_init(&ctx->restore.streams_cond, NULL);
+
     if ( ctx->restore.checkpointed == XC_MIG_STREAM_COLO )
     {
         dirty_bitmap = xc_hypercall_buffer_alloc_pages(xch, dirty_bitmap,
@@ -704,6 +1888,9 @@ static int setup(struct xc_sr_context *ctx)
     }
     ctx->restore.allocated_rec_num = DEFAULT_BUF_RECORDS;
 
+    if ( ctx->restore.nr_streams )
+        rc = setup_streams(ctx);
+
  err:
     return rc;
 }
@@ -715,6 +1902,9 @@ static void cleanup(struct xc_sr_context *ctx)
     DECLARE_HYPERCALL_BUFFER_SHADOW(unsigned long, dirty_bitmap,
                                     &ctx->restore.dirty_bitmap_hbuf);
 
+    cleanup_streams(ctx);
+    postcopy_cleanup(ctx);
+
     for ( i = 0; i < ctx->restore.buffered_rec_num; i++ )
         free(ctx->restore.buffered_records[i].data);
 
@@ -725,6 +1915,10 @@ static void cleanup(struct xc_sr_context *ctx)
     free(ctx->restore.populated_pfns);
     if ( ctx->restore.ops.cleanup(ctx) )
         PERROR("Failed to clean up");
+
+    pthread_cond_destroy(&ctx->restore.streams_cond);
+    pthread_mutex_destroy(&ctx->restore.streams_lock);
+    pthread_mutex_destroy(&ctx->restore.populate_lock);
 }
 
 /*
@@ -783,7 +1977,25 @@ static int restore(struct xc_sr_context *ctx)
                 goto err;
         }
 
-    } while ( rec.type != REC_TYPE_END );
+    } while ( rec.type != REC_TYPE_END && !ctx->restore.postcopy.active );
+
+    if ( ctx->restore.postcopy.active )
+    {
+        rc = postcopy_loop(ctx);
+        if ( rc )
+            goto err;
+    }
+
+    rc = wait_streams_end(ctx);
+    if ( rc )
+        goto err;
+
+    if ( ctx->restore.postcopy.active )
+    {
+        /* The guest was resumed by postcopy_loop(). */
+        IPRINTF("Post-copy restore successful");
+        goto done;
+    }
 
  remus_failover:
 
@@ -829,7 +2041,8 @@ int xc_domain_restore(xc_interface *xch, int io_fd, uint32_t dom,
                       unsigned long *console_gfn, domid_t console_domid,
                       unsigned int hvm, unsigned int pae, int superpages,
                       xc_migration_stream_t stream_type,
-                      struct restore_callbacks *callbacks, int send_back_fd)
+                      struct restore_callbacks *callbacks, int send_back_fd,
+                      const int *page_fds, unsigned int nr_page_fds)
 {
     xen_pfn_t nr_pfns;
     struct xc_sr_context ctx =
@@ -846,6 +2059,8 @@ int xc_domain_restore(xc_interface *xch, int io_fd, uint32_t dom,
     ctx.restore.checkpointed = stream_type;
     ctx.restore.callbacks = callbacks;
     ctx.restore.send_back_fd = send_back_fd;
+    ctx.restore.stream_fds = page_fds;
+    ctx.restore.nr_streams = nr_page_fds;
 
     /* Sanity checks for callbacks. */
     if ( stream_type )
@@ -861,8 +2076,15 @@ int xc_domain_restore(xc_interface *xch, int io_fd, uint32_t dom,
     }
 
     DPRINTF("fd %d, dom %u, hvm %u, pae %u, superpages %d"
-            ", stream_type %d", io_fd, dom, hvm, pae,
-            superpages, stream_type);
+            ", stream_type %d, page data streams %u", io_fd, dom, hvm, pae,
+            superpages, stream_type, nr_page_fds);
+
+    if ( nr_page_fds && stream_type != XC_MIG_STREAM_NONE )
+    {
+        ERROR("Parallel page data streams need a plain migration stream");
+        errno = EINVAL;
+        return -1;
+    }
 
     if ( xc_domain_getinfo(xch, dom, 1, &ctx.dominfo) != 1 )
     {
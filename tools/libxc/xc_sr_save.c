@@ -1,8 +1,16 @@
 #include <assert.h>
+#include <poll.h>
+#include <time.h>
 #include <arpa/inet.h>
 
 #include "xc_sr_common.h"
 
+/* Lowest cap, in percent per vcpu, throttle_domain() goes down to. */
+#define THROTTLE_MIN_CAP 10
+
+/* Pages sent in the background between checks for post-copy requests. */
+#define POSTCOPY_BACKGROUND_PAGES 64
+
 /*
  * Writes an Image header and Domain header into the stream.
  */
@@ -67,16 +75,177 @@ static int write_checkpoint_record(struct xc_sr_context *ctx)
 }
 
 /*
- * Writes a batch of memory as a PAGE_DATA record into the stream.  The batch
- * is constructed in ctx->save.batch_pfns.
+ * Writes a STREAM_SYNC record into the main stream and all page data
+ * streams.  The streams must be idle.
+ */
+static int write_stream_sync_records(struct xc_sr_context *ctx)
+{
+    xc_interface *xch = ctx->xch;
+    struct xc_sr_rec_stream_sync sync =
+    {
+        .seq = ++ctx->save.stream_seq,
+        .nr_streams = ctx->save.nr_streams,
+    };
+    struct xc_sr_record rec =
+    {
+        .type = REC_TYPE_STREAM_SYNC,
+        .length = sizeof(sync),
+        .data = &sync,
+    };
+    unsigned i;
+
+    for ( i = 0; i < ctx->save.nr_streams; ++i )
+    {
+        if ( write_split_record_fd(ctx, ctx->save.streams[i].fd,
+                                   &rec, NULL, 0) )
+        {
+            ERROR("Failed to write sync record to page data stream %u", i);
+            return -1;
+        }
+    }
+
+    return write_record(ctx, &rec);
+}
+
+/*
+ * Writes an END record into all page data streams.
+ */
+static int write_stream_end_records(struct xc_sr_context *ctx)
+{
+    struct xc_sr_record end = { REC_TYPE_END, 0, NULL };
+    unsigned i;
+
+    for ( i = 0; i < ctx->save.nr_streams; ++i )
+        if ( write_split_record_fd(ctx, ctx->save.streams[i].fd,
+                                   &end, NULL, 0) )
+            return -1;
+
+    return 0;
+}
+
+/*
+ * Mark a page as deferred, to be sent again once the domain is suspended.
+ * May be called from the page data stream threads.
+ */
+static void defer_page(struct xc_sr_context *ctx, xen_pfn_t pfn)
+{
+    pthread_mutex_lock(&ctx->save.streams_lock);
+    set_bit(pfn, ctx->save.deferred_pages);
+    ++ctx->save.nr_deferred_pages;
+    pthread_mutex_unlock(&ctx->save.streams_lock);
+}
+
+/*
+ * Writes the page data of a batch as a COMPRESSED_PAGE_DATA record into the
+ * stream fd.  All-zero pages are only marked in the zero bitmap, others are
+ * LZ4 compressed, or sent as they are if that doesn't make them smaller.
+ */
+static int write_compressed_batch(struct xc_sr_context *ctx, int fd,
+                                  unsigned nr_pfns, const uint64_t *rec_pfns,
+                                  void **guest_data)
+{
+    xc_interface *xch = ctx->xch;
+    struct xc_sr_rec_compressed_page_data_header *hdr = NULL;
+    uint64_t *zero_bitmap;
+    uint32_t *lengths;
+    uint8_t *data = NULL;
+    unsigned i, nr_data = 0, nr_zero = 0, nr_lengths = 0;
+    size_t bitmap_sz = ((nr_pfns + 63) / 64) * sizeof(*zero_bitmap);
+    size_t hdr_sz, data_sz = 0, len;
+    struct timespec start, end;
+    struct xc_sr_record rec =
+    {
+        .type = REC_TYPE_COMPRESSED_PAGE_DATA,
+    };
+    int rc = -1;
+
+    for ( i = 0; i < nr_pfns; ++i )
+        if ( guest_data[i] )
+            ++nr_data;
+
+    hdr_sz = sizeof(*hdr) + nr_pfns * sizeof(*rec_pfns) + bitmap_sz;
+    hdr = calloc(1, hdr_sz + ROUNDUP(nr_data * sizeof(*lengths),
+                                     REC_ALIGN_ORDER));
+    data = malloc(nr_data * PAGE_SIZE);
+    if ( !hdr || (nr_data && !data) )
+    {
+        ERROR("Unable to allocate memory to compress a batch of %u pages",
+              nr_pfns);
+        goto err;
+    }
+
+    hdr->count = nr_pfns;
+    memcpy(hdr->pfn, rec_pfns, nr_pfns * sizeof(*rec_pfns));
+    zero_bitmap = &hdr->pfn[nr_pfns];
+    lengths = (uint32_t *)&zero_bitmap[bitmap_sz / sizeof(*zero_bitmap)];
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    for ( i = 0; i < nr_pfns; ++i )
+    {
+        if ( !guest_data[i] )
+            continue;
+
+        if ( page_is_zero(guest_data[i]) )
+        {
+            zero_bitmap[i / 64] |= 1ULL << (i % 64);
+            ++nr_zero;
+            continue;
+        }
+
+        len = lz4_compress_block(guest_data[i], PAGE_SIZE,
+                                 data + data_sz, PAGE_SIZE - 1);
+        if ( !len )
+        {
+            memcpy(data + data_sz, guest_data[i], PAGE_SIZE);
+            len = PAGE_SIZE;
+        }
+
+        lengths[nr_lengths++] = len;
+        data_sz += len;
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    hdr_sz += ROUNDUP(nr_lengths * sizeof(*lengths), REC_ALIGN_ORDER);
+    rec.length = hdr_sz;
+    rec.data = hdr;
+
+    rc = write_split_record_fd(ctx, fd, &rec, data, data_sz);
+    if ( rc )
+        goto err;
+
+    pthread_mutex_lock(&ctx->save.streams_lock);
+    ctx->save.compress_stats.pages += nr_data;
+    ctx->save.compress_stats.zero_pages += nr_zero;
+    ctx->save.compress_stats.in_bytes += (uint64_t)nr_data * PAGE_SIZE;
+    ctx->save.compress_stats.out_bytes += bitmap_sz + data_sz +
+        nr_lengths * sizeof(*lengths);
+    ctx->save.compress_stats.ns +=
+        (end.tv_sec - start.tv_sec) * 1000000000ULL +
+        end.tv_nsec - start.tv_nsec;
+    pthread_mutex_unlock(&ctx->save.streams_lock);
+
+ err:
+    free(data);
+    free(hdr);
+
+    return rc;
+}
+
+/*
+ * Writes a batch of memory as a PAGE_DATA record into the stream fd.  Called
+ * for ctx->save.batch_pfns, or from the page data stream threads.
  *
  * This function:
  * - gets the types for each pfn in the batch.
  * - for each pfn with real data:
  *   - maps and attempts to localise the pages.
- * - construct and writes a PAGE_DATA record into the stream.
+ * - construct and writes a PAGE_DATA (or COMPRESSED_PAGE_DATA) record into
+ *   the stream.
  */
-static int write_batch(struct xc_sr_context *ctx)
+static int write_batch(struct xc_sr_context *ctx, int fd,
+                       const xen_pfn_t *batch_pfns, unsigned nr_pfns)
 {
     xc_interface *xch = ctx->xch;
     xen_pfn_t *mfns = NULL, *types = NULL;
@@ -85,7 +254,6 @@ static int write_batch(struct xc_sr_context *ctx)
     void **local_pages = NULL;
     int *errors = NULL, rc = -1;
     unsigned i, p, nr_pages = 0, nr_pages_mapped = 0;
-    unsigned nr_pfns = ctx->save.nr_batch_pfns;
     void *page, *orig_page;
     uint64_t *rec_pfns = NULL;
     struct iovec *iov = NULL; int iovcnt = 0;
@@ -119,14 +287,22 @@ static int write_batch(struct xc_sr_context *ctx)
 
     for ( i = 0; i < nr_pfns; ++i )
     {
-        types[i] = mfns[i] = ctx->save.ops.pfn_to_gfn(ctx,
-                                                      ctx->save.batch_pfns[i]);
+        types[i] = mfns[i] = ctx->save.ops.pfn_to_gfn(ctx, batch_pfns[i]);
 
         /* Likely a ballooned page. */
         if ( mfns[i] == INVALID_MFN )
         {
-            set_bit(ctx->save.batch_pfns[i], ctx->save.deferred_pages);
-            ++ctx->save.nr_deferred_pages;
+            /*
+             * Deferred pages are sent once the domain is suspended, which
+             * has already happened when serving post-copy pages.  The
+             * restorer would wait for this one forever, so give up.
+             */
+            if ( ctx->save.postcopy_active )
+            {
+                ERROR("Post-copy pfn %#"PRIpfn" has no mfn", batch_pfns[i]);
+                goto err;
+            }
+            defer_page(ctx, batch_pfns[i]);
         }
     }
 
@@ -145,6 +321,12 @@ static int write_batch(struct xc_sr_context *ctx)
         case XEN_DOMCTL_PFINFO_BROKEN:
         case XEN_DOMCTL_PFINFO_XALLOC:
         case XEN_DOMCTL_PFINFO_XTAB:
+            if ( ctx->save.postcopy_active )
+            {
+                ERROR("Post-copy pfn %#"PRIpfn" is no longer populated",
+                      batch_pfns[i]);
+                goto err;
+            }
             continue;
         }
 
@@ -175,7 +357,7 @@ static int write_batch(struct xc_sr_context *ctx)
             if ( errors[p] )
             {
                 ERROR("Mapping of pfn %#"PRIpfn" (mfn %#"PRIpfn") failed %d",
-                      ctx->save.batch_pfns[i], mfns[p], errors[p]);
+                      batch_pfns[i], mfns[p], errors[p]);
                 goto err;
             }
 
@@ -189,8 +371,13 @@ static int write_batch(struct xc_sr_context *ctx)
             {
                 if ( rc == -1 && errno == EAGAIN )
                 {
-                    set_bit(ctx->save.batch_pfns[i], ctx->save.deferred_pages);
-                    ++ctx->save.nr_deferred_pages;
+                    if ( ctx->save.postcopy_active )
+                    {
+                        ERROR("Post-copy pfn %#"PRIpfn" can't be sent",
+                              batch_pfns[i]);
+                        goto err;
+                    }
+                    defer_page(ctx, batch_pfns[i]);
                     types[i] = XEN_DOMCTL_PFINFO_XTAB;
                     --nr_pages;
                 }
@@ -220,7 +407,13 @@ static int write_batch(struct xc_sr_context *ctx)
     rec.length += nr_pages * PAGE_SIZE;
 
     for ( i = 0; i < nr_pfns; ++i )
-        rec_pfns[i] = ((uint64_t)(types[i]) << 32) | ctx->save.batch_pfns[i];
+        rec_pfns[i] = ((uint64_t)(types[i]) << 32) | batch_pfns[i];
+
+    if ( ctx->save.compress )
+    {
+        rc = write_compressed_batch(ctx, fd, nr_pfns, rec_pfns, guest_data);
+        goto err;
+    }
 
     iov[0].iov_base = &rec.type;
     iov[0].iov_len = sizeof(rec.type);
@@ -250,7 +443,7 @@ static int write_batch(struct xc_sr_context *ctx)
         }
     }
 
-    if ( writev_exact(ctx->fd, iov, iovcnt) )
+    if ( writev_exact(fd, iov, iovcnt) )
     {
         PERROR("Failed to write page data to stream");
         goto err;
@@ -258,7 +451,7 @@ static int write_batch(struct xc_sr_context *ctx)
 
     /* Sanity check we have sent all the pages we expected to. */
     assert(nr_pages == 0);
-    rc = ctx->save.nr_batch_pfns = 0;
+    rc = 0;
 
  err:
     free(rec_pfns);
@@ -276,6 +469,107 @@ static int write_batch(struct xc_sr_context *ctx)
     return rc;
 }
 
+/*
+ * Page data stream thread: writes the batches handed over by the main thread.
+ */
+static void *save_stream_thread(void *arg)
+{
+    struct xc_sr_save_stream *stream = arg;
+    struct xc_sr_context *ctx = stream->ctx;
+    int rc;
+
+    pthread_mutex_lock(&ctx->save.streams_lock);
+    for ( ;; )
+    {
+        while ( !stream->nr_work_pfns && !stream->stop )
+            pthread_cond_wait(&stream->cond, &ctx->save.streams_lock);
+
+        if ( !stream->nr_work_pfns )
+            break;
+
+        if ( !stream->failed )
+        {
+            pthread_mutex_unlock(&ctx->save.streams_lock);
+            rc = write_batch(ctx, stream->fd, stream->work_pfns,
+                             stream->nr_work_pfns);
+            pthread_mutex_lock(&ctx->save.streams_lock);
+            if ( rc )
+                stream->failed = true;
+        }
+
+        stream->nr_work_pfns = 0;
+        pthread_cond_broadcast(&stream->cond);
+    }
+    pthread_mutex_unlock(&ctx->save.streams_lock);
+
+    return NULL;
+}
+
+/*
+ * Hand the batch of a page data stream over to its thread, waiting for the
+ * previous one to be written.
+ */
+static int submit_stream_batch(struct xc_sr_context *ctx,
+                               struct xc_sr_save_stream *stream)
+{
+    xen_pfn_t *pfns;
+    int rc = 0;
+
+    pthread_mutex_lock(&ctx->save.streams_lock);
+    while ( stream->nr_work_pfns && !stream->failed )
+        pthread_cond_wait(&stream->cond, &ctx->save.streams_lock);
+
+    if ( stream->failed )
+        rc = -1;
+    else if ( stream->nr_batch_pfns )
+    {
+        pfns = stream->work_pfns;
+        stream->work_pfns = stream->batch_pfns;
+        stream->nr_work_pfns = stream->nr_batch_pfns;
+        stream->batch_pfns = pfns;
+        stream->nr_batch_pfns = 0;
+        pthread_cond_broadcast(&stream->cond);
+    }
+    pthread_mutex_unlock(&ctx->save.streams_lock);
+
+    return rc;
+}
+
+/*
+ * Send the partial batches of all page data streams, and wait for all of
+ * them to be written.
+ */
+static int flush_streams(struct xc_sr_context *ctx)
+{
+    xc_interface *xch = ctx->xch;
+    struct xc_sr_save_stream *stream;
+    unsigned i;
+    int rc = 0;
+
+    for ( i = 0; i < ctx->save.nr_streams; ++i )
+    {
+        rc = submit_stream_batch(ctx, &ctx->save.streams[i]);
+        if ( rc )
+            break;
+    }
+
+    pthread_mutex_lock(&ctx->save.streams_lock);
+    for ( i = 0; i < ctx->save.nr_streams; ++i )
+    {
+        stream = &ctx->save.streams[i];
+        while ( stream->nr_work_pfns )
+            pthread_cond_wait(&stream->cond, &ctx->save.streams_lock);
+        if ( stream->failed )
+        {
+            ERROR("Failed to write page data to stream %u", i);
+            rc = -1;
+        }
+    }
+    pthread_mutex_unlock(&ctx->save.streams_lock);
+
+    return rc;
+}
+
 /*
  * Flush a batch of pfns into the stream.
  */
@@ -283,13 +577,18 @@ static int flush_batch(struct xc_sr_context *ctx)
 {
     int rc = 0;
 
+    if ( ctx->save.nr_streams )
+        return flush_streams(ctx);
+
     if ( ctx->save.nr_batch_pfns == 0 )
         return rc;
 
-    rc = write_batch(ctx);
+    rc = write_batch(ctx, ctx->fd, ctx->save.batch_pfns,
+                     ctx->save.nr_batch_pfns);
 
     if ( !rc )
     {
+        ctx->save.nr_batch_pfns = 0;
         VALGRIND_MAKE_MEM_UNDEFINED(ctx->save.batch_pfns,
                                     MAX_BATCH_SIZE *
                                     sizeof(*ctx->save.batch_pfns));
@@ -299,12 +598,28 @@ static int flush_batch(struct xc_sr_context *ctx)
 }
 
 /*
- * Add a single pfn to the batch, flushing the batch if full.
+ * Add a single pfn to the batch, flushing the batch if full.  With parallel
+ * streams, the stream is chosen by the pfn's batch sized chunk of memory.
  */
 static int add_to_batch(struct xc_sr_context *ctx, xen_pfn_t pfn)
 {
+    struct xc_sr_save_stream *stream;
     int rc = 0;
 
+    if ( ctx->save.nr_streams )
+    {
+        stream = &ctx->save.streams[(pfn / MAX_BATCH_SIZE) %
+                                    ctx->save.nr_streams];
+
+        if ( stream->nr_batch_pfns == MAX_BATCH_SIZE )
+            rc = submit_stream_batch(ctx, stream);
+
+        if ( rc == 0 )
+            stream->batch_pfns[stream->nr_batch_pfns++] = pfn;
+
+        return rc;
+    }
+
     if ( ctx->save.nr_batch_pfns == MAX_BATCH_SIZE )
         rc = flush_batch(ctx);
 
@@ -314,6 +629,97 @@ static int add_to_batch(struct xc_sr_context *ctx, xen_pfn_t pfn)
     return rc;
 }
 
+/*
+ * Order all page data sent so far against the main stream.
+ */
+static int sync_streams(struct xc_sr_context *ctx)
+{
+    int rc;
+
+    if ( !ctx->save.nr_streams )
+        return 0;
+
+    rc = flush_streams(ctx);
+    if ( rc )
+        return rc;
+
+    return write_stream_sync_records(ctx);
+}
+
+static int setup_streams(struct xc_sr_context *ctx)
+{
+    xc_interface *xch = ctx->xch;
+    struct xc_sr_save_stream *stream;
+    unsigned i;
+
+    ctx->save.streams = calloc(ctx->save.nr_streams,
+                               sizeof(*ctx->save.streams));
+    if ( !ctx->save.streams )
+    {
+        ERROR("Unable to allocate memory for %u page data streams",
+              ctx->save.nr_streams);
+        return -1;
+    }
+
+    for ( i = 0; i < ctx->save.nr_streams; ++i )
+    {
+        stream = &ctx->save.streams[i];
+        stream->ctx = ctx;
+        stream->fd = ctx->save.stream_fds[i];
+        pthread_cond_init(&stream->cond, NULL);
+
+        stream->batch_pfns = malloc(MAX_BATCH_SIZE *
+                                    sizeof(*stream->batch_pfns));
+        stream->work_pfns = malloc(MAX_BATCH_SIZE *
+                                   sizeof(*stream->work_pfns));
+        if ( !stream->batch_pfns || !stream->work_pfns )
+        {
+            ERROR("Unable to allocate memory for page data stream batches");
+            return -1;
+        }
+
+        if ( pthread_create(&stream->thread, NULL, save_stream_thread,
+                            stream) )
+        {
+            PERROR("Unable to create thread for page data stream %u", i);
+            return -1;
+        }
+        stream->thread_started = true;
+    }
+
+    return 0;
+}
+
+static void cleanup_streams(struct xc_sr_context *ctx)
+{
+    struct xc_sr_save_stream *stream;
+    unsigned i;
+
+    if ( !ctx->save.streams )
+        return;
+
+    pthread_mutex_lock(&ctx->save.streams_lock);
+    for ( i = 0; i < ctx->save.nr_streams; ++i )
+    {
+        ctx->save.streams[i].stop = true;
+        pthread_cond_broadcast(&ctx->save.streams[i].cond);
+    }
+    pthread_mutex_unlock(&ctx->save.streams_lock);
+
+    for ( i = 0; i < ctx->save.nr_streams; ++i )
+    {
+        stream = &ctx->save.streams[i];
+        if ( stream->thread_started )
+            pthread_join(stream->thread, NULL);
+        pthread_cond_destroy(&stream->cond);
+        free(stream->batch_pfns);
+        free(stream->work_pfns);
+    }
+
+    free(ctx->save.streams);
+    ctx->save.streams = NULL;
+}
+
 /*
  * Pause/suspend the domain, and refresh ctx->dominfo if required.
  */
@@ -466,6 +872,157 @@ static int update_progress_string(struct xc_sr_context *ctx,
     return 0;
 }
 
+/*
+ * Report the cumulative effect of page compression so far.
+ */
+static void report_compression(struct xc_sr_context *ctx)
+{
+    xc_interface *xch = ctx->xch;
+    char *str = NULL;
+    uint64_t pages, zero_pages, in_bytes, out_bytes, ns;
+
+    if ( !ctx->save.compress )
+        return;
+
+    pthread_mutex_lock(&ctx->save.streams_lock);
+    pages = ctx->save.compress_stats.pages;
+    zero_pages = ctx->save.compress_stats.zero_pages;
+    in_bytes = ctx->save.compress_stats.in_bytes;
+    out_bytes = ctx->save.compress_stats.out_bytes;
+    ns = ctx->save.compress_stats.ns;
+    pthread_mutex_unlock(&ctx->save.streams_lock);
+
+    if ( !pages )
+        return;
+
+    if ( asprintf(&str, "Compressed %"PRIu64" pages (%"PRIu64" zero), "
+                  "%"PRIu64"k to %"PRIu64"k (%"PRIu64"%%) in %"PRIu64"ms",
+                  pages, zero_pages, in_bytes >> 10, out_bytes >> 10,
+                  out_bytes * 100 / in_bytes, ns / 1000000) == -1 )
+        return;
+
+    xc_report_progress_single(xch, str);
+    free(str);
+}
+
+/*
+ * Nanoseconds since *ts, which is updated to the current time.
+ */
+static uint64_t elapsed_ns(struct timespec *ts)
+{
+    struct timespec now;
+    uint64_t ns;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    ns = (now.tv_sec - ts->tv_sec) * 1000000000ULL +
+        now.tv_nsec - ts->tv_nsec;
+    *ts = now;
+
+    return ns;
+}
+
+/*
+ * Cap the guest's vcpus to slow down its dirtying of memory, halving the cap
+ * each time.  Returns 0 if the guest got throttled further, -1 if not.
+ */
+static int throttle_domain(struct xc_sr_context *ctx)
+{
+    xc_interface *xch = ctx->xch;
+    struct xen_domctl_sched_credit sdom;
+    unsigned nr_vcpus = ctx->dominfo.max_vcpu_id + 1;
+
+    if ( !ctx->save.throttled )
+    {
+        /* Fails for schedulers other than credit. */
+        if ( xc_sched_credit_domain_get(xch, ctx->domid,
+                                        &ctx->save.sched_credit) )
+        {
+            PERROR("Unable to get scheduler parameters to throttle domain");
+            ctx->save.auto_throttle = false;
+            return -1;
+        }
+
+        ctx->save.throttle_cap = ctx->save.sched_credit.cap ?: nr_vcpus * 100;
+    }
+
+    if ( ctx->save.throttle_cap / 2 < nr_vcpus * THROTTLE_MIN_CAP )
+        return -1;
+
+    sdom = ctx->save.sched_credit;
+    sdom.cap = ctx->save.throttle_cap / 2;
+    if ( xc_sched_credit_domain_set(xch, ctx->domid, &sdom) )
+    {
+        PERROR("Unable to throttle domain to a cap of %u%%", sdom.cap);
+        ctx->save.auto_throttle = false;
+        return -1;
+    }
+
+    ctx->save.throttled = true;
+    ctx->save.throttle_cap = sdom.cap;
+    IPRINTF("Throttled domain to a cap of %u%%", sdom.cap);
+
+    return 0;
+}
+
+/*
+ * Restore the scheduler parameters changed by throttle_domain().
+ */
+static void unthrottle_domain(struct xc_sr_context *ctx)
+{
+    xc_interface *xch = ctx->xch;
+
+    if ( !ctx->save.throttled )
+        return;
+
+    if ( xc_sched_credit_domain_set(xch, ctx->domid, &ctx->save.sched_credit) )
+        PERROR("Failed to restore scheduler parameters of throttled domain");
+
+    ctx->save.throttled = false;
+}
+
+/*
+ * Decide whether to stop iterating, given the pages found dirty after
+ * dirty_ns and the rate the previous sent pages went out at.  Stop when the
+ * remaining pages can be sent within max_downtime_ms, or when another
+ * iteration is not expected to shrink them by much and the guest can't be
+ * throttled (any further).
+ */
+static bool memory_converged(struct xc_sr_context *ctx, unsigned iter,
+                             unsigned long dirty, uint64_t dirty_ns,
+                             unsigned long sent, uint64_t send_ns)
+{
+    xc_interface *xch = ctx->xch;
+    uint64_t bandwidth, dirty_rate, downtime_ms, next_dirty;
+
+    /* Both in pages per second. */
+    bandwidth = sent * 1000000000ULL / (send_ns ?: 1);
+    dirty_rate = dirty * 1000000000ULL / (dirty_ns ?: 1);
+
+    if ( !bandwidth )
+        return false;
+
+    downtime_ms = dirty * 1000ULL / bandwidth;
+    /* Pages expected to get dirty again while sending the current ones. */
+    next_dirty = dirty_rate * dirty / bandwidth;
+
+    IPRINTF("Iteration %u: %lu pages dirty at %"PRIu64" pages/s, sending at "
+            "%"PRIu64" pages/s, expected downtime %"PRIu64"ms",
+            iter, dirty, dirty_rate, bandwidth, downtime_ms);
+
+    if ( downtime_ms <= ctx->save.max_downtime_ms )
+        return true;
+
+    if ( next_dirty * 8 < dirty * 7 )
+        return false;
+
+    if ( ctx->save.auto_throttle && !throttle_domain(ctx) )
+        return false;
+
+    IPRINTF("Dirty memory not converging, expected downtime %"PRIu64"ms",
+            downtime_ms);
+    return true;
+}
+
 /*
  * Send memory while guest is running.
  */
@@ -474,17 +1031,30 @@ static int send_memory_live(struct xc_sr_context *ctx)
     xc_interface *xch = ctx->xch;
     xc_shadow_op_stats_t stats = { 0, ctx->save.p2m_size };
     char *progress_str = NULL;
+    struct timespec dirty_ts, send_ts;
+    uint64_t dirty_ns, send_ns;
+    unsigned long sent;
     unsigned x;
     int rc;
+    DECLARE_HYPERCALL_BUFFER_SHADOW(unsigned long, dirty_bitmap,
+                                    &ctx->save.dirty_bitmap_hbuf);
 
     rc = update_progress_string(ctx, &progress_str, 0);
     if ( rc )
         goto out;
 
+    clock_gettime(CLOCK_MONOTONIC, &dirty_ts);
+    send_ts = dirty_ts;
+
     rc = send_all_pages(ctx);
     if ( rc )
         goto out;
 
+    send_ns = elapsed_ns(&send_ts);
+    sent = ctx->save.p2m_size;
+
+    report_compression(ctx);
+
     for ( x = 1;
           ((x < ctx->save.max_iterations) &&
            (stats.dirty_count > ctx->save.dirty_threshold)); ++x )
@@ -499,16 +1069,36 @@ static int send_memory_live(struct xc_sr_context *ctx)
             goto out;
         }
 
+        dirty_ns = elapsed_ns(&dirty_ts);
+
         if ( stats.dirty_count == 0 )
             break;
 
+        if ( ctx->save.max_downtime_ms &&
+             memory_converged(ctx, x, stats.dirty_count, dirty_ns,
+                              sent, send_ns) )
+        {
+            /* Leave the pages just found dirty to the final iteration. */
+            bitmap_or(ctx->save.deferred_pages, dirty_bitmap,
+                      ctx->save.p2m_size);
+            ctx->save.nr_deferred_pages += stats.dirty_count;
+            break;
+        }
+
         rc = update_progress_string(ctx, &progress_str, x);
         if ( rc )
             goto out;
 
+        send_ts = dirty_ts;
+
         rc = send_dirty_pages(ctx, stats.dirty_count);
         if ( rc )
             goto out;
+
+        send_ns = elapsed_ns(&send_ts);
+        sent = stats.dirty_count;
+
+        report_compression(ctx);
     }
 
  out:
@@ -633,6 +1223,285 @@ static int suspend_and_send_dirty(struct xc_sr_context *ctx)
     return rc;
 }
 
+/*
+ * Writes a POSTCOPY_PFNS record for a batch of pfns, whose gfns are passed in
+ * types, and marks those which have data as outstanding.
+ */
+static int write_postcopy_pfns_record(struct xc_sr_context *ctx,
+                                      struct xc_sr_rec_postcopy_pfns *hdr,
+                                      xen_pfn_t *types, unsigned nr_pfns)
+{
+    xc_interface *xch = ctx->xch;
+    struct xc_sr_record rec =
+    {
+        .type = REC_TYPE_POSTCOPY_PFNS,
+        .length = sizeof(*hdr) + nr_pfns * sizeof(*hdr->pfn),
+        .data = hdr,
+    };
+    unsigned i;
+
+    /* The guest is suspended, so the types won't change any more. */
+    if ( xc_get_pfn_type_batch(xch, ctx->domid, nr_pfns, types) )
+    {
+        PERROR("Failed to get types for post-copy pfns");
+        return -1;
+    }
+
+    for ( i = 0; i < nr_pfns; ++i )
+    {
+        if ( types[i] < XEN_DOMCTL_PFINFO_BROKEN )
+        {
+            set_bit(hdr->pfn[i], ctx->save.postcopy_pfns);
+            ++ctx->save.nr_postcopy_pfns;
+        }
+
+        hdr->pfn[i] |= (uint64_t)types[i] << 32;
+    }
+
+    hdr->count = nr_pfns;
+    hdr->_res1 = 0;
+
+    return write_record(ctx, &rec);
+}
+
+/*
+ * Writes POSTCOPY_PFNS records for the pages in the dirty bitmap.
+ */
+static int write_postcopy_pfns(struct xc_sr_context *ctx)
+{
+    xc_interface *xch = ctx->xch;
+    struct xc_sr_rec_postcopy_pfns *hdr;
+    xen_pfn_t *types, p;
+    unsigned nr_pfns = 0;
+    int rc = -1;
+    DECLARE_HYPERCALL_BUFFER_SHADOW(unsigned long, dirty_bitmap,
+                                    &ctx->save.dirty_bitmap_hbuf);
+
+    hdr = malloc(sizeof(*hdr) + MAX_BATCH_SIZE * sizeof(*hdr->pfn));
+    types = malloc(MAX_BATCH_SIZE * sizeof(*types));
+    if ( !hdr || !types )
+    {
+        ERROR("Unable to allocate memory for post-copy pfn list");
+        goto err;
+    }
+
+    for ( p = 0; p < ctx->save.p2m_size; ++p )
+    {
+        if ( !test_bit(p, dirty_bitmap) )
+            continue;
+
+        types[nr_pfns] = ctx->save.ops.pfn_to_gfn(ctx, p);
+        hdr->pfn[nr_pfns++] = p;
+
+        if ( nr_pfns == MAX_BATCH_SIZE )
+        {
+            if ( write_postcopy_pfns_record(ctx, hdr, types, nr_pfns) )
+                goto err;
+            nr_pfns = 0;
+        }
+    }
+
+    if ( nr_pfns && write_postcopy_pfns_record(ctx, hdr, types, nr_pfns) )
+        goto err;
+
+    rc = 0;
+
+ err:
+    free(types);
+    free(hdr);
+
+    return rc;
+}
+
+/*
+ * Suspend the domain and list the pages dirtied since the pre-copy pass, to
+ * be sent after the switch over.  This is the last iteration of a post-copy
+ * migration.
+ */
+static int suspend_and_list_dirty(struct xc_sr_context *ctx)
+{
+    xc_interface *xch = ctx->xch;
+    xc_shadow_op_stats_t stats = { 0, ctx->save.p2m_size };
+    int rc;
+    DECLARE_HYPERCALL_BUFFER_SHADOW(unsigned long, dirty_bitmap,
+                                    &ctx->save.dirty_bitmap_hbuf);
+
+    rc = suspend_domain(ctx);
+    if ( rc )
+        return rc;
+
+    if ( xc_shadow_control(
+             xch, ctx->domid, XEN_DOMCTL_SHADOW_OP_CLEAN,
+             HYPERCALL_BUFFER(dirty_bitmap), ctx->save.p2m_size,
+             NULL, XEN_DOMCTL_SHADOW_LOGDIRTY_FINAL, &stats) !=
+         ctx->save.p2m_size )
+    {
+        PERROR("Failed to retrieve logdirty bitmap");
+        return -1;
+    }
+
+    bitmap_or(dirty_bitmap, ctx->save.deferred_pages, ctx->save.p2m_size);
+
+    /* The pre-copy pages must be in place before pages are paged out. */
+    rc = sync_streams(ctx);
+    if ( rc )
+        return rc;
+
+    rc = write_postcopy_pfns(ctx);
+    if ( rc )
+        return rc;
+
+    bitmap_clear(ctx->save.deferred_pages, ctx->save.p2m_size);
+    ctx->save.nr_deferred_pages = 0;
+
+    IPRINTF("%lu pages left for post-copy", ctx->save.nr_postcopy_pfns);
+
+    return 0;
+}
+
+/*
+ * Add an outstanding post-copy page to the batch.
+ */
+static int postcopy_add_to_batch(struct xc_sr_context *ctx, xen_pfn_t pfn)
+{
+    int rc = 0;
+
+    if ( pfn >= ctx->save.p2m_size ||
+         !test_and_clear_bit(pfn, ctx->save.postcopy_pfns) )
+        return 0;
+
+    --ctx->save.nr_postcopy_pfns;
+
+    if ( ctx->save.nr_batch_pfns == MAX_BATCH_SIZE )
+    {
+        rc = write_batch(ctx, ctx->fd, ctx->save.batch_pfns,
+                         ctx->save.nr_batch_pfns);
+        ctx->save.nr_batch_pfns = 0;
+    }
+
+    if ( rc == 0 )
+        ctx->save.batch_pfns[ctx->save.nr_batch_pfns++] = pfn;
+
+    return rc;
+}
+
+/*
+ * Send the outstanding pages of a POSTCOPY_PAGE_REQUEST record from the
+ * restorer.  Pages which have been sent already are ignored, as the request
+ * may have crossed them on the wire.
+ */
+static int handle_postcopy_request(struct xc_sr_context *ctx)
+{
+    xc_interface *xch = ctx->xch;
+    struct xc_sr_record rec;
+    struct xc_sr_rec_postcopy_page_request *req;
+    unsigned i;
+    int rc;
+
+    rc = read_record(ctx, ctx->save.recv_fd, &rec);
+    if ( rc )
+        return rc;
+
+    rc = -1;
+    req = rec.data;
+
+    if ( rec.type != REC_TYPE_POSTCOPY_PAGE_REQUEST )
+    {
+        ERROR("Expected post-copy page request, but received %#x (%s)",
+              rec.type, rec_type_to_str(rec.type));
+        goto err;
+    }
+
+    if ( rec.length < sizeof(*req) ||
+         rec.length < sizeof(*req) + req->count * sizeof(*req->pfn) )
+    {
+        ERROR("POSTCOPY_PAGE_REQUEST record too short: length %u",
+              rec.length);
+        goto err;
+    }
+
+    for ( i = 0; i < req->count; ++i )
+    {
+        rc = postcopy_add_to_batch(ctx, req->pfn[i]);
+        if ( rc )
+            goto err;
+    }
+
+    rc = 0;
+
+ err:
+    free(rec.data);
+    return rc;
+}
+
+/*
+ * Serve the outstanding pages after POSTCOPY_TRANSITION.  Requested pages
+ * take priority, the others are sent in small batches in between, so that
+ * a request never waits behind much background data.
+ */
+static int send_postcopy_pages(struct xc_sr_context *ctx)
+{
+    xc_interface *xch = ctx->xch;
+    struct pollfd pfd = { .fd = ctx->save.recv_fd, .events = POLLIN };
+    unsigned long total = ctx->save.nr_postcopy_pfns;
+    xen_pfn_t cursor = 0;
+    unsigned n;
+    int rc;
+
+    xc_set_progress_prefix(xch, "Post-copy");
+    ctx->save.postcopy_active = true;
+
+    while ( ctx->save.nr_postcopy_pfns )
+    {
+        rc = poll(&pfd, 1, 0);
+        if ( rc < 0 )
+        {
+            if ( errno == EINTR )
+                continue;
+            PERROR("Failed to poll for post-copy page requests");
+            return -1;
+        }
+
+        if ( rc )
+            rc = handle_postcopy_request(ctx);
+        else
+        {
+            for ( n = 0; ctx->save.nr_postcopy_pfns &&
+                      n < POSTCOPY_BACKGROUND_PAGES; ++cursor )
+            {
+                if ( cursor == ctx->save.p2m_size )
+                    cursor = 0;
+
+                if ( !test_bit(cursor, ctx->save.postcopy_pfns) )
+                    continue;
+
+                rc = postcopy_add_to_batch(ctx, cursor);
+                if ( rc )
+                    return rc;
+                ++n;
+            }
+        }
+        if ( rc )
+            return rc;
+
+        if ( ctx->save.nr_batch_pfns )
+        {
+            rc = write_batch(ctx, ctx->fd, ctx->save.batch_pfns,
+                             ctx->save.nr_batch_pfns);
+            if ( rc )
+                return rc;
+            ctx->save.nr_batch_pfns = 0;
+        }
+
+        xc_report_progress_step(xch, total - ctx->save.nr_postcopy_pfns,
+                                total);
+    }
+
+    xc_set_progress_prefix(xch, NULL);
+
+    return 0;
+}
+
 static int verify_frames(struct xc_sr_context *ctx)
 {
     xc_interface *xch = ctx->xch;
@@ -687,7 +1556,10 @@ static int send_domain_memory_live(struct xc_sr_context *ctx)
     if ( rc )
         goto out;
 
-    rc = suspend_and_send_dirty(ctx);
+    if ( ctx->save.postcopy )
+        rc = suspend_and_list_dirty(ctx);
+    else
+        rc = suspend_and_send_dirty(ctx);
     if ( rc )
         goto out;
 
@@ -740,6 +1612,8 @@ static int setup(struct xc_sr_context *ctx)
     DECLARE_HYPERCALL_BUFFER_SHADOW(unsigned long, dirty_bitmap,
                                     &ctx->save.dirty_bitmap_hbuf);
 
+    pthread_mutex_init(&ctx->save.streams_lock, NULL);
+
     rc = ctx->save.ops.setup(ctx);
     if ( rc )
         goto err;
@@ -749,8 +1623,11 @@ static int setup(struct xc_sr_context *ctx)
     ctx->save.batch_pfns = malloc(MAX_BATCH_SIZE *
                                   sizeof(*ctx->save.batch_pfns));
     ctx->save.deferred_pages = calloc(1, bitmap_size(ctx->save.p2m_size));
+    if ( ctx->save.postcopy )
+        ctx->save.postcopy_pfns = calloc(1, bitmap_size(ctx->save.p2m_size));
 
-    if ( !ctx->save.batch_pfns || !dirty_bitmap || !ctx->save.deferred_pages )
+    if ( !ctx->save.batch_pfns || !dirty_bitmap || !ctx->save.deferred_pages ||
+         (ctx->save.postcopy && !ctx->save.postcopy_pfns) )
     {
         ERROR("Unable to allocate memory for dirty bitmaps, batch pfns and"
               " deferred pages");
@@ -759,6 +1636,13 @@ static int setup(struct xc_sr_context *ctx)
         goto err;
     }
 
+    if ( ctx->save.nr_streams )
+    {
+        rc = setup_streams(ctx);
+        if ( rc )
+            goto err;
+    }
+
     rc = 0;
 
  err:
@@ -772,6 +1656,9 @@ static void cleanup(struct xc_sr_context *ctx)
                                     &ctx->save.dirty_bitmap_hbuf);
 
 
+    cleanup_streams(ctx);
+    unthrottle_domain(ctx);
+
     xc_shadow_control(xch, ctx->domid, XEN_DOMCTL_SHADOW_OP_OFF,
                       NULL, 0, NULL, 0, NULL);
 
@@ -780,8 +1667,10 @@ static void cleanup(struct xc_sr_context *ctx)
 
     xc_hypercall_buffer_free_pages(xch, dirty_bitmap,
                                    NRPAGES(bitmap_size(ctx->save.p2m_size)));
+    free(ctx->save.postcopy_pfns);
     free(ctx->save.deferred_pages);
     free(ctx->save.batch_pfns);
+    pthread_mutex_destroy(&ctx->save.streams_lock);
 }
 
 /*
@@ -818,6 +1707,11 @@ static int save(struct xc_sr_context *ctx, uint16_t guest_type)
         if ( rc )
             goto err;
 
+        /* Page data must not overtake the records sent so far. */
+        rc = sync_streams(ctx);
+        if ( rc )
+            goto err;
+
         if ( ctx->save.live )
             rc = send_domain_memory_live(ctx);
         else if ( ctx->save.checkpointed != XC_MIG_STREAM_NONE )
@@ -828,6 +1722,13 @@ static int save(struct xc_sr_context *ctx, uint16_t guest_type)
         if ( rc )
             goto err;
 
+        /* All page data must be in place before the end of checkpoint. */
+        rc = sync_streams(ctx);
+        if ( rc )
+            goto err;
+
+        report_compression(ctx);
+
         if ( !ctx->dominfo.shutdown ||
              (ctx->dominfo.shutdown_reason != SHUTDOWN_suspend) )
         {
@@ -840,6 +1741,22 @@ static int save(struct xc_sr_context *ctx, uint16_t guest_type)
         if ( rc )
             goto err;
 
+        if ( ctx->save.postcopy )
+        {
+            struct xc_sr_record transition =
+                { REC_TYPE_POSTCOPY_TRANSITION, 0, NULL };
+
+            rc = write_record(ctx, &transition);
+            if ( rc )
+                goto err;
+
+            xc_report_progress_single(xch, "Post-copy");
+
+            rc = send_postcopy_pages(ctx);
+            if ( rc )
+                goto err;
+        }
+
         if ( ctx->save.checkpointed != XC_MIG_STREAM_NONE )
         {
             /*
@@ -895,6 +1812,10 @@ static int save(struct xc_sr_context *ctx, uint16_t guest_type)
     if ( rc )
         goto err;
 
+    rc = write_stream_end_records(ctx);
+    if ( rc )
+        goto err;
+
     xc_report_progress_single(xch, "Complete");
     goto done;
 
@@ -918,7 +1839,9 @@ static int save(struct xc_sr_context *ctx, uint16_t guest_type)
 int xc_domain_save(xc_interface *xch, int io_fd, uint32_t dom,
                    uint32_t max_iters, uint32_t max_factor, uint32_t flags,
                    struct save_callbacks* callbacks, int hvm,
-                   xc_migration_stream_t stream_type, int recv_fd)
+                   xc_migration_stream_t stream_type, int recv_fd,
+                   const int *page_fds, unsigned int nr_page_fds,
+                   uint32_t max_downtime_ms)
 {
     struct xc_sr_context ctx =
         {
@@ -930,8 +1853,14 @@ int xc_domain_save(xc_interface *xch, int io_fd, uint32_t dom,
     ctx.save.callbacks = callbacks;
     ctx.save.live  = !!(flags & XCFLAGS_LIVE);
     ctx.save.debug = !!(flags & XCFLAGS_DEBUG);
+    ctx.save.compress = !!(flags & XCFLAGS_PAGE_COMPRESS);
+    ctx.save.auto_throttle = !!(flags & XCFLAGS_AUTO_THROTTLE);
+    ctx.save.postcopy = !!(flags & XCFLAGS_POSTCOPY);
+    ctx.save.max_downtime_ms = max_downtime_ms;
     ctx.save.checkpointed = stream_type;
     ctx.save.recv_fd = recv_fd;
+    ctx.save.stream_fds = page_fds;
+    ctx.save.nr_streams = nr_page_fds;
 
     /* If altering migration_stream update this assert too. */
     assert(stream_type == XC_MIG_STREAM_NONE ||
@@ -947,6 +1876,17 @@ int xc_domain_save(xc_interface *xch, int io_fd, uint32_t dom,
     ctx.save.max_iterations = 5;
     ctx.save.dirty_threshold = 50;
 
+    /*
+     * With a downtime target, memory_converged() decides when to stop, the
+     * iteration limit is only a backstop.
+     */
+    if ( ctx.save.max_downtime_ms )
+        ctx.save.max_iterations = 30;
+
+    /* Post-copy only sends one pass over memory ahead of the switch over. */
+    if ( ctx.save.postcopy )
+        ctx.save.max_iterations = 1;
+
     /* Sanity checks for callbacks. */
     if ( hvm )
         assert(callbacks->switch_qemu_logdirty);
@@ -955,8 +1895,20 @@ int xc_domain_save(xc_interface *xch, int io_fd, uint32_t dom,
     if ( ctx.save.checkpointed == XC_MIG_STREAM_COLO )
         assert(callbacks->wait_checkpoint);
 
-    DPRINTF("fd %d, dom %u, max_iters %u, max_factor %u, flags %u, hvm %d",
-            io_fd, dom, max_iters, max_factor, flags, hvm);
+    DPRINTF("fd %d, dom %u, max_iters %u, max_factor %u, flags %u, hvm %d"
+            ", page data streams %u", io_fd, dom, max_iters, max_factor,
+            flags, hvm, nr_page_fds);
+
+    /*
+     * Checkpointed streams buffer records on the restore side, which the
+     * page data streams would bypass.
+     */
+    if ( nr_page_fds && stream_type != XC_MIG_STREAM_NONE )
+    {
+        ERROR("Parallel page data streams need a plain migration stream");
+        errno = EINVAL;
+        return -1;
+    }
 
     if ( xc_domain_getinfo(xch, dom, 1, &ctx.dominfo) != 1 )
     {
@@ -972,6 +1924,17 @@ int xc_domain_save(xc_interface *xch, int io_fd, uint32_t dom,
 
     ctx.domid = dom;
 
+    /* Pages are paged in on the far side with mem_paging, HVM only. */
+    if ( ctx.save.postcopy &&
+         (!ctx.save.live || !ctx.dominfo.hvm ||
+          stream_type != XC_MIG_STREAM_NONE || recv_fd < 0) )
+    {
+        ERROR("Post-copy needs a live migration of an HVM domain with a"
+              " plain stream and a back channel");
+        errno = EINVAL;
+        return -1;
+    }
+
     if ( ctx.dominfo.hvm )
     {
         ctx.save.ops = save_ops_x86_hvm;
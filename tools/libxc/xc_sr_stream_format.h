@@ -76,6 +76,11 @@ struct xc_sr_rhdr
 #define REC_TYPE_VERIFY                     0x0000000dU
 #define REC_TYPE_CHECKPOINT                 0x0000000eU
 #define REC_TYPE_CHECKPOINT_DIRTY_PFN_LIST  0x0000000fU
+#define REC_TYPE_STREAM_SYNC                0x00000010U
+#define REC_TYPE_COMPRESSED_PAGE_DATA       0x00000011U
+#define REC_TYPE_POSTCOPY_PFNS              0x00000012U
+#define REC_TYPE_POSTCOPY_TRANSITION        0x00000013U
+#define REC_TYPE_POSTCOPY_PAGE_REQUEST      0x00000014U
 
 #define REC_TYPE_OPTIONAL             0x80000000U
 
@@ -138,6 +143,47 @@ struct xc_sr_rec_hvm_params
     struct xc_sr_rec_hvm_params_entry param[0];
 };
 
+/* STREAM_SYNC */
+struct xc_sr_rec_stream_sync
+{
+    uint32_t seq;
+    uint32_t nr_streams;
+};
+
+/*
+ * COMPRESSED_PAGE_DATA
+ *
+ * The pfn list is followed by:
+ * - uint64_t zero_bitmap[(count + 63) / 64], a bit set for each data
+ *   carrying pfn whose page is all zeroes and therefore has no data.
+ * - uint32_t length[], one per data carrying pfn not in zero_bitmap,
+ *   padded to an 8 octet boundary.  A length of PAGE_SIZE means the page
+ *   is stored uncompressed, anything shorter is an LZ4 block.
+ * - The page data, each page's bytes directly following the previous.
+ */
+struct xc_sr_rec_compressed_page_data_header
+{
+    uint32_t count;
+    uint32_t _res1;
+    uint64_t pfn[0];
+};
+
+/* POSTCOPY_PFNS, pfns encoded as for PAGE_DATA */
+struct xc_sr_rec_postcopy_pfns
+{
+    uint32_t count;
+    uint32_t _res1;
+    uint64_t pfn[0];
+};
+
+/* POSTCOPY_PAGE_REQUEST */
+struct xc_sr_rec_postcopy_page_request
+{
+    uint32_t count;
+    uint32_t _res1;
+    uint64_t pfn[0];
+};
+
 #endif
 /*
  * Local variables:
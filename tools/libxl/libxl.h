@@ -962,6 +962,24 @@ void libxl_mac_copy(libxl_ctx *ctx, libxl_mac *dst, const libxl_mac *src);
  */
 #define LIBXL_HAVE_CHECKPOINTED_STREAM 1
 
+/*
+ * LIBXL_HAVE_SUSPEND_COMPRESS
+ *
+ * If this is defined, libxl_domain_suspend accepts LIBXL_SUSPEND_COMPRESS
+ * to elide zero pages and compress the others in the migration stream.
+ * The receiving side must support this too.
+ */
+#define LIBXL_HAVE_SUSPEND_COMPRESS 1
+
+/*
+ * LIBXL_HAVE_DOMAIN_SUSPEND_PARAMS
+ *
+ * If this is defined, libxl_domain_suspend takes a
+ * libxl_domain_suspend_params, giving a target maximum downtime for live
+ * migration and whether to throttle a guest whose memory isn't converging.
+ */
+#define LIBXL_HAVE_DOMAIN_SUSPEND_PARAMS 1
+
 /*
  * LIBXL_HAVE_BUILDINFO_HVM_SYSTEM_FIRMWARE
  *
@@ -1019,6 +1037,15 @@ void libxl_mac_copy(libxl_ctx *ctx, libxl_mac *dst, const libxl_mac *src);
  */
 #define LIBXL_HAVE_QED 1
 
+/*
+ * LIBXL_HAVE_SCHED_HIST
+ *
+ * If this is defined, libxl_domain_get_sched_hist() and the
+ * libxl_sched_hist type are available, to retrieve the run delay and
+ * slice length histograms of the vcpus of a domain.
+ */
+#define LIBXL_HAVE_SCHED_HIST 1
+
 typedef char **libxl_string_list;
 void libxl_string_list_dispose(libxl_string_list *sl);
 int libxl_string_list_length(const libxl_string_list *sl);
@@ -1362,12 +1389,30 @@ int libxl_retrieve_domain_configuration(libxl_ctx *ctx, uint32_t domid,
                                         libxl_domain_config *d_config)
                                         LIBXL_EXTERNAL_CALLERS_ONLY;
 
+/* params may be NULL, for the defaults. */
 int libxl_domain_suspend(libxl_ctx *ctx, uint32_t domid, int fd,
                          int flags, /* LIBXL_SUSPEND_* */
+                         const libxl_domain_suspend_params *params,
                          const libxl_asyncop_how *ao_how)
                          LIBXL_EXTERNAL_CALLERS_ONLY;
 #define LIBXL_SUSPEND_DEBUG 1
 #define LIBXL_SUSPEND_LIVE 2
+#define LIBXL_SUSPEND_COMPRESS 4
+
+#if defined(LIBXL_API_VERSION) && LIBXL_API_VERSION < 0x040800
+
+static inline int libxl_domain_suspend_0x040700(libxl_ctx *ctx,
+                                                uint32_t domid, int fd,
+                                                int flags,
+                                                const libxl_asyncop_how *ao_how)
+    LIBXL_EXTERNAL_CALLERS_ONLY
+{
+    return libxl_domain_suspend(ctx, domid, fd, flags, NULL, ao_how);
+}
+
+#define libxl_domain_suspend libxl_domain_suspend_0x040700
+
+#endif
 
 /* @param suspend_cancel [from xenctrl.h:xc_domain_resume( @param fast )]
  *   If this parameter is true, use co-operative resume. The guest
@@ -1995,6 +2040,14 @@ int libxl_set_vcpuaffinity_all(libxl_ctx *ctx, uint32_t domid,
 
 int libxl_domain_set_nodeaffinity(libxl_ctx *ctx, uint32_t domid,
                                   libxl_bitmap *nodemap);
+/*
+ * Run delay and slice length histograms of vcpu vcpuid of domid, or of
+ * all its vcpus together if vcpuid is LIBXL_SCHED_HIST_ALL_VCPUS.
+ */
+#define LIBXL_SCHED_HIST_ALL_VCPUS (-1)
+int libxl_domain_get_sched_hist(libxl_ctx *ctx, uint32_t domid, int vcpuid,
+                                libxl_sched_hist *run_delay,
+                                libxl_sched_hist *slice);
 int libxl_domain_get_nodeaffinity(libxl_ctx *ctx, uint32_t domid,
                                   libxl_bitmap *nodemap);
 int libxl_set_vcpuonline(libxl_ctx *ctx, uint32_t domid, libxl_bitmap *cpumap);
@@ -3291,6 +3291,9 @@ struct libxl__domain_save_state {
     libxl_domain_type type;
     int live;
     int debug;
+    int compress;
+    uint32_t max_downtime_ms;
+    bool auto_throttle;
     int checkpointed_stream;
     const libxl_domain_remus_info *remus;
     /* private */
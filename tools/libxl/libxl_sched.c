@@ -156,6 +156,46 @@ int libxl_domain_get_nodeaffinity(libxl_ctx *ctx, uint32_t domid,
     return 0;
 }
 
+static void sched_hist_from_xc(libxl_sched_hist *hist,
+                               const xc_sched_hist_t *xchist)
+{
+    int i;
+
+    hist->num_buckets = XEN_SCHED_HIST_BUCKETS;
+    hist->buckets = libxl__calloc(NOGC, hist->num_buckets,
+                                  sizeof(*hist->buckets));
+    for (i = 0; i < hist->num_buckets; i++)
+        hist->buckets[i] = xchist->count[i];
+    hist->bucket_shift = XEN_SCHED_HIST_SHIFT;
+    hist->total = xchist->total;
+}
+
+int libxl_domain_get_sched_hist(libxl_ctx *ctx, uint32_t domid, int vcpuid,
+                                libxl_sched_hist *run_delay,
+                                libxl_sched_hist *slice)
+{
+    GC_INIT(ctx);
+    xc_sched_hist_t xc_run_delay, xc_slice;
+    uint32_t vcpu = vcpuid == LIBXL_SCHED_HIST_ALL_VCPUS ?
+                    XEN_DOMCTL_SCHED_HIST_ALL : vcpuid;
+    int rc;
+
+    if (xc_domain_get_sched_hist(ctx->xch, domid, vcpu,
+                                 &xc_run_delay, &xc_slice)) {
+        LOGED(ERROR, domid, "Getting scheduling histograms");
+        rc = ERROR_FAIL;
+        goto out;
+    }
+
+    sched_hist_from_xc(run_delay, &xc_run_delay);
+    sched_hist_from_xc(slice, &xc_slice);
+    rc = 0;
+
+ out:
+    GC_FREE;
+    return rc;
+}
+
 int libxl_get_scheduler(libxl_ctx *ctx)
 {
     int r, sched;
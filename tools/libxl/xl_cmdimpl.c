@@ -4528,7 +4528,7 @@ static int save_domain(uint32_t domid, const char *filename, int checkpoint,
 
     save_domain_core_writeconfig(fd, filename, config_data, config_len);
 
-    int rc = libxl_domain_suspend(ctx, domid, fd, 0, NULL);
+    int rc = libxl_domain_suspend(ctx, domid, fd, 0, NULL, NULL);
     close(fd);
 
     if (rc < 0) {
@@ -4690,7 +4690,8 @@ static void migrate_do_preamble(int send_fd, int recv_fd, pid_t child,
 
 }
 
-static void migrate_domain(uint32_t domid, const char *rune, int debug,
+static void migrate_domain(uint32_t domid, const char *rune, int flags,
+                           const libxl_domain_suspend_params *params,
                            const char *override_config_file)
 {
     pid_t child = -1;
@@ -4699,7 +4700,7 @@ static void migrate_domain(uint32_t domid, const char *rune, int debug,
     char *away_domname;
     char rc_buf;
     uint8_t *config_data;
-    int config_len, flags = LIBXL_SUSPEND_LIVE;
+    int config_len;
 
     save_domain_core_begin(domid, override_config_file,
                            &config_data, &config_len);
@@ -4717,9 +4718,8 @@ static void migrate_domain(uint32_t domid, const char *rune, int debug,
 
     xtl_stdiostream_adjust_flags(logger, XTL_STDIOSTREAM_HIDE_PROGRESS, 0);
 
-    if (debug)
-        flags |= LIBXL_SUSPEND_DEBUG;
-    rc = libxl_domain_suspend(ctx, domid, send_fd, flags, NULL);
+    rc = libxl_domain_suspend(ctx, domid, send_fd, flags | LIBXL_SUSPEND_LIVE,
+                              params, NULL);
     if (rc) {
         fprintf(stderr, "migration sender: libxl_domain_suspend failed"
                 " (rc=%d)\n", rc);
@@ -5144,12 +5144,19 @@ int main_migrate(int argc, char **argv)
     char *rune = NULL;
     char *host;
     int opt, daemonize = 1, monitor = 1, debug = 0, pause_after_migration = 0;
+    int flags = 0;
+    libxl_domain_suspend_params params;
     static struct option opts[] = {
         {"debug", 0, 0, 0x100},
         {"live", 0, 0, 0x200},
+        {"compress", 0, 0, 0x300},
+        {"max-downtime", 1, 0, 0x400},
+        {"auto-throttle", 0, 0, 0x500},
         COMMON_LONG_OPTS
     };
 
+    libxl_domain_suspend_params_init(&params);
+
     SWITCH_FOREACH_OPT(opt, "FC:s:ep", opts, "migrate", 2) {
     case 'C':
         config_filename = optarg;
@@ -5169,10 +5176,20 @@ int main_migrate(int argc, char **argv)
         break;
     case 0x100: /* --debug */
         debug = 1;
+        flags |= LIBXL_SUSPEND_DEBUG;
         break;
     case 0x200: /* --live */
         /* ignored for compatibility with xm */
         break;
+    case 0x300: /* --compress */
+        flags |= LIBXL_SUSPEND_COMPRESS;
+        break;
+    case 0x400: /* --max-downtime */
+        params.max_downtime_ms = parse_ulong(optarg);
+        break;
+    case 0x500: /* --auto-throttle */
+        params.auto_throttle = true;
+        break;
     }
 
     domid = find_domain(argv[optind]);
@@ -5203,7 +5220,8 @@ int main_migrate(int argc, char **argv)
                   pause_after_migration ? " -p" : "");
     }
 
-    migrate_domain(domid, rune, debug, config_filename);
+    migrate_domain(domid, rune, flags, &params, config_filename);
+    libxl_domain_suspend_params_dispose(&params);
     return EXIT_SUCCESS;
 }
 #endif
@@ -5775,6 +5793,125 @@ int main_vcpulist(int argc, char **argv)
     return EXIT_SUCCESS;
 }
 
+static void print_sched_hist_bound(uint64_t ns)
+{
+    if (ns >= 1000000)
+        printf("%7.1fms", ns / 1e6);
+    else if (ns >= 1000)
+        printf("%7.1fus", ns / 1e3);
+    else
+        printf("%7"PRIu64"ns", ns);
+}
+
+static void print_sched_hist(const char *name, uint32_t domid, int vcpuid)
+{
+    libxl_sched_hist run_delay, slice;
+    uint64_t nr_delay = 0, nr_slice = 0;
+    int i, first = -1, last = -1;
+
+    libxl_sched_hist_init(&run_delay);
+    libxl_sched_hist_init(&slice);
+
+    if (libxl_domain_get_sched_hist(ctx, domid, vcpuid, &run_delay, &slice)) {
+        fprintf(stderr, "libxl_domain_get_sched_hist failed.\n");
+        goto out;
+    }
+
+    /* Only print the range of buckets that actually have events. */
+    for (i = 0; i < run_delay.num_buckets; i++) {
+        nr_delay += run_delay.buckets[i];
+        nr_slice += slice.buckets[i];
+        if (run_delay.buckets[i] || slice.buckets[i]) {
+            if (first < 0)
+                first = i;
+            last = i;
+        }
+    }
+
+    if (vcpuid == LIBXL_SCHED_HIST_ALL_VCPUS)
+        printf("%s (%u), all vcpus:\n", name, domid);
+    else
+        printf("%s (%u), vcpu %d:\n", name, domid, vcpuid);
+    printf("  %-11s %14s %14s\n", "Length", "Run delay", "Slice");
+
+    for (i = first; first >= 0 && i <= last; i++) {
+        if (i == run_delay.num_buckets - 1) {
+            printf("  >=");
+            print_sched_hist_bound(1ULL << (i - 1 + run_delay.bucket_shift));
+        } else {
+            printf("  < ");
+            print_sched_hist_bound(1ULL << (i + run_delay.bucket_shift));
+        }
+        printf(" %14"PRIu64" %14"PRIu64"\n",
+               run_delay.buckets[i], slice.buckets[i]);
+    }
+
+    printf("  %-11s %12.1fus %12.1fus\n", "Average",
+           nr_delay ? run_delay.total / 1e3 / nr_delay : 0.0,
+           nr_slice ? slice.total / 1e3 / nr_slice : 0.0);
+
+ out:
+    libxl_sched_hist_dispose(&run_delay);
+    libxl_sched_hist_dispose(&slice);
+}
+
+static void print_domain_sched_hist(uint32_t domid, bool per_vcpu)
+{
+    libxl_dominfo info;
+    char *domname;
+    int i;
+
+    libxl_dominfo_init(&info);
+    if (libxl_domain_info(ctx, &info, domid)) {
+        fprintf(stderr, "libxl_domain_info failed.\n");
+        goto out;
+    }
+
+    domname = libxl_domid_to_name(ctx, domid);
+    print_sched_hist(domname, domid, LIBXL_SCHED_HIST_ALL_VCPUS);
+    if (per_vcpu)
+        for (i = 0; i <= info.vcpu_max_id; i++)
+            print_sched_hist(domname, domid, i);
+    free(domname);
+
+ out:
+    libxl_dominfo_dispose(&info);
+}
+
+int main_sched_hist(int argc, char **argv)
+{
+    libxl_dominfo *dominfo;
+    bool per_vcpu = false;
+    int opt, i, nb_domain;
+    static struct option opts[] = {
+        {"vcpus", 0, 0, 'v'},
+        COMMON_LONG_OPTS
+    };
+
+    SWITCH_FOREACH_OPT(opt, "v", opts, "sched-hist", 0) {
+    case 'v':
+        per_vcpu = true;
+        break;
+    }
+
+    if (optind >= argc) {
+        if (!(dominfo = libxl_list_domain(ctx, &nb_domain))) {
+            fprintf(stderr, "libxl_list_domain failed.\n");
+            return EXIT_FAILURE;
+        }
+
+        for (i = 0; i < nb_domain; i++)
+            print_domain_sched_hist(dominfo[i].domid, per_vcpu);
+
+        libxl_dominfo_list_free(dominfo, nb_domain);
+    } else {
+        for (; optind < argc; optind++)
+            print_domain_sched_hist(find_domain(argv[optind]), per_vcpu);
+    }
+
+    return EXIT_SUCCESS;
+}
+
 int main_vcpupin(int argc, char **argv)
 {
     static struct option opts[] = {
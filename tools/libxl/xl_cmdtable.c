@@ -165,6 +165,12 @@ struct cmd_spec cmd_table[] = {
       "-e              Do not wait in the background (on <host>) for the death\n"
       "                of the domain.\n"
       "--debug         Print huge (!) amount of debug during the migration process.\n"
+      "--compress      Compress memory sent to <host>, which must support it.\n"
+      "--max-downtime <ms>\n"
+      "                Stop sending memory while the domain runs when the rest\n"
+      "                can be sent in <ms>, or when that stops making progress.\n"
+      "--auto-throttle With --max-downtime, cap the domain's vcpus rather than\n"
+      "                give up if its memory isn't converging.\n"
       "-p              Do not unpause domain after migrating it."
     },
     { "restore",
@@ -279,6 +285,12 @@ struct cmd_spec cmd_table[] = {
       "-p PERIOD, --period=PERIOD     Period (us)\n"
       "-b BUDGET, --budget=BUDGET     Budget (us)\n"
     },
+    { "sched-hist",
+      &main_sched_hist, 0, 0,
+      "Show run delay and slice length histograms",
+      "[-v] [Domain, ...]",
+      "-v, --vcpus        Also show the histograms of each vcpu"
+    },
     { "domid",
       &main_domid, 0, 0,
       "Convert a domain name to domain id",
@@ -22,6 +22,7 @@
 
 #include "bidir-hash.h"
 #include "memshr-priv.h"
+#include "shm.h"
 
 static struct blockshr_hash *blks_hash;
 
@@ -38,6 +39,14 @@ void* bidir_daemon(void *unused)
 {
     uint32_t nr_ent, max_nr_ent, tab_size, max_load, min_load;
 
+    /* Every process sharing blocks runs this thread, but only one prunes
+     * at a time. The others wait here to take over when it exits. */
+    if(shm_prune_lock() < 0)
+    {
+        DPRINTF("Failed to take the prune lock.\n");
+        return NULL;
+    }
+
     while(1)
     {
         blockshr_hash_sizes( blks_hash, 
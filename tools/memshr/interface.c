@@ -82,34 +82,47 @@ void memshr_daemon_initialize(void)
 void memshr_vbd_initialize(void)
 {
     xc_interface *xc_handle;
+    int lock;
 
-    memset(&memshr, 0, sizeof(private_memshr_info_t));
+    /* Sharing is only wanted once we know the domain, and only needs to be
+     * set up once per process */
+    if(vbd_info.domid == DOMID_INVALID || vbd_info.enabled)
+        return;
 
-    if((SHARED_INFO = shm_shared_info_open(0)) == NULL)
+    if((lock = shm_init_lock()) < 0)
     {
-        DPRINTF("Failed to open shared info.\n");
+        DPRINTF("Failed to take the init lock.\n");
         return;
     }
 
-    if(!SHARED_INFO->fgprtshr_hash_inited)
+    memset(&memshr, 0, sizeof(private_memshr_info_t));
+
+    /* The first process to get here sets up the shared areas, the
+     * others attach to them */
+    if((SHARED_INFO = shm_shared_info_open(0)) == NULL ||
+       !SHARED_INFO->blockshr_hash_inited)
     {
-        DPRINTF("fgprtshr hash not inited.\n");
-        return;
+        memshr_daemon_initialize();
+        goto out;
     }
 
     if((memshr.fgprts = shm_fgprtshr_hash_open(0)) == NULL)
     {
         DPRINTF("Failed to open fgprtshr_hash.\n");
-        return;
+        goto out;
     }
 
     if((memshr.blks = shm_blockshr_hash_open(0)) == NULL)
     {
         DPRINTF("Failed to open blockshr_hash.\n");
-        return;
+        goto out;
     }
 
-    if(vbd_info.domid == DOMID_INVALID)
+    bidir_daemon_initialize(memshr.blks);
+
+out:
+    shm_init_unlock(lock);
+    if(memshr.blks == NULL)
         return;
 
     if((xc_handle = xc_interface_open(0,0,0)) == 0)
@@ -126,6 +139,9 @@ uint16_t memshr_vbd_image_get(const char* file)
 {
     uint16_t id;
 
+    if(!vbd_info.enabled)
+        return 0;
+
     if(pthread_mutex_lock(&SHARED_INFO->lock)) goto error_out;
     id = shm_vbd_image_get(file, SHARED_INFO->vbd_images);
     if(pthread_mutex_unlock(&SHARED_INFO->lock)) goto error_out;
@@ -137,6 +153,9 @@ error_out:
 
 void memshr_vbd_image_put(uint16_t memshr_id)
 {
+    if(!vbd_info.enabled || memshr_id == 0)
+        return;
+
     if(pthread_mutex_lock(&SHARED_INFO->lock)) return;
     shm_vbd_image_put(memshr_id, SHARED_INFO->vbd_images);
     if(pthread_mutex_unlock(&SHARED_INFO->lock)) return;
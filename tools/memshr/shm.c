@@ -16,10 +16,12 @@
  * along with this program; If not, see <http://www.gnu.org/licenses/>.
  */
 #include <assert.h>
+#include <errno.h>
 #include <stdlib.h>
 #include <string.h>
 #include <fcntl.h>
 #include <unistd.h>
+#include <sys/file.h>
 #include <sys/mman.h>
 #include <sys/stat.h>
 #include <sys/types.h>
@@ -31,6 +33,9 @@
 #define MEMSHR_INFO_SHM_FILE  "/memshr-info"
 #define MEMSHR_INFO_MAGIC     0x15263748 
 
+#define MEMSHR_INIT_LOCK_FILE  "/memshr-init"
+#define MEMSHR_PRUNE_LOCK_FILE "/memshr-prune"
+
 #define FGPRT_HASH_SHM_FILE "/blktap-fgprts"
 #define FGPRT_HASH_PAGES    10000
 
@@ -127,6 +132,7 @@ shared_memshr_info_t * shm_shared_info_open(int unlink)
     if(shared_info->magic != MEMSHR_INFO_MAGIC)
     {
         DPRINTF("Incorrect magic in shared info.\n");
+        shm_area_close(&(shm_info.shared_info_area));
         return NULL;
     }
     
@@ -260,3 +266,40 @@ void shm_vbd_image_put(uint16_t memshr_id, vbd_image_info_t *vbd_imgs)
     }
 }
 
+static int shm_flock(const char *file)
+{
+    int fd;
+
+    fd = shm_open(file, (O_CREAT | O_RDWR), (S_IREAD | S_IWRITE));
+    if(fd < 0) return -1;
+
+    while(flock(fd, LOCK_EX) < 0)
+    {
+        if(errno != EINTR)
+        {
+            close(fd);
+            return -1;
+        }
+    }
+
+    return fd;
+}
+
+/* Serialises setting up the shared areas between the processes using them */
+int shm_init_lock(void)
+{
+    return shm_flock(MEMSHR_INIT_LOCK_FILE);
+}
+
+void shm_init_unlock(int fd)
+{
+    flock(fd, LOCK_UN);
+    close(fd);
+}
+
+/* Blocks until the caller is the only process pruning the block hash. The
+ * lock is held until the process exits. */
+int shm_prune_lock(void)
+{
+    return shm_flock(MEMSHR_PRUNE_LOCK_FILE);
+}
@@ -45,5 +45,8 @@ struct fgprtshr_hash * shm_fgprtshr_hash_open(int unlink);
 struct blockshr_hash * shm_blockshr_hash_open(int unlink);
 uint16_t shm_vbd_image_get(const char* file, vbd_image_info_t *vbd_imgs);
 void     shm_vbd_image_put(uint16_t memshr_id, vbd_image_info_t *vbd_imgs);
+int      shm_init_lock(void);
+void     shm_init_unlock(int fd);
+int      shm_prune_lock(void);
 
 #endif /* __SHM_H__ */
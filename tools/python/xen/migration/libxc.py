@@ -61,6 +61,11 @@ REC_TYPE_x86_pv_vcpu_msrs           = 0x0000000c
 REC_TYPE_verify                     = 0x0000000d
 REC_TYPE_checkpoint                 = 0x0000000e
 REC_TYPE_checkpoint_dirty_pfn_list  = 0x0000000f
+REC_TYPE_stream_sync                = 0x00000010
+REC_TYPE_compressed_page_data       = 0x00000011
+REC_TYPE_postcopy_pfns              = 0x00000012
+REC_TYPE_postcopy_transition        = 0x00000013
+REC_TYPE_postcopy_page_request      = 0x00000014
 
 rec_type_to_str = {
     REC_TYPE_end                        : "End",
@@ -78,7 +83,12 @@ rec_type_to_str = {
     REC_TYPE_x86_pv_vcpu_msrs           : "x86 PV vcpu msrs",
     REC_TYPE_verify                     : "Verify",
     REC_TYPE_checkpoint                 : "Checkpoint",
-    REC_TYPE_checkpoint_dirty_pfn_list  : "Checkpoint dirty pfn list"
+    REC_TYPE_checkpoint_dirty_pfn_list  : "Checkpoint dirty pfn list",
+    REC_TYPE_stream_sync                : "Stream sync",
+    REC_TYPE_compressed_page_data       : "Compressed page data",
+    REC_TYPE_postcopy_pfns              : "Post-copy pfns",
+    REC_TYPE_postcopy_transition        : "Post-copy transition",
+    REC_TYPE_postcopy_page_request      : "Post-copy page request",
 }
 
 # page_data
@@ -116,6 +126,15 @@ TSC_INFO_FORMAT           = "IIQII"
 HVM_PARAMS_ENTRY_FORMAT   = "QQ"
 HVM_PARAMS_FORMAT         = "II"
 
+# stream_sync
+STREAM_SYNC_FORMAT        = "II"
+
+# compressed_page_data
+COMPRESSED_PAGE_DATA_FORMAT = "II"
+
+# postcopy_pfns
+POSTCOPY_PFNS_FORMAT      = "II"
+
 class VerifyLibxc(VerifyBase):
     """ Verify a Libxc v2 stream """
 
@@ -409,6 +428,135 @@ class VerifyLibxc(VerifyBase):
         """ checkpoint dirty pfn list """
         raise RecordError("Found checkpoint dirty pfn list record in stream")
 
+    def verify_record_stream_sync(self, content):
+        """ stream sync record """
+
+        sz = calcsize(STREAM_SYNC_FORMAT)
+
+        if len(content) != sz:
+            raise RecordError("Stream sync record length expected %d, got %d"
+                              % (sz, len(content)))
+
+        seq, nr_streams = unpack(STREAM_SYNC_FORMAT, content)
+
+        if nr_streams == 0:
+            raise RecordError("Stream sync record for no page data streams")
+
+        self.info("  Stream sync: seq %d, %d page data streams"
+                  % (seq, nr_streams))
+
+    def verify_record_compressed_page_data(self, content):
+        """ Compressed Page Data record """
+        minsz = calcsize(COMPRESSED_PAGE_DATA_FORMAT)
+
+        if len(content) <= minsz:
+            raise RecordError("COMPRESSED_PAGE_DATA record must be at least %d"
+                              " bytes long" % (minsz, ))
+
+        count, res1 = unpack(COMPRESSED_PAGE_DATA_FORMAT, content[:minsz])
+
+        if res1 != 0:
+            raise StreamError("Reserved bits set in COMPRESSED_PAGE_DATA"
+                              " record 0x%04x" % (res1, ))
+
+        pfnsz = count * 8
+        bitmapsz = ((count + 63) // 64) * 8
+        if (len(content) - minsz) < pfnsz + bitmapsz:
+            raise RecordError("COMPRESSED_PAGE_DATA record must contain a pfn"
+                              " and zero bitmap bit for each count")
+
+        pfns = list(unpack("=%dQ" % (count,), content[minsz:minsz + pfnsz]))
+        bitmap = list(unpack("=%dQ" % (bitmapsz // 8, ),
+                             content[minsz + pfnsz:minsz + pfnsz + bitmapsz]))
+
+        nr_pages = nr_zero = 0
+        for idx, pfn in enumerate(pfns):
+
+            if pfn & PAGE_DATA_PFN_RESZ_MASK:
+                raise RecordError("Reserved bits set in pfn[%d]: 0x%016x",
+                                  idx, pfn & PAGE_DATA_PFN_RESZ_MASK)
+
+            if pfn >> PAGE_DATA_TYPE_SHIFT in (5, 6, 7, 8):
+                raise RecordError("Invalid type value in pfn[%d]: 0x%016x",
+                                  idx, pfn & PAGE_DATA_TYPE_LTAB_MASK)
+
+            zero = bitmap[idx // 64] & (1 << (idx % 64))
+
+            if PAGE_DATA_TYPE_NOTAB <= (pfn & PAGE_DATA_TYPE_LTABTYPE_MASK) \
+                    <= PAGE_DATA_TYPE_L4TAB:
+                if zero:
+                    nr_zero += 1
+                else:
+                    nr_pages += 1
+            elif zero:
+                raise RecordError("pfn[%d] has no data but is marked as zero"
+                                  % (idx, ))
+
+        off = minsz + pfnsz + bitmapsz
+        lensz = nr_pages * 4
+        if len(content) < off + lensz:
+            raise RecordError("COMPRESSED_PAGE_DATA record must contain a"
+                              " length for each non-zero page")
+
+        lengths = unpack("=%dI" % (nr_pages, ), content[off:off + lensz])
+
+        for idx, length in enumerate(lengths):
+            if not 0 < length <= 4096:
+                raise RecordError("Invalid length %d for page %d"
+                                  % (length, idx))
+
+        datasz = sum(lengths)
+        off += (lensz + 7) & ~7
+        if len(content) != off + datasz:
+            raise RecordError("Expected %u + %u, got %u"
+                              % (off, datasz, len(content)))
+
+        self.info("  Compressed page data: %d pages, %d zero, %d bytes"
+                  % (nr_pages + nr_zero, nr_zero, datasz))
+
+    def verify_record_postcopy_pfns(self, content):
+        """ Post-copy pfns record """
+        minsz = calcsize(POSTCOPY_PFNS_FORMAT)
+
+        if len(content) <= minsz:
+            raise RecordError("POSTCOPY_PFNS record must be at least %d bytes"
+                              " long" % (minsz, ))
+
+        count, res1 = unpack(POSTCOPY_PFNS_FORMAT, content[:minsz])
+
+        if res1 != 0:
+            raise StreamError("Reserved bits set in POSTCOPY_PFNS record"
+                              " 0x%04x" % (res1, ))
+
+        if len(content) != minsz + count * 8:
+            raise RecordError("POSTCOPY_PFNS record length expected %d, got %d"
+                              % (minsz + count * 8, len(content)))
+
+        pfns = unpack("=%dQ" % (count,), content[minsz:])
+
+        for idx, pfn in enumerate(pfns):
+
+            if pfn & PAGE_DATA_PFN_RESZ_MASK:
+                raise RecordError("Reserved bits set in pfn[%d]: 0x%016x",
+                                  idx, pfn & PAGE_DATA_PFN_RESZ_MASK)
+
+            if pfn >> PAGE_DATA_TYPE_SHIFT in (5, 6, 7, 8):
+                raise RecordError("Invalid type value in pfn[%d]: 0x%016x",
+                                  idx, pfn & PAGE_DATA_TYPE_LTAB_MASK)
+
+        self.info("  Post-copy pfns: %d" % (count, ))
+
+    def verify_record_postcopy_transition(self, content):
+        """ Post-copy transition record """
+
+        if len(content) != 0:
+            raise RecordError("Post-copy transition record with non-zero"
+                              " length")
+
+    def verify_record_postcopy_page_request(self, content):
+        """ Post-copy page request """
+        raise RecordError("Found post-copy page request record in stream")
+
 
 record_verifiers = {
     REC_TYPE_end:
@@ -451,4 +599,14 @@ record_verifiers = {
         VerifyLibxc.verify_record_checkpoint,
     REC_TYPE_checkpoint_dirty_pfn_list:
         VerifyLibxc.verify_record_checkpoint_dirty_pfn_list,
+    REC_TYPE_stream_sync:
+        VerifyLibxc.verify_record_stream_sync,
+    REC_TYPE_compressed_page_data:
+        VerifyLibxc.verify_record_compressed_page_data,
+    REC_TYPE_postcopy_pfns:
+        VerifyLibxc.verify_record_postcopy_pfns,
+    REC_TYPE_postcopy_transition:
+        VerifyLibxc.verify_record_postcopy_transition,
+    REC_TYPE_postcopy_page_request:
+        VerifyLibxc.verify_record_postcopy_page_request,
     }
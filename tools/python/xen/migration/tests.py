@@ -26,6 +26,9 @@ class TestLibxc(unittest.TestCase):
                          (libxc.TSC_INFO_FORMAT, 24),
                          (libxc.HVM_PARAMS_ENTRY_FORMAT, 16),
                          (libxc.HVM_PARAMS_FORMAT, 8),
+                         (libxc.STREAM_SYNC_FORMAT, 8),
+                         (libxc.COMPRESSED_PAGE_DATA_FORMAT, 8),
+                         (libxc.POSTCOPY_PFNS_FORMAT, 8),
                          ):
             self.assertEqual(calcsize(fmt), sz)
 
@@ -0,0 +1,18 @@
+/*
+ * Just enough of the hypervisor environment to build xen/common/rbtree.c
+ * as a userspace object.  The Makefile links this in as xen/types.h.
+ */
+#ifndef __CREDIT2_RUNQ_HARNESS_H__
+#define __CREDIT2_RUNQ_HARNESS_H__
+
+#include <stddef.h>
+
+#define EXPORT_SYMBOL(sym)
+
+#define ARRAY_SIZE(x) (sizeof(x) / sizeof((x)[0]))
+
+#define container_of(ptr, type, member) ({                  \
+        typeof( ((type *)0)->member ) *__mptr = (ptr);      \
+        (type *)( (char *)__mptr - offsetof(type,member) );})
+
+#endif /* __CREDIT2_RUNQ_HARNESS_H__ */
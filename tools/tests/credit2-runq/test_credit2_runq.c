@@ -0,0 +1,296 @@
+/*
+ * Userspace model of the Credit2 runqueue, used to measure the cost of a
+ * scheduling decision (pick the head of the runqueue, burn some credit,
+ * put it back) with the ordered list the scheduler used to have and with
+ * the rbtree it uses now.  Both implementations are driven by the same
+ * pseudo-random sequence and must pick vcpus in exactly the same order.
+ *
+ * Usage: test_credit2_runq [nr_vcpus [nr_decisions]]
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <time.h>
+
+#include <xen/types.h>
+#include <xen/rbtree.h>
+
+/* Same constants as xen/common/sched_credit2.c, in ns. */
+#define CSCHED2_CREDIT_INIT     10000000
+#define CSCHED2_CARRYOVER_MAX   500000
+#define CSCHED2_MIN_TIMER       500000
+#define CSCHED2_CREDIT_RESET    0
+
+struct list_head {
+    struct list_head *next, *prev;
+};
+
+struct vcpu {
+    unsigned int id;
+    int credit;
+    struct list_head runq_list;
+    struct rb_node runq_node;
+};
+
+struct runq_ops {
+    const char *name;
+    void (*init)(void);
+    void (*insert)(struct vcpu *v);
+    struct vcpu *(*pick)(void);
+    int (*check)(void);
+};
+
+static struct vcpu *vcpus;
+static unsigned int nr_vcpus;
+
+/* The ordered list, as in csched2's __runq_insert() before the rbtree. */
+static struct list_head list_runq;
+
+static void list_init(void)
+{
+    list_runq.next = list_runq.prev = &list_runq;
+}
+
+static void list_insert(struct vcpu *svc)
+{
+    struct list_head *iter;
+
+    for ( iter = list_runq.next; iter != &list_runq; iter = iter->next )
+    {
+        struct vcpu *iter_svc = container_of(iter, struct vcpu, runq_list);
+
+        if ( svc->credit > iter_svc->credit )
+            break;
+    }
+
+    /* list_add_tail(&svc->runq_list, iter) */
+    svc->runq_list.next = iter;
+    svc->runq_list.prev = iter->prev;
+    iter->prev->next = &svc->runq_list;
+    iter->prev = &svc->runq_list;
+}
+
+static struct vcpu *list_pick(void)
+{
+    struct list_head *first = list_runq.next;
+
+    if ( first == &list_runq )
+        return NULL;
+
+    first->next->prev = first->prev;
+    first->prev->next = first->next;
+
+    return container_of(first, struct vcpu, runq_list);
+}
+
+static int list_check(void)
+{
+    struct list_head *iter;
+    int last = INT32_MAX;
+
+    for ( iter = list_runq.next; iter != &list_runq; iter = iter->next )
+    {
+        struct vcpu *svc = container_of(iter, struct vcpu, runq_list);
+
+        if ( svc->credit > last )
+            return -1;
+        last = svc->credit;
+    }
+
+    return 0;
+}
+
+/* The rbtree, as in csched2's __runq_insert() now. */
+static struct rb_root rb_runq;
+
+static void rbtree_init(void)
+{
+    rb_runq = RB_ROOT;
+}
+
+static void rbtree_insert(struct vcpu *svc)
+{
+    struct rb_node **link = &rb_runq.rb_node, *parent = NULL;
+
+    while ( *link )
+    {
+        parent = *link;
+
+        if ( svc->credit > rb_entry(parent, struct vcpu, runq_node)->credit )
+            link = &parent->rb_left;
+        else
+            link = &parent->rb_right;
+    }
+
+    rb_link_node(&svc->runq_node, parent, link);
+    rb_insert_color(&svc->runq_node, &rb_runq);
+}
+
+static struct vcpu *rbtree_pick(void)
+{
+    struct rb_node *first = rb_first(&rb_runq);
+
+    if ( first == NULL )
+        return NULL;
+
+    rb_erase(first, &rb_runq);
+
+    return rb_entry(first, struct vcpu, runq_node);
+}
+
+static int rbtree_check(void)
+{
+    struct rb_node *iter;
+    int last = INT32_MAX;
+
+    for ( iter = rb_first(&rb_runq); iter != NULL; iter = rb_next(iter) )
+    {
+        struct vcpu *svc = rb_entry(iter, struct vcpu, runq_node);
+
+        if ( svc->credit > last )
+            return -1;
+        last = svc->credit;
+    }
+
+    return 0;
+}
+
+static const struct runq_ops runqs[] = {
+    { "list",   list_init,   list_insert,   list_pick,   list_check },
+    { "rbtree", rbtree_init, rbtree_insert, rbtree_pick, rbtree_check },
+};
+
+/* Small deterministic generator, so both runs see the same workload. */
+static uint32_t rnd_state;
+
+static uint32_t rnd(void)
+{
+    rnd_state = rnd_state * 1103515245 + 12345;
+    return rnd_state >> 8;
+}
+
+/*
+ * As reset_credit(): everyone, queued or not, gets the same credit added
+ * and is then clipped to the same maximum.  This is done in place, and
+ * must never break the order of the runqueue.
+ */
+static void reset_credit(void)
+{
+    unsigned int i;
+
+    for ( i = 0; i < nr_vcpus; i++ )
+    {
+        vcpus[i].credit += CSCHED2_CREDIT_INIT;
+        if ( vcpus[i].credit > CSCHED2_CREDIT_INIT + CSCHED2_CARRYOVER_MAX )
+            vcpus[i].credit = CSCHED2_CREDIT_INIT + CSCHED2_CARRYOVER_MAX;
+    }
+}
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/*
+ * Runs nr_decisions scheduling decisions and records the id of the vcpu
+ * picked by each of them in trace[].  Returns the elapsed time in ns, or
+ * 0 if the runqueue was found out of order.
+ */
+static uint64_t run(const struct runq_ops *ops, unsigned int nr_decisions,
+                    unsigned int *trace)
+{
+    unsigned int i, resets = 0;
+    uint64_t start, end;
+
+    rnd_state = 1;
+    ops->init();
+    for ( i = 0; i < nr_vcpus; i++ )
+    {
+        vcpus[i].id = i;
+        /* Quantize credits, so that ties (and FIFO among them) happen. */
+        vcpus[i].credit = (rnd() % 100) * (CSCHED2_CREDIT_INIT / 100);
+        ops->insert(&vcpus[i]);
+    }
+
+    start = now_ns();
+
+    for ( i = 0; i < nr_decisions; i++ )
+    {
+        struct vcpu *snext = ops->pick();
+
+        trace[i] = snext->id;
+        snext->credit -= CSCHED2_MIN_TIMER * (1 + rnd() % 4);
+        if ( snext->credit <= CSCHED2_CREDIT_RESET )
+        {
+            reset_credit();
+            resets++;
+        }
+        ops->insert(snext);
+    }
+
+    end = now_ns();
+
+    if ( ops->check() )
+    {
+        printf("%s: runqueue out of order after %u resets\n",
+               ops->name, resets);
+        return 0;
+    }
+
+    return end - start;
+}
+
+int main(int argc, char **argv)
+{
+    unsigned int nr_decisions, i, j;
+    unsigned int *trace[ARRAY_SIZE(runqs)];
+    uint64_t ns[ARRAY_SIZE(runqs)];
+
+    nr_vcpus = argc > 1 ? strtoul(argv[1], NULL, 0) : 1000;
+    nr_decisions = argc > 2 ? strtoul(argv[2], NULL, 0) : 1000000;
+
+    if ( !nr_vcpus || !nr_decisions )
+    {
+        fprintf(stderr, "usage: %s [nr_vcpus [nr_decisions]]\n", argv[0]);
+        return 2;
+    }
+
+    vcpus = calloc(nr_vcpus, sizeof(*vcpus));
+    if ( !vcpus )
+        return 1;
+
+    printf("%u runnable vcpus, %u scheduling decisions\n",
+           nr_vcpus, nr_decisions);
+
+    for ( i = 0; i < ARRAY_SIZE(runqs); i++ )
+    {
+        trace[i] = malloc(nr_decisions * sizeof(*trace[i]));
+        if ( !trace[i] )
+            return 1;
+
+        ns[i] = run(&runqs[i], nr_decisions, trace[i]);
+        if ( !ns[i] )
+            return 1;
+
+        printf("%-8s %8.1f ns/decision\n", runqs[i].name,
+               (double)ns[i] / nr_decisions);
+    }
+
+    for ( i = 1; i < ARRAY_SIZE(runqs); i++ )
+        for ( j = 0; j < nr_decisions; j++ )
+            if ( trace[i][j] != trace[0][j] )
+            {
+                printf("%s: decision %u picked vcpu %u, %s picked %u\n",
+                       runqs[i].name, j, trace[i][j],
+                       runqs[0].name, trace[0][j]);
+                return 1;
+            }
+
+    printf("all runqueues made the same decisions\n");
+
+    return 0;
+}
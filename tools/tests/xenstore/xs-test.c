@@ -35,6 +35,7 @@
 #define WRITE_BUFFERS_N    10
 #define WRITE_BUFFERS_SIZE 4000
 #define MAX_TA_LOOPS       100
+#define WATCHES_N          10000
 
 struct test {
     char *name;
@@ -403,6 +404,157 @@ static int test_ta3_deinit(uintptr_t par)
     return verify_node(paths[0], "b", 1);
 }
 
+static int test_ta4_init(uintptr_t par)
+{
+    unsigned int i;
+
+    for ( i = 0; i < WRITE_BUFFERS_N; i++ )
+        if ( !xs_write(xsh, XBT_NULL, paths[i], write_buffers[i], 1) )
+            return errno;
+
+    return 0;
+}
+
+static int test_ta4(uintptr_t par)
+{
+    xs_transaction_t t;
+    char **dir;
+    unsigned int num;
+    int ret;
+
+    t = xs_transaction_start(xsh);
+    if ( t == XBT_NULL )
+        return errno;
+    if ( !xs_rm(xsh, t, path) )
+        goto out;
+    dir = xs_directory(xsh, XBT_NULL, path, &num);
+    if ( !dir )
+        goto out;
+    free(dir);
+    errno = (num == WRITE_BUFFERS_N) ? 0 : ENODATA;
+    if ( errno )
+        goto out;
+    dir = xs_directory(xsh, t, path, &num);
+    if ( dir || errno != ENOENT )
+    {
+        free(dir);
+        errno = ENODATA;
+        goto out;
+    }
+    if ( !xs_transaction_end(xsh, t, par ? true : false) )
+        return errno;
+    return 0;
+
+ out:
+    ret = errno;
+    xs_transaction_end(xsh, t, true);
+    return ret;
+}
+
+static int test_ta4_deinit(uintptr_t par)
+{
+    char **dir;
+    unsigned int num;
+
+    dir = xs_directory(xsh, XBT_NULL, path, &num);
+    free(dir);
+    if ( par )
+        return (dir && num == WRITE_BUFFERS_N) ? 0 : ENODATA;
+    return (!dir && errno == ENOENT) ? 0 : ENODATA;
+}
+
+#define test_ta5_init ret0
+
+static int test_ta5(uintptr_t par)
+{
+    xs_transaction_t t;
+    char *buf;
+    unsigned int len;
+    int ret;
+
+    t = xs_transaction_start(xsh);
+    if ( t == XBT_NULL )
+        return errno;
+    buf = xs_read(xsh, t, paths[0], &len);
+    if ( buf || errno != ENOENT )
+    {
+        free(buf);
+        errno = ENODATA;
+        goto out;
+    }
+    if ( !xs_write(xsh, XBT_NULL, paths[0], "b", 1) )
+        goto out;
+    buf = xs_read(xsh, t, paths[0], &len);
+    if ( buf || errno != ENOENT )
+    {
+        free(buf);
+        errno = ENODATA;
+        goto out;
+    }
+    if ( !xs_write(xsh, t, paths[0], "c", 1) )
+        goto out;
+    if ( xs_transaction_end(xsh, t, false) || errno != EAGAIN )
+        return ENODATA;
+    return 0;
+
+ out:
+    ret = errno;
+    xs_transaction_end(xsh, t, true);
+    return ret;
+}
+
+static int test_ta5_deinit(uintptr_t par)
+{
+    return verify_node(paths[0], "b", 1);
+}
+
+static int test_watch_init(uintptr_t par)
+{
+    char token[16];
+    char *wpath;
+    unsigned int i;
+    bool ok;
+
+    for ( i = 0; i < par; i++ )
+    {
+        if ( asprintf(&wpath, "%s/w/%u", path, i) < 0 )
+            return ENOMEM;
+        snprintf(token, sizeof(token), "%u", i);
+        ok = xs_watch(xsh, wpath, token);
+        free(wpath);
+        if ( !ok )
+            return errno;
+    }
+
+    return 0;
+}
+
+static int test_watch(uintptr_t par)
+{
+    return xs_write(xsh, XBT_NULL, paths[0], write_buffers[0], 1) ? 0 : errno;
+}
+
+static int test_watch_deinit(uintptr_t par)
+{
+    char token[16];
+    char *wpath;
+    unsigned int i;
+    bool ok;
+
+    for ( i = 0; i < par; i++ )
+    {
+        if ( asprintf(&wpath, "%s/w/%u", path, i) < 0 )
+            return ENOMEM;
+        snprintf(token, sizeof(token), "%u", i);
+        ok = xs_unwatch(xsh, wpath, token);
+        free(wpath);
+        if ( !ok )
+            return errno;
+    }
+
+    return verify_node(paths[0], write_buffers[0], 1);
+}
+
 #define TEST(s, f, p, l) { s, f ## _init, f, f ## _deinit, (uintptr_t)(p), l }
 struct test tests[] = {
 TEST("read 1", test_read, 1, "Read node with 1 byte data"),
@@ -417,6 +569,10 @@ TEST("ta empty x", test_ta1, 1, "Empty transaction abort"),
 TEST("ta rmw", test_ta2, 0, "Read-modify-write transaction"),
 TEST("ta rmw x", test_ta2, 1, "Read-modify-write transaction abort"),
 TEST("ta err", test_ta3, 0, "Transaction with conflict"),
+TEST("ta rm", test_ta4, 0, "Remove node with sub-nodes in transaction"),
+TEST("ta rm x", test_ta4, 1, "Remove node with sub-nodes in transaction abort"),
+TEST("ta new err", test_ta5, 0, "Transaction with conflict on new node"),
+TEST("watch 10k", test_watch, WATCHES_N, "Write node with 10000 watches registered"),
 };
 
 static void cleanup(void)
@@ -54,14 +54,23 @@ typedef struct xenstat_collector {
 
 static int  xenstat_collect_vcpus(xenstat_node * node);
 static int  xenstat_collect_xen_version(xenstat_node * node);
+static int  xenstat_collect_sched_hist(xenstat_node * node);
+static void xenstat_free_sched_hist(xenstat_node * node);
+static void xenstat_uninit_sched_hist(xenstat_handle * handle);
 static void xenstat_free_vcpus(xenstat_node * node);
 static void xenstat_free_networks(xenstat_node * node);
 static void xenstat_free_xen_version(xenstat_node * node);
 static void xenstat_free_vbds(xenstat_node * node);
 static void xenstat_uninit_vcpus(xenstat_handle * handle);
 static void xenstat_uninit_xen_version(xenstat_handle * handle);
-static char *xenstat_get_domain_name(xenstat_handle * handle, unsigned int domain_id);
+static char *xenstat_get_domain_name(xenstat_handle * handle,
+				     xenstat_domain * domain);
 static void xenstat_prune_domain(xenstat_node *node, unsigned int entry);
+static xenstat_domain_cache *xenstat_cache_lookup(xenstat_handle * handle,
+						 unsigned int domid);
+static int xenstat_update_cache(xenstat_node * node);
+static void xenstat_free_cache(xenstat_domain_cache *cache,
+			       unsigned int num_cached);
 
 static xenstat_collector collectors[] = {
 	{ XENSTAT_VCPU, xenstat_collect_vcpus,
@@ -71,7 +80,9 @@ static xenstat_collector collectors[] = {
 	{ XENSTAT_XEN_VERSION, xenstat_collect_xen_version,
 	  xenstat_free_xen_version, xenstat_uninit_xen_version },
 	{ XENSTAT_VBD, xenstat_collect_vbds,
-	  xenstat_free_vbds, xenstat_uninit_vbds }
+	  xenstat_free_vbds, xenstat_uninit_vbds },
+	{ XENSTAT_SCHED_HIST, xenstat_collect_sched_hist,
+	  xenstat_free_sched_hist, xenstat_uninit_sched_hist }
 };
 
 #define NUM_COLLECTORS (sizeof(collectors)/sizeof(xenstat_collector))
@@ -124,6 +135,7 @@ void xenstat_uninit(xenstat_handle * handle)
 	if (handle) {
 		for (i = 0; i < NUM_COLLECTORS; i++)
 			collectors[i].uninit(handle);
+		xenstat_free_cache(handle->cache, handle->num_cached);
 		xc_interface_close(handle->xc_handle);
 		xs_daemon_close(handle->xshandle);
 		free(handle->priv);
@@ -158,6 +170,13 @@ void domain_get_tmem_stats(xenstat_handle * handle, xenstat_domain * domain)
 	domain->tmem_stats.succ_pers_gets = parse(buffer,"Gp");
 }
 
+static int domain_compare(const void *a, const void *b)
+{
+	const xenstat_domain *da = a, *db = b;
+
+	return (da->id > db->id) - (da->id < db->id);
+}
+
 xenstat_node *xenstat_get_node(xenstat_handle * handle, unsigned int flags)
 {
 #define DOMAIN_CHUNK_SIZE 256
@@ -175,6 +194,7 @@ xenstat_node *xenstat_get_node(xenstat_handle * handle, unsigned int flags)
 
 	/* Store the handle in the node for later access */
 	node->handle = handle;
+	handle->generation++;
 
 	/* Get information about the physical system */
 	if (xc_physinfo(handle->xc_handle, &physinfo) < 0) {
@@ -228,8 +248,14 @@ xenstat_node *xenstat_get_node(xenstat_handle * handle, unsigned int flags)
 		for (i = 0; i < new_domains; i++) {
 			/* Fill in domain using domaininfo[i] */
 			domain->id = domaininfo[i].domain;
-			domain->name = xenstat_get_domain_name(handle, 
-							       domain->id);
+			memcpy(domain->uuid, domaininfo[i].handle,
+			       sizeof(xen_domain_handle_t));
+			domain->prev = xenstat_cache_lookup(handle, domain->id);
+			if (domain->prev != NULL &&
+			    memcmp(domain->prev->uuid, domain->uuid,
+				   sizeof(xen_domain_handle_t)) != 0)
+				domain->prev = NULL;
+			domain->name = xenstat_get_domain_name(handle, domain);
 			if (domain->name == NULL) {
 				if (errno == ENOMEM) {
 					/* fatal error */
@@ -246,6 +272,7 @@ xenstat_node *xenstat_get_node(xenstat_handle * handle, unsigned int flags)
 			domain->state = domaininfo[i].flags;
 			domain->cpu_ns = domaininfo[i].cpu_time;
 			domain->num_vcpus = (domaininfo[i].max_vcpu_id+1);
+			domain->online_vcpus = domaininfo[i].nr_online_vcpus;
 			domain->vcpus = NULL;
 			domain->cur_mem =
 			    ((unsigned long long)domaininfo[i].tot_pages)
@@ -267,6 +294,15 @@ xenstat_node *xenstat_get_node(xenstat_handle * handle, unsigned int flags)
 		}
 	} while (new_domains == DOMAIN_CHUNK_SIZE);
 
+	/* The hypervisor hands domains out by ascending ID, which lookups and
+	 * the cache rely on; make sure of it. */
+	for (i = 1; i < node->num_domains; i++) {
+		if (node->domains[i - 1].id > node->domains[i].id) {
+			qsort(node->domains, node->num_domains,
+			      sizeof(xenstat_domain), domain_compare);
+			break;
+		}
+	}
 
 	/* Run all the extra data collectors requested */
 	node->flags = 0;
@@ -280,6 +316,11 @@ xenstat_node *xenstat_get_node(xenstat_handle * handle, unsigned int flags)
 		}
 	}
 
+	if (xenstat_update_cache(node) == 0) {
+		xenstat_free_node(node);
+		return NULL;
+	}
+
 	return node;
 err:
 	free(node->domains);
@@ -302,19 +343,26 @@ void xenstat_free_node(xenstat_node * node)
 					collectors[i].free(node);
 			free(node->domains);
 		}
+		free(node->changed);
+		free(node->removed);
 		free(node);
 	}
 }
 
 xenstat_domain *xenstat_node_domain(xenstat_node * node, unsigned int domid)
 {
-	unsigned int i;
-
-	/* FIXME: binary search */
-	/* Find the appropriate domain entry in the node struct. */
-	for (i = 0; i < node->num_domains; i++) {
-		if (node->domains[i].id == domid)
-			return &(node->domains[i]);
+	unsigned int lo = 0, hi = node->num_domains, mid;
+
+	/* Find the appropriate domain entry in the node struct; the domains
+	 * are sorted by ID. */
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		if (node->domains[mid].id == domid)
+			return &(node->domains[mid]);
+		if (node->domains[mid].id < domid)
+			lo = mid + 1;
+		else
+			hi = mid;
 	}
 	return NULL;
 }
@@ -327,6 +375,32 @@ xenstat_domain *xenstat_node_domain_by_index(xenstat_node * node,
 	return NULL;
 }
 
+unsigned int xenstat_node_num_changed(xenstat_node * node)
+{
+	return node->num_changed;
+}
+
+xenstat_domain *xenstat_node_changed_domain(xenstat_node * node,
+					    unsigned int index)
+{
+	if (index < node->num_changed)
+		return &(node->domains[node->changed[index]]);
+	return NULL;
+}
+
+unsigned int xenstat_node_num_removed(xenstat_node * node)
+{
+	return node->num_removed;
+}
+
+unsigned int xenstat_node_removed_domid(xenstat_node * node,
+					unsigned int index)
+{
+	if (index < node->num_removed)
+		return node->removed[index];
+	return 0;
+}
+
 const char *xenstat_node_xen_version(xenstat_node * node)
 {
 	return node->handle->xen_version;
@@ -375,6 +449,12 @@ char *xenstat_domain_name(xenstat_domain * domain)
 	return domain->name;
 }
 
+/* Get what changed in the domain since the previous node */
+unsigned int xenstat_domain_changed(xenstat_domain * domain)
+{
+	return domain->changed;
+}
+
 /* Get information about how much CPU time has been used */
 unsigned long long xenstat_domain_cpu_ns(xenstat_domain * domain)
 {
@@ -487,13 +567,27 @@ static int xenstat_collect_vcpus(xenstat_node * node)
 
 	/* Fill in VCPU information */
 	for (i = 0; i < node->num_domains; i+=inc_index) {
+		xenstat_domain_cache *prev = node->domains[i].prev;
+
 		inc_index = 1; /* default is to increment to next domain */
 
 		node->domains[i].vcpus = malloc(node->domains[i].num_vcpus
 						* sizeof(xenstat_vcpu));
 		if (node->domains[i].vcpus == NULL)
 			return 0;
-	
+
+		/* There is no hypercall returning all of a domain's VCPUs at
+		 * once, but none of them can have changed unless the domain
+		 * ran since the previous node, so reuse what was seen then. */
+		if (prev != NULL && prev->vcpus != NULL &&
+		    prev->cpu_ns == node->domains[i].cpu_ns &&
+		    prev->num_vcpus == node->domains[i].num_vcpus &&
+		    prev->online_vcpus == node->domains[i].online_vcpus) {
+			memcpy(node->domains[i].vcpus, prev->vcpus,
+			       prev->num_vcpus * sizeof(xenstat_vcpu));
+			continue;
+		}
+
 		for (vcpu = 0; vcpu < node->domains[i].num_vcpus; vcpu++) {
 			/* FIXME: need to be using a more efficient mechanism*/
 			xc_vcpuinfo_t info;
@@ -548,6 +642,107 @@ unsigned long long xenstat_vcpu_ns(xenstat_vcpu * vcpu)
 	return vcpu->ns;
 }
 
+/*
+ * Scheduling histogram functions
+ */
+static void xenstat_copy_sched_hist(xenstat_sched_hist *hist,
+				    const xc_sched_hist_t *xchist)
+{
+	unsigned int i;
+
+	for (i = 0; i < XEN_SCHED_HIST_BUCKETS; i++)
+		hist->buckets[i] = xchist->count[i];
+	hist->total = xchist->total;
+}
+
+/* Collect the run delay and slice histograms of all domains */
+static int xenstat_collect_sched_hist(xenstat_node * node)
+{
+	unsigned int i = 0;
+
+	while (i < node->num_domains) {
+		xenstat_domain *domain = &node->domains[i];
+		xc_sched_hist_t run_delay, slice;
+
+		if (xc_domain_get_sched_hist(node->handle->xc_handle,
+					     domain->id,
+					     XEN_DOMCTL_SCHED_HIST_ALL,
+					     &run_delay, &slice) != 0) {
+			if (errno == ENOMEM)
+				return 0;
+			if (errno == ESRCH) {
+				/* domain is in transition - remove from list */
+				xenstat_prune_domain(node, i);
+				continue;
+			}
+			/* Not supported by, or not allowed on, this
+			 * hypervisor: report no histograms rather than no
+			 * domains, and don't ask again for the others. */
+			break;
+		}
+
+		xenstat_copy_sched_hist(&domain->run_delay, &run_delay);
+		xenstat_copy_sched_hist(&domain->slice, &slice);
+		domain->have_sched_hist = 1;
+		i++;
+	}
+	return 1;
+}
+
+/* Free scheduling histograms - nothing to do, they live in the domain */
+static void xenstat_free_sched_hist(xenstat_node * node)
+{
+}
+
+/* Free scheduling histogram information in handle - nothing to do */
+static void xenstat_uninit_sched_hist(xenstat_handle * handle)
+{
+}
+
+xenstat_sched_hist *xenstat_domain_run_delay(xenstat_domain * domain)
+{
+	return domain->have_sched_hist ? &domain->run_delay : NULL;
+}
+
+xenstat_sched_hist *xenstat_domain_slice(xenstat_domain * domain)
+{
+	return domain->have_sched_hist ? &domain->slice : NULL;
+}
+
+unsigned int xenstat_sched_hist_num_buckets(xenstat_sched_hist * hist)
+{
+	return XEN_SCHED_HIST_BUCKETS;
+}
+
+unsigned long long xenstat_sched_hist_bucket(xenstat_sched_hist * hist,
+					     unsigned int bucket)
+{
+	return bucket < XEN_SCHED_HIST_BUCKETS ? hist->buckets[bucket] : 0;
+}
+
+unsigned long long xenstat_sched_hist_limit(xenstat_sched_hist * hist,
+					    unsigned int bucket)
+{
+	if (bucket >= XEN_SCHED_HIST_BUCKETS - 1)
+		return ~0ULL;
+	return 1ULL << (bucket + XEN_SCHED_HIST_SHIFT);
+}
+
+unsigned long long xenstat_sched_hist_count(xenstat_sched_hist * hist)
+{
+	unsigned long long count = 0;
+	unsigned int i;
+
+	for (i = 0; i < XEN_SCHED_HIST_BUCKETS; i++)
+		count += hist->buckets[i];
+	return count;
+}
+
+unsigned long long xenstat_sched_hist_total_ns(xenstat_sched_hist * hist)
+{
+	return hist->total;
+}
+
 /*
  * Network functions
  */
@@ -763,11 +958,18 @@ unsigned long long xenstat_tmem_succ_pers_gets(xenstat_tmem *tmem)
 }
 
 
-static char *xenstat_get_domain_name(xenstat_handle *handle, unsigned int domain_id)
+static char *xenstat_get_domain_name(xenstat_handle *handle,
+				     xenstat_domain *domain)
 {
 	char path[80];
 
-	snprintf(path, sizeof(path),"/local/domain/%i/name", domain_id);
+	/* Names hardly ever change, so only a slice of the known domains
+	 * have theirs read back from xenstore on each call */
+	if (domain->prev != NULL && domain->prev->name != NULL &&
+	    (domain->id + handle->generation) % XENSTAT_REVALIDATE_PERIOD)
+		return strdup(domain->prev->name);
+
+	snprintf(path, sizeof(path),"/local/domain/%i/name", domain->id);
 
 	return xs_read(handle->xshandle, XBT_NULL, path, NULL);
 }
@@ -779,6 +981,9 @@ static void xenstat_prune_domain(xenstat_node *node, unsigned int entry)
 	if (node->num_domains == 0 || entry >= node->num_domains)
 		return;
 
+	free(node->domains[entry].name);
+	free(node->domains[entry].vcpus);
+
 	/* decrement count of domains */
 	node->num_domains--;
 
@@ -792,3 +997,214 @@ static void xenstat_prune_domain(xenstat_node *node, unsigned int entry)
 	   strictly necessary but safer! */
 	memset(&node->domains[node->num_domains], 0, sizeof(xenstat_domain)); 
 }
+
+/*
+ * Domain cache functions
+ */
+
+static xenstat_domain_cache *xenstat_cache_lookup(xenstat_handle *handle,
+						 unsigned int domid)
+{
+	unsigned int lo = 0, hi = handle->num_cached, mid;
+
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		if (handle->cache[mid].id == domid)
+			return &handle->cache[mid];
+		if (handle->cache[mid].id < domid)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return NULL;
+}
+
+static void xenstat_free_cache(xenstat_domain_cache *cache,
+			       unsigned int num_cached)
+{
+	unsigned int i;
+
+	if (cache == NULL)
+		return;
+	for (i = 0; i < num_cached; i++) {
+		free(cache[i].name);
+		free(cache[i].vcpus);
+	}
+	free(cache);
+}
+
+/* The counters only ever go up, so their sum changes whenever any of them
+ * does. */
+static unsigned long long xenstat_network_sum(xenstat_domain *domain)
+{
+	unsigned long long sum = 0;
+	unsigned int i;
+
+	for (i = 0; i < domain->num_networks; i++) {
+		xenstat_network *net = &domain->networks[i];
+
+		sum += net->id + net->rbytes + net->rpackets + net->rerrs +
+		       net->rdrop + net->tbytes + net->tpackets + net->terrs +
+		       net->tdrop;
+	}
+	return sum;
+}
+
+static unsigned long long xenstat_vbd_sum(xenstat_domain *domain)
+{
+	unsigned long long sum = 0;
+	unsigned int i;
+
+	for (i = 0; i < domain->num_vbds; i++) {
+		xenstat_vbd *vbd = &domain->vbds[i];
+
+		sum += vbd->dev + vbd->oo_reqs + vbd->rd_reqs + vbd->wr_reqs +
+		       vbd->rd_sects + vbd->wr_sects;
+	}
+	return sum;
+}
+
+static unsigned long long xenstat_tmem_sum(xenstat_domain *domain)
+{
+	return domain->tmem_stats.curr_eph_pages +
+	       domain->tmem_stats.succ_eph_gets +
+	       domain->tmem_stats.succ_pers_puts +
+	       domain->tmem_stats.succ_pers_gets;
+}
+
+/* Fill in a cache entry for domain, taking over the allocations of the
+ * previous entry where possible.  Returns 0 on allocation failure. */
+static int xenstat_fill_cache(xenstat_domain_cache *entry,
+			      xenstat_domain *domain, unsigned int flags)
+{
+	xenstat_domain_cache *prev = domain->prev;
+
+	entry->id = domain->id;
+	memcpy(entry->uuid, domain->uuid, sizeof(xen_domain_handle_t));
+	entry->flags = flags;
+	entry->state = domain->state;
+	entry->cpu_ns = domain->cpu_ns;
+	entry->cur_mem = domain->cur_mem;
+	entry->max_mem = domain->max_mem;
+	entry->tmem_sum = xenstat_tmem_sum(domain);
+	entry->num_vcpus = domain->num_vcpus;
+	entry->online_vcpus = domain->online_vcpus;
+	entry->num_networks = domain->num_networks;
+	entry->net_sum = xenstat_network_sum(domain);
+	entry->num_vbds = domain->num_vbds;
+	entry->vbd_sum = xenstat_vbd_sum(domain);
+
+	if (prev != NULL && prev->name != NULL &&
+	    strcmp(prev->name, domain->name) == 0) {
+		entry->name = prev->name;
+		prev->name = NULL;
+	} else {
+		entry->name = strdup(domain->name);
+		if (entry->name == NULL)
+			return 0;
+	}
+
+	if (!(flags & XENSTAT_VCPU))
+		return 1;
+
+	if (prev != NULL && prev->vcpus != NULL &&
+	    prev->num_vcpus == domain->num_vcpus) {
+		entry->vcpus = prev->vcpus;
+		prev->vcpus = NULL;
+	} else {
+		entry->vcpus = malloc(domain->num_vcpus * sizeof(xenstat_vcpu));
+		if (entry->vcpus == NULL)
+			return 0;
+	}
+	memcpy(entry->vcpus, domain->vcpus,
+	       domain->num_vcpus * sizeof(xenstat_vcpu));
+
+	return 1;
+}
+
+/* Work out what changed in domain since the previous node */
+static unsigned int xenstat_domain_diff(xenstat_domain *domain,
+					unsigned int flags)
+{
+	xenstat_domain_cache *prev = domain->prev;
+	unsigned int changed = 0;
+
+	if (prev == NULL)
+		return XENSTAT_CHANGED_ALL;
+
+	if (prev->name == NULL || strcmp(prev->name, domain->name) != 0)
+		changed |= XENSTAT_CHANGED_NAME;
+	if (prev->state != domain->state)
+		changed |= XENSTAT_CHANGED_STATE;
+	if (prev->cpu_ns != domain->cpu_ns ||
+	    prev->num_vcpus != domain->num_vcpus ||
+	    prev->online_vcpus != domain->online_vcpus)
+		changed |= XENSTAT_CHANGED_CPU;
+	if (prev->cur_mem != domain->cur_mem ||
+	    prev->max_mem != domain->max_mem ||
+	    prev->tmem_sum != xenstat_tmem_sum(domain))
+		changed |= XENSTAT_CHANGED_MEM;
+	if ((flags & XENSTAT_NETWORK) &&
+	    (!(prev->flags & XENSTAT_NETWORK) ||
+	     prev->num_networks != domain->num_networks ||
+	     prev->net_sum != xenstat_network_sum(domain)))
+		changed |= XENSTAT_CHANGED_NETWORK;
+	if ((flags & XENSTAT_VBD) &&
+	    (!(prev->flags & XENSTAT_VBD) ||
+	     prev->num_vbds != domain->num_vbds ||
+	     prev->vbd_sum != xenstat_vbd_sum(domain)))
+		changed |= XENSTAT_CHANGED_VBD;
+
+	return changed;
+}
+
+/* Record what changed since the previous node, then replace the handle's
+ * cache with what this node saw.  Returns 0 on allocation failure. */
+static int xenstat_update_cache(xenstat_node * node)
+{
+	xenstat_handle *handle = node->handle;
+	xenstat_domain_cache *cache;
+	unsigned int i;
+
+	/* malloc(0) is not portable, so allocate at least one entry */
+	cache = calloc(node->num_domains + 1, sizeof(xenstat_domain_cache));
+	node->changed = malloc((node->num_domains + 1) * sizeof(unsigned int));
+	if (cache == NULL || node->changed == NULL)
+		goto err;
+
+	for (i = 0; i < node->num_domains; i++) {
+		xenstat_domain *domain = &node->domains[i];
+
+		domain->changed = xenstat_domain_diff(domain, node->flags);
+		if (domain->changed)
+			node->changed[node->num_changed++] = i;
+		if (domain->prev != NULL)
+			domain->prev->seen = handle->generation;
+	}
+
+	node->removed = malloc((handle->num_cached + 1) * sizeof(unsigned int));
+	if (node->removed == NULL)
+		goto err;
+	for (i = 0; i < handle->num_cached; i++)
+		if (handle->cache[i].seen != handle->generation)
+			node->removed[node->num_removed++] = handle->cache[i].id;
+
+	for (i = 0; i < node->num_domains; i++) {
+		xenstat_domain *domain = &node->domains[i];
+
+		if (xenstat_fill_cache(&cache[i], domain, node->flags) == 0)
+			goto err;
+	}
+
+	xenstat_free_cache(handle->cache, handle->num_cached);
+	handle->cache = cache;
+	handle->num_cached = node->num_domains;
+
+	for (i = 0; i < node->num_domains; i++)
+		node->domains[i].prev = NULL;
+
+	return 1;
+err:
+	xenstat_free_cache(cache, node->num_domains);
+	return 0;
+}
@@ -28,6 +28,7 @@ typedef struct xenstat_vcpu xenstat_vcpu;
 typedef struct xenstat_network xenstat_network;
 typedef struct xenstat_vbd xenstat_vbd;
 typedef struct xenstat_tmem xenstat_tmem;
+typedef struct xenstat_sched_hist xenstat_sched_hist;
 
 /* Initialize the xenstat library.  Returns a handle to be used with
  * subsequent calls to the xenstat library, or NULL if an error occurs. */
@@ -41,7 +42,9 @@ void xenstat_uninit(xenstat_handle * handle);
 #define XENSTAT_NETWORK 0x2
 #define XENSTAT_XEN_VERSION 0x4
 #define XENSTAT_VBD 0x8
-#define XENSTAT_ALL (XENSTAT_VCPU|XENSTAT_NETWORK|XENSTAT_XEN_VERSION|XENSTAT_VBD)
+#define XENSTAT_SCHED_HIST 0x10
+#define XENSTAT_ALL (XENSTAT_VCPU|XENSTAT_NETWORK|XENSTAT_XEN_VERSION|XENSTAT_VBD|\
+		     XENSTAT_SCHED_HIST)
 
 /* Get all available information about a node */
 xenstat_node *xenstat_get_node(xenstat_handle * handle, unsigned int flags);
@@ -49,6 +52,21 @@ xenstat_node *xenstat_get_node(xenstat_handle * handle, unsigned int flags);
 /* Free the information */
 void xenstat_free_node(xenstat_node * node);
 
+/* Flags describing what changed in a domain since the node previously
+ * returned by xenstat_get_node on the same handle.  A domain which did
+ * not exist in the previous node has all flags set. */
+#define XENSTAT_CHANGED_NAME 0x1
+#define XENSTAT_CHANGED_STATE 0x2
+#define XENSTAT_CHANGED_CPU 0x4
+#define XENSTAT_CHANGED_MEM 0x8
+#define XENSTAT_CHANGED_NETWORK 0x10
+#define XENSTAT_CHANGED_VBD 0x20
+#define XENSTAT_CHANGED_NEW 0x40
+#define XENSTAT_CHANGED_ALL (XENSTAT_CHANGED_NAME|XENSTAT_CHANGED_STATE|\
+			     XENSTAT_CHANGED_CPU|XENSTAT_CHANGED_MEM|\
+			     XENSTAT_CHANGED_NETWORK|XENSTAT_CHANGED_VBD|\
+			     XENSTAT_CHANGED_NEW)
+
 /*
  * Node functions - extract information from a xenstat_node
  */
@@ -61,6 +79,23 @@ xenstat_domain *xenstat_node_domain(xenstat_node * node,
 xenstat_domain *xenstat_node_domain_by_index(xenstat_node * node,
 					     unsigned index);
 
+/* Find the number of domains which changed since the previous node */
+unsigned int xenstat_node_num_changed(xenstat_node * node);
+
+/* Get the changed domain with the given index; used to loop over only the
+ * domains which changed since the previous node. */
+xenstat_domain *xenstat_node_changed_domain(xenstat_node * node,
+					    unsigned int index);
+
+/* Find the number of domains which went away since the previous node.  A
+ * domain ID which was reused in the meantime is reported both as removed
+ * and, with XENSTAT_CHANGED_NEW, as changed. */
+unsigned int xenstat_node_num_removed(xenstat_node * node);
+
+/* Get the domain ID of the removed domain with the given index */
+unsigned int xenstat_node_removed_domid(xenstat_node * node,
+					unsigned int index);
+
 /* Get xen version of the node */
 const char *xenstat_node_xen_version(xenstat_node * node);
 
@@ -92,6 +127,9 @@ unsigned xenstat_domain_id(xenstat_domain * domain);
 /* Set the domain name for the domain */
 char *xenstat_domain_name(xenstat_domain * domain);
 
+/* Get the XENSTAT_CHANGED_* flags for the domain */
+unsigned int xenstat_domain_changed(xenstat_domain * domain);
+
 /* Get information about how much CPU time has been used */
 unsigned long long xenstat_domain_cpu_ns(xenstat_domain * domain);
 
@@ -136,6 +174,12 @@ xenstat_vbd *xenstat_domain_vbd(xenstat_domain * domain,
 /* Get the tmem information for a given domain */
 xenstat_tmem *xenstat_domain_tmem(xenstat_domain * domain);
 
+/* Get the run delay (time spent waiting, runnable, for a CPU) and slice
+ * length histograms of all the VCPUs of a domain.  NULL unless
+ * XENSTAT_SCHED_HIST was collected. */
+xenstat_sched_hist *xenstat_domain_run_delay(xenstat_domain * domain);
+xenstat_sched_hist *xenstat_domain_slice(xenstat_domain * domain);
+
 /*
  * VCPU functions - extract information from a xenstat_vcpu
  */
@@ -144,6 +188,27 @@ xenstat_tmem *xenstat_domain_tmem(xenstat_domain * domain);
 unsigned int xenstat_vcpu_online(xenstat_vcpu * vcpu);
 unsigned long long xenstat_vcpu_ns(xenstat_vcpu * vcpu);
 
+/*
+ * Scheduling histogram functions - extract information from a
+ * xenstat_sched_hist
+ */
+
+/* Get the number of buckets of the histogram */
+unsigned int xenstat_sched_hist_num_buckets(xenstat_sched_hist * hist);
+
+/* Get the number of events in a bucket */
+unsigned long long xenstat_sched_hist_bucket(xenstat_sched_hist * hist,
+					     unsigned int bucket);
+
+/* Get the length (ns) the events in a bucket are shorter than; the last
+ * bucket also counts all the longer events */
+unsigned long long xenstat_sched_hist_limit(xenstat_sched_hist * hist,
+					    unsigned int bucket);
+
+/* Get the number of events, and their total length (ns) */
+unsigned long long xenstat_sched_hist_count(xenstat_sched_hist * hist);
+unsigned long long xenstat_sched_hist_total_ns(xenstat_sched_hist * hist);
+
 
 /*
  * Network functions - extract information from a xenstat_network
@@ -28,14 +28,29 @@
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
-#include <regex.h>
+#include <errno.h>
+#include <limits.h>
 
 #include "xenstat_priv.h"
 
 #define SYSFS_VBD_PATH "/sys/bus/xen-backend/devices"
 
+/* What a network interface was last found to belong to */
+struct netif_cache {
+	char name[16];
+	int is_vif;
+	unsigned int domid;
+	unsigned int netid;
+};
+
 struct priv_data {
-	FILE *procnetdev;
+	int procnetdev;
+	char *netbuf;			/* Contents of /proc/net/dev */
+	size_t netbuf_size;
+	char bridge[16];
+	unsigned int bridge_generation;
+	struct netif_cache *netifs;	/* In /proc/net/dev order */
+	unsigned int num_netifs;
 	DIR *sysfsvbd;
 };
 
@@ -45,11 +60,11 @@ get_priv_data(xenstat_handle *handle)
 	if (handle->priv != NULL)
 		return handle->priv;
 
-	handle->priv = malloc(sizeof(struct priv_data));
+	handle->priv = calloc(1, sizeof(struct priv_data));
 	if (handle->priv == NULL)
 		return (NULL);
 
-	((struct priv_data *)handle->priv)->procnetdev = NULL;
+	((struct priv_data *)handle->priv)->procnetdev = -1;
 	((struct priv_data *)handle->priv)->sysfsvbd = NULL;
 
 	return handle->priv;
@@ -72,6 +87,8 @@ void getBridge(char *excludeName, char *result, size_t resultLen)
 	char tmp[256] = { 0 };
 
 	d = opendir("/sys/class/net");
+	if (d == NULL)
+		return;
 	while ((de = readdir(d)) != NULL) {
 		if ((strlen(de->d_name) > 0) && (de->d_name[0] != '.')
 			&& (strstr(de->d_name, excludeName) == NULL)) {
@@ -87,8 +104,9 @@ void getBridge(char *excludeName, char *result, size_t resultLen)
 	closedir(d);
 }
 
-/* parseNetLine provides regular expression based parsing for lines from /proc/net/dev, all the */
-/* information are parsed but not all are used in our case, ie. for xenstat */
+/* parseNetLine parses a line from /proc/net/dev, all the information is */
+/* parsed but not all is used in our case, ie. for xenstat.  iface must hold */
+/* at least 16 bytes.  Returns 0 on success, -1 if line is not an interface. */
 int parseNetDevLine(char *line, char *iface, unsigned long long *rxBytes, unsigned long long *rxPackets,
 		unsigned long long *rxErrs, unsigned long long *rxDrops, unsigned long long *rxFifo,
 		unsigned long long *rxFrames, unsigned long long *rxComp, unsigned long long *rxMcast,
@@ -96,143 +114,47 @@ int parseNetDevLine(char *line, char *iface, unsigned long long *rxBytes, unsign
 		unsigned long long *txDrops, unsigned long long *txFifo, unsigned long long *txColls,
 		unsigned long long *txCarrier, unsigned long long *txComp)
 {
-	/* Temporary/helper variables */
-	int ret;
-	char *tmp;
-	int i = 0, x = 0, col = 0;
-	regex_t r;
-	regmatch_t matches[19];
-	int num = 19;
-
-	/* Regular exception to parse all the information from /proc/net/dev line */
-	char *regex = "([^:]*):([^ ]*)[ ]*([^ ]*)[ ]*([^ ]*)[ ]*([^ ]*)[ ]*([^ ]*)[ ]*([^ ]*)"
-			"[ ]*([^ ]*)[ ]*([^ ]*)[ ]*([^ ]*)[ ]*([^ ]*)[ ]*([^ ]*)[ ]*([^ ]*)[ ]*"
-			"([^ ]*)[ ]*([^ ]*)[ ]*([^ ]*)[ ]*([^ ]*)[ ]*([^ ]*)";
-
-	/* Initialize all variables called has passed as non-NULL to zeros */
+	unsigned long long *fields[16] = {
+		rxBytes, rxPackets, rxErrs, rxDrops, rxFifo, rxFrames, rxComp, rxMcast,
+		txBytes, txPackets, txErrs, txDrops, txFifo, txColls, txCarrier, txComp
+	};
+	char *colon, *p;
+	size_t len;
+	int i;
+
+	for (i = 0; i < 16; i++)
+		if (fields[i] != NULL)
+			*fields[i] = 0;
 	if (iface != NULL)
-		memset(iface, 0, sizeof(*iface));
-	if (rxBytes != NULL)
-		*rxBytes = 0;
-	if (rxPackets != NULL)
-		*rxPackets = 0;
-	if (rxErrs != NULL)
-		*rxErrs = 0;
-	if (rxDrops != NULL)
-		*rxDrops = 0;
-	if (rxFifo != NULL)
-		*rxFifo = 0;
-	if (rxFrames != NULL)
-		*rxFrames = 0;
-	if (rxPackets != NULL)
-		*rxPackets = 0;
-	if (rxComp != NULL)
-		*rxComp = 0;
-	if (txBytes != NULL)
-		*txBytes = 0;
-	if (txPackets != NULL)
-		*txPackets = 0;
-	if (txErrs != NULL)
-		*txErrs = 0;
-	if (txDrops != NULL)
-		*txDrops = 0;
-	if (txFifo != NULL)
-		*txFifo = 0;
-	if (txColls != NULL)
-		*txColls = 0;
-	if (txCarrier != NULL)
-		*txCarrier = 0;
-	if (txComp != NULL)
-		*txComp = 0;
-
-	if ((ret = regcomp(&r, regex, REG_EXTENDED))) {
-		regfree(&r);
-		return ret;
+		iface[0] = '\0';
+
+	colon = strchr(line, ':');
+	if (colon == NULL)
+		return -1;
+
+	/* The name is right-aligned in its column */
+	for (p = line; p < colon && *p == ' '; p++)
+		;
+	len = colon - p;
+	if (len == 0 || len > 15)
+		return -1;
+	if (iface != NULL) {
+		memcpy(iface, p, len);
+		iface[len] = '\0';
 	}
 
-	tmp = (char *)malloc( sizeof(char) );
-	if (regexec (&r, line, num, matches, REG_EXTENDED) == 0){
-		for (i = 1; i < num; i++) {
-			/* The expression matches are empty sometimes so we need to check it first */
-			if (matches[i].rm_eo - matches[i].rm_so > 0) {
-				/* Col variable contains current id of non-empty match */
-				col++;
-				tmp = (char *)realloc(tmp, (matches[i].rm_eo - 
-							matches[i].rm_so + 1) * sizeof(char));
-				for (x = matches[i].rm_so; x < matches[i].rm_eo; x++)
-					tmp[x - matches[i].rm_so] = line[x];
-
-				/* We populate all the fields from /proc/net/dev line */
-				if (i > 1) {
-					unsigned long long ullTmp = strtoull(tmp, NULL, 10);
-
-					switch (col) {
-						case 2: if (rxBytes != NULL)
-								*rxBytes = ullTmp;
-							break;
-						case 3: if (rxPackets != NULL)
-								*rxPackets = ullTmp;
-							break;
-						case 4: if (rxErrs != NULL)
-								*rxErrs = ullTmp;
-							break;
-						case 5: if (rxDrops != NULL)
-								*rxDrops = ullTmp;
-							break;
-						case 6: if (rxFifo != NULL)
-								*rxFifo = ullTmp;
-							break;
-						case 7: if (rxFrames != NULL)
-								*rxFrames = ullTmp;
-							break;
-						case 8: if (rxComp != NULL)
-								*rxComp = ullTmp;
-							break;
-						case 9: if (rxMcast != NULL)
-								*rxMcast = ullTmp;
-							break;
-						case 10: if (txBytes != NULL)
-								*txBytes = ullTmp;
-							break;
-						case 11: if (txPackets != NULL)
-								*txPackets = ullTmp;
-							break;
-						case 12: if (txErrs != NULL)
-								*txErrs = ullTmp;
-							break;
-						case 13: if (txDrops != NULL)
-								*txDrops = ullTmp;
-							break;
-						case 14: if (txFifo != NULL)
-								*txFifo = ullTmp;
-							break;
-						case 15: if (txColls != NULL)
-								*txColls = ullTmp;
-							break;
-						case 16: if (txCarrier != NULL)
-								*txCarrier = ullTmp;
-							break;
-						case 17: if (txComp != NULL)
-								*txComp = ullTmp;
-							break;
-					}
-				}
-				else
-				/* There were errors when parsing this directly in RE. strpbrk() helps */
-				if (iface != NULL) {
-					char *tmp2 = strpbrk(tmp, "abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ0123456789");
-					if (tmp2 != NULL)
-						strcpy(iface, tmp2);
-				}
+	p = colon + 1;
+	for (i = 0; i < 16; i++) {
+		char *end;
+		unsigned long long val = strtoull(p, &end, 10);
 
-				memset(tmp, 0, matches[i].rm_eo - matches[i].rm_so);
-			}
-		}
+		if (end == p)
+			break;
+		if (fields[i] != NULL)
+			*fields[i] = val;
+		p = end;
 	}
 
-	free(tmp);
-	regfree(&r);
-
 	return 0;
 }
 
@@ -259,65 +181,158 @@ static int get_iface_domid_network(const char *iface, unsigned int *domid_p, uns
 	return 0;
 }
 
+/* Read the whole of /proc/net/dev into the buffer kept in priv, opening and
+ * validating the file on first use.  Returns the length read, or -1. */
+static ssize_t read_procnetdev(struct priv_data *priv)
+{
+	size_t len = 0;
+	ssize_t ret;
+
+	if (priv->procnetdev == -1) {
+		priv->procnetdev = open("/proc/net/dev", O_RDONLY);
+		if (priv->procnetdev == -1) {
+			perror("Error opening /proc/net/dev");
+			return -1;
+		}
+	}
+
+	if (lseek(priv->procnetdev, 0, SEEK_SET) == -1) {
+		perror("Error reading /proc/net/dev");
+		return -1;
+	}
+
+	for (;;) {
+		if (priv->netbuf_size - len < 2) {
+			size_t size = priv->netbuf_size ? 2 * priv->netbuf_size
+							: 16384;
+			char *tmp = realloc(priv->netbuf, size);
+
+			if (tmp == NULL) {
+				perror("Allocation error");
+				return -1;
+			}
+			priv->netbuf = tmp;
+			priv->netbuf_size = size;
+		}
+
+		ret = read(priv->procnetdev, priv->netbuf + len,
+			   priv->netbuf_size - len - 1);
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
+			perror("Error reading /proc/net/dev");
+			return -1;
+		}
+		if (ret == 0)
+			break;
+		len += ret;
+	}
+	priv->netbuf[len] = '\0';
+
+	/* Validate the format of /proc/net/dev */
+	if (len < sizeof(PROCNETDEV_HEADER) - 1 ||
+	    memcmp(priv->netbuf, PROCNETDEV_HEADER,
+		   sizeof(PROCNETDEV_HEADER) - 1) != 0) {
+		fprintf(stderr, "Unexpected /proc/net/dev format\n");
+		return -1;
+	}
+
+	return len;
+}
+
+/* Find out the domid and network number of an interface, going to sysfs only
+ * for interfaces not seen last time and for a slice of those which were.
+ * hint is where the lookup in the previous cache starts; interfaces tend to
+ * be listed in the same order every time. */
+static void lookup_iface(xenstat_node *node, struct priv_data *priv,
+			 struct netif_cache *entry, unsigned int slot,
+			 unsigned int *hint)
+{
+	unsigned int i, j;
+
+	for (i = 0; i < priv->num_netifs; i++) {
+		j = (*hint + i) % priv->num_netifs;
+		if (strcmp(priv->netifs[j].name, entry->name) != 0)
+			continue;
+		*hint = j + 1;
+		if ((slot + node->handle->generation) %
+		    XENSTAT_REVALIDATE_PERIOD == 0)
+			break;
+		/* An interface outliving its domain has been reused */
+		if (priv->netifs[j].is_vif &&
+		    xenstat_node_domain(node, priv->netifs[j].domid) == NULL)
+			break;
+		entry->is_vif = priv->netifs[j].is_vif;
+		entry->domid = priv->netifs[j].domid;
+		entry->netid = priv->netifs[j].netid;
+		return;
+	}
+
+	entry->is_vif = get_iface_domid_network(entry->name, &entry->domid,
+						&entry->netid);
+}
+
 /* Collect information about networks */
 int xenstat_collect_networks(xenstat_node * node)
 {
 	/* Helper variables for parseNetDevLine() function defined above */
-	int i;
-	char line[512] = { 0 }, iface[16] = { 0 }, devBridge[16] = { 0 }, devNoBridge[16] = { 0 };
+	int i, ret;
 	unsigned long long rxBytes, rxPackets, rxErrs, rxDrops, txBytes, txPackets, txErrs, txDrops;
+	struct netif_cache *netifs;
+	unsigned int num_netifs = 0, max_netifs = 0, hint = 0;
+	char *line, *end;
+	ssize_t len;
 
 	struct priv_data *priv = get_priv_data(node->handle);
+	char devNoBridge[sizeof(priv->bridge) + 1];
 
 	if (priv == NULL) {
 		perror("Allocation error");
 		return 0;
 	}
 
-	/* Open and validate /proc/net/dev if we haven't already */
-	if (priv->procnetdev == NULL) {
-		char header[sizeof(PROCNETDEV_HEADER)];
-		priv->procnetdev = fopen("/proc/net/dev", "r");
-		if (priv->procnetdev == NULL) {
-			perror("Error opening /proc/net/dev");
-			return 0;
-		}
+	/* Fill in networks from a single read of /proc/net/dev */
+	len = read_procnetdev(priv);
+	if (len < 0)
+		return 0;
 
-		/* Validate the format of /proc/net/dev */
-		if (fread(header, sizeof(PROCNETDEV_HEADER) - 1, 1,
-			  priv->procnetdev) != 1) {
-			perror("Error reading /proc/net/dev header");
-			return 0;
-		}
-		header[sizeof(PROCNETDEV_HEADER) - 1] = '\0';
-		if (strcmp(header, PROCNETDEV_HEADER) != 0) {
-			fprintf(stderr,
-				"Unexpected /proc/net/dev format\n");
-			return 0;
-		}
+	for (line = priv->netbuf; (line = strchr(line, '\n')) != NULL; line++)
+		max_netifs++;
+	netifs = calloc(max_netifs + 1, sizeof(struct netif_cache));
+	if (netifs == NULL) {
+		perror("Allocation error");
+		return 0;
 	}
 
-	/* Fill in networks */
-	/* FIXME: optimize this */
-	fseek(priv->procnetdev, sizeof(PROCNETDEV_HEADER) - 1,
-	      SEEK_SET);
-
 	/* We get the bridge devices for use with bonding interface to get bonding interface stats */
-	getBridge("vir", devBridge, sizeof(devBridge));
-	snprintf(devNoBridge, 16, "p%s", devBridge);
+	if (priv->bridge_generation == 0 ||
+	    node->handle->generation - priv->bridge_generation >=
+	    XENSTAT_REVALIDATE_PERIOD) {
+		memset(priv->bridge, 0, sizeof(priv->bridge));
+		getBridge("vir", priv->bridge, sizeof(priv->bridge));
+		priv->bridge_generation = node->handle->generation;
+	}
+	ret = snprintf(devNoBridge, sizeof(devNoBridge), "p%s", priv->bridge);
+	if (ret < 0 || (size_t)ret >= sizeof(devNoBridge))
+		/* matches any name, so the bonding fixup below is skipped */
+		devNoBridge[0] = '\0';
 
-	while (fgets(line, 512, priv->procnetdev)) {
+	for (line = priv->netbuf + sizeof(PROCNETDEV_HEADER) - 1;
+	     (end = strchr(line, '\n')) != NULL; line = end + 1) {
 		xenstat_domain *domain;
 		xenstat_network net;
-		unsigned int domid;
+		struct netif_cache *netif = &netifs[num_netifs];
 
-		parseNetDevLine(line, iface, &rxBytes, &rxPackets, &rxErrs, &rxDrops, NULL, NULL, NULL,
-				NULL, &txBytes, &txPackets, &txErrs, &txDrops, NULL, NULL, NULL, NULL);
+		*end = '\0';
+		if (parseNetDevLine(line, netif->name, &rxBytes, &rxPackets, &rxErrs, &rxDrops, NULL, NULL, NULL,
+				NULL, &txBytes, &txPackets, &txErrs, &txDrops, NULL, NULL, NULL, NULL) != 0)
+			continue;
 
 		/* If the device parsed is network bridge and both tx & rx packets are zero, we are most */
 		/* likely using bonding so we alter the configuration for dom0 to have bridge stats */
-		if ((strstr(iface, devBridge) != NULL) &&
-		    (strstr(iface, devNoBridge) == NULL) &&
+		if ((priv->bridge[0] != '\0') &&
+		    (strstr(netif->name, priv->bridge) != NULL) &&
+		    (strstr(netif->name, devNoBridge) == NULL) &&
 		    ((domain = xenstat_node_domain(node, 0)) != NULL)) {
 			for (i = 0; i < domain->num_networks; i++) {
 				if ((domain->networks[i].id != 0) ||
@@ -333,32 +348,37 @@ int xenstat_collect_networks(xenstat_node * node)
 				domain->networks[i].rerrs = rxErrs;
 				domain->networks[i].rdrop = rxDrops;
 			}
+			continue;
 		}
-		else /* Otherwise we need to preserve old behaviour */
-		if (get_iface_domid_network(iface, &domid, &net.id)) {
-
-			net.tbytes = txBytes;
-			net.tpackets = txPackets;
-			net.terrs = txErrs;
-			net.tdrop = txDrops;
-			net.rbytes = rxBytes;
-			net.rpackets = rxPackets;
-			net.rerrs = rxErrs;
-			net.rdrop = rxDrops;
-
-		/* FIXME: this does a search for the domid */
-		  domain = xenstat_node_domain(node, domid);
-		  if (domain == NULL) {
+
+		/* Otherwise we need to preserve old behaviour */
+		lookup_iface(node, priv, netif, num_netifs, &hint);
+		num_netifs++;
+		if (!netif->is_vif)
+			continue;
+
+		net.id = netif->netid;
+		net.tbytes = txBytes;
+		net.tpackets = txPackets;
+		net.terrs = txErrs;
+		net.tdrop = txDrops;
+		net.rbytes = rxBytes;
+		net.rpackets = rxPackets;
+		net.rerrs = rxErrs;
+		net.rdrop = rxDrops;
+
+		domain = xenstat_node_domain(node, netif->domid);
+		if (domain == NULL) {
 			fprintf(stderr,
 				"Found interface vif%u.%u but domain %u"
-				" does not exist.\n", domid, net.id,
-				domid);
+				" does not exist.\n", netif->domid, net.id,
+				netif->domid);
 			continue;
-		  }
-		  if (domain->networks == NULL) {
+		}
+		if (domain->networks == NULL) {
 			domain->num_networks = 1;
 			domain->networks = malloc(sizeof(xenstat_network));
-		  } else {
+		} else {
 			struct xenstat_network *tmp;
 			domain->num_networks++;
 			tmp = realloc(domain->networks,
@@ -367,12 +387,17 @@ int xenstat_collect_networks(xenstat_node * node)
 			if (tmp == NULL)
 				free(domain->networks);
 			domain->networks = tmp;
-		  }
-		  if (domain->networks == NULL)
+		}
+		if (domain->networks == NULL) {
+			free(netifs);
 			return 0;
-		  domain->networks[domain->num_networks - 1] = net;
-          }
-        }
+		}
+		domain->networks[domain->num_networks - 1] = net;
+	}
+
+	free(priv->netifs);
+	priv->netifs = netifs;
+	priv->num_netifs = num_netifs;
 
 	return 1;
 }
@@ -381,18 +406,19 @@ int xenstat_collect_networks(xenstat_node * node)
 void xenstat_uninit_networks(xenstat_handle * handle)
 {
 	struct priv_data *priv = get_priv_data(handle);
-	if (priv != NULL && priv->procnetdev != NULL)
-		fclose(priv->procnetdev);
+	if (priv == NULL)
+		return;
+	if (priv->procnetdev != -1)
+		close(priv->procnetdev);
+	free(priv->netbuf);
+	free(priv->netifs);
 }
 
-static int read_attributes_vbd(const char *vbd_directory, const char *what, char *ret, int cap)
+static int read_attributes_vbd(int stats_fd, const char *what, char *ret, int cap)
 {
-	static char file_name[80];
 	int fd, num_read;
 
-	snprintf(file_name, sizeof(file_name), "%s/%s/%s",
-		SYSFS_VBD_PATH, vbd_directory, what);
-	fd = open(file_name, O_RDONLY, 0);
+	fd = openat(stats_fd, what, O_RDONLY, 0);
 	if (fd==-1) return -1;
 	num_read = read(fd, ret, cap - 1);
 	close(fd);
@@ -430,8 +456,8 @@ int xenstat_collect_vbds(xenstat_node * node)
 		xenstat_domain *domain;
 		xenstat_vbd vbd;
 		unsigned int domid;
-		int ret;
-		char buf[256];
+		int ret, stats_fd;
+		char buf[NAME_MAX + sizeof("/statistics")];
 
 		ret = sscanf(dp->d_name, "%3s-%u-%u", buf, &domid, &vbd.dev);
 		if (ret != 3)
@@ -453,35 +479,28 @@ int xenstat_collect_vbds(xenstat_node * node)
 			continue;
 		}
 
-		if((read_attributes_vbd(dp->d_name, "statistics/oo_req", buf, 256)<=0)
-		   || ((ret = sscanf(buf, "%llu", &vbd.oo_reqs)) != 1))
-		{
+		/* Resolve the statistics directory once for all five reads */
+		ret = snprintf(buf, sizeof(buf), "%s/statistics", dp->d_name);
+		if (ret < 0 || (size_t)ret >= sizeof(buf))
 			continue;
-		}
-
-		if((read_attributes_vbd(dp->d_name, "statistics/rd_req", buf, 256)<=0)
-		   || ((ret = sscanf(buf, "%llu", &vbd.rd_reqs)) != 1))
-		{
+		stats_fd = openat(dirfd(priv->sysfsvbd), buf,
+				  O_RDONLY | O_DIRECTORY);
+		if (stats_fd == -1)
 			continue;
-		}
-
-		if((read_attributes_vbd(dp->d_name, "statistics/wr_req", buf, 256)<=0)
-		   || ((ret = sscanf(buf, "%llu", &vbd.wr_reqs)) != 1))
-		{
-			continue;
-		}
 
-		if((read_attributes_vbd(dp->d_name, "statistics/rd_sect", buf, 256)<=0)
-		   || ((ret = sscanf(buf, "%llu", &vbd.rd_sects)) != 1))
-		{
+		ret = (read_attributes_vbd(stats_fd, "oo_req", buf, sizeof(buf)) > 0 &&
+		       sscanf(buf, "%llu", &vbd.oo_reqs) == 1 &&
+		       read_attributes_vbd(stats_fd, "rd_req", buf, sizeof(buf)) > 0 &&
+		       sscanf(buf, "%llu", &vbd.rd_reqs) == 1 &&
+		       read_attributes_vbd(stats_fd, "wr_req", buf, sizeof(buf)) > 0 &&
+		       sscanf(buf, "%llu", &vbd.wr_reqs) == 1 &&
+		       read_attributes_vbd(stats_fd, "rd_sect", buf, sizeof(buf)) > 0 &&
+		       sscanf(buf, "%llu", &vbd.rd_sects) == 1 &&
+		       read_attributes_vbd(stats_fd, "wr_sect", buf, sizeof(buf)) > 0 &&
+		       sscanf(buf, "%llu", &vbd.wr_sects) == 1);
+		close(stats_fd);
+		if (!ret)
 			continue;
-		}
-
-		if((read_attributes_vbd(dp->d_name, "statistics/wr_sect", buf, 256)<=0)
-		   || ((ret = sscanf(buf, "%llu", &vbd.wr_sects)) != 1))
-		{
-			continue;
-		}
 
 		if ((xenstat_save_vbd(domain, &vbd)) == NULL) {
 			perror("Allocation error");
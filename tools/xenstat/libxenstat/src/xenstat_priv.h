@@ -32,12 +32,42 @@
 #define SHORT_ASC_LEN 5                 /* length of 65535 */
 #define VERSION_SIZE (2 * SHORT_ASC_LEN + 1 + sizeof(xen_extraversion_t) + 1)
 
+/* Cached attributes which can change behind our back (domain names, the
+ * interface to domain mapping) are re-read from their source once every
+ * this many calls to xenstat_get_node, a slice at a time. */
+#define XENSTAT_REVALIDATE_PERIOD 64
+
+/* What the previous xenstat_get_node saw of a domain, kept in the handle
+ * so the next one can skip work and report what changed */
+typedef struct xenstat_domain_cache {
+	unsigned int id;
+	xen_domain_handle_t uuid;	/* Tells a reused domain ID apart */
+	unsigned int seen;		/* Generation which last saw the domain */
+	unsigned int flags;		/* Collectors run for this entry */
+	char *name;
+	unsigned int state;
+	unsigned long long cpu_ns;
+	unsigned long long cur_mem;
+	unsigned long long max_mem;
+	unsigned long long tmem_sum;
+	unsigned int num_vcpus;
+	unsigned int online_vcpus;
+	xenstat_vcpu *vcpus;		/* Array of length num_vcpus */
+	unsigned int num_networks;
+	unsigned long long net_sum;
+	unsigned int num_vbds;
+	unsigned long long vbd_sum;
+} xenstat_domain_cache;
+
 struct xenstat_handle {
 	xc_interface *xc_handle;
 	struct xs_handle *xshandle; /* xenstore handle */
 	int page_size;
 	void *priv;
 	char xen_version[VERSION_SIZE]; /* xen version running on this node */
+	unsigned int generation;	/* No. of calls to xenstat_get_node */
+	unsigned int num_cached;
+	xenstat_domain_cache *cache;	/* Sorted by domain ID */
 };
 
 struct xenstat_node {
@@ -50,6 +80,10 @@ struct xenstat_node {
 	unsigned int num_domains;
 	xenstat_domain *domains;	/* Array of length num_domains */
 	long freeable_mb;
+	unsigned int num_changed;
+	unsigned int *changed;		/* Indices into domains */
+	unsigned int num_removed;
+	unsigned int *removed;		/* Domain IDs */
 };
 
 struct xenstat_tmem {
@@ -59,12 +93,19 @@ struct xenstat_tmem {
 	unsigned long long succ_pers_gets;
 };
 
+struct xenstat_sched_hist {
+	unsigned long long buckets[XEN_SCHED_HIST_BUCKETS];
+	unsigned long long total;	/* ns */
+};
+
 struct xenstat_domain {
 	unsigned int id;
+	xen_domain_handle_t uuid;
 	char *name;
 	unsigned int state;
 	unsigned long long cpu_ns;
 	unsigned int num_vcpus;		/* No. vcpus configured for domain */
+	unsigned int online_vcpus;
 	xenstat_vcpu *vcpus;		/* Array of length num_vcpus */
 	unsigned long long cur_mem;	/* Current memory reservation */
 	unsigned long long max_mem;	/* Total memory allowed */
@@ -74,6 +115,11 @@ struct xenstat_domain {
 	unsigned int num_vbds;
 	xenstat_vbd *vbds;
 	xenstat_tmem tmem_stats;
+	unsigned int have_sched_hist;	/* run_delay and slice are valid */
+	xenstat_sched_hist run_delay;
+	xenstat_sched_hist slice;
+	unsigned int changed;		/* XENSTAT_CHANGED_* */
+	xenstat_domain_cache *prev;	/* Only valid in xenstat_get_node */
 };
 
 struct xenstat_vcpu {
@@ -0,0 +1,876 @@
+/*
+ * xenstat-exporter: serve libxenstat statistics in the OpenMetrics text
+ * format over a local socket.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; under version 2 of the License.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+
+/*
+ * Statistics are collected on a fixed interval with a single xenstat
+ * handle, and each collection is rendered once into a complete HTTP
+ * response.  Scrapes only ever copy out the most recent response, so
+ * however often (or seldom) they come, they cost the host nothing beyond
+ * the collection itself.
+ */
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <syslog.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <xenstat.h>
+
+#include "_paths.h"
+
+#define DEFAULT_SOCKET XEN_RUN_DIR "/xenstat-exporter.sock"
+#define DEFAULT_INTERVAL 5		/* seconds */
+#define MAX_CLIENTS 32
+#define CLIENT_TIMEOUT_MS 5000
+#define REQUEST_MAX 4096
+
+#define NOT_FOUND "Not found\n"
+#define BAD_METHOD "Only GET is supported\n"
+#define BAD_REQUEST "Request too large\n"
+
+#define CONTENT_TYPE \
+	"application/openmetrics-text; version=1.0.0; charset=utf-8"
+
+/* A rendered HTTP response, shared by every client it is being sent to */
+struct response {
+	unsigned int refs;
+	size_t len;
+	char data[];
+};
+
+struct client {
+	int fd;
+	uint64_t deadline;
+	size_t request_len;
+	char request[REQUEST_MAX];
+	struct response *response;	/* NULL while reading the request */
+	size_t sent;
+};
+
+/* Growable text buffer used while rendering */
+struct buffer {
+	char *data;
+	size_t len;
+	size_t size;
+	int failed;
+};
+
+static xenstat_handle *xhandle;
+static xenstat_node *cur_node;		/* Latest successful collection */
+static struct response *metrics;	/* Response to the latest collection */
+static struct response *not_found, *bad_method, *bad_request;
+static struct client *clients[MAX_CLIENTS];
+static unsigned int num_clients;
+static int listen_fd = -1;
+static const char *socket_path = DEFAULT_SOCKET;
+static int use_syslog;
+static volatile sig_atomic_t quit;
+
+/* Exporter's own statistics */
+static unsigned long long collections;
+static unsigned long long collection_errors;
+static uint64_t collection_ns;
+static struct timespec last_collection;
+
+static void usage(const char *program)
+{
+	printf("Usage: %s [OPTION]\n"
+	       "Serves xen statistics in the OpenMetrics text format\n\n"
+	       "-h, --help             display this help and exit\n"
+	       "-i, --interval=SECONDS seconds between collections (default %d)\n"
+	       "-s, --socket=PATH      listen on a UNIX socket (default %s)\n"
+	       "-p, --port=PORT        listen on 127.0.0.1:PORT instead\n"
+	       "-D, --daemon           detach and log to syslog\n",
+	       program, DEFAULT_INTERVAL, DEFAULT_SOCKET);
+}
+
+static void logmsg(int priority, const char *fmt, ...)
+{
+	va_list ap;
+
+	va_start(ap, fmt);
+	if (use_syslog) {
+		vsyslog(priority, fmt, ap);
+	} else {
+		vfprintf(stderr, fmt, ap);
+		fputc('\n', stderr);
+	}
+	va_end(ap);
+}
+
+static uint64_t monotonic_ms(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/*
+ * Rendering
+ */
+
+static void buffer_printf(struct buffer *b, const char *fmt, ...)
+{
+	va_list ap;
+	int len;
+
+	if (b->failed)
+		return;
+
+	for (;;) {
+		va_start(ap, fmt);
+		len = vsnprintf(b->data + b->len, b->size - b->len, fmt, ap);
+		va_end(ap);
+		if (len < 0) {
+			b->failed = 1;
+			return;
+		}
+		if (b->len + len < b->size)
+			break;
+
+		b->size = b->size ? 2 * b->size : 65536;
+		while (b->size <= b->len + len)
+			b->size *= 2;
+		b->data = realloc(b->data, b->size);
+		if (b->data == NULL) {
+			b->failed = 1;
+			return;
+		}
+	}
+	b->len += len;
+}
+
+/* Append a label value, escaped as the exposition format requires */
+static void buffer_escape(struct buffer *b, const char *s)
+{
+	for (; *s; s++) {
+		if (*s == '\\' || *s == '"')
+			buffer_printf(b, "\\%c", *s);
+		else if (*s == '\n')
+			buffer_printf(b, "\\n");
+		else
+			buffer_printf(b, "%c", *s);
+	}
+}
+
+static void family(struct buffer *b, const char *name, const char *type,
+		   const char *unit, const char *help)
+{
+	buffer_printf(b, "# TYPE %s %s\n", name, type);
+	if (unit != NULL)
+		buffer_printf(b, "# UNIT %s %s\n", name, unit);
+	buffer_printf(b, "# HELP %s %s\n", name, help);
+}
+
+static void domain_labels(struct buffer *b, xenstat_domain *domain)
+{
+	buffer_printf(b, "domid=\"%u\",domain=\"", xenstat_domain_id(domain));
+	buffer_escape(b, xenstat_domain_name(domain));
+	buffer_printf(b, "\"");
+}
+
+/* Nanosecond counters are printed as exact decimal seconds */
+static void seconds(struct buffer *b, unsigned long long ns)
+{
+	buffer_printf(b, " %llu.%09llu\n", ns / 1000000000ULL,
+		      ns % 1000000000ULL);
+}
+
+static void render_node(struct buffer *b, xenstat_node *node)
+{
+	const char *version = xenstat_node_xen_version(node);
+
+	family(b, "xen_version", "info", NULL, "Version of the hypervisor.");
+	buffer_printf(b, "xen_version_info{version=\"");
+	buffer_escape(b, version);
+	buffer_printf(b, "\"} 1\n");
+
+	family(b, "xen_node_cpus", "gauge", NULL,
+	       "Number of physical CPUs.");
+	buffer_printf(b, "xen_node_cpus %u\n", xenstat_node_num_cpus(node));
+
+	family(b, "xen_node_cpu_frequency_hertz", "gauge", "hertz",
+	       "Physical CPU frequency.");
+	buffer_printf(b, "xen_node_cpu_frequency_hertz %llu\n",
+		      xenstat_node_cpu_hz(node));
+
+	family(b, "xen_node_memory_bytes", "gauge", "bytes",
+	       "Total host memory.");
+	buffer_printf(b, "xen_node_memory_bytes %llu\n",
+		      xenstat_node_tot_mem(node));
+
+	family(b, "xen_node_memory_free_bytes", "gauge", "bytes",
+	       "Host memory not allocated to any domain.");
+	buffer_printf(b, "xen_node_memory_free_bytes %llu\n",
+		      xenstat_node_free_mem(node));
+
+	family(b, "xen_node_domains", "gauge", NULL, "Number of domains.");
+	buffer_printf(b, "xen_node_domains %u\n",
+		      xenstat_node_num_domains(node));
+}
+
+static void render_domains(struct buffer *b, xenstat_node *node)
+{
+	static const struct {
+		const char *name;
+		unsigned int (*get)(xenstat_domain *);
+	} states[] = {
+		{ "running", xenstat_domain_running },
+		{ "blocked", xenstat_domain_blocked },
+		{ "paused", xenstat_domain_paused },
+		{ "shutdown", xenstat_domain_shutdown },
+		{ "crashed", xenstat_domain_crashed },
+		{ "dying", xenstat_domain_dying },
+	};
+	unsigned int num_domains = xenstat_node_num_domains(node);
+	unsigned int i, j;
+	xenstat_domain *domain;
+
+	family(b, "xen_domain_state", "stateset", NULL,
+	       "Scheduling and lifecycle state of the domain.");
+	for (i = 0; i < num_domains; i++) {
+		domain = xenstat_node_domain_by_index(node, i);
+		for (j = 0; j < sizeof(states) / sizeof(states[0]); j++) {
+			buffer_printf(b, "xen_domain_state{");
+			domain_labels(b, domain);
+			buffer_printf(b, ",xen_domain_state=\"%s\"} %u\n",
+				      states[j].name, states[j].get(domain));
+		}
+	}
+
+	family(b, "xen_domain_cpu_seconds", "counter", "seconds",
+	       "CPU time consumed by all of the domain's VCPUs.");
+	for (i = 0; i < num_domains; i++) {
+		domain = xenstat_node_domain_by_index(node, i);
+		buffer_printf(b, "xen_domain_cpu_seconds_total{");
+		domain_labels(b, domain);
+		buffer_printf(b, "}");
+		seconds(b, xenstat_domain_cpu_ns(domain));
+	}
+
+	family(b, "xen_domain_vcpus", "gauge", NULL,
+	       "Number of VCPUs configured for the domain.");
+	for (i = 0; i < num_domains; i++) {
+		domain = xenstat_node_domain_by_index(node, i);
+		buffer_printf(b, "xen_domain_vcpus{");
+		domain_labels(b, domain);
+		buffer_printf(b, "} %u\n", xenstat_domain_num_vcpus(domain));
+	}
+
+	family(b, "xen_domain_memory_bytes", "gauge", "bytes",
+	       "Current memory reservation of the domain.");
+	for (i = 0; i < num_domains; i++) {
+		domain = xenstat_node_domain_by_index(node, i);
+		buffer_printf(b, "xen_domain_memory_bytes{");
+		domain_labels(b, domain);
+		buffer_printf(b, "} %llu\n", xenstat_domain_cur_mem(domain));
+	}
+
+	family(b, "xen_domain_memory_max_bytes", "gauge", "bytes",
+	       "Maximum memory reservation of the domain.");
+	for (i = 0; i < num_domains; i++) {
+		unsigned long long max_mem;
+
+		domain = xenstat_node_domain_by_index(node, i);
+		max_mem = xenstat_domain_max_mem(domain);
+		buffer_printf(b, "xen_domain_memory_max_bytes{");
+		domain_labels(b, domain);
+		if (max_mem == (unsigned long long)-1)
+			buffer_printf(b, "} +Inf\n");
+		else
+			buffer_printf(b, "} %llu\n", max_mem);
+	}
+}
+
+static void render_vcpus(struct buffer *b, xenstat_node *node)
+{
+	unsigned int num_domains = xenstat_node_num_domains(node);
+	unsigned int i, j;
+	xenstat_domain *domain;
+	xenstat_vcpu *vcpu;
+
+	family(b, "xen_vcpu_online", "gauge", NULL,
+	       "Whether the VCPU is online.");
+	for (i = 0; i < num_domains; i++) {
+		domain = xenstat_node_domain_by_index(node, i);
+		for (j = 0; j < xenstat_domain_num_vcpus(domain); j++) {
+			vcpu = xenstat_domain_vcpu(domain, j);
+			buffer_printf(b, "xen_vcpu_online{");
+			domain_labels(b, domain);
+			buffer_printf(b, ",vcpu=\"%u\"} %u\n", j,
+				      xenstat_vcpu_online(vcpu) ? 1 : 0);
+		}
+	}
+
+	family(b, "xen_vcpu_cpu_seconds", "counter", "seconds",
+	       "CPU time consumed by the VCPU.");
+	for (i = 0; i < num_domains; i++) {
+		domain = xenstat_node_domain_by_index(node, i);
+		for (j = 0; j < xenstat_domain_num_vcpus(domain); j++) {
+			vcpu = xenstat_domain_vcpu(domain, j);
+			buffer_printf(b, "xen_vcpu_cpu_seconds_total{");
+			domain_labels(b, domain);
+			buffer_printf(b, ",vcpu=\"%u\"}", j);
+			seconds(b, xenstat_vcpu_ns(vcpu));
+		}
+	}
+}
+
+static void render_networks(struct buffer *b, xenstat_node *node)
+{
+	static const struct {
+		const char *name;
+		const char *help;
+		unsigned long long (*get)(xenstat_network *);
+	} counters[] = {
+		{ "xen_network_receive_bytes", "Bytes received.",
+		  xenstat_network_rbytes },
+		{ "xen_network_receive_packets",
+		  "Packets received.",
+		  xenstat_network_rpackets },
+		{ "xen_network_receive_errors",
+		  "Receive errors.",
+		  xenstat_network_rerrs },
+		{ "xen_network_receive_drops",
+		  "Received packets dropped.",
+		  xenstat_network_rdrop },
+		{ "xen_network_transmit_bytes",
+		  "Bytes transmitted.",
+		  xenstat_network_tbytes },
+		{ "xen_network_transmit_packets",
+		  "Packets transmitted.",
+		  xenstat_network_tpackets },
+		{ "xen_network_transmit_errors",
+		  "Transmit errors.",
+		  xenstat_network_terrs },
+		{ "xen_network_transmit_drops",
+		  "Transmitted packets dropped.",
+		  xenstat_network_tdrop },
+	};
+	unsigned int num_domains = xenstat_node_num_domains(node);
+	unsigned int c, i, j;
+	xenstat_domain *domain;
+	xenstat_network *net;
+
+	/* As with xentop, these are the counters of the backend interface */
+	for (c = 0; c < sizeof(counters) / sizeof(counters[0]); c++) {
+		family(b, counters[c].name, "counter",
+		       strstr(counters[c].name, "bytes") ? "bytes" : NULL,
+		       counters[c].help);
+		for (i = 0; i < num_domains; i++) {
+			domain = xenstat_node_domain_by_index(node, i);
+			for (j = 0; j < xenstat_domain_num_networks(domain);
+			     j++) {
+				net = xenstat_domain_network(domain, j);
+				buffer_printf(b, "%s_total{", counters[c].name);
+				domain_labels(b, domain);
+				buffer_printf(b, ",network=\"%u\"} %llu\n",
+					      xenstat_network_id(net),
+					      counters[c].get(net));
+			}
+		}
+	}
+}
+
+static void render_vbds(struct buffer *b, xenstat_node *node)
+{
+	static const struct {
+		const char *name;
+		const char *help;
+		unsigned long long (*get)(xenstat_vbd *);
+	} counters[] = {
+		{ "xen_vbd_oo_requests",
+		  "Requests delayed for lack of backend resources.",
+		  xenstat_vbd_oo_reqs },
+		{ "xen_vbd_read_requests", "Read requests.",
+		  xenstat_vbd_rd_reqs },
+		{ "xen_vbd_write_requests", "Write requests.",
+		  xenstat_vbd_wr_reqs },
+		{ "xen_vbd_read_sectors", "Sectors read.",
+		  xenstat_vbd_rd_sects },
+		{ "xen_vbd_write_sectors", "Sectors written.",
+		  xenstat_vbd_wr_sects },
+	};
+	static const char *backends[] = { "unknown", "blkback", "blktap" };
+	unsigned int num_domains = xenstat_node_num_domains(node);
+	unsigned int c, i, j, type;
+	xenstat_domain *domain;
+	xenstat_vbd *vbd;
+
+	for (c = 0; c < sizeof(counters) / sizeof(counters[0]); c++) {
+		family(b, counters[c].name, "counter", NULL, counters[c].help);
+		for (i = 0; i < num_domains; i++) {
+			domain = xenstat_node_domain_by_index(node, i);
+			for (j = 0; j < xenstat_domain_num_vbds(domain); j++) {
+				vbd = xenstat_domain_vbd(domain, j);
+				type = xenstat_vbd_type(vbd);
+				if (type >= sizeof(backends) / sizeof(backends[0]))
+					type = 0;
+				buffer_printf(b, "%s_total{", counters[c].name);
+				domain_labels(b, domain);
+				buffer_printf(b, ",device=\"%u\",backend=\"%s\"}"
+					      " %llu\n", xenstat_vbd_dev(vbd),
+					      backends[type],
+					      counters[c].get(vbd));
+			}
+		}
+	}
+}
+
+static void render_exporter(struct buffer *b)
+{
+	family(b, "xenstat_exporter_collections", "counter", NULL,
+	       "Collections attempted.");
+	buffer_printf(b, "xenstat_exporter_collections_total %llu\n",
+		      collections);
+
+	family(b, "xenstat_exporter_collection_errors", "counter", NULL,
+	       "Collections which failed; the previous data is served.");
+	buffer_printf(b, "xenstat_exporter_collection_errors_total %llu\n",
+		      collection_errors);
+
+	family(b, "xenstat_exporter_collection_duration_seconds", "gauge",
+	       "seconds", "Time taken by the latest collection.");
+	buffer_printf(b, "xenstat_exporter_collection_duration_seconds");
+	seconds(b, collection_ns);
+
+	family(b, "xenstat_exporter_last_collection_timestamp_seconds",
+	       "gauge", "seconds", "Time of the latest successful collection.");
+	buffer_printf(b, "xenstat_exporter_last_collection_timestamp_seconds");
+	seconds(b, (unsigned long long)last_collection.tv_sec * 1000000000ULL
+		+ last_collection.tv_nsec);
+}
+
+/* Wrap body in an HTTP response.  Returns NULL on allocation failure. */
+static struct response *response_new(const char *status,
+				     const char *content_type,
+				     const char *body, size_t body_len)
+{
+	struct response *r;
+	char header[256];
+	int len;
+
+	len = snprintf(header, sizeof(header),
+		       "HTTP/1.0 %s\r\n"
+		       "Content-Type: %s\r\n"
+		       "Content-Length: %zu\r\n"
+		       "Connection: close\r\n\r\n",
+		       status, content_type, body_len);
+
+	r = malloc(sizeof(*r) + len + body_len);
+	if (r == NULL)
+		return NULL;
+	r->refs = 1;
+	r->len = len + body_len;
+	memcpy(r->data, header, len);
+	memcpy(r->data + len, body, body_len);
+	return r;
+}
+
+static struct response *response_get(struct response *r)
+{
+	r->refs++;
+	return r;
+}
+
+static void response_put(struct response *r)
+{
+	if (r != NULL && --r->refs == 0)
+		free(r);
+}
+
+static struct response *render(xenstat_node *node)
+{
+	struct buffer b = { NULL, 0, 0, 0 };
+	struct response *r;
+
+	if (node != NULL) {
+		render_node(&b, node);
+		render_domains(&b, node);
+		render_vcpus(&b, node);
+		render_networks(&b, node);
+		render_vbds(&b, node);
+	}
+	render_exporter(&b);
+	buffer_printf(&b, "# EOF\n");
+
+	if (b.failed) {
+		free(b.data);
+		return NULL;
+	}
+
+	r = response_new("200 OK", CONTENT_TYPE, b.data, b.len);
+	free(b.data);
+	return r;
+}
+
+/*
+ * Collection
+ */
+
+static void collect(void)
+{
+	xenstat_node *new_node;
+	struct response *r;
+	struct timespec start, end;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	new_node = xenstat_get_node(xhandle, XENSTAT_ALL);
+	clock_gettime(CLOCK_MONOTONIC, &end);
+
+	collections++;
+	collection_ns = (uint64_t)(end.tv_sec - start.tv_sec) * 1000000000ULL
+		+ end.tv_nsec - start.tv_nsec;
+
+	/* Keep serving the last good data, with the error counted */
+	if (new_node == NULL) {
+		collection_errors++;
+		logmsg(LOG_WARNING, "Failed to collect statistics: %s",
+		       strerror(errno));
+	} else {
+		if (cur_node != NULL)
+			xenstat_free_node(cur_node);
+		cur_node = new_node;
+		clock_gettime(CLOCK_REALTIME, &last_collection);
+	}
+
+	r = render(cur_node);
+	if (r == NULL) {
+		logmsg(LOG_ERR, "Failed to render statistics");
+		return;
+	}
+	response_put(metrics);
+	metrics = r;
+}
+
+/*
+ * Serving
+ */
+
+static int set_nonblocking(int fd)
+{
+	int flags = fcntl(fd, F_GETFL);
+
+	if (flags == -1 || fcntl(fd, F_SETFL, flags | O_NONBLOCK) == -1)
+		return -1;
+	return 0;
+}
+
+static int open_unix_socket(const char *path)
+{
+	struct sockaddr_un addr = { .sun_family = AF_UNIX };
+	int fd;
+
+	if (strlen(path) >= sizeof(addr.sun_path)) {
+		logmsg(LOG_ERR, "Socket path too long: %s", path);
+		return -1;
+	}
+	strcpy(addr.sun_path, path);
+
+	fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (fd == -1)
+		return -1;
+
+	unlink(path);
+	if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) == -1) {
+		close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+static int open_tcp_socket(unsigned short port)
+{
+	struct sockaddr_in addr = {
+		.sin_family = AF_INET,
+		.sin_port = htons(port),
+		.sin_addr.s_addr = htonl(INADDR_LOOPBACK),
+	};
+	int fd, on = 1;
+
+	fd = socket(AF_INET, SOCK_STREAM, 0);
+	if (fd == -1)
+		return -1;
+
+	setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+	if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) == -1) {
+		close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+static void client_close(unsigned int i)
+{
+	struct client *c = clients[i];
+
+	close(c->fd);
+	response_put(c->response);
+	free(c);
+	clients[i] = clients[--num_clients];
+}
+
+static void accept_client(void)
+{
+	struct client *c;
+	int fd;
+
+	fd = accept(listen_fd, NULL, NULL);
+	if (fd == -1)
+		return;
+
+	c = calloc(1, sizeof(*c));
+	if (c == NULL || set_nonblocking(fd) == -1) {
+		free(c);
+		close(fd);
+		return;
+	}
+	c->fd = fd;
+	c->deadline = monotonic_ms() + CLIENT_TIMEOUT_MS;
+	clients[num_clients++] = c;
+}
+
+/* Pick the response once the request line and headers are in */
+static void client_request(struct client *c)
+{
+	char *end, *path;
+
+	c->request[c->request_len] = '\0';
+	if (strstr(c->request, "\r\n\r\n") == NULL &&
+	    strstr(c->request, "\n\n") == NULL) {
+		if (c->request_len == sizeof(c->request) - 1)
+			c->response = response_get(bad_request);
+		return;
+	}
+
+	if (strncmp(c->request, "GET ", 4) != 0) {
+		c->response = response_get(bad_method);
+		return;
+	}
+
+	path = c->request + 4;
+	end = path + strcspn(path, " ?\r\n");
+	*end = '\0';
+	if (strcmp(path, "/metrics") == 0 || strcmp(path, "/") == 0)
+		c->response = response_get(metrics);
+	else
+		c->response = response_get(not_found);
+}
+
+/* Returns 0 once the client is finished with */
+static int client_io(struct client *c, short revents)
+{
+	ssize_t ret;
+
+	if (c->response == NULL) {
+		ret = read(c->fd, c->request + c->request_len,
+			   sizeof(c->request) - 1 - c->request_len);
+		if (ret == 0 || (ret < 0 && errno != EAGAIN && errno != EINTR))
+			return 0;
+		if (ret > 0) {
+			c->request_len += ret;
+			client_request(c);
+		}
+		if (c->response == NULL)
+			return 1;
+	}
+
+	ret = send(c->fd, c->response->data + c->sent,
+		   c->response->len - c->sent, MSG_NOSIGNAL);
+	if (ret < 0)
+		return errno == EAGAIN || errno == EINTR;
+	c->sent += ret;
+	return c->sent < c->response->len;
+}
+
+static void handle_signal(int sig)
+{
+	quit = 1;
+}
+
+static void cleanup(void)
+{
+	while (num_clients)
+		client_close(0);
+	if (listen_fd != -1) {
+		close(listen_fd);
+		if (socket_path != NULL)
+			unlink(socket_path);
+	}
+	if (cur_node != NULL)
+		xenstat_free_node(cur_node);
+	if (xhandle != NULL)
+		xenstat_uninit(xhandle);
+}
+
+int main(int argc, char **argv)
+{
+	int opt, optind = 0;
+	struct option lopts[] = {
+		{ "help",     no_argument,       NULL, 'h' },
+		{ "interval", required_argument, NULL, 'i' },
+		{ "socket",   required_argument, NULL, 's' },
+		{ "port",     required_argument, NULL, 'p' },
+		{ "daemon",   no_argument,       NULL, 'D' },
+		{ 0, 0, 0, 0 },
+	};
+	const char *sopts = "hi:s:p:D";
+	struct pollfd fds[MAX_CLIENTS + 1];
+	struct sigaction sa = { .sa_handler = handle_signal };
+	unsigned int interval = DEFAULT_INTERVAL, i, nfds;
+	int port = 0, daemonize = 0;
+	uint64_t now, next_collection, wake;
+
+	while ((opt = getopt_long(argc, argv, sopts, lopts, &optind)) != -1) {
+		switch (opt) {
+		case 'h':
+			usage(argv[0]);
+			exit(0);
+		case 'i':
+			interval = atoi(optarg);
+			if (interval == 0) {
+				fprintf(stderr, "Invalid interval: %s\n",
+					optarg);
+				exit(1);
+			}
+			break;
+		case 's':
+			socket_path = optarg;
+			break;
+		case 'p':
+			port = atoi(optarg);
+			if (port <= 0 || port > 65535) {
+				fprintf(stderr, "Invalid port: %s\n", optarg);
+				exit(1);
+			}
+			socket_path = NULL;
+			break;
+		case 'D':
+			daemonize = 1;
+			break;
+		default:
+			usage(argv[0]);
+			exit(1);
+		}
+	}
+
+	not_found = response_new("404 Not Found", "text/plain",
+				 NOT_FOUND, strlen(NOT_FOUND));
+	bad_method = response_new("405 Method Not Allowed", "text/plain",
+				  BAD_METHOD, strlen(BAD_METHOD));
+	bad_request = response_new("400 Bad Request", "text/plain",
+				   BAD_REQUEST, strlen(BAD_REQUEST));
+	if (!not_found || !bad_method || !bad_request) {
+		fprintf(stderr, "Out of memory\n");
+		exit(1);
+	}
+
+	if (daemonize) {
+		if (daemon(0, 0) == -1) {
+			perror("daemon");
+			exit(1);
+		}
+		openlog("xenstat-exporter", LOG_PID, LOG_DAEMON);
+		use_syslog = 1;
+	}
+
+	xhandle = xenstat_init();
+	if (xhandle == NULL) {
+		logmsg(LOG_ERR, "Failed to initialize xenstat library");
+		exit(1);
+	}
+	atexit(cleanup);
+
+	listen_fd = socket_path ? open_unix_socket(socket_path)
+				: open_tcp_socket(port);
+	if (listen_fd == -1 || listen(listen_fd, MAX_CLIENTS) == -1 ||
+	    set_nonblocking(listen_fd) == -1) {
+		logmsg(LOG_ERR, "Failed to listen on %s: %s",
+		       socket_path ? socket_path : "127.0.0.1",
+		       strerror(errno));
+		exit(1);
+	}
+
+	sigaction(SIGINT, &sa, NULL);
+	sigaction(SIGTERM, &sa, NULL);
+	signal(SIGPIPE, SIG_IGN);
+
+	next_collection = monotonic_ms();
+	while (!quit) {
+		now = monotonic_ms();
+		if (now >= next_collection) {
+			collect();
+			next_collection += interval * 1000ULL;
+			now = monotonic_ms();
+			if (next_collection <= now)
+				next_collection = now + interval * 1000ULL;
+		}
+
+		/* Drop clients which have hung around too long */
+		for (i = 0; i < num_clients; )
+			if (clients[i]->deadline <= now)
+				client_close(i);
+			else
+				i++;
+
+		wake = next_collection;
+		nfds = 0;
+		for (i = 0; i < num_clients; i++) {
+			fds[nfds].fd = clients[i]->fd;
+			fds[nfds].events = clients[i]->response ? POLLOUT
+								 : POLLIN;
+			nfds++;
+			if (clients[i]->deadline < wake)
+				wake = clients[i]->deadline;
+		}
+		if (num_clients < MAX_CLIENTS) {
+			fds[nfds].fd = listen_fd;
+			fds[nfds].events = POLLIN;
+			nfds++;
+		}
+
+		if (poll(fds, nfds, wake - now) == -1) {
+			if (errno == EINTR)
+				continue;
+			logmsg(LOG_ERR, "poll: %s", strerror(errno));
+			exit(1);
+		}
+
+		/* Walk backwards so that closing a client, which moves the
+		 * last one into its slot, leaves earlier entries alone */
+		for (i = num_clients; i-- > 0; )
+			if (fds[i].revents && !client_io(clients[i],
+							  fds[i].revents))
+				client_close(i);
+		if (nfds > num_clients && fds[nfds - 1].fd == listen_fd &&
+		    (fds[nfds - 1].revents & POLLIN))
+			accept_client();
+	}
+
+	return 0;
+}
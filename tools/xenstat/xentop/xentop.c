@@ -96,6 +96,8 @@ static int compare_cpu(xenstat_domain *domain1, xenstat_domain *domain2);
 static void print_cpu(xenstat_domain *domain);
 static int compare_cpu_pct(xenstat_domain *domain1, xenstat_domain *domain2);
 static void print_cpu_pct(xenstat_domain *domain);
+static int compare_run_delay(xenstat_domain *domain1, xenstat_domain *domain2);
+static void print_run_delay(xenstat_domain *domain);
 static int compare_mem(xenstat_domain *domain1, xenstat_domain *domain2);
 static void print_mem(xenstat_domain *domain);
 static void print_mem_pct(xenstat_domain *domain);
@@ -146,6 +148,7 @@ typedef enum field_id {
 	FIELD_STATE,
 	FIELD_CPU,
 	FIELD_CPU_PCT,
+	FIELD_RUN_DELAY,
 	FIELD_MEM,
 	FIELD_MEM_PCT,
 	FIELD_MAXMEM,
@@ -176,6 +179,7 @@ field fields[] = {
 	{ FIELD_STATE,     "STATE",      6, compare_state,     print_state   },
 	{ FIELD_CPU,       "CPU(sec)",  10, compare_cpu,       print_cpu     },
 	{ FIELD_CPU_PCT,   "CPU(%)",     6, compare_cpu_pct,   print_cpu_pct },
+	{ FIELD_RUN_DELAY, "RDELAY(us)",10, compare_run_delay, print_run_delay },
 	{ FIELD_MEM,       "MEM(k)",    10, compare_mem,       print_mem     },
 	{ FIELD_MEM_PCT,   "MEM(%)",     6, compare_mem,       print_mem_pct },
 	{ FIELD_MAXMEM,    "MAXMEM(k)", 10, compare_maxmem,    print_maxmem  },
@@ -536,6 +540,49 @@ static void print_cpu_pct(xenstat_domain *domain)
 	print("%6.1f", get_cpu_pct(domain));
 }
 
+/* Computes the average time, in microseconds, the vcpus of a domain spent
+ * runnable but waiting for a CPU since the previous sample (or since they
+ * were created, if there is no previous sample) */
+static double get_run_delay(xenstat_domain *domain)
+{
+	xenstat_domain *old_domain = NULL;
+	xenstat_sched_hist *hist, *old_hist = NULL;
+	unsigned long long count, total;
+
+	hist = xenstat_domain_run_delay(domain);
+	if(hist == NULL)
+		return 0.0;
+
+	if(prev_node != NULL)
+		old_domain = xenstat_node_domain(prev_node,
+		                                 xenstat_domain_id(domain));
+	if(old_domain != NULL)
+		old_hist = xenstat_domain_run_delay(old_domain);
+
+	count = xenstat_sched_hist_count(hist);
+	total = xenstat_sched_hist_total_ns(hist);
+	if(old_hist != NULL) {
+		count -= xenstat_sched_hist_count(old_hist);
+		total -= xenstat_sched_hist_total_ns(old_hist);
+	}
+
+	if(count == 0)
+		return 0.0;
+
+	return (total / 1000.0) / count;
+}
+
+static int compare_run_delay(xenstat_domain *domain1, xenstat_domain *domain2)
+{
+	return -compare(get_run_delay(domain1), get_run_delay(domain2));
+}
+
+/* Prints average run delay statistic */
+static void print_run_delay(xenstat_domain *domain)
+{
+	print("%10.1f", get_run_delay(domain));
+}
+
 /* Compares current memory of two domains, returning -1,0,1 for <,=,> */
 static int compare_mem(xenstat_domain *domain1, xenstat_domain *domain2)
 {
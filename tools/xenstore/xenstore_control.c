@@ -8,15 +8,17 @@
 int main(int argc, char **argv)
 {
   struct xs_handle * xsh;
+  char *result;
 
   if (argc < 2 ||
-      strcmp(argv[1], "check"))
+      (strcmp(argv[1], "check") && strcmp(argv[1], "cache")))
   {
     fprintf(stderr,
             "Usage:\n"
             "\n"
             "       %s check\n"
-            "\n", argv[0]);
+            "       %s cache\n"
+            "\n", argv[0], argv[0]);
     return 2;
   }
 
@@ -27,7 +29,10 @@ int main(int argc, char **argv)
     return 1;
   }
 
-  xs_debug_command(xsh, argv[1], NULL, 0);
+  result = xs_debug_command(xsh, argv[1], NULL, 0);
+  if (result && strcmp(argv[1], "check"))
+    fputs(result, stdout);
+  free(result);
 
   xs_daemon_close(xsh);
 
@@ -66,24 +66,18 @@
 #endif
 
 extern xenevtchn_handle *xce_handle; /* in xenstored_domain.c */
-static int xce_pollfd_idx = -1;
-static struct pollfd *fds;
-static unsigned int current_array_size;
-static unsigned int nr_fds;
-
-#define ROUNDUP(_x, _w) (((unsigned long)(_x)+(1UL<<(_w))-1) & ~((1UL<<(_w))-1))
 
 static bool verbose = false;
 LIST_HEAD(connections);
+/* Connections with pending events or work, see conn_set_ready(). */
+static LIST_HEAD(ready_conns);
 static int tracefd = -1;
 static bool recovery = true;
 static int reopen_log_pipe[2];
-static int reopen_log_pipe0_pollfd_idx = -1;
 static char *tracefile = NULL;
-static TDB_CONTEXT *tdb_ctx = NULL;
+TDB_CONTEXT *tdb_ctx = NULL;
 static bool trigger_talloc_report = false;
 
-static void corrupt(struct connection *conn, const char *fmt, ...);
 static void check_store(void);
 static const char *sockmsg_string(enum xsd_sockmsg_type type);
 
@@ -105,24 +99,7 @@ int quota_nb_entry_per_domain = 1000;
 int quota_nb_watch_per_domain = 128;
 int quota_max_entry_size = 2048; /* 2K */
 int quota_max_transaction = 10;
-
-TDB_CONTEXT *tdb_context(struct connection *conn)
-{
-	/* conn = NULL used in manual_node at setup. */
-	if (!conn || !conn->transaction)
-		return tdb_ctx;
-	return tdb_transaction_context(conn->transaction);
-}
-
-bool replace_tdb(const char *newname, TDB_CONTEXT *newtdb)
-{
-	if (!(tdb_ctx->flags & TDB_INTERNAL))
-		if (rename(newname, xs_daemon_tdb()) != 0)
-			return false;
-	tdb_close(tdb_ctx);
-	tdb_ctx = talloc_steal(talloc_autofree_context(), newtdb);
-	return true;
-}
+int quota_node_cache = 16384;
 
 void trace(const char *fmt, ...)
 {
@@ -284,8 +261,10 @@ static int destroy_conn(void *_conn)
 		       && poll(&pfd, 1, 0) == 1)
 			if (!write_messages(conn))
 				break;
+		fd_watch_remove(conn->fd);
 		close(conn->fd);
 	}
+	list_del(&conn->ready_list);
         if (conn->target)
                 talloc_unlink(conn, conn->target);
 	list_del(&conn->list);
@@ -293,77 +272,210 @@ static int destroy_conn(void *_conn)
 	return 0;
 }
 
-/* This function returns index inside the array if succeed, -1 if fail */
-static int set_fd(int fd, short events)
+void conn_set_ready(struct connection *conn)
 {
-	int ret;
-	if (current_array_size < nr_fds + 1) {
-		struct pollfd *new_fds = NULL;
-		unsigned long newsize;
+	if (list_empty(&conn->ready_list))
+		list_add_tail(&conn->ready_list, &ready_conns);
+}
 
-		/* Round up to 2^8 boundary, in practice this just
-		 * make newsize larger than current_array_size.
-		 */
-		newsize = ROUNDUP(nr_fds + 1, 8);
+/* Wait for output space on a socket only while there is output queued. */
+static void update_conn_events(struct connection *conn)
+{
+	short events = POLLIN|POLLPRI;
+
+	if (!list_empty(&conn->out_list))
+		events |= POLLOUT;
+
+	if (events != conn->events &&
+	    !fd_watch_modify(conn->fd, events, conn))
+		conn->events = events;
+}
+
+/*
+ * Node cache: copies of the data base records of recently used nodes,
+ * hashed by node name and kept in LRU order.  The cache is write-through:
+ * all modifications of the data base are done via cached_store() and
+ * cached_delete(), so it is never stale (this includes the nodes written
+ * when committing a transaction).  Transaction specific nodes are not
+ * cached, as they are short-lived.
+ */
+struct cached_node
+{
+	/* LRU list, most recently used node first. */
+	struct list_head list;
+
+	/* Hash key, owned by the hashtable. */
+	TDB_DATA *key;
 
-		new_fds = realloc(fds, sizeof(struct pollfd)*newsize);
-		if (!new_fds)
-			goto fail;
-		fds = new_fds;
+	/* Copy of the data base record. */
+	TDB_DATA data;
+};
+
+static struct hashtable *node_cache;
+static LIST_HEAD(node_cache_lru);
+static unsigned int node_cache_entries;
+static unsigned long node_cache_hits, node_cache_misses, node_cache_evictions;
 
-		memset(&fds[0] + current_array_size, 0,
-		       sizeof(struct pollfd ) * (newsize-current_array_size));
-		current_array_size = newsize;
+static unsigned int hash_from_tdb_key_fn(void *k)
+{
+	TDB_DATA *key = k;
+	unsigned int hash = 5381;
+	size_t i;
+
+	for (i = 0; i < key->dsize; i++)
+		hash = ((hash << 5) + hash) + (unsigned int)key->dptr[i];
+
+	return hash;
+}
+
+static int tdb_keys_equal_fn(void *key1, void *key2)
+{
+	TDB_DATA *k1 = key1, *k2 = key2;
+
+	return k1->dsize == k2->dsize &&
+	       !memcmp(k1->dptr, k2->dptr, k1->dsize);
+}
+
+static bool node_cache_wanted(TDB_DATA key)
+{
+	/* Only global nodes, transaction specific ones don't start with /. */
+	return node_cache && key.dsize && key.dptr[0] == '/';
+}
+
+static void node_cache_remove(struct cached_node *c)
+{
+	list_del(&c->list);
+	/* Frees c->key. */
+	hashtable_remove(node_cache, c->key);
+	talloc_free(c);
+	node_cache_entries--;
+}
+
+static void node_cache_insert(TDB_DATA key, TDB_DATA data)
+{
+	struct cached_node *c;
+
+	if (!node_cache_wanted(key))
+		return;
+
+	c = hashtable_search(node_cache, &key);
+	if (c)
+		node_cache_remove(c);
+
+	if (node_cache_entries >= (unsigned int)quota_node_cache) {
+		c = list_entry(node_cache_lru.prev, struct cached_node, list);
+		if (&c->list == &node_cache_lru)
+			return;
+		node_cache_remove(c);
+		node_cache_evictions++;
 	}
 
-	fds[nr_fds].fd = fd;
-	fds[nr_fds].events = events;
-	ret = nr_fds;
-	nr_fds++;
+	c = talloc(talloc_autofree_context(), struct cached_node);
+	if (!c)
+		return;
+	c->data.dsize = data.dsize;
+	c->data.dptr = talloc_memdup(c, data.dptr, data.dsize);
+	c->key = malloc(sizeof(*c->key) + key.dsize);
+	if (!c->data.dptr || !c->key)
+		goto nomem;
+	c->key->dsize = key.dsize;
+	c->key->dptr = (void *)(c->key + 1);
+	memcpy(c->key->dptr, key.dptr, key.dsize);
+	if (!hashtable_insert(node_cache, c->key, c))
+		goto nomem;
+
+	list_add(&c->list, &node_cache_lru);
+	node_cache_entries++;
+	return;
+
+ nomem:
+	/* Not caching the node is fine. */
+	free(c->key);
+	talloc_free(c);
+}
+
+static void node_cache_invalidate(TDB_DATA key)
+{
+	struct cached_node *c;
 
-	return ret;
-fail:
-	syslog(LOG_ERR, "realloc failed, ignoring fd %d\n", fd);
-	return -1;
+	if (!node_cache_wanted(key))
+		return;
+
+	c = hashtable_search(node_cache, &key);
+	if (c)
+		node_cache_remove(c);
 }
 
-static void initialize_fds(int sock, int *p_sock_pollfd_idx,
-			   int ro_sock, int *p_ro_sock_pollfd_idx,
-			   int *ptimeout)
+TDB_DATA cached_fetch(TDB_DATA key)
 {
-	struct connection *conn;
+	struct cached_node *c;
+	TDB_DATA data;
 
-	if (fds)
-		memset(fds, 0, sizeof(struct pollfd) * current_array_size);
-	nr_fds = 0;
-
-	*ptimeout = -1;
-
-	if (sock != -1)
-		*p_sock_pollfd_idx = set_fd(sock, POLLIN|POLLPRI);
-	if (ro_sock != -1)
-		*p_ro_sock_pollfd_idx = set_fd(ro_sock, POLLIN|POLLPRI);
-	if (reopen_log_pipe[0] != -1)
-		reopen_log_pipe0_pollfd_idx =
-			set_fd(reopen_log_pipe[0], POLLIN|POLLPRI);
-
-	if (xce_handle != NULL)
-		xce_pollfd_idx = set_fd(xenevtchn_fd(xce_handle),
-					POLLIN|POLLPRI);
-
-	list_for_each_entry(conn, &connections, list) {
-		if (conn->domain) {
-			if (domain_can_read(conn) ||
-			    (domain_can_write(conn) &&
-			     !list_empty(&conn->out_list)))
-				*ptimeout = 0;
-		} else {
-			short events = POLLIN|POLLPRI;
-			if (!list_empty(&conn->out_list))
-				events |= POLLOUT;
-			conn->pollfd_idx = set_fd(conn->fd, events);
+	if (!node_cache_wanted(key))
+		return tdb_fetch(tdb_ctx, key);
+
+	c = hashtable_search(node_cache, &key);
+	if (c) {
+		data.dsize = c->data.dsize;
+		data.dptr = talloc_memdup(tdb_ctx, c->data.dptr, data.dsize);
+		if (data.dptr) {
+			node_cache_hits++;
+			list_del(&c->list);
+			list_add(&c->list, &node_cache_lru);
+			return data;
 		}
 	}
+
+	node_cache_misses++;
+	data = tdb_fetch(tdb_ctx, key);
+	if (data.dptr)
+		node_cache_insert(key, data);
+
+	return data;
+}
+
+int cached_store(TDB_DATA key, TDB_DATA data)
+{
+	int ret;
+
+	ret = tdb_store(tdb_ctx, key, data, TDB_REPLACE);
+	if (ret)
+		node_cache_invalidate(key);
+	else
+		node_cache_insert(key, data);
+
+	return ret;
+}
+
+int cached_delete(TDB_DATA key)
+{
+	node_cache_invalidate(key);
+
+	return tdb_delete(tdb_ctx, key);
+}
+
+static void init_node_cache(void)
+{
+	if (quota_node_cache <= 0)
+		return;
+
+	node_cache = create_hashtable(quota_node_cache / 4,
+				      hash_from_tdb_key_fn, tdb_keys_equal_fn);
+	if (!node_cache)
+		barf_perror("Could not create node cache");
+}
+
+static char *node_cache_stats(const void *ctx)
+{
+	unsigned long lookups = node_cache_hits + node_cache_misses;
+
+	return talloc_asprintf(ctx,
+		"node cache: %u/%d nodes, %lu hits, %lu misses "
+		"(%lu%% hit rate), %lu evictions\n",
+		node_cache_entries, quota_node_cache, node_cache_hits,
+		node_cache_misses,
+		lookups ? node_cache_hits * 100 / lookups : 0,
+		node_cache_evictions);
 }
 
 /*
@@ -376,21 +488,6 @@ static struct node *read_node(struct connection *conn, const void *ctx,
 	TDB_DATA key, data;
 	struct xs_tdb_record_hdr *hdr;
 	struct node *node;
-	TDB_CONTEXT * context = tdb_context(conn);
-
-	key.dptr = (void *)name;
-	key.dsize = strlen(name);
-	data = tdb_fetch(context, key);
-
-	if (data.dptr == NULL) {
-		if (tdb_error(context) == TDB_ERR_NOEXIST)
-			errno = ENOENT;
-		else {
-			log("TDB error on read: %s", tdb_errorstr(context));
-			errno = EIO;
-		}
-		return NULL;
-	}
 
 	node = talloc(ctx, struct node);
 	if (!node) {
@@ -403,8 +500,31 @@ static struct node *read_node(struct connection *conn, const void *ctx,
 		errno = ENOMEM;
 		return NULL;
 	}
+
+	if (transaction_prepend(conn, node, name, &key)) {
+		talloc_free(node);
+		return NULL;
+	}
+
+	data = cached_fetch(key);
+
+	if (data.dptr == NULL) {
+		if (tdb_error(tdb_ctx) == TDB_ERR_NOEXIST) {
+			/* Transactions depend on nonexistence, too. */
+			node->generation = NO_GENERATION;
+			access_node(conn, node, NODE_ACCESS_READ, NULL);
+			errno = ENOENT;
+		} else {
+			log("TDB error on read: %s", tdb_errorstr(tdb_ctx));
+			errno = EIO;
+		}
+		talloc_free(node);
+		return NULL;
+	}
+
 	node->parent = NULL;
-	node->tdb = tdb_context(conn);
+	node->key.dptr = NULL;
+	node->key.dsize = 0;
 	talloc_steal(node, data.dptr);
 
 	/* Datalen, childlen, number of permissions */
@@ -421,33 +541,33 @@ static struct node *read_node(struct connection *conn, const void *ctx,
 	/* Children is strings, nul separated. */
 	node->children = node->data + node->datalen;
 
+	if (access_node(conn, node, NODE_ACCESS_READ, NULL)) {
+		talloc_free(node);
+		return NULL;
+	}
+
 	return node;
 }
 
-static bool write_node(struct connection *conn, struct node *node)
+static unsigned int node_record_size(struct node *node)
 {
-	/*
-	 * conn will be null when this is called from manual_node.
-	 * tdb_context copes with this.
-	 */
-
-	TDB_DATA key, data;
-	void *p;
-	struct xs_tdb_record_hdr *hdr;
-
-	key.dptr = (void *)node->name;
-	key.dsize = strlen(node->name);
-
-	data.dsize = sizeof(*hdr)
+	return sizeof(struct xs_tdb_record_hdr)
 		+ node->num_perms*sizeof(node->perms[0])
 		+ node->datalen + node->childlen;
+}
 
-	if (domain_is_unprivileged(conn) && data.dsize >= quota_max_entry_size)
-		goto error;
-
-	add_change_node(conn, node, false);
+int write_node_raw(struct connection *conn, TDB_DATA *key, struct node *node)
+{
+	TDB_DATA data;
+	void *p;
+	struct xs_tdb_record_hdr *hdr;
 
+	data.dsize = node_record_size(node);
 	data.dptr = talloc_size(node, data.dsize);
+	if (!data.dptr) {
+		errno = ENOMEM;
+		return errno;
+	}
 	hdr = (void *)data.dptr;
 	hdr->generation = node->generation;
 	hdr->num_perms = node->num_perms;
@@ -461,14 +581,33 @@ static bool write_node(struct connection *conn, struct node *node)
 	memcpy(p, node->children, node->childlen);
 
 	/* TDB should set errno, but doesn't even set ecode AFAICT. */
-	if (tdb_store(tdb_context(conn), key, data, TDB_REPLACE) != 0) {
-		corrupt(conn, "Write of %s failed", key.dptr);
-		goto error;
+	if (cached_store(*key, data) != 0) {
+		corrupt(conn, "Write of %s failed", key->dptr);
+		errno = ENOSPC;
+		return errno;
 	}
-	return true;
- error:
-	errno = ENOSPC;
-	return false;
+	return 0;
+}
+
+static bool write_node(struct connection *conn, struct node *node)
+{
+	/*
+	 * conn will be null when this is called from manual_node.
+	 * access_node copes with this.
+	 */
+	TDB_DATA key;
+
+	if (domain_is_unprivileged(conn) &&
+	    node_record_size(node) >= quota_max_entry_size) {
+		errno = ENOSPC;
+		return false;
+	}
+
+	if (access_node(conn, node, NODE_ACCESS_WRITE, &key))
+		return false;
+	node->key = key;
+
+	return !write_node_raw(conn, &key, node);
 }
 
 static enum xs_perm_type perm_for_conn(struct connection *conn,
@@ -712,6 +851,10 @@ void send_reply(struct connection *conn, enum xsd_sockmsg_type type,
 
 	/* Queue for later transmission. */
 	list_add_tail(&bdata->list, &conn->out_list);
+	if (conn->domain)
+		conn_set_ready(conn);
+	else
+		update_conn_events(conn);
 
 	return;
 }
@@ -895,10 +1038,16 @@ static void delete_node_single(struct connection *conn, struct node *node,
 {
 	TDB_DATA key;
 
-	key.dptr = (void *)node->name;
-	key.dsize = strlen(node->name);
+	if (access_node(conn, node, NODE_ACCESS_DELETE, &key))
+		return;
 
-	if (tdb_delete(tdb_context(conn), key) != 0) {
+	/*
+	 * Inside a transaction there is only a transaction specific node to
+	 * delete if the transaction has written the node before.
+	 */
+	if (cached_delete(key) != 0 &&
+	    (!conn || !conn->transaction ||
+	     tdb_error(tdb_ctx) != TDB_ERR_NOEXIST)) {
 		corrupt(conn, "Could not delete '%s'", node->name);
 		return;
 	}
@@ -947,7 +1096,6 @@ static struct node *construct_node(struct connection *conn, const void *ctx,
 
 	/* Allocate node */
 	node = talloc(ctx, struct node);
-	node->tdb = tdb_context(conn);
 	node->name = talloc_strdup(node, name);
 
 	/* Inherit permissions, except unprivileged domains own what they create */
@@ -968,15 +1116,11 @@ static struct node *construct_node(struct connection *conn, const void *ctx,
 static int destroy_node(void *_node)
 {
 	struct node *node = _node;
-	TDB_DATA key;
 
 	if (streq(node->name, "/"))
 		corrupt(NULL, "Destroying root node!");
 
-	key.dptr = (void *)node->name;
-	key.dsize = strlen(node->name);
-
-	tdb_delete(node->tdb, key);
+	cached_delete(node->key);
 	return 0;
 }
 
@@ -1279,6 +1423,15 @@ static int do_debug(struct connection *conn, struct buffered_data *in)
 	if (streq(in->buffer, "check"))
 		check_store();
 
+	if (streq(in->buffer, "cache")) {
+		char *stats = node_cache_stats(in);
+
+		if (!stats)
+			return ENOMEM;
+		send_reply(conn, XS_DEBUG, stats, strlen(stats) + 1);
+		return 0;
+	}
+
 	send_ack(conn, XS_DEBUG);
 
 	return 0;
@@ -1440,7 +1593,6 @@ struct connection *new_connection(connwritefn_t *write, connreadfn_t *read)
 		return NULL;
 
 	new->fd = -1;
-	new->pollfd_idx = -1;
 	new->write = write;
 	new->read = read;
 	new->can_write = true;
@@ -1448,6 +1600,7 @@ struct connection *new_connection(connwritefn_t *write, connreadfn_t *read)
 	INIT_LIST_HEAD(&new->out_list);
 	INIT_LIST_HEAD(&new->watches);
 	INIT_LIST_HEAD(&new->transaction_list);
+	INIT_LIST_HEAD(&new->ready_list);
 
 	list_add_tail(&new->list, &connections);
 	talloc_set_destructor(new, destroy_conn);
@@ -1508,11 +1661,18 @@ static void accept_connection(int sock, bool canwrite)
 		return;
 
 	conn = new_connection(writefd, readfd);
-	if (conn) {
-		conn->fd = fd;
-		conn->can_write = canwrite;
-	} else
+	if (!conn) {
 		close(fd);
+		return;
+	}
+
+	conn->fd = fd;
+	conn->can_write = canwrite;
+	conn->events = POLLIN|POLLPRI;
+	if (fd_watch_add(fd, conn->events, conn)) {
+		syslog(LOG_ERR, "cannot watch fd %d: %m", fd);
+		talloc_free(conn);
+	}
 }
 #endif
 
@@ -1734,7 +1894,13 @@ static int clean_store_(TDB_CONTEXT *tdb, TDB_DATA key, TDB_DATA val,
 			void *private)
 {
 	struct hashtable *reachable = private;
-	char * name = talloc_strndup(NULL, key.dptr, key.dsize);
+	char *name;
+
+	/* Transaction specific nodes don't start with "/". */
+	if (key.dsize == 0 || key.dptr[0] != '/')
+		return 0;
+
+	name = talloc_strndup(NULL, key.dptr, key.dsize);
 
 	if (!name) {
 		log("clean_store: ENOMEM");
@@ -1744,7 +1910,7 @@ static int clean_store_(TDB_CONTEXT *tdb, TDB_DATA key, TDB_DATA val,
 	if (!hashtable_search(reachable, name)) {
 		log("clean_store: '%s' is orphaned!", name);
 		if (recovery) {
-			tdb_delete(tdb, key);
+			cached_delete(key);
 		}
 	}
 
@@ -1787,7 +1953,7 @@ static void check_store(void)
 
 
 /* Something is horribly wrong: check the store. */
-static void corrupt(struct connection *conn, const char *fmt, ...)
+void corrupt(struct connection *conn, const char *fmt, ...)
 {
 	va_list arglist;
 	char *str;
@@ -1899,6 +2065,8 @@ static void usage(void)
 "  -S, --entry-size <size> limit the size of entry per domain, and\n"
 "  -W, --watch-nb <nb>     limit the number of watches per domain,\n"
 "  -t, --transaction <nb>  limit the number of transaction allowed per domain,\n"
+"  -C, --node-cache <nb>   keep up to <nb> nodes cached in memory (default\n"
+"                          16384, 0 disables the cache),\n"
 "  -R, --no-recovery       to request that no recovery should be attempted when\n"
 "                          the store is corrupted (debug only),\n"
 "  -I, --internal-db       store database in memory, not on disk\n"
@@ -1908,6 +2076,7 @@ static void usage(void)
 
 
 static struct option options[] = {
+	{ "node-cache", 1, NULL, 'C' },
 	{ "no-domain-init", 0, NULL, 'D' },
 	{ "entry-nb", 1, NULL, 'E' },
 	{ "pid-file", 1, NULL, 'F' },
@@ -1935,18 +2104,20 @@ int priv_domid = 0;
 int main(int argc, char *argv[])
 {
 	int opt, *sock = NULL, *ro_sock = NULL;
-	int sock_pollfd_idx = -1, ro_sock_pollfd_idx = -1;
+	static int xce_marker;
+	struct fd_event events[FD_WATCH_MAX_EVENTS];
 	bool dofork = true;
 	bool outputpid = false;
 	bool no_domain_init = false;
 	const char *pidfile = NULL;
 	const char *memfile = NULL;
-	int timeout;
 
-
-	while ((opt = getopt_long(argc, argv, "DE:F:HNPS:t:T:RVW:M:", options,
+	while ((opt = getopt_long(argc, argv, "C:DE:F:HNPS:t:T:RVW:M:", options,
 				  NULL)) != -1) {
 		switch (opt) {
+		case 'C':
+			quota_node_cache = strtol(optarg, NULL, 10);
+			break;
 		case 'D':
 			no_domain_init = true;
 			break;
@@ -2034,6 +2205,8 @@ int main(int argc, char *argv[])
 	init_pipe(reopen_log_pipe);
 
 	/* Setup the database */
+	init_watches();
+	init_node_cache();
 	setup_structure();
 
 	/* Listen to hypervisor. */
@@ -2054,9 +2227,22 @@ int main(int argc, char *argv[])
 
 	signal(SIGHUP, trigger_reopen_log);
 
-	/* Get ready to listen to the tools. */
-	initialize_fds(*sock, &sock_pollfd_idx, *ro_sock, &ro_sock_pollfd_idx,
-		       &timeout);
+	/*
+	 * Get ready to listen to the tools.  The fds not belonging to a
+	 * connection are told apart by their data pointer.
+	 */
+	fd_watch_init();
+	if (*sock != -1 && fd_watch_add(*sock, POLLIN|POLLPRI, sock))
+		barf_perror("Could not watch socket");
+	if (*ro_sock != -1 && fd_watch_add(*ro_sock, POLLIN|POLLPRI, ro_sock))
+		barf_perror("Could not watch ro socket");
+	if (reopen_log_pipe[0] != -1 &&
+	    fd_watch_add(reopen_log_pipe[0], POLLIN|POLLPRI, reopen_log_pipe))
+		barf_perror("Could not watch reopen log pipe");
+	if (xce_handle != NULL &&
+	    fd_watch_add(xenevtchn_fd(xce_handle), POLLIN|POLLPRI,
+			 &xce_marker))
+		barf_perror("Could not watch event channel");
 
 	/* Tell the kernel we're up and running. */
 	xenbus_notify_running();
@@ -2069,6 +2255,7 @@ int main(int argc, char *argv[])
 	/* Main loop. */
 	for (;;) {
 		struct connection *conn, *next;
+		int i, nr;
 
 		if (trigger_talloc_report) {
 			FILE *out;
@@ -2082,67 +2269,75 @@ int main(int argc, char *argv[])
 			}
 		}
 
-		if (poll(fds, nr_fds, timeout) < 0) {
+		/* Don't sleep if there are connections still needing work. */
+		nr = fd_watch_wait(events, FD_WATCH_MAX_EVENTS,
+				   list_empty(&ready_conns) ? -1 : 0);
+		if (nr < 0) {
 			if (errno == EINTR)
 				continue;
 			barf_perror("Poll failed");
 		}
 
-		if (reopen_log_pipe0_pollfd_idx != -1) {
-			if (fds[reopen_log_pipe0_pollfd_idx].revents
-			    & ~POLLIN) {
-				close(reopen_log_pipe[0]);
-				close(reopen_log_pipe[1]);
-				init_pipe(reopen_log_pipe);
-			} else if (fds[reopen_log_pipe0_pollfd_idx].revents
-				   & POLLIN) {
-				char c;
-				if (read(reopen_log_pipe[0], &c, 1) != 1)
-					barf_perror("read failed");
-				reopen_log();
-			}
-			reopen_log_pipe0_pollfd_idx = -1;
-		}
+		/* Queue the socket connections first: nothing frees them. */
+		for (i = 0; i < nr; i++) {
+			void *data = events[i].data;
 
-		if (sock_pollfd_idx != -1) {
-			if (fds[sock_pollfd_idx].revents & ~POLLIN) {
-				barf_perror("sock poll failed");
-				break;
-			} else if (fds[sock_pollfd_idx].revents & POLLIN) {
-				accept_connection(*sock, true);
-				sock_pollfd_idx = -1;
-			}
-		}
+			if (data == sock || data == ro_sock ||
+			    data == reopen_log_pipe || data == &xce_marker)
+				continue;
 
-		if (ro_sock_pollfd_idx != -1) {
-			if (fds[ro_sock_pollfd_idx].revents & ~POLLIN) {
-				barf_perror("ro sock poll failed");
-				break;
-			} else if (fds[ro_sock_pollfd_idx].revents & POLLIN) {
-				accept_connection(*ro_sock, false);
-				ro_sock_pollfd_idx = -1;
-			}
+			conn = data;
+			conn->revents = events[i].revents;
+			conn_set_ready(conn);
 		}
 
-		if (xce_pollfd_idx != -1) {
-			if (fds[xce_pollfd_idx].revents & ~POLLIN) {
-				barf_perror("xce_handle poll failed");
-				break;
-			} else if (fds[xce_pollfd_idx].revents & POLLIN) {
-				handle_event();
-				xce_pollfd_idx = -1;
+		for (i = 0; i < nr; i++) {
+			void *data = events[i].data;
+			short revents = events[i].revents;
+
+			if (data == reopen_log_pipe) {
+				if (revents & ~POLLIN) {
+					fd_watch_remove(reopen_log_pipe[0]);
+					close(reopen_log_pipe[0]);
+					close(reopen_log_pipe[1]);
+					init_pipe(reopen_log_pipe);
+					if (fd_watch_add(reopen_log_pipe[0],
+							 POLLIN|POLLPRI,
+							 reopen_log_pipe))
+						barf_perror("Could not watch reopen log pipe");
+				} else if (revents & POLLIN) {
+					char c;
+					if (read(reopen_log_pipe[0], &c, 1) != 1)
+						barf_perror("read failed");
+					reopen_log();
+				}
+			} else if (data == sock) {
+				if (revents & ~POLLIN)
+					barf_perror("sock poll failed");
+				else if (revents & POLLIN)
+					accept_connection(*sock, true);
+			} else if (data == ro_sock) {
+				if (revents & ~POLLIN)
+					barf_perror("ro sock poll failed");
+				else if (revents & POLLIN)
+					accept_connection(*ro_sock, false);
+			} else if (data == &xce_marker) {
+				if (revents & ~POLLIN)
+					barf_perror("xce_handle poll failed");
+				else if (revents & POLLIN)
+					handle_event();
 			}
 		}
 
-		next = list_entry(connections.next, typeof(*conn), list);
-		if (&next->list != &connections)
+		next = list_entry(ready_conns.next, typeof(*conn), ready_list);
+		if (&next->ready_list != &ready_conns)
 			talloc_increase_ref_count(next);
-		while (&next->list != &connections) {
+		while (&next->ready_list != &ready_conns) {
 			conn = next;
 
-			next = list_entry(conn->list.next,
-					  typeof(*conn), list);
-			if (&next->list != &connections)
+			next = list_entry(conn->ready_list.next,
+					  typeof(*conn), ready_list);
+			if (&next->ready_list != &ready_conns)
 				talloc_increase_ref_count(next);
 
 			if (conn->domain) {
@@ -2157,37 +2352,34 @@ int main(int argc, char *argv[])
 					handle_output(conn);
 				if (talloc_free(conn) == 0)
 					continue;
+
+				/* Stay queued while there's work left. */
+				if (!domain_can_read(conn) &&
+				    (!domain_can_write(conn) ||
+				     list_empty(&conn->out_list)))
+					list_del_init(&conn->ready_list);
 			} else {
-				if (conn->pollfd_idx != -1) {
-					if (fds[conn->pollfd_idx].revents
-					    & ~(POLLIN|POLLOUT))
-						talloc_free(conn);
-					else if (fds[conn->pollfd_idx].revents
-						 & POLLIN)
-						handle_input(conn);
-				}
+				if (conn->revents & ~(POLLIN|POLLOUT))
+					talloc_free(conn);
+				else if (conn->revents & POLLIN)
+					handle_input(conn);
 				if (talloc_free(conn) == 0)
 					continue;
 
 				talloc_increase_ref_count(conn);
 
-				if (conn->pollfd_idx != -1) {
-					if (fds[conn->pollfd_idx].revents
-					    & ~(POLLIN|POLLOUT))
-						talloc_free(conn);
-					else if (fds[conn->pollfd_idx].revents
-						 & POLLOUT)
-						handle_output(conn);
-				}
+				if (conn->revents & ~(POLLIN|POLLOUT))
+					talloc_free(conn);
+				else if (conn->revents & POLLOUT)
+					handle_output(conn);
 				if (talloc_free(conn) == 0)
 					continue;
 
-				conn->pollfd_idx = -1;
+				conn->revents = 0;
+				list_del_init(&conn->ready_list);
+				update_conn_events(conn);
 			}
 		}
-
-		initialize_fds(*sock, &sock_pollfd_idx, *ro_sock,
-			       &ro_sock_pollfd_idx, &timeout);
 	}
 }
 
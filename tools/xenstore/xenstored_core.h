@@ -66,8 +66,12 @@ struct connection
 
 	/* The file descriptor we came in on. */
 	int fd;
-	/* The index of pollfd in global pollfd array */
-	int pollfd_idx;
+	/* Events we are waiting for on fd, and those reported last. */
+	short events;
+	short revents;
+
+	/* Entry in the list of connections needing attention. */
+	struct list_head ready_list;
 
 	/* Who am I? 0 for socket connections. */
 	unsigned int id;
@@ -104,11 +108,13 @@ struct connection
 };
 extern struct list_head connections;
 
+#define NO_GENERATION ~((uint64_t)0)
+
 struct node {
 	const char *name;
 
-	/* Database I came from */
-	TDB_CONTEXT *tdb;
+	/* Data base key the node has been written to (transaction specific). */
+	TDB_DATA key;
 
 	/* Parent (optional) */
 	struct node *parent;
@@ -145,17 +151,25 @@ void send_ack(struct connection *conn, enum xsd_sockmsg_type type);
 /* Canonicalize this path if possible. */
 char *canonicalize(struct connection *conn, const void *ctx, const char *node);
 
+/* Write a node to the data base using the given key. */
+int write_node_raw(struct connection *conn, TDB_DATA *key, struct node *node);
+
 /* Get this node, checking we have permissions. */
 struct node *get_node(struct connection *conn,
 		      const void *ctx,
 		      const char *name,
 		      enum xs_perm_type perm);
 
-/* Get TDB context for this connection */
-TDB_CONTEXT *tdb_context(struct connection *conn);
+/* The data base, holding global and transaction specific nodes. */
+extern TDB_CONTEXT *tdb_ctx;
 
-/* Replace the tdb: required for transaction code */
-bool replace_tdb(const char *newname, TDB_CONTEXT *newtdb);
+/* Data base access via the node cache. */
+TDB_DATA cached_fetch(TDB_DATA key);
+int cached_store(TDB_DATA key, TDB_DATA data);
+int cached_delete(TDB_DATA key);
+
+/* Something is horribly wrong: check the store. */
+void corrupt(struct connection *conn, const char *fmt, ...);
 
 struct connection *new_connection(connwritefn_t *write, connreadfn_t *read);
 
@@ -196,6 +210,29 @@ void finish_daemonize(void);
 /* Open a pipe for signal handling */
 void init_pipe(int reopen_log_pipe[2]);
 
+/*
+ * Waiting for events on file descriptors.  events and revents use the
+ * poll() flags, data is handed back with the events of the fd.  Linux
+ * uses epoll, so the cost of waiting doesn't grow with the number of
+ * connections.
+ */
+#define FD_WATCH_MAX_EVENTS 64
+
+struct fd_event {
+	void *data;
+	short revents;
+};
+
+void fd_watch_init(void);
+int fd_watch_add(int fd, short events, void *data);
+int fd_watch_modify(int fd, short events, void *data);
+void fd_watch_remove(int fd);
+/* Returns number of events stored in ev (at most nr), -1 on error. */
+int fd_watch_wait(struct fd_event *ev, unsigned int nr, int timeout);
+
+/* Have the main loop look at a domain connection. */
+void conn_set_ready(struct connection *conn);
+
 xengnttab_handle **xgt_handle;
 
 #endif /* _XENSTORED_CORE_H */
@@ -39,6 +39,10 @@ static evtchn_port_t virq_port;
 
 xenevtchn_handle *xce_handle = NULL;
 
+/* Domains by local event channel port, for finding the one to service. */
+static struct domain **port_domains;
+static unsigned int nr_port_domains;
+
 struct domain
 {
 	struct list_head list;
@@ -184,6 +188,29 @@ static void unmap_interface(void *interface)
 		munmap(interface, XC_PAGE_SIZE);
 }
 
+static bool set_port_domain(evtchn_port_t port, struct domain *domain)
+{
+	if (port >= nr_port_domains) {
+		unsigned int nr = nr_port_domains ? nr_port_domains : 64;
+		struct domain **new;
+
+		if (!domain)
+			return true;
+		while (nr <= port)
+			nr *= 2;
+		new = realloc(port_domains, nr * sizeof(*new));
+		if (!new)
+			return false;
+		memset(new + nr_port_domains, 0,
+		       (nr - nr_port_domains) * sizeof(*new));
+		port_domains = new;
+		nr_port_domains = nr;
+	}
+
+	port_domains[port] = domain;
+	return true;
+}
+
 static int destroy_domain(void *_domain)
 {
 	struct domain *domain = _domain;
@@ -191,6 +218,7 @@ static int destroy_domain(void *_domain)
 	list_del(&domain->list);
 
 	if (domain->port) {
+		set_port_domain(domain->port, NULL);
 		if (xenevtchn_unbind(xce_handle, domain->port) == -1)
 			eprintf("> Unbinding port %i failed!\n", domain->port);
 	}
@@ -235,7 +263,6 @@ static void domain_cleanup(void)
 		fire_watches(NULL, NULL, "@releaseDomain", false);
 }
 
-/* We scan all domains rather than use the information given here. */
 void handle_event(void)
 {
 	evtchn_port_t port;
@@ -245,6 +272,9 @@ void handle_event(void)
 
 	if (port == virq_port)
 		domain_cleanup();
+	else if (port < nr_port_domains && port_domains[port] &&
+		 port_domains[port]->interface)
+		conn_set_ready(port_domains[port]->conn);
 
 	if (xenevtchn_unmask(xce_handle, port) == -1)
 		barf_perror("Failed to write to event fd");
@@ -297,6 +327,10 @@ static struct domain *new_domain(void *context, unsigned int domid,
 	if (rc == -1)
 	    return NULL;
 	domain->port = rc;
+	if (!set_port_domain(domain->port, domain)) {
+		errno = ENOMEM;
+		return NULL;
+	}
 
 	domain->conn = new_connection(writechn, readchn);
 	if (!domain->conn)
@@ -390,15 +424,22 @@ int do_introduce(struct connection *conn, struct buffered_data *in)
 		fire_watches(NULL, in, "@introduceDomain", false);
 	} else if ((domain->mfn == mfn) && (domain->conn != conn)) {
 		/* Use XS_INTRODUCE for recreating the xenbus event-channel. */
-		if (domain->port)
+		if (domain->port) {
+			set_port_domain(domain->port, NULL);
 			xenevtchn_unbind(xce_handle, domain->port);
+		}
 		rc = xenevtchn_bind_interdomain(xce_handle, domid, port);
 		domain->port = (rc == -1) ? 0 : rc;
+		if (domain->port && !set_port_domain(domain->port, domain)) {
+			xenevtchn_unbind(xce_handle, domain->port);
+			domain->port = 0;
+		}
 		domain->remote_port = port;
 	} else
 		return EINVAL;
 
 	domain_conn_reset(domain);
+	conn_set_ready(domain->conn);
 
 	send_ack(conn, XS_INTRODUCE);
 
@@ -590,6 +631,7 @@ static int dom0_init(void)
 		return -1;
 
 	talloc_steal(dom0->conn, dom0); 
+	conn_set_ready(dom0->conn);
 
 	xenevtchn_notify(xce_handle, dom0->port);
 
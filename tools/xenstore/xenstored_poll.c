@@ -0,0 +1,126 @@
+/*
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/*
+ * fd_watch_* on top of plain poll(), for the systems without epoll.  The
+ * pollfd array is kept between calls of fd_watch_wait().
+ */
+
+#include <stdlib.h>
+#include <errno.h>
+#include <poll.h>
+
+#include "xenstored_core.h"
+
+static struct pollfd *fds;
+static void **fds_data;
+static unsigned int nr_fds, fds_size;
+
+void fd_watch_init(void)
+{
+}
+
+static int fd_watch_find(int fd)
+{
+	unsigned int i;
+
+	for (i = 0; i < nr_fds; i++)
+		if (fds[i].fd == fd)
+			return i;
+
+	return -1;
+}
+
+int fd_watch_add(int fd, short events, void *data)
+{
+	if (nr_fds == fds_size) {
+		unsigned int size = fds_size ? fds_size * 2 : 8;
+		struct pollfd *new_fds;
+		void **new_data;
+
+		new_fds = realloc(fds, size * sizeof(*fds));
+		if (!new_fds)
+			return -1;
+		fds = new_fds;
+		new_data = realloc(fds_data, size * sizeof(*fds_data));
+		if (!new_data)
+			return -1;
+		fds_data = new_data;
+		fds_size = size;
+	}
+
+	fds[nr_fds].fd = fd;
+	fds[nr_fds].events = events;
+	fds[nr_fds].revents = 0;
+	fds_data[nr_fds] = data;
+	nr_fds++;
+
+	return 0;
+}
+
+int fd_watch_modify(int fd, short events, void *data)
+{
+	int i = fd_watch_find(fd);
+
+	if (i < 0) {
+		errno = ENOENT;
+		return -1;
+	}
+
+	fds[i].events = events;
+	fds_data[i] = data;
+
+	return 0;
+}
+
+void fd_watch_remove(int fd)
+{
+	int i = fd_watch_find(fd);
+
+	if (i < 0)
+		return;
+
+	nr_fds--;
+	fds[i] = fds[nr_fds];
+	fds_data[i] = fds_data[nr_fds];
+}
+
+int fd_watch_wait(struct fd_event *ev, unsigned int nr, int timeout)
+{
+	unsigned int i, n = 0;
+
+	if (poll(fds, nr_fds, timeout) < 0)
+		return -1;
+
+	for (i = 0; i < nr_fds && n < nr; i++) {
+		if (!fds[i].revents)
+			continue;
+		ev[n].data = fds_data[i];
+		ev[n].revents = fds[i].revents;
+		n++;
+	}
+
+	return n;
+}
+
+/*
+ * Local variables:
+ *  c-file-style: "linux"
+ *  indent-tabs-mode: t
+ *  c-indent-level: 8
+ *  c-basic-offset: 8
+ *  tab-width: 8
+ * End:
+ */
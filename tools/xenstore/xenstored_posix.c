@@ -22,6 +22,12 @@
 #include <fcntl.h>
 #include <stdlib.h>
 #include <sys/mman.h>
+#include <string.h>
+#include <errno.h>
+#include <poll.h>
+#if defined(__linux__)
+#include <sys/epoll.h>
+#endif
 
 #include "utils.h"
 #include "xenstored_core.h"
@@ -95,6 +101,92 @@ void init_pipe(int reopen_log_pipe[2])
 	}
 }
 
+#if defined(__linux__)
+static int epoll_fd = -1;
+
+static uint32_t poll_to_epoll(short events)
+{
+	uint32_t ev = 0;
+
+	if (events & POLLIN)
+		ev |= EPOLLIN;
+	if (events & POLLPRI)
+		ev |= EPOLLPRI;
+	if (events & POLLOUT)
+		ev |= EPOLLOUT;
+
+	return ev;
+}
+
+static short epoll_to_poll(uint32_t ev)
+{
+	short events = 0;
+
+	if (ev & EPOLLIN)
+		events |= POLLIN;
+	if (ev & EPOLLPRI)
+		events |= POLLPRI;
+	if (ev & EPOLLOUT)
+		events |= POLLOUT;
+	if (ev & EPOLLERR)
+		events |= POLLERR;
+	if (ev & EPOLLHUP)
+		events |= POLLHUP;
+
+	return events;
+}
+
+void fd_watch_init(void)
+{
+	epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+	if (epoll_fd < 0)
+		barf_perror("epoll_create1");
+}
+
+static int fd_watch_ctl(int op, int fd, short events, void *data)
+{
+	struct epoll_event ev;
+
+	memset(&ev, 0, sizeof(ev));
+	ev.events = poll_to_epoll(events);
+	ev.data.ptr = data;
+
+	return epoll_ctl(epoll_fd, op, fd, &ev);
+}
+
+int fd_watch_add(int fd, short events, void *data)
+{
+	return fd_watch_ctl(EPOLL_CTL_ADD, fd, events, data);
+}
+
+int fd_watch_modify(int fd, short events, void *data)
+{
+	return fd_watch_ctl(EPOLL_CTL_MOD, fd, events, data);
+}
+
+void fd_watch_remove(int fd)
+{
+	fd_watch_ctl(EPOLL_CTL_DEL, fd, 0, NULL);
+}
+
+int fd_watch_wait(struct fd_event *ev, unsigned int nr, int timeout)
+{
+	struct epoll_event events[FD_WATCH_MAX_EVENTS];
+	int i, n;
+
+	if (nr > FD_WATCH_MAX_EVENTS)
+		nr = FD_WATCH_MAX_EVENTS;
+
+	n = epoll_wait(epoll_fd, events, nr, timeout);
+	for (i = 0; i < n; i++) {
+		ev[i].data = events[i].data.ptr;
+		ev[i].revents = epoll_to_poll(events[i].events);
+	}
+
+	return n;
+}
+#endif
+
 void unmap_xenbus(void *interface)
 {
 	munmap(interface, getpagesize());
@@ -16,6 +16,7 @@
     along with this program; If not, see <http://www.gnu.org/licenses/>.
 */
 
+#include <inttypes.h>
 #include <stdio.h>
 #include <sys/types.h>
 #include <sys/stat.h>
@@ -35,14 +36,52 @@
 #include "xenstore_lib.h"
 #include "utils.h"
 
-struct changed_node
+/*
+ * Some notes regarding detection and handling of transaction conflicts:
+ *
+ * Transactions don't operate on a private copy of the whole data base.
+ * Instead each transaction records every node it accesses in its list of
+ * accessed nodes.  The transaction's view of such a node is kept in the
+ * main data base under a transaction specific key (the transaction's
+ * generation count prepended to the node name): when a node is read for
+ * the first time it is copied there, and writes by the transaction go
+ * there as well, so they are invisible to others.  A missing transaction
+ * specific node means the node doesn't exist in the transaction's view.
+ *
+ * Each modification of the data base sets the node's generation count to
+ * the global generation count, which is then incremented.  When a node is
+ * read for the first time in a transaction its generation count (or
+ * NO_GENERATION if it doesn't exist) is remembered.  At the end of the
+ * transaction all those remembered generation counts are compared with the
+ * current ones in the global data base.  If any of them differs another
+ * connection has modified a node the transaction depends on and the
+ * transaction fails with EAGAIN.  Otherwise all modified nodes are copied
+ * from their transaction specific keys to the global ones (or deleted).
+ *
+ * This makes starting a transaction independent of the size of the data
+ * base, while ending it depends only on the number of nodes accessed.
+ */
+
+struct accessed_node
 {
-	/* List of all changed nodes in the context of this transaction. */
+	/* List of all accessed nodes in the context of this transaction. */
 	struct list_head list;
 
 	/* The name of the node. */
 	char *node;
 
+	/* Generation count (or NO_GENERATION) for conflict checking. */
+	uint64_t generation;
+
+	/* Generation count checking required? */
+	bool check_gen;
+
+	/* Modified? */
+	bool modified;
+
+	/* Fire watches for this node at the end of the transaction? */
+	bool fire_watch;
+
 	/* And the children? (ie. rm) */
 	bool recurse;
 };
@@ -67,82 +106,249 @@ struct transaction
 	/* Connection-local identifier for this transaction. */
 	uint32_t id;
 
-	/* Generation when transaction started. */
+	/* Generation when transaction started, used as node name prefix. */
 	uint64_t generation;
 
-	/* Transaction internal generation. */
-	uint64_t trans_gen;
-
-	/* TDB to work on, and filename */
-	TDB_CONTEXT *tdb;
-	char *tdb_name;
-
-	/* List of changed nodes. */
-	struct list_head changes;
+	/* List of accessed nodes. */
+	struct list_head accessed;
 
 	/* List of changed domains - to record the changed domain entry number */
 	struct list_head changed_domains;
+
+	/* Flag for letting transaction fail. */
+	bool fail;
 };
 
 extern int quota_max_transaction;
 static uint64_t generation;
 
-/* Return tdb context to use for this connection. */
-TDB_CONTEXT *tdb_transaction_context(struct transaction *trans)
+static void set_tdb_key(const char *name, TDB_DATA *key)
 {
-	return trans->tdb;
+	key->dptr = (char *)name;
+	key->dsize = strlen(name);
 }
 
-/* Callers get a change node (which can fail) and only commit after they've
- * finished.  This way they don't have to unwind eg. a write. */
-void add_change_node(struct connection *conn, struct node *node, bool recurse)
+static struct accessed_node *find_accessed_node(struct transaction *trans,
+						const char *name)
 {
-	struct changed_node *i;
+	struct accessed_node *i;
+
+	list_for_each_entry(i, &trans->accessed, list)
+		if (streq(i->node, name))
+			return i;
+
+	return NULL;
+}
+
+/* Transaction specific name of a node, e.g. "42/local/domain/1". */
+static char *transaction_get_node_name(const void *ctx,
+				       struct transaction *trans,
+				       const char *name)
+{
+	return talloc_asprintf(ctx, "%"PRIu64"%s", trans->generation, name);
+}
+
+int transaction_prepend(struct connection *conn, const void *ctx,
+			const char *name, TDB_DATA *key)
+{
+	struct transaction *trans = conn ? conn->transaction : NULL;
+	char *tdb_name;
+
+	if (!trans || !find_accessed_node(trans, name)) {
+		set_tdb_key(name, key);
+		return 0;
+	}
+
+	tdb_name = transaction_get_node_name(ctx, trans, name);
+	if (!tdb_name)
+		return errno = ENOMEM;
+
+	set_tdb_key(tdb_name, key);
+
+	return 0;
+}
+
+int access_node(struct connection *conn, struct node *node,
+		enum node_access_type type, TDB_DATA *key)
+{
+	struct accessed_node *i;
 	struct transaction *trans;
+	TDB_DATA local_key;
+	char *tdb_name;
 
-	if (!conn || !conn->transaction) {
-		/* They're changing the global database. */
+	if (type != NODE_ACCESS_READ)
 		node->generation = generation++;
-		return;
+
+	if (!conn || !conn->transaction) {
+		/* They're accessing the global database. */
+		if (key)
+			set_tdb_key(node->name, key);
+		return 0;
 	}
 
 	trans = conn->transaction;
 
-	node->generation = generation + trans->trans_gen++;
+	tdb_name = transaction_get_node_name(node, trans, node->name);
+	if (!tdb_name)
+		goto nomem;
 
-	list_for_each_entry(i, &trans->changes, list) {
-		if (streq(i->node, node->name)) {
-			if (recurse)
-				i->recurse = recurse;
-			return;
+	i = find_accessed_node(trans, node->name);
+	if (!i) {
+		i = talloc_zero(trans, struct accessed_node);
+		if (!i)
+			goto nomem;
+		i->node = talloc_strdup(i, node->name);
+		if (!i->node) {
+			talloc_free(i);
+			goto nomem;
 		}
+		/*
+		 * Only the first access can tell what the transaction saw:
+		 * take a transaction specific copy of a node being read.
+		 */
+		if (type == NODE_ACCESS_READ) {
+			i->generation = node->generation;
+			i->check_gen = true;
+			if (node->generation != NO_GENERATION) {
+				set_tdb_key(tdb_name, &local_key);
+				if (write_node_raw(conn, &local_key, node)) {
+					talloc_free(i);
+					trans->fail = true;
+					return errno;
+				}
+			}
+		}
+		list_add_tail(&i->list, &trans->accessed);
 	}
 
-	i = talloc(trans, struct changed_node);
+	if (type != NODE_ACCESS_READ)
+		i->modified = true;
+	if (type == NODE_ACCESS_WRITE)
+		i->fire_watch = true;
+
+	if (key)
+		set_tdb_key(tdb_name, key);
+	else
+		talloc_free(tdb_name);
+
+	return 0;
+
+ nomem:
+	/* All we can do is let the transaction fail. */
+	trans->fail = true;
+	errno = ENOMEM;
+	return ENOMEM;
+}
+
+/* Callers get a change node (which can fail) and only commit after they've
+ * finished.  This way they don't have to unwind eg. a write. */
+void add_change_node(struct connection *conn, struct node *node, bool recurse)
+{
+	struct accessed_node *i;
+
+	if (!conn || !conn->transaction)
+		return;
+
+	i = find_accessed_node(conn->transaction, node->name);
 	if (!i) {
-		/* All we can do is let the transaction fail. */
-		generation++;
+		/* Modifications are always recorded by access_node(). */
+		conn->transaction->fail = true;
 		return;
 	}
-	i->node = talloc_strdup(i, node->name);
-	if (!i->node) {
-		/* All we can do is let the transaction fail. */
-		generation++;
-		talloc_free(i);
-		return;
+
+	i->fire_watch = true;
+	if (recurse)
+		i->recurse = recurse;
+}
+
+/*
+ * Verify that no node read by the transaction has been modified by someone
+ * else, then make all modifications of the transaction globally visible.
+ */
+static int finalize_transaction(struct connection *conn,
+				struct transaction *trans)
+{
+	struct accessed_node *i;
+	TDB_DATA key, ta_key, data;
+	struct xs_tdb_record_hdr *hdr;
+	uint64_t gen;
+	char *trans_name;
+	int ret;
+
+	list_for_each_entry(i, &trans->accessed, list) {
+		if (!i->check_gen)
+			continue;
+
+		set_tdb_key(i->node, &key);
+		data = cached_fetch(key);
+		if (!data.dptr) {
+			if (tdb_error(tdb_ctx) != TDB_ERR_NOEXIST)
+				return EIO;
+			gen = NO_GENERATION;
+		} else {
+			hdr = (void *)data.dptr;
+			gen = hdr->generation;
+			talloc_free(data.dptr);
+		}
+		if (i->generation != gen)
+			return EAGAIN;
+	}
+
+	list_for_each_entry(i, &trans->accessed, list) {
+		if (!i->modified)
+			continue;
+
+		trans_name = transaction_get_node_name(i, trans, i->node);
+		if (!trans_name)
+			goto err;
+		set_tdb_key(trans_name, &ta_key);
+		set_tdb_key(i->node, &key);
+
+		data = cached_fetch(ta_key);
+		if (data.dptr) {
+			hdr = (void *)data.dptr;
+			hdr->generation = generation++;
+			ret = cached_store(key, data);
+			talloc_free(data.dptr);
+			if (ret)
+				goto err;
+		} else if (tdb_error(tdb_ctx) != TDB_ERR_NOEXIST) {
+			goto err;
+		} else if (cached_delete(key) &&
+			   tdb_error(tdb_ctx) != TDB_ERR_NOEXIST) {
+			/* No transaction copy: the node has been deleted. */
+			goto err;
+		}
+		talloc_free(trans_name);
 	}
-	i->recurse = recurse;
-	list_add_tail(&i->list, &trans->changes);
+
+	return 0;
+
+ err:
+	/* We are doomed: the transaction is only partially committed. */
+	corrupt(conn, "Partial transaction");
+	return EIO;
 }
 
 static int destroy_transaction(void *_transaction)
 {
 	struct transaction *trans = _transaction;
+	struct accessed_node *i;
+	char *trans_name;
+	TDB_DATA key;
 
 	trace_destroy(trans, "transaction");
-	if (trans->tdb)
-		tdb_close(trans->tdb);
-	unlink(trans->tdb_name);
+
+	/* Remove transaction specific nodes from the data base. */
+	list_for_each_entry(i, &trans->accessed, list) {
+		trans_name = transaction_get_node_name(i, trans, i->node);
+		if (trans_name) {
+			set_tdb_key(trans_name, &key);
+			cached_delete(key);
+			talloc_free(trans_name);
+		}
+	}
+
 	return 0;
 }
 
@@ -177,18 +383,9 @@ int do_transaction_start(struct connection *conn, struct buffered_data *in)
 	if (!trans)
 		return ENOMEM;
 
-	INIT_LIST_HEAD(&trans->changes);
+	INIT_LIST_HEAD(&trans->accessed);
 	INIT_LIST_HEAD(&trans->changed_domains);
-	trans->generation = generation;
-	trans->tdb_name = talloc_asprintf(trans, "%s.%p",
-					  xs_daemon_tdb(), trans);
-	if (!trans->tdb_name)
-		return ENOMEM;
-	trans->tdb = tdb_copy(tdb_context(conn), trans->tdb_name);
-	if (!trans->tdb)
-		return errno;
-	/* Make it close if we go away. */
-	talloc_steal(trans, trans->tdb);
+	trans->generation = generation++;
 
 	/* Pick an unused transaction identifier. */
 	do {
@@ -211,9 +408,10 @@ int do_transaction_start(struct connection *conn, struct buffered_data *in)
 int do_transaction_end(struct connection *conn, struct buffered_data *in)
 {
 	const char *arg = onearg(in);
-	struct changed_node *i;
+	struct accessed_node *i;
 	struct changed_domain *d;
 	struct transaction *trans;
+	int ret;
 
 	if (!arg || (!streq(arg, "T") && !streq(arg, "F")))
 		return EINVAL;
@@ -229,22 +427,20 @@ int do_transaction_end(struct connection *conn, struct buffered_data *in)
 	talloc_steal(in, trans);
 
 	if (streq(arg, "T")) {
-		/* FIXME: Merge, rather failing on any change. */
-		if (trans->generation != generation)
+		if (trans->fail)
 			return EAGAIN;
-		if (!replace_tdb(trans->tdb_name, trans->tdb))
-			return errno;
-		/* Don't close this: we won! */
-		trans->tdb = NULL;
+		ret = finalize_transaction(conn, trans);
+		if (ret)
+			return ret;
 
 		/* fix domain entry for each changed domain */
 		list_for_each_entry(d, &trans->changed_domains, list)
 			domain_entry_fix(d->domid, d->nbentry);
 
 		/* Fire off the watches for everything that changed. */
-		list_for_each_entry(i, &trans->changes, list)
-			fire_watches(conn, in, i->node, i->recurse);
-		generation += trans->trans_gen;
+		list_for_each_entry(i, &trans->accessed, list)
+			if (i->fire_watch)
+				fire_watches(conn, in, i->node, i->recurse);
 	}
 	send_ack(conn, XS_TRANSACTION_END);
 
@@ -264,7 +460,7 @@ void transaction_entry_inc(struct transaction *trans, unsigned int domid)
 	d = talloc(trans, struct changed_domain);
 	if (!d) {
 		/* Let the transaction fail. */
-		generation++;
+		trans->fail = true;
 		return;
 	}
 	d->domid = domid;
@@ -285,7 +481,7 @@ void transaction_entry_dec(struct transaction *trans, unsigned int domid)
 	d = talloc(trans, struct changed_domain);
 	if (!d) {
 		/* Let the transaction fail. */
-		generation++;
+		trans->fail = true;
 		return;
 	}
 	d->domid = domid;
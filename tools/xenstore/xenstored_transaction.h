@@ -19,6 +19,12 @@
 #define _XENSTORED_TRANSACTION_H
 #include "xenstored_core.h"
 
+enum node_access_type {
+    NODE_ACCESS_READ,
+    NODE_ACCESS_WRITE,
+    NODE_ACCESS_DELETE
+};
+
 struct transaction;
 
 int do_transaction_start(struct connection *conn, struct buffered_data *node);
@@ -30,12 +36,24 @@ struct transaction *transaction_lookup(struct connection *conn, uint32_t id);
 void transaction_entry_inc(struct transaction *trans, unsigned int domid);
 void transaction_entry_dec(struct transaction *trans, unsigned int domid);
 
-/* This node was changed. */
+/* This node was changed: fire watches for it when committing. */
 void add_change_node(struct connection *conn, struct node *node,
                      bool recurse);
 
-/* Return tdb context to use for this connection. */
-TDB_CONTEXT *tdb_transaction_context(struct transaction *trans);
+/*
+ * Record an access of a node, updating its generation for modifications.
+ * If key is not NULL it is set to the data base key to use for writing or
+ * deleting the node, which is transaction specific inside a transaction.
+ */
+int access_node(struct connection *conn, struct node *node,
+                enum node_access_type type, TDB_DATA *key);
+
+/*
+ * Set key to the data base key for reading node name by this connection.
+ * Temporary memory allocations are done with ctx.
+ */
+int transaction_prepend(struct connection *conn, const void *ctx,
+                        const char *name, TDB_DATA *key);
 
 void conn_delete_all_transactions(struct connection *conn);
 
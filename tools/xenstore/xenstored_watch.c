@@ -29,14 +29,53 @@
 #include "xenstore_lib.h"
 #include "utils.h"
 #include "xenstored_domain.h"
+#include "hashtable.h"
 
 extern int quota_nb_watch_per_domain;
 
+/*
+ * Watched paths are kept in a tree mirroring the node hierarchy, with each
+ * element of the tree found via a hashtable keyed by its full path.  Only
+ * paths having watches registered on them or on one of their descendants
+ * are in the tree.  Special watches ("@...") are children of "/", as the
+ * root watches get all events.  This way firing the watches for a node
+ * only needs to visit the node's ancestors instead of all watches of all
+ * connections.
+ */
+struct watch_path
+{
+	/* Sibling paths with the same parent. */
+	struct list_head list;
+
+	/* Parent path, NULL for "/". */
+	struct watch_path *parent;
+
+	/* Child paths. */
+	struct list_head children;
+
+	/* Watches registered on this path. */
+	struct list_head watches;
+
+	/* Full path, owned by watch_paths. */
+	char *path;
+};
+
+static struct hashtable *watch_paths;
+
 struct watch
 {
 	/* Watches on this connection */
 	struct list_head list;
 
+	/* Watches on the same path (of all connections). */
+	struct list_head path_list;
+
+	/* Path of the watch in the watched paths tree. */
+	struct watch_path *path;
+
+	/* Connection owning the watch. */
+	struct connection *conn;
+
 	/* Current outstanding events applying to this watch. */
 	struct list_head events;
 
@@ -56,24 +95,6 @@ static bool check_event_node(const char *node)
 	return true;
 }
 
-/* Is child a subnode of parent, or equal? */
-static bool is_child(const char *child, const char *parent)
-{
-	unsigned int len = strlen(parent);
-
-	/*
-	 * / should really be "" for this algorithm to work, but that's a
-	 * usability nightmare.
-	 */
-	if (streq(parent, "/"))
-		return true;
-
-	if (strncmp(child, parent, len) != 0)
-		return false;
-
-	return child[len] == '/' || child[len] == '\0';
-}
-
 /*
  * Send a watch event.
  * Temporary memory allocations are done with ctx.
@@ -119,6 +140,146 @@ static void add_event(struct connection *conn,
 	talloc_free(data);
 }
 
+static unsigned int hash_from_key_fn(void *k)
+{
+	char *str = k;
+	unsigned int hash = 5381;
+	char c;
+
+	while ((c = *str++))
+		hash = ((hash << 5) + hash) + (unsigned int)c;
+
+	return hash;
+}
+
+static int keys_equal_fn(void *key1, void *key2)
+{
+	return 0 == strcmp((char *)key1, (char *)key2);
+}
+
+/* Strip last element of path in place, return false for "/". */
+static bool strip_path(char *path)
+{
+	char *slash = strrchr(path, '/');
+
+	if (!slash || slash == path) {
+		if (streq(path, "/"))
+			return false;
+		strcpy(path, "/");
+		return true;
+	}
+	*slash = 0;
+	return true;
+}
+
+static void put_watch_path(struct watch_path *p)
+{
+	struct watch_path *parent;
+
+	while (p && list_empty(&p->watches) && list_empty(&p->children)) {
+		parent = p->parent;
+		list_del(&p->list);
+		/* Frees p->path. */
+		hashtable_remove(watch_paths, p->path);
+		talloc_free(p);
+		p = parent;
+	}
+}
+
+static struct watch_path *get_watch_path(const char *path)
+{
+	struct watch_path *p, *parent = NULL;
+	char *parent_path;
+
+	p = hashtable_search(watch_paths, (void *)path);
+	if (p)
+		return p;
+
+	if (!streq(path, "/")) {
+		parent_path = talloc_strdup(NULL, path);
+		if (!parent_path)
+			return NULL;
+		strip_path(parent_path);
+		parent = get_watch_path(parent_path);
+		talloc_free(parent_path);
+		if (!parent)
+			return NULL;
+	}
+
+	p = talloc_zero(talloc_autofree_context(), struct watch_path);
+	if (!p)
+		goto nomem;
+	p->path = strdup(path);
+	if (!p->path)
+		goto nomem;
+	if (!hashtable_insert(watch_paths, p->path, p)) {
+		free(p->path);
+		goto nomem;
+	}
+
+	INIT_LIST_HEAD(&p->children);
+	INIT_LIST_HEAD(&p->watches);
+	p->parent = parent;
+	if (parent)
+		list_add_tail(&p->list, &parent->children);
+	else
+		INIT_LIST_HEAD(&p->list);
+
+	return p;
+
+ nomem:
+	talloc_free(p);
+	put_watch_path(parent);
+	return NULL;
+}
+
+/* Find the path or its nearest ancestor in the watched paths tree. */
+static struct watch_path *find_watch_path(void *ctx, const char *name)
+{
+	struct watch_path *p;
+	char *path;
+
+	if (!watch_paths || !hashtable_count(watch_paths))
+		return NULL;
+
+	path = talloc_strdup(ctx, name);
+	if (!path)
+		return NULL;
+
+	do {
+		p = hashtable_search(watch_paths, path);
+	} while (!p && strip_path(path));
+
+	talloc_free(path);
+	return p;
+}
+
+/* Fire the watches on p and its parents, starting at the root. */
+static void fire_watches_path(void *ctx, struct watch_path *p,
+			      const char *name)
+{
+	struct watch *watch;
+
+	if (p->parent)
+		fire_watches_path(ctx, p->parent, name);
+
+	list_for_each_entry(watch, &p->watches, path_list)
+		add_event(watch->conn, ctx, watch, name);
+}
+
+/* Fire the watches below p for removal of the subtree. */
+static void fire_watches_below(void *ctx, struct watch_path *p)
+{
+	struct watch_path *child;
+	struct watch *watch;
+
+	list_for_each_entry(child, &p->children, list) {
+		list_for_each_entry(watch, &child->watches, path_list)
+			add_event(watch->conn, ctx, watch, watch->node);
+		fire_watches_below(ctx, child);
+	}
+}
+
 /*
  * Check whether any watch events are to be sent.
  * Temporary memory allocations are done with ctx.
@@ -126,27 +287,31 @@ static void add_event(struct connection *conn,
 void fire_watches(struct connection *conn, void *ctx, const char *name,
 		  bool recurse)
 {
-	struct connection *i;
-	struct watch *watch;
+	struct watch_path *p;
 
 	/* During transactions, don't fire watches. */
 	if (conn && conn->transaction)
 		return;
 
-	/* Create an event for each watch. */
-	list_for_each_entry(i, &connections, list) {
-		list_for_each_entry(watch, &i->watches, list) {
-			if (is_child(name, watch->node))
-				add_event(i, ctx, watch, name);
-			else if (recurse && is_child(watch->node, name))
-				add_event(i, ctx, watch, watch->node);
-		}
-	}
+	p = find_watch_path(ctx, name);
+	if (!p)
+		return;
+
+	/* Create an event for each watch on the node and its parents. */
+	fire_watches_path(ctx, p, name);
+
+	/* Watches below the node are affected if it is removed. */
+	if (recurse && streq(p->path, name))
+		fire_watches_below(ctx, p);
 }
 
 static int destroy_watch(void *_watch)
 {
-	trace_destroy(_watch, "watch");
+	struct watch *watch = _watch;
+
+	trace_destroy(watch, "watch");
+	list_del(&watch->path_list);
+	put_watch_path(watch->path);
 	return 0;
 }
 
@@ -197,10 +362,18 @@ int do_watch(struct connection *conn, struct buffered_data *in)
 	else
 		watch->relative_path = NULL;
 
+	watch->path = get_watch_path(watch->node);
+	if (!watch->path) {
+		talloc_free(watch);
+		return ENOMEM;
+	}
+	watch->conn = conn;
+
 	INIT_LIST_HEAD(&watch->events);
 
 	domain_watch_inc(conn);
 	list_add_tail(&watch->list, &conn->watches);
+	list_add_tail(&watch->path_list, &watch->path->watches);
 	trace_create(watch, "watch");
 	talloc_set_destructor(watch, destroy_watch);
 	send_ack(conn, XS_WATCH);
@@ -234,6 +407,13 @@ int do_unwatch(struct connection *conn, struct buffered_data *in)
 	return ENOENT;
 }
 
+void init_watches(void)
+{
+	watch_paths = create_hashtable(64, hash_from_key_fn, keys_equal_fn);
+	if (!watch_paths)
+		barf_perror("Could not create watch index");
+}
+
 void conn_delete_all_watches(struct connection *conn)
 {
 	struct watch *watch;
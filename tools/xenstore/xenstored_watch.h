@@ -30,4 +30,7 @@ void fire_watches(struct connection *conn, void *tmp, const char *name,
 
 void conn_delete_all_watches(struct connection *conn);
 
+/* Set up the index of watched paths. */
+void init_watches(void);
+
 #endif /* _XENSTORED_WATCH_H */
@@ -0,0 +1,188 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <errno.h>
+#include "mshard.h"
+
+/*
+ * Sharded reading of a trace file.  The whole file is mapped once, and
+ * the per-pcpu streams (shards) are described by the list of windows
+ * belonging to each pcpu.  Reads are plain copies out of the mapping.
+ *
+ * The analysis consumes all the shards at once, in tsc order, so it
+ * touches the file at as many places as there are pcpus.  To keep it from
+ * stalling on each of those page faults in turn, a pool of threads walks
+ * the shards ahead of the analysis and faults their windows in, staying
+ * at most MSHARD_AHEAD bytes ahead of where the analysis of each shard
+ * is.  The analysis itself is unchanged, so its output is too.
+ */
+
+#define MSHARD_PAGE_SIZE 4096
+
+mshard_handle_t mshard_init(int fd, int nr_shards)
+{
+    struct stat s;
+    mshard_handle_t h;
+
+    if ( fstat(fd, &s) < 0 )
+        return NULL;
+
+    h = calloc(1, sizeof(*h));
+    if ( !h )
+        return NULL;
+
+    h->fd = fd;
+    h->file_size = s.st_size;
+    h->nr_shards = nr_shards;
+
+    h->shard = calloc(nr_shards, sizeof(*h->shard));
+    if ( !h->shard )
+        goto fail;
+
+    h->map = mmap(NULL, h->file_size, PROT_READ, MAP_SHARED, fd, 0);
+    if ( h->map == MAP_FAILED )
+        goto fail;
+
+    return h;
+
+ fail:
+    free(h->shard);
+    free(h);
+    return NULL;
+}
+
+void mshard_add_window(mshard_handle_t h, int shard, off_t offset, size_t len)
+{
+    struct mshard *s = &h->shard[shard];
+
+    if ( s->count == s->max )
+    {
+        s->max = s->max ? s->max * 2 : 64;
+        s->window = realloc(s->window, s->max * sizeof(*s->window));
+        if ( !s->window )
+        {
+            perror("realloc");
+            exit(1);
+        }
+    }
+
+    s->window[s->count].offset = offset;
+    s->window[s->count].len = len;
+    s->count++;
+}
+
+static void mshard_fault_in(mshard_handle_t h, const struct mshard_window *w)
+{
+    off_t start = w->offset & ~(off_t)(MSHARD_PAGE_SIZE - 1);
+    off_t end = w->offset + w->len;
+    volatile char c;
+
+    if ( end > h->file_size )
+        end = h->file_size;
+    if ( start >= end )
+        return;
+
+    madvise((void *)(h->map + start), end - start, MADV_WILLNEED);
+
+    for ( ; start < end; start += MSHARD_PAGE_SIZE )
+        c = h->map[start];
+    (void)c;
+}
+
+static void *mshard_worker(void *arg)
+{
+    struct mshard_worker *wk = arg;
+    mshard_handle_t h = wk->h;
+    struct mshard *s;
+    int *next, i, progress, remaining;
+
+    next = calloc(h->nr_shards, sizeof(*next));
+    if ( !next )
+        return NULL;
+
+    while ( !__atomic_load_n(&h->stop, __ATOMIC_RELAXED) )
+    {
+        progress = remaining = 0;
+
+        /* One window from each of our shards per pass. */
+        for ( i = wk->id; i < h->nr_shards; i += h->nr_threads )
+        {
+            s = &h->shard[i];
+
+            if ( next[i] >= s->count )
+                continue;
+            remaining = 1;
+
+            if ( s->window[next[i]].offset >
+                 __atomic_load_n(&s->consumed, __ATOMIC_RELAXED) + MSHARD_AHEAD )
+                continue;
+
+            mshard_fault_in(h, &s->window[next[i]++]);
+            progress = 1;
+        }
+
+        if ( !remaining )
+            break;
+        if ( !progress )
+            usleep(1000);
+    }
+
+    free(next);
+    return NULL;
+}
+
+void mshard_start(mshard_handle_t h, int nr_threads)
+{
+    int i, rc;
+
+    h->workers = calloc(nr_threads, sizeof(*h->workers));
+    if ( !h->workers )
+    {
+        perror("calloc");
+        exit(1);
+    }
+
+    h->nr_threads = nr_threads;
+    for ( i = 0; i < nr_threads; i++ )
+    {
+        h->workers[i].h = h;
+        h->workers[i].id = i;
+
+        rc = pthread_create(&h->workers[i].thread, NULL, mshard_worker,
+                            &h->workers[i]);
+        if ( rc )
+        {
+            fprintf(stderr, "pthread_create: %s\n", strerror(rc));
+            exit(1);
+        }
+    }
+}
+
+void mshard_finish(mshard_handle_t h)
+{
+    int i;
+
+    __atomic_store_n(&h->stop, 1, __ATOMIC_RELAXED);
+    for ( i = 0; i < h->nr_threads; i++ )
+        pthread_join(h->workers[i].thread, NULL);
+
+    free(h->workers);
+    h->workers = NULL;
+    h->nr_threads = 0;
+}
+
+ssize_t mshard_read64(mshard_handle_t h, void *rec, ssize_t len, off_t offset)
+{
+    if ( offset > h->file_size )
+        return 0;
+    if ( offset + len > h->file_size )
+        len = h->file_size - offset;
+
+    memcpy(rec, h->map + offset, len);
+
+    return len;
+}
@@ -0,0 +1,42 @@
+#include <pthread.h>
+
+/* How far ahead of the analysis a shard is faulted in. */
+#define MSHARD_AHEAD (64ULL<<20)
+
+/* The windows of one pcpu's stream, in file order. */
+struct mshard {
+    struct mshard_window {
+        off_t offset;
+        size_t len;
+    } *window;
+    int count, max;
+    /* Offset the analysis has reached in this stream; stored by the
+     * analysis, loaded by the prefetch threads, both with __atomic. */
+    off_t consumed;
+};
+
+typedef struct mshard_ctrl {
+    int fd;
+    off_t file_size;
+    const char *map;
+    int nr_shards;
+    struct mshard *shard;
+    int nr_threads;
+    struct mshard_worker {
+        pthread_t thread;
+        struct mshard_ctrl *h;
+        int id;
+    } *workers;
+    int stop; /* __atomic */
+} *mshard_handle_t;
+
+mshard_handle_t mshard_init(int fd, int nr_shards);
+void mshard_add_window(mshard_handle_t h, int shard, off_t offset, size_t len);
+void mshard_start(mshard_handle_t h, int nr_threads);
+void mshard_finish(mshard_handle_t h);
+ssize_t mshard_read64(mshard_handle_t h, void *dst, ssize_t len, off_t offset);
+
+static inline void mshard_consumed(mshard_handle_t h, int shard, off_t offset)
+{
+    __atomic_store_n(&h->shard[shard].consumed, offset, __ATOMIC_RELAXED);
+}
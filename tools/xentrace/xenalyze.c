@@ -31,6 +31,7 @@
 #include <xen/trace.h>
 #include "analyze.h"
 #include "mread.h"
+#include "mshard.h"
 #include "pv.h"
 #include <errno.h>
 #include <strings.h>
@@ -38,6 +39,7 @@
 #include <assert.h>
 
 struct mread_ctrl;
+struct mshard_ctrl;
 
 
 #define DEFAULT_CPU_HZ 2400000000LL
@@ -66,6 +68,7 @@ struct array_struct {
 struct {
     int fd;
     struct mread_ctrl *mh;
+    struct mshard_ctrl *sh;
     struct symbol_struct * symbols;
     char * symbol_file;
     char * trace_file;
@@ -189,6 +192,7 @@ struct {
     int interrupt_eip_enumeration_vector;
     int default_guest_paging_levels;
     int sample_size, sample_max;
+    int prefetch; /* Threads reading ahead the per-pcpu streams */
     enum error_level tolerance; /* Tolerate up to this level of error */
     struct {
         tsc_t cycles;
@@ -9464,7 +9468,10 @@ ssize_t __read_record(struct trace_record *rec, off_t offset)
 {
     ssize_t r, rsize;
 
-    r=mread64(G.mh, rec, sizeof(*rec), offset);
+    if ( G.sh )
+        r=mshard_read64(G.sh, rec, sizeof(*rec), offset);
+    else
+        r=mread64(G.mh, rec, sizeof(*rec), offset);
 
     if(r < 0) {
         /* Read error */
@@ -9553,6 +9560,8 @@ ssize_t read_record(struct pcpu_info * p) {
     if(ri->size)
     {
         __fill_in_record_info(p);
+        if ( G.sh )
+            mshard_consumed(G.sh, p->pid, *offset);
     }
     else
     {
@@ -9564,6 +9573,41 @@ ssize_t read_record(struct pcpu_info * p) {
     return ri->size;
 }
 
+/*
+ * Build the per-pcpu shards for --prefetch by walking the cpu_change
+ * records, which chain the windows of the file together.  Only the
+ * headers are read; the windows themselves are faulted in later by the
+ * prefetch threads.
+ */
+void shard_trace(void)
+{
+    struct trace_record rec;
+    struct cpu_change_data *cd;
+    off_t offset = 0;
+    ssize_t r;
+
+    while ( (r = __read_record(&rec, offset)) > 0 )
+    {
+        if ( rec.event != TRC_TRACE_CPU_CHANGE || rec.cycle_flag )
+        {
+            fprintf(warn, "%s: Unexpected record event %x at offset %llx, stopping\n",
+                    __func__, rec.event, (unsigned long long)offset);
+            break;
+        }
+
+        cd = (typeof(cd))rec.u.notsc.data;
+        if ( cd->cpu < 0 || cd->cpu >= MAX_CPUS )
+        {
+            fprintf(warn, "%s: cpu %d exceeds MAX_CPUS %d, stopping\n",
+                    __func__, cd->cpu, MAX_CPUS);
+            break;
+        }
+
+        mshard_add_window(G.sh, cd->cpu, offset + r, cd->window_size);
+        offset += r + cd->window_size;
+    }
+}
+
 /*
  * This funciton gets called for every record when doing dump.  Try to
  * make it efficient by changing the minimum amount from the last
@@ -9938,6 +9982,7 @@ enum {
     OPT_PROGRESS,
     OPT_TOLERANCE,
     OPT_TSC_LOOP_FATAL,
+    OPT_PREFETCH,
     /* Specific letters */
     OPT_DUMP_ALL='a',
     OPT_INTERVAL_LENGTH='i',
@@ -10418,6 +10463,16 @@ error_t cmd_parser(int key, char *arg, struct argp_state *state)
         opt.tsc_loop_fatal = 1;
         break;
 
+    case OPT_PREFETCH:
+    {
+        char * inval;
+
+        opt.prefetch = (int)strtol(arg, &inval, 0);
+        if ( inval == arg || opt.prefetch < 1 )
+            argp_usage(state);
+    }
+    break;
+
     case ARGP_KEY_ARG:
     {
         /* FIXME - strcpy */
@@ -10707,6 +10762,11 @@ const struct argp_option cmd_opts[] =  {
       .key = OPT_TSC_LOOP_FATAL,
       .doc = "Stop processing and exit if tsc skew tracking detects a dependency loop.", },
 
+    { .name = "prefetch",
+      .key = OPT_PREFETCH,
+      .arg = "N",
+      .doc = "Map the whole trace file and use N threads to fault the per-pcpu streams in ahead of the analysis, which itself stays single-threaded.  The output is the same as without.", },
+
     { .name = "tolerance",
       .key = OPT_TOLERANCE,
       .arg = "errlevel",
@@ -10747,6 +10807,18 @@ int main(int argc, char *argv[]) {
     if ( (G.mh = mread_init(G.fd)) == NULL )
         perror("mread");
 
+    if ( opt.prefetch )
+    {
+        if ( (G.sh = mshard_init(G.fd, MAX_CPUS)) == NULL )
+            fprintf(warn, "Could not map trace file (%s), not prefetching\n",
+                    strerror(errno));
+        else
+        {
+            shard_trace();
+            mshard_start(G.sh, opt.prefetch);
+        }
+    }
+
     if (G.symbol_file != NULL)
         parse_symbol_file(G.symbol_file);
 
@@ -10760,6 +10832,9 @@ int main(int argc, char *argv[]) {
 
     process_records();
 
+    if ( G.sh )
+        mshard_finish(G.sh);
+
     if(opt.interval_mode)
         interval_tail();
 
@@ -24,8 +24,11 @@
 #include <getopt.h>
 #include <assert.h>
 #include <ctype.h>
+#include <pthread.h>
+#include <stdbool.h>
 #include <sys/poll.h>
 #include <sys/statvfs.h>
+#include <sys/uio.h>
 
 #include <xen/xen.h>
 #include <xen/trace.h>
@@ -34,6 +37,11 @@
 #include <xenevtchn.h>
 #include <xenctrl.h>
 
+/* *BSD has no O_LARGEFILE */
+#ifndef O_LARGEFILE
+#define O_LARGEFILE	0
+#endif
+
 #define PERROR(_m, _a...)                                       \
 do {                                                            \
     int __saved_errno = errno;                                  \
@@ -62,7 +70,8 @@ typedef struct settings_st {
     unsigned long memory_buffer;
     uint8_t discard:1,
         disable_tracing:1,
-        start_disabled:1;
+        start_disabled:1,
+        per_cpu:1;
 } settings_t;
 
 struct t_struct {
@@ -80,6 +89,13 @@ static xenevtchn_handle *xce_handle = NULL;
 static int virq_port = -1;
 static int outfd = 1;
 
+/* Per-CPU totals, reported when xentrace exits. */
+struct cpu_stats {
+    unsigned long long bytes;
+    unsigned long long lost;
+};
+static struct cpu_stats *cpu_stats;
+
 static void close_handler(int signal)
 {
     interrupted = 1;
@@ -332,6 +348,37 @@ fail:
     return;
 }
 
+/**
+ * check_disk_space - enforce the --reserve-disk-space limit
+ * @fd       - file about to be written
+ * @size     - number of bytes about to be written
+ */
+static void check_disk_space(int fd, unsigned long size)
+{
+    struct statvfs stat;
+    unsigned long long freespace;
+
+    if ( opts.disk_rsvd == 0 )
+        return;
+
+    /* Check that filesystem has enough space. */
+    if ( fstatvfs(fd, &stat) )
+    {
+        PERROR("Statfs failed");
+        exit(EXIT_FAILURE);
+    }
+
+    freespace = stat.f_frsize * (unsigned long long)stat.f_bfree;
+    freespace -= size;
+    freespace >>= 20; /* Convert to MB */
+
+    if ( freespace <= opts.disk_rsvd )
+    {
+        fprintf(stderr, "Disk space limit reached (free space: %lluMB, limit: %luMB).\n", freespace, opts.disk_rsvd);
+        exit (EXIT_FAILURE);
+    }
+}
+
 /**
  * write_buffer - write a section of the trace buffer
  * @cpu      - source buffer CPU ID
@@ -346,35 +393,10 @@ fail:
 static void write_buffer(unsigned int cpu, unsigned char *start, int size,
                          int total_size)
 {
-    struct statvfs stat;
     size_t written = 0;
     
-    if ( opts.memory_buffer == 0 && opts.disk_rsvd != 0 )
-    {
-        unsigned long long freespace;
-
-        /* Check that filesystem has enough space. */
-        if ( fstatvfs (outfd, &stat) )
-        {
-            fprintf(stderr, "Statfs failed!\n");
-            goto fail;
-        }
-
-        freespace = stat.f_frsize * (unsigned long long)stat.f_bfree;
-
-        if ( total_size )
-            freespace -= total_size;
-        else
-            freespace -= size;
-
-        freespace >>= 20; /* Convert to MB */
-
-        if ( freespace <= opts.disk_rsvd )
-        {
-            fprintf(stderr, "Disk space limit reached (free space: %lluMB, limit: %luMB).\n", freespace, opts.disk_rsvd);
-            exit (EXIT_FAILURE);
-        }
-    }
+    if ( opts.memory_buffer == 0 )
+        check_disk_space(outfd, total_size ? total_size : size);
 
     /* Write a CPU_BUF record on each buffer "window" written.  Wrapped
      * windows may involve two writes, so only write the record on the
@@ -657,6 +679,304 @@ static void wait_for_event_or_timeout(unsigned long milliseconds)
     }
 }
 
+/**
+ * get_window - find the unconsumed data in a trace buffer
+ * @meta        - trace buffer metadata
+ * @data        - trace buffer data area
+ * @data_size   - size of the data area
+ * @iov         - filled in with the window, in two pieces if it wraps
+ * @window_size - total size of the window
+ * @prod        - producer index to hand back to Xen as the new consumer
+ *
+ * Returns the number of pieces in @iov, or 0 if the buffer is empty.
+ */
+static int get_window(struct t_buf *meta, unsigned char *data,
+                      unsigned long data_size, struct iovec iov[2],
+                      unsigned long *window_size, uint32_t *prod)
+{
+    unsigned long start_offset, end_offset, cons;
+
+    /* Read window information only once. */
+    cons = meta->cons;
+    *prod = meta->prod;
+    xen_rmb(); /* read prod, then read item. */
+
+    if ( cons == *prod )
+        return 0;
+
+    assert(cons < 2*data_size);
+    assert(*prod < 2*data_size);
+
+    // NB: if (prod<cons), then (prod-cons)%data_size will not yield
+    // the correct answer because data_size is not a power of 2.
+    if ( *prod < cons )
+        *window_size = (*prod + 2*data_size) - cons;
+    else
+        *window_size = *prod - cons;
+    assert(*window_size > 0);
+    assert(*window_size <= data_size);
+
+    start_offset = cons % data_size;
+    end_offset = *prod % data_size;
+
+    iov[0].iov_base = data + start_offset;
+
+    /* If window does not wrap, it is one big chunk */
+    if ( end_offset > start_offset )
+    {
+        iov[0].iov_len = *window_size;
+        return 1;
+    }
+
+    /* If wrapped, it is two chunks:
+     * - first, start to the end of the buffer
+     * - second, start of buffer to end of window
+     */
+    iov[0].iov_len = data_size - start_offset;
+    iov[1].iov_base = data;
+    iov[1].iov_len = end_offset;
+
+    return 2;
+}
+
+/**
+ * count_lost_records - sum up the TRC_LOST_RECORDS reports in a section of
+ *                      a trace buffer
+ *
+ * Xen never lets a record straddle the end of the buffer, so each piece of
+ * a wrapped window starts and ends on a record boundary.
+ */
+static unsigned long long count_lost_records(const unsigned char *start,
+                                             unsigned long size)
+{
+    const struct t_rec *rec;
+    const uint32_t *extra;
+    unsigned long off = 0;
+    unsigned long long lost = 0;
+
+    while ( off + sizeof(uint32_t) <= size )
+    {
+        rec = (const struct t_rec *)(start + off);
+        extra = rec->cycles_included ? rec->u.cycles.extra_u32
+                                     : rec->u.nocycles.extra_u32;
+
+        /* The first extra word is the number of records lost. */
+        if ( rec->event == TRC_LOST_RECORDS && rec->extra_u32 >= 1 )
+            lost += extra[0];
+
+        off += (const unsigned char *)(extra + rec->extra_u32) -
+               (const unsigned char *)rec;
+    }
+
+    return lost;
+}
+
+static void account_window(unsigned int cpu, const struct iovec *iov, int nr,
+                           unsigned long window_size)
+{
+    int i;
+
+    cpu_stats[cpu].bytes += window_size;
+    for ( i = 0; i < nr; i++ )
+        cpu_stats[cpu].lost += count_lost_records(iov[i].iov_base,
+                                                  iov[i].iov_len);
+}
+
+static void print_cpu_stats(unsigned int num)
+{
+    unsigned int i;
+
+    for ( i = 0; i < num; i++ )
+    {
+        if ( !cpu_stats[i].bytes && !cpu_stats[i].lost )
+            continue;
+
+        fprintf(stderr, "CPU%u: %llu bytes read, %llu records lost\n",
+                i, cpu_stats[i].bytes, cpu_stats[i].lost);
+    }
+}
+
+/*
+ * Per-CPU output: each trace buffer is drained by its own thread into its
+ * own file, <output file>.<cpu>.  The main thread only waits for VIRQ_TBUF
+ * (or the poll timeout) and kicks the workers; a worker which is still busy
+ * writing simply picks up the larger window on its next pass.
+ *
+ * Every window goes out as a single writev() of the cpu_change record and
+ * the one or two pieces of the window, straight from the mapping of Xen's
+ * buffer, so the data is never copied in user space.
+ */
+struct cpu_worker {
+    unsigned int cpu;
+    int fd;
+    pthread_t thread;
+    struct t_buf *meta;
+    unsigned char *data;
+    unsigned long data_size;
+};
+
+static pthread_mutex_t worker_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t worker_cond = PTHREAD_COND_INITIALIZER;
+static unsigned long worker_gen; /* bumped to make every worker drain */
+static bool workers_stop;        /* drain one final time, then exit */
+
+static void write_iov_exact(int fd, struct iovec *iov, int cnt)
+{
+    ssize_t written;
+
+    while ( cnt )
+    {
+        written = writev(fd, iov, cnt);
+        if ( written < 0 )
+        {
+            if ( errno == EINTR )
+                continue;
+            PERROR("Failed to write trace data");
+            exit(EXIT_FAILURE);
+        }
+
+        while ( cnt && written >= iov->iov_len )
+        {
+            written -= iov->iov_len;
+            iov++;
+            cnt--;
+        }
+
+        if ( cnt )
+        {
+            iov->iov_base = (char *)iov->iov_base + written;
+            iov->iov_len -= written;
+        }
+    }
+}
+
+static void *cpu_worker(void *arg)
+{
+    struct cpu_worker *w = arg;
+    struct cpu_change_record rec;
+    struct iovec iov[3];
+    unsigned long gen = 0, window_size;
+    uint32_t prod;
+    bool stop;
+    int nr;
+
+    for ( ; ; )
+    {
+        pthread_mutex_lock(&worker_lock);
+        while ( gen == worker_gen && !workers_stop )
+            pthread_cond_wait(&worker_cond, &worker_lock);
+        gen = worker_gen;
+        stop = workers_stop;
+        pthread_mutex_unlock(&worker_lock);
+
+        nr = get_window(w->meta, w->data, w->data_size, &iov[1],
+                        &window_size, &prod);
+        if ( nr )
+        {
+            check_disk_space(w->fd, sizeof(rec) + window_size);
+            account_window(w->cpu, &iov[1], nr, window_size);
+
+            rec.header = CPU_CHANGE_HEADER;
+            rec.data.cpu = w->cpu;
+            rec.data.window_size = window_size;
+            iov[0].iov_base = &rec;
+            iov[0].iov_len = sizeof(rec);
+
+            write_iov_exact(w->fd, iov, nr + 1);
+
+            xen_mb(); /* read buffer, then update cons. */
+            w->meta->cons = prod;
+        }
+
+        if ( stop )
+            break;
+    }
+
+    return NULL;
+}
+
+static void kick_workers(bool stop)
+{
+    pthread_mutex_lock(&worker_lock);
+    worker_gen++;
+    if ( stop )
+        workers_stop = true;
+    pthread_cond_broadcast(&worker_cond);
+    pthread_mutex_unlock(&worker_lock);
+}
+
+static struct cpu_worker *start_workers(struct t_struct *tbufs,
+                                        unsigned int num,
+                                        unsigned long data_size)
+{
+    struct cpu_worker *workers;
+    sigset_t set, old;
+    char *name;
+    unsigned int i;
+    int rc;
+
+    workers = calloc(num, sizeof(*workers));
+    name = malloc(strlen(opts.outfile) + 16);
+    if ( !workers || !name )
+    {
+        PERROR("Failed to allocate per-cpu workers");
+        exit(EXIT_FAILURE);
+    }
+
+    /* Signals are for the main thread, which tells the workers to stop. */
+    sigemptyset(&set);
+    sigaddset(&set, SIGHUP);
+    sigaddset(&set, SIGTERM);
+    sigaddset(&set, SIGINT);
+    sigaddset(&set, SIGALRM);
+    pthread_sigmask(SIG_BLOCK, &set, &old);
+
+    for ( i = 0; i < num; i++ )
+    {
+        struct cpu_worker *w = &workers[i];
+
+        w->cpu = i;
+        w->meta = tbufs->meta[i];
+        w->data = tbufs->data[i];
+        w->data_size = data_size;
+
+        sprintf(name, "%s.%u", opts.outfile, i);
+        w->fd = open(name, O_WRONLY | O_CREAT | O_TRUNC | O_LARGEFILE, 0644);
+        if ( w->fd < 0 )
+        {
+            PERROR("Could not open output file %s", name);
+            exit(EXIT_FAILURE);
+        }
+
+        rc = pthread_create(&w->thread, NULL, cpu_worker, w);
+        if ( rc )
+        {
+            errno = rc;
+            PERROR("Failed to start worker for cpu %u", i);
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+    free(name);
+
+    return workers;
+}
+
+static void stop_workers(struct cpu_worker *workers, unsigned int num)
+{
+    unsigned int i;
+
+    kick_workers(true);
+
+    for ( i = 0; i < num; i++ )
+    {
+        pthread_join(workers[i].thread, NULL);
+        close(workers[i].fd);
+    }
+
+    free(workers);
+}
 
 /**
  * monitor_tbufs - monitor the contents of tbufs and output to a file
@@ -704,56 +1024,52 @@ static int monitor_tbufs(void)
         for ( i = 0; i < num; i++ )
             meta[i]->cons = meta[i]->prod;
 
+    cpu_stats = calloc(num, sizeof(*cpu_stats));
+    if ( !cpu_stats )
+    {
+        PERROR("Failed to allocate per-cpu statistics");
+        exit(EXIT_FAILURE);
+    }
+
+    if ( opts.per_cpu )
+    {
+        struct cpu_worker *workers = start_workers(tbufs, num, data_size);
+
+        while ( 1 )
+        {
+            kick_workers(false);
+            if ( interrupted )
+                break;
+            wait_for_event_or_timeout(opts.poll_sleep);
+        }
+
+        /* Disable tracing, then have the workers drain their buffers one last time */
+        if ( opts.disable_tracing )
+            disable_tbufs();
+        stop_workers(workers, num);
+
+        goto out;
+    }
+
     /* now, scan buffers for events */
     while ( 1 )
     {
         for ( i = 0; i < num; i++ )
         {
-            unsigned long start_offset, end_offset, window_size, cons, prod;
-                
-            /* Read window information only once. */
-            cons = meta[i]->cons;
-            prod = meta[i]->prod;
-            xen_rmb(); /* read prod, then read item. */
-
-            if ( cons == prod )
+            struct iovec iov[2];
+            unsigned long window_size;
+            uint32_t prod;
+            int nr;
+
+            nr = get_window(meta[i], data[i], data_size, iov,
+                            &window_size, &prod);
+            if ( nr == 0 )
                 continue;
-           
-            assert(cons < 2*data_size);
-            assert(prod < 2*data_size);
-
-            // NB: if (prod<cons), then (prod-cons)%data_size will not yield
-            // the correct answer because data_size is not a power of 2.
-            if ( prod < cons )
-                window_size = (prod + 2*data_size) - cons;
-            else
-                window_size = prod - cons;
-            assert(window_size > 0);
-            assert(window_size <= data_size);
-
-            start_offset = cons % data_size;
-            end_offset = prod % data_size;
 
-            if ( end_offset > start_offset )
-            {
-                /* If window does not wrap, write in one big chunk */
-                write_buffer(i, data[i]+start_offset,
-                             window_size,
-                             window_size);
-            }
-            else
-            {
-                /* If wrapped, write in two chunks:
-                 * - first, start to the end of the buffer
-                 * - second, start of buffer to end of window
-                 */
-                write_buffer(i, data[i] + start_offset,
-                             data_size - start_offset,
-                             window_size);
-                write_buffer(i, data[i],
-                             end_offset,
-                             0);
-            }
+            write_buffer(i, iov[0].iov_base, iov[0].iov_len, window_size);
+            if ( nr > 1 )
+                write_buffer(i, iov[1].iov_base, iov[1].iov_len, 0);
+            account_window(i, iov, nr, window_size);
 
             xen_mb(); /* read buffer, then update cons. */
             meta[i]->cons = prod;
@@ -780,11 +1096,16 @@ static int monitor_tbufs(void)
     if ( opts.memory_buffer )
         membuf_dump();
 
+ out:
+    print_cpu_stats(num);
+
     /* cleanup */
+    free(cpu_stats);
     free(meta);
     free(data);
     /* don't need to munmap - cleanup is automatic */
-    close(outfd);
+    if ( !opts.per_cpu )
+        close(outfd);
 
     return 0;
 }
@@ -835,6 +1156,8 @@ static void usage(void)
 "  -r  --reserve-disk-space=n Before writing trace records to disk, check to see\n" \
 "                          that after the write there will be at least n space\n" \
 "                          left on the disk.\n" \
+"  -P  --per-cpu-output    Write the records of each CPU to its own file,\n" \
+"                          <output file>.<cpu>, from a thread per CPU.\n" \
 "\n" \
 "This tool is used to capture trace buffer data from Xen. The\n" \
 "data is output in a binary format, in the following order:\n" \
@@ -1083,12 +1406,13 @@ static void parse_args(int argc, char **argv)
         { "discard-buffers", no_argument,      0, 'D' },
         { "dont-disable-tracing", no_argument, 0, 'x' },
         { "start-disabled", no_argument,       0, 'X' },
+        { "per-cpu-output", no_argument,       0, 'P' },
         { "help",           no_argument,       0, '?' },
         { "version",        no_argument,       0, 'V' },
         { 0, 0, 0, 0 }
     };
 
-    while ( (option = getopt_long(argc, argv, "t:s:c:e:S:r:T:M:DxX?V",
+    while ( (option = getopt_long(argc, argv, "t:s:c:e:S:r:T:M:DxXP?V",
                     long_options, NULL)) != -1) 
     {
         switch ( option )
@@ -1137,6 +1461,10 @@ static void parse_args(int argc, char **argv)
             opts.memory_buffer = sargtol(optarg, 0);
             break;
 
+        case 'P': /* One output file per CPU */
+            opts.per_cpu = 1;
+            break;
+
         default:
             usage();
         }
@@ -1147,12 +1475,13 @@ static void parse_args(int argc, char **argv)
         usage();
 
     opts.outfile = argv[optind];
-}
 
-/* *BSD has no O_LARGEFILE */
-#ifndef O_LARGEFILE
-#define O_LARGEFILE	0
-#endif
+    if ( opts.per_cpu && opts.memory_buffer )
+    {
+        fprintf(stderr, "Per-cpu output cannot be used with a memory buffer.\n");
+        usage();
+    }
+}
 
 int main(int argc, char **argv)
 {
@@ -1189,18 +1518,20 @@ int main(int argc, char **argv)
     if ( opts.timeout != 0 ) 
         alarm(opts.timeout);
 
-    if ( opts.outfile )
+    if ( opts.per_cpu )
+        outfd = -1; /* The workers open their own files. */
+    else if ( opts.outfile )
         outfd = open(opts.outfile,
                      O_WRONLY | O_CREAT | O_TRUNC | O_LARGEFILE,
                      0644);
 
-    if ( outfd < 0 )
+    if ( outfd < 0 && !opts.per_cpu )
     {
         perror("Could not open output file");
         exit(EXIT_FAILURE);
     }        
 
-    if ( isatty(outfd) )
+    if ( outfd >= 0 && isatty(outfd) )
     {
         fprintf(stderr, "Cannot output to a TTY, specify a log file.\n");
         exit(EXIT_FAILURE);
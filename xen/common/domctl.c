@@ -928,6 +928,37 @@ long do_domctl(XEN_GUEST_HANDLE_PARAM(xen_domctl_t) u_domctl)
         break;
     }
 
+    case XEN_DOMCTL_get_sched_hist:
+    {
+        struct xen_domctl_sched_hist *sh = &op->u.sched_hist;
+        struct xen_sched_hist run_delay = { { 0 } }, slice = { { 0 } };
+        struct vcpu *v;
+
+        if ( sh->vcpu == XEN_DOMCTL_SCHED_HIST_ALL )
+        {
+            for_each_vcpu ( d, v )
+                vcpu_sched_hist_get(v, &run_delay, &slice);
+        }
+        else
+        {
+            ret = -EINVAL;
+            if ( sh->vcpu >= d->max_vcpus )
+                break;
+
+            ret = -ESRCH;
+            if ( (v = d->vcpu[sh->vcpu]) == NULL )
+                break;
+
+            vcpu_sched_hist_get(v, &run_delay, &slice);
+        }
+
+        ret = 0;
+        if ( copy_to_guest(sh->run_delay, &run_delay, 1) ||
+             copy_to_guest(sh->slice, &slice, 1) )
+            ret = -EFAULT;
+        break;
+    }
+
     case XEN_DOMCTL_max_mem:
     {
         uint64_t new_max = op->u.max_mem.max_memkb >> (PAGE_SHIFT - 10);
@@ -126,6 +126,7 @@
 #include <xen/sched.h>
 #include <xen/spinlock.h>
 #include <xen/mm.h>
+#include <xen/cpu.h>
 #include <xen/irq.h>
 #include <xen/softirq.h>
 #include <xen/domain_page.h>
@@ -385,9 +386,28 @@ typedef struct page_list_head heap_by_zone_and_order_t[NR_ZONES][MAX_ORDER+1];
 static heap_by_zone_and_order_t *_heap[MAX_NUMNODES];
 #define heap(node, zone, order) ((*_heap[node])[zone][order])
 
+/*
+ * Locking: each node's buddy lists, avail[] and node_need_scrub[] entries
+ * are protected by that node's heap lock.  The global heap_lock protects
+ * total_avail_pages, outstanding claims and the offlined/broken page lists;
+ * where both are needed, the node lock is taken first.
+ */
+static struct node_heap {
+    spinlock_t lock;
+} __cacheline_aligned node_heap[MAX_NUMNODES] = {
+    [0 ... MAX_NUMNODES - 1] = { .lock = SPIN_LOCK_UNLOCKED }
+};
+#define node_heap_lock(node) (&node_heap[node].lock)
+
 static unsigned long *avail[MAX_NUMNODES];
 static long total_avail_pages;
 
+/* Free pages per node still holding guest data. */
+static unsigned long node_need_scrub[MAX_NUMNODES];
+
+/* u.free.first_dirty of a buddy with no pages left to scrub. */
+#define INVALID_DIRTY_IDX (~0U)
+
 /* TMEM: Reserve a fraction of memory for mid-size (0<order<9) allocations.*/
 static long midsize_alloc_zone_pages;
 #define MIDSIZE_ALLOC_FRAC 128
@@ -395,6 +415,9 @@ static long midsize_alloc_zone_pages;
 static DEFINE_SPINLOCK(heap_lock);
 static long outstanding_claims; /* total outstanding claims by all domains */
 
+static unsigned long drain_page_caches(void);
+static unsigned long page_cache_pages(void);
+
 unsigned long domain_adjust_tot_pages(struct domain *d, long pages)
 {
     long dom_before, dom_after, dom_claimed, sys_before, sys_after;
@@ -433,6 +456,10 @@ int domain_set_outstanding_pages(struct domain *d, unsigned long pages)
     int ret = -ENOMEM;
     unsigned long claim, avail_pages;
 
+    /* Pages in page caches count as allocated: give them back first. */
+    if ( pages )
+        drain_page_caches();
+
     /*
      * take the domain's page_alloc_lock, else all d->tot_page adjustments
      * must always take the global heap_lock rather than only in the much
@@ -502,7 +529,7 @@ void get_outstanding_claims(uint64_t *free_pages, uint64_t *outstanding_pages)
 {
     spin_lock(&heap_lock);
     *outstanding_pages = outstanding_claims;
-    *free_pages =  avail_domheap_pages();
+    *free_pages =  avail_domheap_pages() + page_cache_pages();
     spin_unlock(&heap_lock);
 }
 
@@ -685,43 +712,723 @@ static void check_low_mem_virq(void)
     }
 }
 
+/* Put a free buddy on its heap list: clean buddies first, dirty ones last. */
+static void page_list_add_scrub(struct page_info *pg, unsigned int node,
+                                unsigned int zone, unsigned int order,
+                                unsigned int first_dirty)
+{
+    PFN_ORDER(pg) = order;
+    pg->u.free.first_dirty = first_dirty;
+
+    if ( first_dirty != INVALID_DIRTY_IDX )
+        page_list_add_tail(pg, &heap(node, zone, order));
+    else
+        page_list_add(pg, &heap(node, zone, order));
+}
+
+/* Index of the first page of a 2^@order buddy that needs scrubbing. */
+static unsigned int buddy_first_dirty(const struct page_info *pg,
+                                      unsigned int order)
+{
+    unsigned int i;
+
+    for ( i = 0; i < (1U << order); i++ )
+        if ( test_bit(_PGC_need_scrub, &pg[i].count_info) )
+            return i;
+
+    return INVALID_DIRTY_IDX;
+}
+
+/*
+ * Find and remove a free buddy of at least 2^@order pages on @node, whose
+ * heap lock must be held.  Unless @use_unscrubbed is set, only buddies
+ * without dirty pages are considered.
+ */
+static struct page_info *get_node_buddy(
+    unsigned int node, unsigned int zone_lo, unsigned int zone_hi,
+    unsigned int order, bool_t use_unscrubbed, unsigned int *zonep)
+{
+    unsigned int j, zone = zone_hi;
+    unsigned long request = 1UL << order;
+    struct page_info *pg;
+
+    ASSERT(spin_is_locked(node_heap_lock(node)));
+
+    do {
+        /* Check if target node can support the allocation. */
+        if ( !avail[node] || (avail[node][zone] < request) )
+            continue;
+
+        /*
+         * Find smallest order which can satisfy the request.  Clean
+         * buddies are kept at the head of each list, so a dirty head
+         * means there is no clean buddy of that order.
+         */
+        for ( j = order; j <= MAX_ORDER; j++ )
+        {
+            pg = page_list_first(&heap(node, zone, j));
+            if ( pg && (use_unscrubbed ||
+                        pg->u.free.first_dirty == INVALID_DIRTY_IDX) )
+            {
+                page_list_del(pg, &heap(node, zone, j));
+                *zonep = zone;
+                return pg;
+            }
+        }
+    } while ( zone-- > zone_lo ); /* careful: unsigned zone may wrap */
+
+    return NULL;
+}
+
+/*
+ * Halve the buddy at @pg, just taken off the heap, until it is 2^@order
+ * pages, putting the other halves back.  Returns the remaining chunk.
+ */
+static struct page_info *split_buddy(
+    struct page_info *pg, unsigned int node, unsigned int zone,
+    unsigned int order)
+{
+    unsigned int j = PFN_ORDER(pg), first_dirty = pg->u.free.first_dirty;
+
+    while ( j != order )
+    {
+        unsigned int half = 1U << --j;
+
+        /* The lower half goes back; carry on with the upper one. */
+        if ( first_dirty == INVALID_DIRTY_IDX || first_dirty >= half )
+        {
+            page_list_add_scrub(pg, node, zone, j, INVALID_DIRTY_IDX);
+            if ( first_dirty != INVALID_DIRTY_IDX )
+                first_dirty -= half;
+        }
+        else
+        {
+            page_list_add_scrub(pg, node, zone, j, first_dirty);
+            first_dirty = 0;
+        }
+        pg += half;
+    }
+
+    return pg;
+}
+
+/*
+ * Account for the 2^@order pages at @pg leaving @node's heap and mark them
+ * in use.  Returns how many of them still need scrubbing.
+ */
+static unsigned int take_buddy_pages(
+    struct page_info *pg, unsigned int node, unsigned int zone,
+    unsigned int order)
+{
+    unsigned int i, dirty_cnt = 0;
+
+    ASSERT(avail[node][zone] >= (1UL << order));
+    avail[node][zone] -= 1UL << order;
+
+    for ( i = 0; i < (1U << order); i++ )
+    {
+        /* Reference count must continuously be zero for free pages. */
+        BUG_ON((pg[i].count_info & ~PGC_need_scrub) != PGC_state_free);
+
+        /* Dirty pages stay marked until scrubbed. */
+        if ( pg[i].count_info & PGC_need_scrub )
+            dirty_cnt++;
+        pg[i].count_info = (pg[i].count_info & PGC_need_scrub) |
+                           PGC_state_inuse;
+    }
+
+    ASSERT(node_need_scrub[node] >= dirty_cnt);
+    node_need_scrub[node] -= dirty_cnt;
+
+    return dirty_cnt;
+}
+
+/* Remove any offlined page in the buddy pointed to by head. */
+static int reserve_offlined_page(struct page_info *head)
+{
+    unsigned int node = phys_to_nid(page_to_maddr(head));
+    int zone = page_to_zone(head), i, head_order = PFN_ORDER(head), count = 0;
+    struct page_info *cur_head;
+    int cur_order;
+
+    ASSERT(spin_is_locked(node_heap_lock(node)));
+
+    cur_head = head;
+
+    page_list_del(head, &heap(node, zone, head_order));
+
+    while ( cur_head < (head + (1 << head_order)) )
+    {
+        struct page_info *pg;
+        int next_order;
+
+        if ( page_state_is(cur_head, offlined) )
+        {
+            cur_head++;
+            continue;
+        }
+
+        next_order = cur_order = 0;
+
+        while ( cur_order < head_order )
+        {
+            next_order = cur_order + 1;
+
+            if ( (cur_head + (1 << next_order)) >= (head + ( 1 << head_order)) )
+                goto merge;
+
+            for ( i = (1 << cur_order), pg = cur_head + (1 << cur_order );
+                  i < (1 << next_order);
+                  i++, pg++ )
+                if ( page_state_is(pg, offlined) )
+                    break;
+            if ( i == ( 1 << next_order) )
+            {
+                cur_order = next_order;
+                continue;
+            }
+            else
+            {
+            merge:
+                /* We don't consider merging outside the head_order. */
+                page_list_add_scrub(cur_head, node, zone, cur_order,
+                                    buddy_first_dirty(cur_head, cur_order));
+                cur_head += (1 << cur_order);
+                break;
+            }
+        }
+    }
+
+    spin_lock(&heap_lock);
+
+    for ( cur_head = head; cur_head < head + ( 1UL << head_order); cur_head++ )
+    {
+        if ( !page_state_is(cur_head, offlined) )
+            continue;
+
+        avail[node][zone]--;
+        total_avail_pages--;
+        ASSERT(total_avail_pages >= 0);
+
+        /* The page keeps its mark so that onlining it scrubs it again. */
+        if ( test_bit(_PGC_need_scrub, &cur_head->count_info) )
+        {
+            ASSERT(node_need_scrub[node]);
+            node_need_scrub[node]--;
+        }
+
+        page_list_add_tail(cur_head,
+                           test_bit(_PGC_broken, &cur_head->count_info) ?
+                           &page_broken_list : &page_offlined_list);
+
+        count++;
+    }
+
+    spin_unlock(&heap_lock);
+
+    return count;
+}
+
+/*
+ * Merge the free 2^@order buddy at @pg with its free neighbours as far as
+ * possible and put the result on the heap.  Returns the final buddy head.
+ */
+static struct page_info *merge_free_buddy(
+    struct page_info *pg, unsigned int node, unsigned int zone,
+    unsigned int order, unsigned int first_dirty)
+{
+    unsigned long mask;
+    struct page_info *buddy;
+
+    ASSERT(spin_is_locked(node_heap_lock(node)));
+
+    while ( order < MAX_ORDER )
+    {
+        mask = 1UL << order;
+
+        if ( (page_to_mfn(pg) & mask) )
+        {
+            /* Merge with predecessor block? */
+            buddy = pg - mask;
+            if ( !mfn_valid(page_to_mfn(buddy)) ||
+                 !page_state_is(buddy, free) ||
+                 (PFN_ORDER(buddy) != order) ||
+                 (phys_to_nid(page_to_maddr(buddy)) != node) )
+                break;
+            page_list_del(buddy, &heap(node, zone, order));
+            if ( buddy->u.free.first_dirty != INVALID_DIRTY_IDX )
+                first_dirty = buddy->u.free.first_dirty;
+            else if ( first_dirty != INVALID_DIRTY_IDX )
+                first_dirty += mask;
+            pg = buddy;
+        }
+        else
+        {
+            /* Merge with successor block? */
+            buddy = pg + mask;
+            if ( !mfn_valid(page_to_mfn(buddy)) ||
+                 !page_state_is(buddy, free) ||
+                 (PFN_ORDER(buddy) != order) ||
+                 (phys_to_nid(page_to_maddr(buddy)) != node) )
+                break;
+            page_list_del(buddy, &heap(node, zone, order));
+            if ( first_dirty == INVALID_DIRTY_IDX &&
+                 buddy->u.free.first_dirty != INVALID_DIRTY_IDX )
+                first_dirty = mask + buddy->u.free.first_dirty;
+        }
+
+        order++;
+    }
+
+    page_list_add_scrub(pg, node, zone, order, first_dirty);
+
+    return pg;
+}
+
+/* A page being freed is not a guest frame any more. */
+static void page_release_owner(struct page_info *pg)
+{
+    /* If a page has no owner it will need no safety TLB flush. */
+    pg->u.free.need_tlbflush = (page_get_owner(pg) != NULL);
+    if ( pg->u.free.need_tlbflush )
+        pg->tlbflush_timestamp = tlbflush_current_time();
+
+    page_set_owner(pg, NULL); /* set_gpfn_from_mfn snoops pg owner */
+    set_gpfn_from_mfn(page_to_mfn(pg), INVALID_M2P_ENTRY);
+}
+
+/*
+ * Per-CPU caches of clean order-0 pages from the local node.  They are
+ * refilled and drained in batches, so that most single-page allocations
+ * and frees touch neither the node heap locks nor heap_lock.  Cached pages
+ * are in the inuse state and accounted as allocated: a refill is claim
+ * checked like any other allocation.  A cache's lock is only ever contended
+ * by remote drains.
+ */
+#define PAGE_CACHE_BATCH 16
+#define PAGE_CACHE_HIGH  (4 * PAGE_CACHE_BATCH)
+
+struct page_cache {
+    spinlock_t lock;
+    struct page_list_head list;
+    unsigned int count;
+};
+
+static DEFINE_PER_CPU(struct page_cache, page_cache);
+
+/* Set once boot scrubbing is done, as cached pages would escape it. */
+static bool_t __read_mostly page_cache_enabled;
+
+/* Lowest zone the page caches hold pages from: keep DMA memory out. */
+static unsigned int page_cache_zone_lo(void)
+{
+    return dma_bitsize ? bits_to_zone(dma_bitsize) + 1 : MEMZONE_XEN + 1;
+}
+
+/* Take up to PAGE_CACHE_BATCH clean pages off @node's heap into @list. */
+static unsigned int page_cache_refill(
+    unsigned int node, unsigned int zone_lo, unsigned int zone_hi,
+    struct page_list_head *list)
+{
+    unsigned int zone, n = 0;
+    long want;
+    struct page_info *pg;
+
+    spin_lock(&heap_lock);
+
+    /* Leave the scarce memory cases, and claimed memory, to the slow path. */
+    want = min_t(long, total_avail_pages - outstanding_claims,
+                 PAGE_CACHE_BATCH);
+    if ( (want <= 0) ||
+         ((total_avail_pages <= midsize_alloc_zone_pages) &&
+          tmem_freeable_pages()) )
+    {
+        spin_unlock(&heap_lock);
+        return 0;
+    }
+
+    total_avail_pages -= want;
+    check_low_mem_virq();
+
+    spin_unlock(&heap_lock);
+
+    spin_lock(node_heap_lock(node));
+    while ( (n < want) &&
+            (pg = get_node_buddy(node, zone_lo, zone_hi, 0, 0, &zone)) )
+    {
+        pg = split_buddy(pg, node, zone, 0);
+        take_buddy_pages(pg, node, zone, 0);
+        page_list_add_tail(pg, list);
+        n++;
+    }
+    spin_unlock(node_heap_lock(node));
+
+    if ( n < want )
+    {
+        spin_lock(&heap_lock);
+        total_avail_pages += want - n;
+        spin_unlock(&heap_lock);
+    }
+
+    return n;
+}
+
+/* Move up to @want of the coldest pages of a locked cache to @list. */
+static unsigned int page_cache_take(struct page_cache *pc, unsigned int want,
+                                    struct page_list_head *list)
+{
+    unsigned int n;
+    struct page_info *pg;
+
+    ASSERT(spin_is_locked(&pc->lock));
+
+    for ( n = 0; n < want && (pg = page_list_last(&pc->list)) != NULL; n++ )
+    {
+        page_list_del(pg, &pc->list);
+        page_list_add(pg, list);
+    }
+    pc->count -= n;
+
+    return n;
+}
+
+/* Give the @n cached pages on @list, all from one node, back to the heap. */
+static void page_cache_return(struct page_list_head *list, unsigned int n)
+{
+    unsigned int node = phys_to_nid(page_to_maddr(page_list_first(list)));
+    unsigned int zone;
+    struct page_info *pg;
+    bool_t tainted;
+
+    spin_lock(node_heap_lock(node));
+
+    spin_lock(&heap_lock);
+    total_avail_pages += n;
+    if ( tmem_enabled() )
+        midsize_alloc_zone_pages = max(
+            midsize_alloc_zone_pages, total_avail_pages / MIDSIZE_ALLOC_FRAC);
+    spin_unlock(&heap_lock);
+
+    while ( (pg = page_list_remove_head(list)) != NULL )
+    {
+        ASSERT(phys_to_nid(page_to_maddr(pg)) == node);
+        zone = page_to_zone(pg);
+        tainted = page_state_is(pg, offlining);
+        pg->count_info = (pg->count_info & PGC_broken) |
+                         (tainted ? PGC_state_offlined : PGC_state_free);
+        avail[node][zone]++;
+
+        pg = merge_free_buddy(pg, node, zone, 0, INVALID_DIRTY_IDX);
+        if ( tainted )
+            reserve_offlined_page(pg);
+    }
+
+    spin_unlock(node_heap_lock(node));
+}
+
+/* Empty one CPU's page cache into the heap.  Returns the pages freed. */
+static unsigned int page_cache_flush(struct page_cache *pc)
+{
+    unsigned int n;
+    PAGE_LIST_HEAD(list);
+
+    spin_lock(&pc->lock);
+    n = page_cache_take(pc, pc->count, &list);
+    spin_unlock(&pc->lock);
+
+    if ( n )
+        page_cache_return(&list, n);
+
+    return n;
+}
+
+/* Empty all page caches, e.g. before giving up on an allocation. */
+static unsigned long drain_page_caches(void)
+{
+    unsigned int cpu;
+    unsigned long n = 0;
+
+    if ( !page_cache_enabled || !get_cpu_maps() )
+        return 0;
+
+    for_each_online_cpu ( cpu )
+        if ( read_atomic(&per_cpu(page_cache, cpu).count) )
+            n += page_cache_flush(&per_cpu(page_cache, cpu));
+
+    put_cpu_maps();
+
+    return n;
+}
+
+/* Number of free pages sitting in page caches. */
+static unsigned long page_cache_pages(void)
+{
+    unsigned int cpu;
+    unsigned long n = 0;
+
+    for_each_online_cpu ( cpu )
+        n += read_atomic(&per_cpu(page_cache, cpu).count);
+
+    return n;
+}
+
+/*
+ * Whether emptying the page caches might let a failed allocation succeed.
+ * They hold single pages from above the DMA zones of their CPU's node, so
+ * there is no point for requests restricted to lower zones or to another
+ * node, nor for ones bigger than what these pages could merge back into.
+ */
+static bool_t page_cache_may_help(
+    unsigned int zone_hi, unsigned int order, unsigned int memflags)
+{
+    nodeid_t node = MEMF_get_node(memflags);
+    unsigned int cpu;
+    unsigned long n = 0;
+
+    if ( !page_cache_enabled || (1UL << order) > PAGE_CACHE_HIGH ||
+         zone_hi < page_cache_zone_lo() )
+        return 0;
+
+    if ( !(memflags & MEMF_exact_node) )
+        node = NUMA_NO_NODE;
+
+    for_each_online_cpu ( cpu )
+        if ( node == NUMA_NO_NODE || cpu_to_node(cpu) == node )
+            n += read_atomic(&per_cpu(page_cache, cpu).count);
+
+    return n >= (1UL << order);
+}
+
+/* Try to allocate a single page from the local page cache. */
+static struct page_info *page_cache_alloc(
+    unsigned int zone_lo, unsigned int zone_hi, unsigned int memflags,
+    const struct domain *d)
+{
+    unsigned int cpu = smp_processor_id(), zone, n;
+    nodeid_t node = cpu_to_node(cpu), req_node = MEMF_get_node(memflags);
+    struct page_cache *pc = &per_cpu(page_cache, cpu);
+    struct page_info *pg;
+    PAGE_LIST_HEAD(list);
+
+    if ( !page_cache_enabled || node == NUMA_NO_NODE || !avail[node] )
+        return NULL;
+
+    /* Only serve requests the local node is good for. */
+    if ( req_node != NUMA_NO_NODE ? req_node != node
+                                  : d && !node_isset(node, d->node_affinity) )
+        return NULL;
+
+    zone_lo = max(zone_lo, page_cache_zone_lo());
+    if ( zone_lo > zone_hi )
+        return NULL;
+
+    spin_lock(&pc->lock);
+
+    if ( !pc->count )
+    {
+        spin_unlock(&pc->lock);
+        if ( (n = page_cache_refill(node, zone_lo, zone_hi, &list)) == 0 )
+            return NULL;
+        spin_lock(&pc->lock);
+        page_list_splice(&list, &pc->list);
+        pc->count += n;
+    }
+
+    pg = page_list_first(&pc->list);
+    zone = page_to_zone(pg);
+    if ( zone < zone_lo || zone > zone_hi )
+    {
+        spin_unlock(&pc->lock);
+        return NULL;
+    }
+    page_list_del(pg, &pc->list);
+    pc->count--;
+
+    spin_unlock(&pc->lock);
+
+    /* Offlining started while the page was cached: let the heap have it. */
+    if ( !page_state_is(pg, inuse) )
+    {
+        page_list_add(pg, &list);
+        page_cache_return(&list, 1);
+        return NULL;
+    }
+
+    return pg;
+}
+
+/* Try to put a clean single page being freed on the local page cache. */
+static bool_t page_cache_free(struct page_info *pg)
+{
+    unsigned int cpu = smp_processor_id(), n = 0;
+    struct page_cache *pc = &per_cpu(page_cache, cpu);
+    unsigned long x, y = pg->count_info;
+    PAGE_LIST_HEAD(list);
+
+    if ( !page_cache_enabled ||
+         (phys_to_nid(page_to_maddr(pg)) != cpu_to_node(cpu)) ||
+         (page_to_zone(pg) < page_cache_zone_lo()) )
+        return 0;
+
+    /* Broken pages and ones being offlined are left to the heap. */
+    do {
+        x = y;
+        if ( (x & (PGC_state | PGC_broken)) != PGC_state_inuse )
+            return 0;
+    } while ( (y = cmpxchg(&pg->count_info, x, PGC_state_inuse)) != x );
+
+    page_release_owner(pg);
+
+    spin_lock(&pc->lock);
+    page_list_add(pg, &pc->list);
+    if ( ++pc->count > PAGE_CACHE_HIGH )
+        n = page_cache_take(pc, PAGE_CACHE_BATCH, &list);
+    spin_unlock(&pc->lock);
+
+    if ( n )
+        page_cache_return(&list, n);
+
+    return 1;
+}
+
+static int cpu_callback(
+    struct notifier_block *nfb, unsigned long action, void *hcpu)
+{
+    unsigned int cpu = (unsigned long)hcpu;
+    struct page_cache *pc = &per_cpu(page_cache, cpu);
+
+    switch ( action )
+    {
+    case CPU_UP_PREPARE:
+        spin_lock_init(&pc->lock);
+        INIT_PAGE_LIST_HEAD(&pc->list);
+        pc->count = 0;
+        break;
+    case CPU_UP_CANCELED:
+    case CPU_DEAD:
+        page_cache_flush(pc);
+        break;
+    default:
+        break;
+    }
+
+    return NOTIFY_DONE;
+}
+
+static struct notifier_block cpu_nfb = {
+    .notifier_call = cpu_callback
+};
+
+static int __init page_cache_init(void)
+{
+    void *cpu = (void *)(long)smp_processor_id();
+
+    cpu_callback(&cpu_nfb, CPU_UP_PREPARE, cpu);
+    register_cpu_notifier(&cpu_nfb);
+    return 0;
+}
+presmp_initcall(page_cache_init);
+
+/*
+ * Find and remove a free buddy of at least 2^@order pages, returning with
+ * the heap lock of its node held.  Unless @use_unscrubbed is set, only
+ * buddies without dirty pages are considered.
+ */
+static struct page_info *get_free_buddy(
+    unsigned int zone_lo, unsigned int zone_hi,
+    unsigned int order, unsigned int memflags,
+    const struct domain *d, bool_t use_unscrubbed, unsigned int *zonep)
+{
+    unsigned int nodemask_retry = 0;
+    nodeid_t first_node, node = MEMF_get_node(memflags), req_node = node;
+    struct page_info *pg;
+    nodemask_t nodemask = (d != NULL ) ? d->node_affinity : node_online_map;
+
+    if ( node == NUMA_NO_NODE )
+    {
+        if ( d != NULL )
+        {
+            node = next_node(d->last_alloc_node, nodemask);
+            if ( node >= MAX_NUMNODES )
+                node = first_node(nodemask);
+        }
+        if ( node >= MAX_NUMNODES )
+            node = cpu_to_node(smp_processor_id());
+    }
+    first_node = node;
+
+    ASSERT(node < MAX_NUMNODES);
+
+    /*
+     * Start with requested node, but exhaust all node memory in requested 
+     * zone before failing, only calc new node value if we fail to find memory 
+     * in target node, this avoids needless computation on fast-path.
+     */
+    for ( ; ; )
+    {
+        spin_lock(node_heap_lock(node));
+        pg = get_node_buddy(node, zone_lo, zone_hi, order, use_unscrubbed,
+                            zonep);
+        if ( pg )
+            return pg;
+        spin_unlock(node_heap_lock(node));
+
+        if ( (memflags & MEMF_exact_node) && req_node != NUMA_NO_NODE )
+            return NULL;
+
+        /* Pick next node. */
+        if ( !node_isset(node, nodemask) )
+        {
+            /* Very first node may be caller-specified and outside nodemask. */
+            ASSERT(!nodemask_retry);
+            first_node = node = first_node(nodemask);
+            if ( node < MAX_NUMNODES )
+                continue;
+        }
+        else if ( (node = next_node(node, nodemask)) >= MAX_NUMNODES )
+            node = first_node(nodemask);
+        if ( node == first_node )
+        {
+            /* When we have tried all in nodemask, we fall back to others. */
+            if ( (memflags & MEMF_exact_node) || nodemask_retry++ )
+                return NULL;
+            nodes_andnot(nodemask, node_online_map, nodemask);
+            first_node = node = first_node(nodemask);
+            if ( node >= MAX_NUMNODES )
+                return NULL;
+        }
+    }
+}
+
 /* Allocate 2^@order contiguous pages. */
 static struct page_info *alloc_heap_pages(
     unsigned int zone_lo, unsigned int zone_hi,
     unsigned int order, unsigned int memflags,
     struct domain *d)
 {
-    unsigned int i, j, zone = 0, nodemask_retry = 0;
-    nodeid_t first_node, node = MEMF_get_node(memflags), req_node = node;
+    unsigned int i, zone = 0, node, dirty_cnt = 0;
     unsigned long request = 1UL << order;
     struct page_info *pg;
-    nodemask_t nodemask = (d != NULL ) ? d->node_affinity : node_online_map;
-    bool_t need_tlbflush = 0;
+    bool_t need_tlbflush = 0, drained = 0;
     uint32_t tlbflush_timestamp = 0;
 
     /* Make sure there are enough bits in memflags for nodeID. */
     BUILD_BUG_ON((_MEMF_bits - _MEMF_node) < (8 * sizeof(nodeid_t)));
 
-    if ( node == NUMA_NO_NODE )
-    {
-        if ( d != NULL )
-        {
-            node = next_node(d->last_alloc_node, nodemask);
-            if ( node >= MAX_NUMNODES )
-                node = first_node(nodemask);
-        }
-        if ( node >= MAX_NUMNODES )
-            node = cpu_to_node(smp_processor_id());
-    }
-    first_node = node;
-
-    ASSERT(node < MAX_NUMNODES);
     ASSERT(zone_lo <= zone_hi);
     ASSERT(zone_hi < NR_ZONES);
 
     if ( unlikely(order > MAX_ORDER) )
         return NULL;
 
+    /* Single pages come from the local page cache where possible. */
+    if ( !order && (pg = page_cache_alloc(zone_lo, zone_hi, memflags, d)) )
+    {
+        node = phys_to_nid(page_to_maddr(pg));
+        goto found;
+    }
+
+ retry:
     spin_lock(&heap_lock);
 
     /*
@@ -745,89 +1452,46 @@ static struct page_info *alloc_heap_pages(
          tmem_freeable_pages() )
         goto try_tmem;
 
+    if ( total_avail_pages < request )
+        goto not_found;
+
     /*
-     * Start with requested node, but exhaust all node memory in requested 
-     * zone before failing, only calc new node value if we fail to find memory 
-     * in target node, this avoids needless computation on fast-path.
+     * Take the pages out of the available count before searching the node
+     * heaps without heap_lock, so that claims stay exact meanwhile.
      */
-    for ( ; ; )
-    {
-        zone = zone_hi;
-        do {
-            /* Check if target node can support the allocation. */
-            if ( !avail[node] || (avail[node][zone] < request) )
-                continue;
-
-            /* Find smallest order which can satisfy the request. */
-            for ( j = order; j <= MAX_ORDER; j++ )
-                if ( (pg = page_list_remove_head(&heap(node, zone, j))) )
-                    goto found;
-        } while ( zone-- > zone_lo ); /* careful: unsigned zone may wrap */
-
-        if ( (memflags & MEMF_exact_node) && req_node != NUMA_NO_NODE )
-            goto not_found;
-
-        /* Pick next node. */
-        if ( !node_isset(node, nodemask) )
-        {
-            /* Very first node may be caller-specified and outside nodemask. */
-            ASSERT(!nodemask_retry);
-            first_node = node = first_node(nodemask);
-            if ( node < MAX_NUMNODES )
-                continue;
-        }
-        else if ( (node = next_node(node, nodemask)) >= MAX_NUMNODES )
-            node = first_node(nodemask);
-        if ( node == first_node )
-        {
-            /* When we have tried all in nodemask, we fall back to others. */
-            if ( (memflags & MEMF_exact_node) || nodemask_retry++ )
-                goto not_found;
-            nodes_andnot(nodemask, node_online_map, nodemask);
-            first_node = node = first_node(nodemask);
-            if ( node >= MAX_NUMNODES )
-                goto not_found;
-        }
-    }
-
- try_tmem:
-    /* Try to free memory from tmem */
-    if ( (pg = tmem_relinquish_pages(order, memflags)) != NULL )
-    {
-        /* reassigning an already allocated anonymous heap page */
-        spin_unlock(&heap_lock);
-        return pg;
-    }
+    total_avail_pages -= request;
+    check_low_mem_virq();
 
- not_found:
-    /* No suitable memory blocks. Fail the request. */
     spin_unlock(&heap_lock);
-    return NULL;
 
- found: 
-    /* We may have to halve the chunk a number of times. */
-    while ( j != order )
+    /* Prefer clean memory; only scrub on demand when none is left. */
+    pg = get_free_buddy(zone_lo, zone_hi, order, memflags, d, 0, &zone);
+    if ( !pg )
+        pg = get_free_buddy(zone_lo, zone_hi, order, memflags, d, 1, &zone);
+    if ( !pg )
     {
-        PFN_ORDER(pg) = --j;
-        page_list_add_tail(pg, &heap(node, zone, j));
-        pg += 1 << j;
+        spin_lock(&heap_lock);
+        total_avail_pages += request;
+        spin_unlock(&heap_lock);
+        goto no_memory;
     }
 
-    ASSERT(avail[node][zone] >= request);
-    avail[node][zone] -= request;
-    total_avail_pages -= request;
-    ASSERT(total_avail_pages >= 0);
-
-    check_low_mem_virq();
+    node = phys_to_nid(page_to_maddr(pg));
+    pg = split_buddy(pg, node, zone, order);
+    dirty_cnt = take_buddy_pages(pg, node, zone, order);
+    spin_unlock(node_heap_lock(node));
 
+ found:
     if ( d != NULL )
         d->last_alloc_node = node;
 
     for ( i = 0; i < (1 << order); i++ )
     {
-        /* Reference count must continuously be zero for free pages. */
-        BUG_ON(pg[i].count_info != PGC_state_free);
-        pg[i].count_info = PGC_state_inuse;
+        if ( dirty_cnt && test_bit(_PGC_need_scrub, &pg[i].count_info) )
+        {
+            scrub_one_page(&pg[i]);
+            clear_bit(_PGC_need_scrub, &pg[i].count_info);
+        }
 
         if ( !(memflags & MEMF_no_tlbflush) )
             accumulate_tlbflush(&need_tlbflush, &pg[i],
@@ -843,101 +1507,54 @@ static struct page_info *alloc_heap_pages(
         flush_page_to_ram(page_to_mfn(&pg[i]));
     }
 
-    spin_unlock(&heap_lock);
-
     if ( need_tlbflush )
         filtered_flush_tlb_mask(tlbflush_timestamp);
 
     return pg;
-}
-
-/* Remove any offlined page in the buddy pointed to by head. */
-static int reserve_offlined_page(struct page_info *head)
-{
-    unsigned int node = phys_to_nid(page_to_maddr(head));
-    int zone = page_to_zone(head), i, head_order = PFN_ORDER(head), count = 0;
-    struct page_info *cur_head;
-    int cur_order;
-
-    ASSERT(spin_is_locked(&heap_lock));
-
-    cur_head = head;
-
-    page_list_del(head, &heap(node, zone, head_order));
 
-    while ( cur_head < (head + (1 << head_order)) )
+ try_tmem:
+    /* Try to free memory from tmem */
+    if ( (pg = tmem_relinquish_pages(order, memflags)) != NULL )
     {
-        struct page_info *pg;
-        int next_order;
-
-        if ( page_state_is(cur_head, offlined) )
-        {
-            cur_head++;
-            continue;
-        }
-
-        next_order = cur_order = 0;
-
-        while ( cur_order < head_order )
-        {
-            next_order = cur_order + 1;
-
-            if ( (cur_head + (1 << next_order)) >= (head + ( 1 << head_order)) )
-                goto merge;
-
-            for ( i = (1 << cur_order), pg = cur_head + (1 << cur_order );
-                  i < (1 << next_order);
-                  i++, pg++ )
-                if ( page_state_is(pg, offlined) )
-                    break;
-            if ( i == ( 1 << next_order) )
-            {
-                cur_order = next_order;
-                continue;
-            }
-            else
-            {
-            merge:
-                /* We don't consider merging outside the head_order. */
-                page_list_add_tail(cur_head, &heap(node, zone, cur_order));
-                PFN_ORDER(cur_head) = cur_order;
-                cur_head += (1 << cur_order);
-                break;
-            }
-        }
+        /* reassigning an already allocated anonymous heap page */
+        spin_unlock(&heap_lock);
+        return pg;
     }
 
-    for ( cur_head = head; cur_head < head + ( 1UL << head_order); cur_head++ )
-    {
-        if ( !page_state_is(cur_head, offlined) )
-            continue;
-
-        avail[node][zone]--;
-        total_avail_pages--;
-        ASSERT(total_avail_pages >= 0);
-
-        page_list_add_tail(cur_head,
-                           test_bit(_PGC_broken, &cur_head->count_info) ?
-                           &page_broken_list : &page_offlined_list);
+ not_found:
+    spin_unlock(&heap_lock);
 
-        count++;
+ no_memory:
+    /* Free memory may be sitting in page caches; else fail the request. */
+    if ( !drained && page_cache_may_help(zone_hi, order, memflags) &&
+         drain_page_caches() )
+    {
+        drained = 1;
+        goto retry;
     }
 
-    return count;
+    return NULL;
 }
 
-/* Free 2^@order set of pages. */
+/*
+ * Free 2^@order set of pages.  With @need_scrub the pages are only marked
+ * dirty; they get scrubbed by idle CPUs or on allocation, whichever first.
+ */
 static void free_heap_pages(
-    struct page_info *pg, unsigned int order)
+    struct page_info *pg, unsigned int order, bool_t need_scrub)
 {
-    unsigned long mask, mfn = page_to_mfn(pg);
     unsigned int i, node = phys_to_nid(page_to_maddr(pg)), tainted = 0;
     unsigned int zone = page_to_zone(pg);
+    unsigned int first_dirty = INVALID_DIRTY_IDX;
 
     ASSERT(order <= MAX_ORDER);
     ASSERT(node >= 0);
 
-    spin_lock(&heap_lock);
+    /* Clean single pages go to the local page cache where possible. */
+    if ( !order && !need_scrub && page_cache_free(pg) )
+        return;
+
+    spin_lock(node_heap_lock(node));
 
     for ( i = 0; i < (1 << order); i++ )
     {
@@ -955,67 +1572,163 @@ static void free_heap_pages(
         ASSERT(!page_state_is(&pg[i], offlined));
         pg[i].count_info =
             ((pg[i].count_info & PGC_broken) |
+             (need_scrub ? PGC_need_scrub : 0) |
              (page_state_is(&pg[i], offlining)
               ? PGC_state_offlined : PGC_state_free));
         if ( page_state_is(&pg[i], offlined) )
             tainted = 1;
 
-        /* If a page has no owner it will need no safety TLB flush. */
-        pg[i].u.free.need_tlbflush = (page_get_owner(&pg[i]) != NULL);
-        if ( pg[i].u.free.need_tlbflush )
-            pg[i].tlbflush_timestamp = tlbflush_current_time();
-
-        /* This page is not a guest frame any more. */
-        page_set_owner(&pg[i], NULL); /* set_gpfn_from_mfn snoops pg owner */
-        set_gpfn_from_mfn(mfn + i, INVALID_M2P_ENTRY);
+        page_release_owner(&pg[i]);
     }
 
     avail[node][zone] += 1 << order;
-    total_avail_pages += 1 << order;
 
+    if ( need_scrub )
+    {
+        first_dirty = 0;
+        node_need_scrub[node] += 1 << order;
+    }
+
+    spin_lock(&heap_lock);
+    total_avail_pages += 1 << order;
     if ( tmem_enabled() )
         midsize_alloc_zone_pages = max(
             midsize_alloc_zone_pages, total_avail_pages / MIDSIZE_ALLOC_FRAC);
+    spin_unlock(&heap_lock);
 
-    /* Merge chunks as far as possible. */
-    while ( order < MAX_ORDER )
+    pg = merge_free_buddy(pg, node, zone, order, first_dirty);
+
+    if ( tainted )
+        reserve_offlined_page(pg);
+
+    spin_unlock(node_heap_lock(node));
+}
+
+/* Largest chunk scrubbed by an idle CPU without dropping its node's heap lock. */
+#define SCRUB_CHUNK_ORDER 9
+
+/* Pick a node for this CPU to scrub: its own, else a CPU-less one. */
+static nodeid_t node_to_scrub(unsigned int cpu)
+{
+    nodeid_t node = cpu_to_node(cpu);
+
+    if ( node_need_scrub[node] )
+        return node;
+
+    for_each_online_node ( node )
+        if ( node_need_scrub[node] &&
+             cpumask_empty(&node_to_cpumask(node)) )
+            return node;
+
+    return NUMA_NO_NODE;
+}
+
+/*
+ * Scrub one chunk of dirty free memory on behalf of the idle loop.  Returns
+ * whether any work was done, in which case the caller should not halt.
+ */
+bool_t scrub_free_pages(void)
+{
+    unsigned int cpu = smp_processor_id(), zone, order, i, done;
+    unsigned int first_dirty;
+    struct page_info *pg;
+    nodeid_t node;
+    bool_t tainted = 0;
+
+    if ( !cpu_is_haltable(cpu) )
+        return 0;
+
+    /* Racy, but avoids taking the heap lock when there's nothing to do. */
+    node = node_to_scrub(cpu);
+    if ( node == NUMA_NO_NODE )
+        return 0;
+
+    spin_lock(node_heap_lock(node));
+
+    /* Dirty buddies sit at the tail of their lists. */
+    for ( zone = 0; zone < NR_ZONES; zone++ )
     {
-        mask = 1UL << order;
+        if ( !avail[node] || !avail[node][zone] )
+            continue;
+        for ( order = MAX_ORDER + 1; order-- > 0; )
+        {
+            pg = page_list_last(&heap(node, zone, order));
+            if ( pg && pg->u.free.first_dirty != INVALID_DIRTY_IDX )
+                goto found;
+        }
+    }
 
-        if ( (page_to_mfn(pg) & mask) )
+    spin_unlock(node_heap_lock(node));
+    return 0;
+
+ found:
+    page_list_del(pg, &heap(node, zone, order));
+    first_dirty = pg->u.free.first_dirty;
+
+    /* Hand back halves until the chunk is small enough. */
+    while ( order > SCRUB_CHUNK_ORDER )
+    {
+        unsigned int half = 1U << --order;
+
+        if ( first_dirty >= half )
         {
-            /* Merge with predecessor block? */
-            if ( !mfn_valid(page_to_mfn(pg-mask)) ||
-                 !page_state_is(pg-mask, free) ||
-                 (PFN_ORDER(pg-mask) != order) ||
-                 (phys_to_nid(page_to_maddr(pg-mask)) != node) )
-                break;
-            pg -= mask;
-            page_list_del(pg, &heap(node, zone, order));
+            page_list_add_scrub(pg, node, zone, order, INVALID_DIRTY_IDX);
+            pg += half;
+            first_dirty -= half;
         }
         else
+            page_list_add_scrub(pg + half, node, zone, order, 0);
+    }
+
+    /*
+     * Take the chunk off the heap without touching the free page counts:
+     * as in-use pages, they can't be merged with or offlined under our feet.
+     */
+    for ( i = 0; i < (1U << order); i++ )
+        pg[i].count_info = (pg[i].count_info & ~PGC_state) | PGC_state_inuse;
+
+    spin_unlock(node_heap_lock(node));
+
+    for ( done = first_dirty; done < (1U << order); done++ )
+    {
+        if ( softirq_pending(cpu) )
+            break;
+        if ( test_bit(_PGC_need_scrub, &pg[done].count_info) )
+            scrub_one_page(&pg[done]);
+    }
+
+    spin_lock(node_heap_lock(node));
+
+    for ( i = 0; i < (1U << order); i++ )
+    {
+        if ( i < done && test_bit(_PGC_need_scrub, &pg[i].count_info) )
         {
-            /* Merge with successor block? */
-            if ( !mfn_valid(page_to_mfn(pg+mask)) ||
-                 !page_state_is(pg+mask, free) ||
-                 (PFN_ORDER(pg+mask) != order) ||
-                 (phys_to_nid(page_to_maddr(pg+mask)) != node) )
-                break;
-            page_list_del(pg + mask, &heap(node, zone, order));
+            ASSERT(node_need_scrub[node]);
+            node_need_scrub[node]--;
+            pg[i].count_info &= ~PGC_need_scrub;
         }
 
-        order++;
+        if ( page_state_is(&pg[i], offlining) )
+        {
+            pg[i].count_info = (pg[i].count_info & ~PGC_state) |
+                               PGC_state_offlined;
+            tainted = 1;
+        }
+        else
+            pg[i].count_info = (pg[i].count_info & ~PGC_state) |
+                               PGC_state_free;
     }
 
-    PFN_ORDER(pg) = order;
-    page_list_add_tail(pg, &heap(node, zone, order));
+    pg = merge_free_buddy(pg, node, zone, order,
+                          buddy_first_dirty(pg, order));
 
     if ( tainted )
         reserve_offlined_page(pg);
 
-    spin_unlock(&heap_lock);
-}
+    spin_unlock(node_heap_lock(node));
 
+    return 1;
+}
 
 /*
  * Following rules applied for page offline:
@@ -1057,6 +1770,8 @@ static int reserve_heap_page(struct page_info *pg)
     unsigned int i, node = phys_to_nid(page_to_maddr(pg));
     unsigned int zone = page_to_zone(pg);
 
+    ASSERT(spin_is_locked(node_heap_lock(node)));
+
     for ( i = 0; i <= MAX_ORDER; i++ )
     {
         struct page_info *tmp;
@@ -1081,6 +1796,7 @@ int offline_page(unsigned long mfn, int broken, uint32_t *status)
     unsigned long old_info = 0;
     struct domain *owner;
     struct page_info *pg;
+    unsigned int node;
 
     if ( !mfn_valid(mfn) )
     {
@@ -1122,22 +1838,25 @@ int offline_page(unsigned long mfn, int broken, uint32_t *status)
         return 0;
     }
 
-    spin_lock(&heap_lock);
+    node = phys_to_nid(page_to_maddr(pg));
+    spin_lock(node_heap_lock(node));
 
+    spin_lock(&heap_lock);
     old_info = mark_page_offline(pg, broken);
+    spin_unlock(&heap_lock);
 
     if ( page_state_is(pg, offlined) )
     {
         reserve_heap_page(pg);
 
-        spin_unlock(&heap_lock);
+        spin_unlock(node_heap_lock(node));
 
         *status = broken ? PG_OFFLINE_OFFLINED | PG_OFFLINE_BROKEN
                          : PG_OFFLINE_OFFLINED;
         return 0;
     }
 
-    spin_unlock(&heap_lock);
+    spin_unlock(node_heap_lock(node));
 
     if ( (owner = page_get_owner_and_reference(pg)) )
     {
@@ -1169,9 +1888,14 @@ int offline_page(unsigned long mfn, int broken, uint32_t *status)
          * No windows If called from #MC handler, since all CPU are in softirq
          * If called from user space like CE handling, tools can wait some time
          * before call again.
+         * The page may also just be sitting in a page cache, in which case
+         * draining the caches completes the offlining.
          */
-        *status = PG_OFFLINE_ANONYMOUS | PG_OFFLINE_FAILED |
-                  (DOMID_INVALID << PG_OFFLINE_OWNER_SHIFT );
+        if ( drain_page_caches() && page_state_is(pg, offlined) )
+            *status = PG_OFFLINE_OFFLINED;
+        else
+            *status = PG_OFFLINE_ANONYMOUS | PG_OFFLINE_FAILED |
+                      (DOMID_INVALID << PG_OFFLINE_OWNER_SHIFT );
     }
 
     if ( broken )
@@ -1199,6 +1923,7 @@ unsigned int online_page(unsigned long mfn, uint32_t *status)
 
     pg = mfn_to_page(mfn);
 
+    spin_lock(node_heap_lock(phys_to_nid(page_to_maddr(pg))));
     spin_lock(&heap_lock);
 
     y = pg->count_info;
@@ -1231,9 +1956,11 @@ unsigned int online_page(unsigned long mfn, uint32_t *status)
     } while ( (y = cmpxchg(&pg->count_info, x, nx)) != x );
 
     spin_unlock(&heap_lock);
+    spin_unlock(node_heap_lock(phys_to_nid(page_to_maddr(pg))));
 
+    /* A page offlined while awaiting scrubbing still needs it. */
     if ( (y & PGC_state) == PGC_state_offlined )
-        free_heap_pages(pg, 0);
+        free_heap_pages(pg, 0, !!(y & PGC_need_scrub));
 
     return ret;
 }
@@ -1302,7 +2029,7 @@ static void init_heap_pages(
             nr_pages -= n;
         }
 
-        free_heap_pages(pg+i, 0);
+        free_heap_pages(pg+i, 0, 0);
     }
 }
 
@@ -1419,6 +2146,23 @@ static void __init smp_scrub_heap_pages(void *data)
     }
 }
 
+/* Keep all heaps still while boot scrubbing looks at free pages. */
+static void __init lock_node_heaps(void)
+{
+    unsigned int node;
+
+    for_each_online_node ( node )
+        spin_lock(node_heap_lock(node));
+}
+
+static void __init unlock_node_heaps(void)
+{
+    unsigned int node;
+
+    for_each_online_node ( node )
+        spin_unlock(node_heap_lock(node));
+}
+
 static int __init find_non_smt(unsigned int node, cpumask_t *dest)
 {
     cpumask_t node_cpus;
@@ -1451,7 +2195,10 @@ void __init scrub_heap_pages(void)
     int cpus;
 
     if ( !opt_bootscrub )
+    {
+        page_cache_enabled = 1;
         return;
+    }
 
     cpumask_clear(&all_worker_cpus);
     /* Scrub block size. */
@@ -1501,9 +2248,9 @@ void __init scrub_heap_pages(void)
 
         process_pending_softirqs();
 
-        spin_lock(&heap_lock);
+        lock_node_heaps();
         on_selected_cpus(&all_worker_cpus, smp_scrub_heap_pages, NULL, 1);
-        spin_unlock(&heap_lock);
+        unlock_node_heaps();
 
         printk(".");
     }
@@ -1558,9 +2305,9 @@ void __init scrub_heap_pages(void)
 
             process_pending_softirqs();
 
-            spin_lock(&heap_lock);
+            lock_node_heaps();
             on_selected_cpus(&node_cpus, smp_scrub_heap_pages, &region[i], 1);
-            spin_unlock(&heap_lock);
+            unlock_node_heaps();
 
             printk(".");
         }
@@ -1571,6 +2318,8 @@ void __init scrub_heap_pages(void)
     /* Now that the heap is initialized, run checks and set bounds
      * for the low mem virq algorithm. */
     setup_low_mem_virq();
+
+    page_cache_enabled = 1;
 }
 
 
@@ -1629,7 +2378,7 @@ void free_xenheap_pages(void *v, unsigned int order)
 
     memguard_guard_range(v, 1 << (order + PAGE_SHIFT));
 
-    free_heap_pages(virt_to_page(v), order);
+    free_heap_pages(virt_to_page(v), order, 0);
 }
 
 #else
@@ -1688,7 +2437,7 @@ void free_xenheap_pages(void *v, unsigned int order)
         pg[i].count_info &= ~PGC_xen_heap;
     }
 
-    free_heap_pages(pg, order);
+    free_heap_pages(pg, order, 0);
 }
 
 #endif
@@ -1797,7 +2546,7 @@ struct page_info *alloc_domheap_pages(
     if ( d && !(memflags & MEMF_no_owner) &&
          assign_pages(d, pg, order, memflags) )
     {
-        free_heap_pages(pg, order);
+        free_heap_pages(pg, order, 0);
         return NULL;
     }
     
@@ -1847,7 +2596,10 @@ void free_domheap_pages(struct page_info *pg, unsigned int order)
             /*
              * Normally we expect a domain to clear pages before freeing them,
              * if it cares about the secrecy of their contents. However, after
-             * a domain has died we assume responsibility for erasure.
+             * a domain has died we assume responsibility for erasure. The
+             * pages are only marked here and get scrubbed in the background,
+             * so tearing down a large domain doesn't take time proportional
+             * to its size.
              */
             scrub = !!d->is_dying;
         }
@@ -1865,11 +2617,7 @@ void free_domheap_pages(struct page_info *pg, unsigned int order)
             scrub = 1;
         }
 
-        if ( unlikely(scrub) )
-            for ( i = 0; i < (1 << order); i++ )
-                scrub_one_page(&pg[i]);
-
-        free_heap_pages(pg, order);
+        free_heap_pages(pg, order, scrub);
     }
 
     if ( drop_dom_ref )
@@ -1967,7 +2715,11 @@ static void dump_heap(unsigned char key)
         for ( j = 0; j < NR_ZONES; j++ )
             printk("heap[node=%d][zone=%d] -> %lu pages\n",
                    i, j, avail[i][j]);
+        printk("heap[node=%d] -> %lu pages need scrubbing\n",
+               i, node_need_scrub[i]);
     }
+
+    printk("page caches -> %lu pages\n", page_cache_pages());
 }
 
 static __init int register_heap_trigger(void)
@@ -25,6 +25,7 @@
 #include <xen/trace.h>
 #include <xen/cpu.h>
 #include <xen/keyhandler.h>
+#include <xen/rbtree.h>
 
 /* Meant only for helping developers during debugging. */
 /* #define d2printk printk */
@@ -207,6 +208,10 @@
 static unsigned int __read_mostly opt_migrate_resist = 500;
 integer_param("sched_credit2_migrate_resist", opt_migrate_resist);
 
+/* Co-schedule the SMT siblings of a core (see "Core scheduling" below). */
+static bool_t __read_mostly opt_coresched;
+boolean_param("credit2_coresched", opt_coresched);
+
 /*
  * Useful macros
  */
@@ -371,13 +376,14 @@ struct csched2_runqueue_data {
     spinlock_t lock;      /* Lock for this runqueue. */
     cpumask_t active;      /* CPUs enabled for this runqueue */
 
-    struct list_head runq; /* Ordered list of runnable vms */
+    struct rb_root runq;   /* Runnable vcpus, ordered by credit */
     struct list_head svc;  /* List of all vcpus assigned to this runqueue */
     unsigned int max_weight;
 
     cpumask_t idle,        /* Currently idle pcpus */
         smt_idle,          /* Fully idle-and-untickled cores (see below) */
-        tickled;           /* Have been asked to go through schedule */
+        tickled,           /* Have been asked to go through schedule */
+        core_drain;        /* Cores being emptied, with core scheduling */
     int load;              /* Instantaneous load: Length of queue  + num non-idle threads */
     s_time_t load_last_update;  /* Last time average was updated */
     s_time_t avgload;           /* Decaying queue load */
@@ -407,7 +413,7 @@ struct csched2_private {
  */
 struct csched2_vcpu {
     struct list_head rqd_elem;         /* On the runqueue data list  */
-    struct list_head runq_elem;        /* On the runqueue            */
+    struct rb_node runq_elem;          /* On the runqueue            */
     struct csched2_runqueue_data *rqd; /* Up-pointer to the runqueue */
 
     /* Up-pointers */
@@ -421,6 +427,7 @@ struct csched2_vcpu {
     s_time_t start_time; /* When we were scheduled (used for credit) */
     unsigned flags;      /* 16 bits doesn't seem to play well with clear_bit() */
     int tickled_cpu;     /* cpu tickled for picking us up (-1 if none) */
+    unsigned int core_cpu; /* cpu we last ran on, for core scheduling */
 
     /* Individual contribution to load */
     s_time_t load_last_update;  /* Last time average was updated */
@@ -512,6 +519,119 @@ void smt_idle_mask_clear(unsigned int cpu, cpumask_t *mask)
     cpumask_andnot(mask, mask, per_cpu(cpu_sibling_mask, cpu));
 }
 
+/*
+ * Core scheduling.
+ *
+ * With credit2_coresched, the SMT siblings of a core only ever run vcpus
+ * of the same domain at the same time (the threads that do not have
+ * anything to run from such domain stay idle), so that a domain never
+ * shares a core with another one.
+ *
+ * All the siblings of a core are always in the same runqueue (even with
+ * credit2_runqueue=core), so the runqueue lock serializes their
+ * scheduling decisions, and protects all the state below:
+ *
+ *  - core_dom records, for each pcpu, the domain it is running, or that
+ *    it is still switching away from (until context_saved() for the last
+ *    vcpu of the domain that ran there). The domain of the non idle
+ *    siblings of a core "owns" the core: when a cpu schedules, it only
+ *    picks vcpus of such domain, or idle;
+ *
+ *  - when a vcpu of another domain has more credit than all the vcpus
+ *    of the owner that are running on (or about to be picked by) a core,
+ *    the core is drained: all its siblings are set in rqd->core_drain and
+ *    made to schedule, and they all pick idle. Once the last of them has
+ *    switched out (i.e., in context_saved()), the core is free. All the
+ *    siblings are then poked again, the first one to get to schedule picks
+ *    the best vcpu of the runqueue, and the others follow its domain.
+ *
+ * So a domain never enters a core before the previous one has left it
+ * completely, which is what gives the isolation. Credits still drive all
+ * the decisions, only at the granularity of a core.
+ */
+static DEFINE_PER_CPU(const struct domain *, core_dom);
+
+/*
+ * Is i a sibling of cpu that core scheduling coordinates with? Only the
+ * siblings in the same cpupool (and hence runqueue) as cpu are: one in
+ * another pool is scheduled by another scheduler, so no isolation from
+ * the domains running there is provided (see init_pdata()).
+ */
+static inline bool_t
+core_sibling(const struct csched2_runqueue_data *rqd, unsigned int cpu,
+             unsigned int i)
+{
+    return i != cpu && cpumask_test_cpu(i, &rqd->active) &&
+           per_cpu(cpupool, i) == per_cpu(cpupool, cpu);
+}
+
+/*
+ * Domain owning the core of cpu, as far as the siblings of cpu (i.e., not
+ * considering cpu itself) are concerned. NULL if none of them is busy.
+ */
+static const struct domain *
+core_owner(const struct csched2_runqueue_data *rqd, unsigned int cpu)
+{
+    unsigned int i;
+
+    for_each_cpu(i, per_cpu(cpu_sibling_mask, cpu))
+        if ( core_sibling(rqd, cpu, i) && per_cpu(core_dom, i) != NULL )
+            return per_cpu(core_dom, i);
+
+    return NULL;
+}
+
+/*
+ * Filter out of mask the cpus that could not run a vcpu of d right now,
+ * because their core belongs to another domain, or is being drained.
+ */
+static void
+core_filter(const struct csched2_runqueue_data *rqd, const struct domain *d,
+            cpumask_t *mask)
+{
+    unsigned int i;
+
+    for_each_cpu(i, mask)
+    {
+        const struct domain *owner = core_owner(rqd, i);
+
+        if ( cpumask_test_cpu(i, &rqd->core_drain) ||
+             (owner != NULL && owner != d) )
+            __cpumask_clear_cpu(i, mask);
+    }
+}
+
+/*
+ * Core scheduling: a vcpu of d has been switched out of cpu. If that was
+ * the last one of the domain on cpu, cpu is not using the core any longer,
+ * and if it was also the last one of a core being drained, the core is
+ * free and all the siblings can pick up work again.
+ */
+static void
+core_release(struct csched2_runqueue_data *rqd, unsigned int cpu,
+             const struct domain *d)
+{
+    unsigned int i;
+
+    if ( per_cpu(core_dom, cpu) != d || !is_idle_vcpu(curr_on_cpu(cpu)) )
+        return;
+
+    per_cpu(core_dom, cpu) = NULL;
+
+    if ( !cpumask_test_cpu(cpu, &rqd->core_drain) ||
+         core_owner(rqd, cpu) != NULL )
+        return;
+
+    for_each_cpu(i, per_cpu(cpu_sibling_mask, cpu))
+    {
+        if ( i != cpu && !core_sibling(rqd, cpu, i) )
+            continue;
+
+        __cpumask_clear_cpu(i, &rqd->core_drain);
+        cpu_raise_softirq(i, SCHEDULE_SOFTIRQ);
+    }
+}
+
 /*
  * When a hard affinity change occurs, we may not be able to check some
  * (any!) of the other runqueues, when looking for the best new processor
@@ -574,13 +694,13 @@ static s_time_t c2t(struct csched2_runqueue_data *rqd, s_time_t credit, struct c
 static /*inline*/ int
 __vcpu_on_runq(struct csched2_vcpu *svc)
 {
-    return !list_empty(&svc->runq_elem);
+    return !RB_EMPTY_NODE(&svc->runq_elem);
 }
 
 static /*inline*/ struct csched2_vcpu *
-__runq_elem(struct list_head *elem)
+__runq_elem(struct rb_node *elem)
 {
-    return list_entry(elem, struct csched2_vcpu, runq_elem);
+    return rb_entry(elem, struct csched2_vcpu, runq_elem);
 }
 
 /*
@@ -847,28 +967,45 @@ update_load(const struct scheduler *ops,
         __update_svc_load(ops, svc, change, now);
 }
 
-static int
-__runq_insert(struct list_head *runq, struct csched2_vcpu *svc)
+/*
+ * The runqueue is an rbtree sorted by decreasing credit, so the vcpu to
+ * run next is always rb_first().  Vcpus with equal credit go to the right
+ * of the ones already queued, which keeps them in FIFO order, exactly as
+ * the ordered list this replaces did.
+ */
+static void
+__runq_insert(struct rb_root *runq, struct csched2_vcpu *svc)
 {
-    struct list_head *iter;
-    int pos = 0;
+    struct rb_node **link = &runq->rb_node, *parent = NULL;
 
     ASSERT(&svc->rqd->runq == runq);
     ASSERT(!is_idle_vcpu(svc->vcpu));
     ASSERT(!svc->vcpu->is_running);
     ASSERT(!(svc->flags & CSFLAG_scheduled));
 
-    list_for_each( iter, runq )
+    while ( *link )
     {
-        struct csched2_vcpu * iter_svc = __runq_elem(iter);
-
-        if ( svc->credit > iter_svc->credit )
-            break;
+        parent = *link;
 
-        pos++;
+        if ( svc->credit > __runq_elem(parent)->credit )
+            link = &parent->rb_left;
+        else
+            link = &parent->rb_right;
     }
 
-    list_add_tail(&svc->runq_elem, iter);
+    rb_link_node(&svc->runq_elem, parent, link);
+    rb_insert_color(&svc->runq_elem, runq);
+}
+
+/* Position of svc in the runqueue.  O(n), only used for tracing. */
+static unsigned int
+__runq_pos(struct csched2_vcpu *svc)
+{
+    struct rb_node *iter = &svc->runq_elem;
+    unsigned int pos = 0;
+
+    while ( (iter = rb_prev(iter)) != NULL )
+        pos++;
 
     return pos;
 }
@@ -877,15 +1014,14 @@ static void
 runq_insert(const struct scheduler *ops, struct csched2_vcpu *svc)
 {
     unsigned int cpu = svc->vcpu->processor;
-    struct list_head * runq = &RQD(ops, cpu)->runq;
-    int pos = 0;
+    struct rb_root *runq = &RQD(ops, cpu)->runq;
 
     ASSERT(spin_is_locked(per_cpu(schedule_data, cpu).schedule_lock));
 
     ASSERT(!__vcpu_on_runq(svc));
     ASSERT(c2r(ops, cpu) == c2r(ops, svc->vcpu->processor));
 
-    pos = __runq_insert(runq, svc);
+    __runq_insert(runq, svc);
 
     if ( unlikely(tb_init_done) )
     {
@@ -895,7 +1031,7 @@ runq_insert(const struct scheduler *ops, struct csched2_vcpu *svc)
         } d;
         d.dom = svc->vcpu->domain->domain_id;
         d.vcpu = svc->vcpu->vcpu_id;
-        d.pos = pos;
+        d.pos = __runq_pos(svc);
         __trace_var(TRC_CSCHED2_RUNQ_POS, 1,
                     sizeof(d),
                     (unsigned char *)&d);
@@ -908,7 +1044,8 @@ static inline void
 __runq_remove(struct csched2_vcpu *svc)
 {
     ASSERT(__vcpu_on_runq(svc));
-    list_del_init(&svc->runq_elem);
+    rb_erase(&svc->runq_elem, &svc->rqd->runq);
+    RB_CLEAR_NODE(&svc->runq_elem);
 }
 
 void burn_credits(struct csched2_runqueue_data *rqd, struct csched2_vcpu *, s_time_t);
@@ -973,6 +1110,8 @@ runq_tickle(const struct scheduler *ops, struct csched2_vcpu *new, s_time_t now)
     else
         cpumask_copy(&mask, &rqd->smt_idle);
     cpumask_and(&mask, &mask, cpumask_scratch_cpu(cpu));
+    if ( unlikely(opt_coresched) )
+        core_filter(rqd, new->vcpu->domain, &mask);
     i = cpumask_test_or_cycle(cpu, &mask);
     if ( i < nr_cpu_ids )
     {
@@ -984,10 +1123,14 @@ runq_tickle(const struct scheduler *ops, struct csched2_vcpu *new, s_time_t now)
     /*
      * If there are no fully idle cores, check all idlers, after
      * having filtered out pcpus that have been tickled but haven't
-     * gone through the scheduler yet.
+     * gone through the scheduler yet. With core scheduling, idlers on
+     * cores owned by other domains are left out: new can only get there
+     * by preempting their busy siblings (which is considered below).
      */
     cpumask_andnot(&mask, &rqd->idle, &rqd->tickled);
     cpumask_and(&mask, &mask, cpumask_scratch_cpu(cpu));
+    if ( unlikely(opt_coresched) )
+        core_filter(rqd, new->vcpu->domain, &mask);
     i = cpumask_test_or_cycle(cpu, &mask);
     if ( i < nr_cpu_ids )
     {
@@ -1115,6 +1258,11 @@ static void reset_credit(const struct scheduler *ops, int cpu, s_time_t now,
      * Rather than looping, however, we just calculate a multiplier,
      * avoiding an integer division and multiplication in the common
      * case.
+     *
+     * Credits of vcpus sitting in the runqueue are changed in place: the
+     * same amount is added to everyone, and then everyone is clipped to
+     * the same maximum, so their relative order never inverts and the
+     * runqueue rbtree does not need to be rebuilt.
      */
     m = 1;
     if ( snext->credit < -CSCHED2_CREDIT_INIT )
@@ -1292,7 +1440,7 @@ csched2_alloc_vdata(const struct scheduler *ops, struct vcpu *vc, void *dd)
         return NULL;
 
     INIT_LIST_HEAD(&svc->rqd_elem);
-    INIT_LIST_HEAD(&svc->runq_elem);
+    RB_CLEAR_NODE(&svc->runq_elem);
 
     svc->sdom = dd;
     svc->vcpu = vc;
@@ -1475,6 +1623,7 @@ csched2_context_saved(const struct scheduler *ops, struct vcpu *vc)
     struct csched2_vcpu * const svc = CSCHED2_VCPU(vc);
     spinlock_t *lock = vcpu_schedule_lock_irq(vc);
     s_time_t now = NOW();
+    unsigned int core_cpu = svc->core_cpu;
 
     BUG_ON( !is_idle_vcpu(vc) && svc->rqd != RQD(ops, vc->processor));
     ASSERT(is_idle_vcpu(vc) || svc->rqd == RQD(ops, vc->processor));
@@ -1502,6 +1651,20 @@ csched2_context_saved(const struct scheduler *ops, struct vcpu *vc)
         update_load(ops, svc->rqd, svc, -1, now);
 
     vcpu_schedule_unlock_irq(lock, vc);
+
+    /*
+     * is_running has been cleared already, so vc may have been moved to
+     * another pcpu (and runqueue) by now, and, as soon as it is back on a
+     * runqueue, be picked and have core_cpu overwritten: that is why the
+     * pcpu it ran on is sampled above, before runq_insert(). Releasing
+     * that needs that pcpu's lock.
+     */
+    if ( unlikely(opt_coresched) && !is_idle_vcpu(vc) )
+    {
+        lock = pcpu_schedule_lock_irq(core_cpu);
+        core_release(RQD(ops, core_cpu), core_cpu, vc->domain);
+        pcpu_schedule_unlock_irq(lock, core_cpu);
+    }
 }
 
 #define MAX_LOAD (STIME_MAX);
@@ -2183,7 +2346,7 @@ csched2_vcpu_insert(const struct scheduler *ops, struct vcpu *vc)
     spinlock_t *lock;
 
     ASSERT(!is_idle_vcpu(vc));
-    ASSERT(list_empty(&svc->runq_elem));
+    ASSERT(!__vcpu_on_runq(svc));
 
     /* csched2_cpu_pick() expects the pcpu lock to be held */
     lock = vcpu_schedule_lock_irq(vc);
@@ -2221,7 +2384,7 @@ csched2_vcpu_remove(const struct scheduler *ops, struct vcpu *vc)
     spinlock_t *lock;
 
     ASSERT(!is_idle_vcpu(vc));
-    ASSERT(list_empty(&svc->runq_elem));
+    ASSERT(!__vcpu_on_runq(svc));
 
     SCHED_STAT_CRANK(vcpu_remove);
 
@@ -2243,15 +2406,26 @@ csched2_runtime(const struct scheduler *ops, int cpu,
     s_time_t time, min_time;
     int rt_credit; /* Proposed runtime measured in credits */
     struct csched2_runqueue_data *rqd = RQD(ops, cpu);
-    struct list_head *runq = &rqd->runq;
+    struct rb_node *first = rb_first(&rqd->runq);
     struct csched2_private *prv = CSCHED2_PRIV(ops);
 
     /*
      * If we're idle, just stay so. Others (or external events)
      * will poke us when necessary.
+     *
+     * With core scheduling, that is not the case if we are still holding
+     * on to our core, or waiting for it to be drained: nobody tickles a
+     * pcpu in core_drain, so if a core_release() got lost, we would never
+     * get to schedule (and, in csched2_schedule(), notice it) again.
      */
     if ( is_idle_vcpu(snext->vcpu) )
+    {
+        if ( unlikely(opt_coresched) &&
+             (per_cpu(core_dom, cpu) != NULL ||
+              cpumask_test_cpu(cpu, &rqd->core_drain)) )
+            return CSCHED2_MAX_TIMER;
         return -1;
+    }
 
     /* General algorithm:
      * 1) Run until snext's credit will be 0
@@ -2278,9 +2452,9 @@ csched2_runtime(const struct scheduler *ops, int cpu,
 
     /* 2) If there's someone waiting whose credit is positive,
      * run until your credit ~= his */
-    if ( ! list_empty(runq) )
+    if ( first != NULL )
     {
-        struct csched2_vcpu *swait = __runq_elem(runq->next);
+        struct csched2_vcpu *swait = __runq_elem(first);
 
         if ( ! is_idle_vcpu(swait->vcpu)
              && swait->credit > 0 )
@@ -2322,6 +2496,62 @@ csched2_runtime(const struct scheduler *ops, int cpu,
 
 void __dump_execstate(void *unused);
 
+/*
+ * Core scheduling: should the core of cpu be handed over to the domain of
+ * sforeign? That is the case if sforeign has more credit than snext, and
+ * than any vcpu running on the siblings of cpu.
+ */
+static bool_t
+core_should_drain(struct csched2_runqueue_data *rqd, unsigned int cpu,
+                  struct csched2_vcpu *snext, struct csched2_vcpu *sforeign,
+                  s_time_t now)
+{
+    unsigned int i;
+
+    if ( sforeign->credit <= snext->credit )
+        return 0;
+
+    for_each_cpu(i, per_cpu(cpu_sibling_mask, cpu))
+    {
+        struct csched2_vcpu *cur;
+
+        if ( !core_sibling(rqd, cpu, i) )
+            continue;
+
+        cur = CSCHED2_VCPU(curr_on_cpu(i));
+        if ( is_idle_vcpu(cur->vcpu) )
+            continue;
+
+        burn_credits(rqd, cur, now);
+        if ( cur->credit >= sforeign->credit )
+            return 0;
+    }
+
+    return 1;
+}
+
+/*
+ * Core scheduling: start draining the core of cpu. Its siblings are made
+ * to schedule, and will pick idle until the core is empty.
+ */
+static void
+core_drain(struct csched2_runqueue_data *rqd, unsigned int cpu)
+{
+    unsigned int i;
+
+    for_each_cpu(i, per_cpu(cpu_sibling_mask, cpu))
+    {
+        if ( i != cpu && !core_sibling(rqd, cpu, i) )
+            continue;
+
+        __cpumask_set_cpu(i, &rqd->core_drain);
+        if ( i != cpu && per_cpu(core_dom, i) != NULL )
+            cpu_raise_softirq(i, SCHEDULE_SOFTIRQ);
+    }
+
+    SCHED_STAT_CRANK(core_drained);
+}
+
 /*
  * Find a candidate.
  */
@@ -2329,14 +2559,17 @@ static struct csched2_vcpu *
 runq_candidate(struct csched2_runqueue_data *rqd,
                struct csched2_vcpu *scurr,
                int cpu, s_time_t now,
+               const struct domain *owner,
+               struct csched2_vcpu **sforeign,
                unsigned int *skipped)
 {
-    struct list_head *iter;
+    struct rb_node *iter;
     struct csched2_vcpu *snext = NULL;
     struct csched2_private *prv = CSCHED2_PRIV(per_cpu(scheduler, cpu));
     bool yield = __test_and_clear_bit(__CSFLAG_vcpu_yield, &scurr->flags);
 
     *skipped = 0;
+    *sforeign = NULL;
 
     /*
      * Return the current vcpu if it has executed for less than ratelimit.
@@ -2374,9 +2607,9 @@ runq_candidate(struct csched2_runqueue_data *rqd,
     else
         snext = CSCHED2_VCPU(idle_vcpu[cpu]);
 
-    list_for_each( iter, &rqd->runq )
+    for ( iter = rb_first(&rqd->runq); iter != NULL; iter = rb_next(iter) )
     {
-        struct csched2_vcpu * svc = list_entry(iter, struct csched2_vcpu, runq_elem);
+        struct csched2_vcpu * svc = __runq_elem(iter);
 
         /* Only consider vcpus that are allowed to run on this processor. */
         if ( !cpumask_test_cpu(cpu, svc->vcpu->cpu_hard_affinity) )
@@ -2397,6 +2630,19 @@ runq_candidate(struct csched2_runqueue_data *rqd,
             continue;
         }
 
+        /*
+         * With core scheduling, only vcpus of the domain owning the core
+         * can run here. Remember the best of the others, though, as our
+         * caller may want to drain the core in its favour.
+         */
+        if ( owner != NULL && svc->vcpu->domain != owner )
+        {
+            if ( *sforeign == NULL )
+                *sforeign = svc;
+            (*skipped)++;
+            continue;
+        }
+
         /*
          * If this is on a different processor, don't pull it unless
          * its credit is at least CSCHED2_MIGRATE_RESIST higher.
@@ -2523,8 +2769,31 @@ csched2_schedule(
         trace_var(TRC_CSCHED2_SCHED_TASKLET, 1, 0, NULL);
         snext = CSCHED2_VCPU(idle_vcpu[cpu]);
     }
+    else if ( unlikely(opt_coresched) &&
+              cpumask_test_cpu(cpu, &rqd->core_drain) )
+    {
+        /* Our core is being handed over to another domain: stay out. */
+        __clear_bit(__CSFLAG_vcpu_yield, &scurr->flags);
+        snext = CSCHED2_VCPU(idle_vcpu[cpu]);
+    }
     else
-        snext = runq_candidate(rqd, scurr, cpu, now, &skipped_vcpus);
+    {
+        const struct domain *owner = NULL;
+        struct csched2_vcpu *sforeign;
+
+        if ( unlikely(opt_coresched) )
+            owner = core_owner(rqd, cpu);
+
+        snext = runq_candidate(rqd, scurr, cpu, now, owner, &sforeign,
+                               &skipped_vcpus);
+
+        if ( unlikely(sforeign != NULL) &&
+             core_should_drain(rqd, cpu, snext, sforeign, now) )
+        {
+            core_drain(rqd, cpu);
+            snext = CSCHED2_VCPU(idle_vcpu[cpu]);
+        }
+    }
 
     /* If switching from a non-idle runnable vcpu, put it
      * back on the runqueue. */
@@ -2578,6 +2847,12 @@ csched2_schedule(
         snext->start_time = now;
         snext->tickled_cpu = -1;
 
+        if ( unlikely(opt_coresched) )
+        {
+            this_cpu(core_dom) = snext->vcpu->domain;
+            snext->core_cpu = cpu;
+        }
+
         /* Safe because lock for old processor is held */
         if ( snext->vcpu->processor != cpu )
         {
@@ -2610,6 +2885,19 @@ csched2_schedule(
         /* Make sure avgload gets updated periodically even
          * if there's no activity */
         update_load(ops, rqd, NULL, 0, now);
+
+        /*
+         * Going from idle to idle, so the last vcpu that ran here has been
+         * switched out already. If we still hold on to the core, or are
+         * still waiting for it to drain, a release has been missed: do it
+         * now, or the core (and, if it was being drained, all its
+         * siblings) would stay idle for good. csched2_runtime() makes sure
+         * we get here.
+         */
+        if ( unlikely(opt_coresched) && is_idle_vcpu(scurr->vcpu) &&
+             (this_cpu(core_dom) != NULL ||
+              cpumask_test_cpu(cpu, &rqd->core_drain)) )
+            core_release(rqd, cpu, this_cpu(core_dom));
     }
 
     /*
@@ -2707,6 +2995,12 @@ csched2_dump(const struct scheduler *ops)
         printk("\ttickled: %s\n", cpustr);
         cpumask_scnprintf(cpustr, sizeof(cpustr), &prv->rqd[i].smt_idle);
         printk("\tfully idle cores: %s\n", cpustr);
+        if ( opt_coresched )
+        {
+            cpumask_scnprintf(cpustr, sizeof(cpustr),
+                              &prv->rqd[i].core_drain);
+            printk("\tdraining cores: %s\n", cpustr);
+        }
     }
 
     printk("Domain info:\n");
@@ -2740,7 +3034,7 @@ csched2_dump(const struct scheduler *ops)
     for_each_cpu(i, &prv->active_queues)
     {
         struct csched2_runqueue_data *rqd = prv->rqd + i;
-        struct list_head *iter, *runq = &rqd->runq;
+        struct rb_node *iter;
         int loop = 0;
 
         /* We need the lock to scan the runqueue. */
@@ -2752,7 +3046,7 @@ csched2_dump(const struct scheduler *ops)
             dump_pcpu(ops, j);
 
         printk("RUNQ:\n");
-        list_for_each( iter, runq )
+        for ( iter = rb_first(&rqd->runq); iter != NULL; iter = rb_next(iter) )
         {
             struct csched2_vcpu *svc = __runq_elem(iter);
 
@@ -2780,7 +3074,7 @@ static void activate_runqueue(struct csched2_private *prv, int rqi)
     rqd->max_weight = 1;
     rqd->id = rqi;
     INIT_LIST_HEAD(&rqd->svc);
-    INIT_LIST_HEAD(&rqd->runq);
+    rqd->runq = RB_ROOT;
     spin_lock_init(&rqd->lock);
 
     __cpumask_set_cpu(rqi, &prv->active_queues);
@@ -2889,6 +3183,25 @@ init_pdata(struct csched2_private *prv, unsigned int cpu)
     __cpumask_set_cpu(cpu, &rqd->active);
     __cpumask_set_cpu(cpu, &prv->initialized);
     __cpumask_set_cpu(cpu, &rqd->smt_idle);
+    per_cpu(core_dom, cpu) = NULL;
+
+    /*
+     * Core scheduling only coordinates the siblings within one cpupool
+     * (see core_sibling()). Tell the admin if that leaves a core shared.
+     */
+    if ( opt_coresched )
+    {
+        cpumask_andnot(cpumask_scratch_cpu(cpu), per_cpu(cpu_sibling_mask, cpu),
+                       &prv->initialized);
+        cpumask_and(cpumask_scratch_cpu(cpu), cpumask_scratch_cpu(cpu),
+                    &cpu_online_map);
+        cpumask_andnot(cpumask_scratch_cpu(cpu), cpumask_scratch_cpu(cpu),
+                       &cpupool_free_cpus);
+        if ( !cpumask_empty(cpumask_scratch_cpu(cpu)) )
+            printk(XENLOG_WARNING
+                   "credit2: cpu %u shares its core with cpus of another "
+                   "cpupool, core scheduling will not isolate them\n", cpu);
+    }
 
     return rqi;
 }
@@ -2995,6 +3308,7 @@ csched2_deinit_pdata(const struct scheduler *ops, void *pcpu, int cpu)
 
     __cpumask_clear_cpu(cpu, &rqd->idle);
     __cpumask_clear_cpu(cpu, &rqd->smt_idle);
+    __cpumask_clear_cpu(cpu, &rqd->core_drain);
     __cpumask_clear_cpu(cpu, &rqd->active);
 
     if ( cpumask_empty(&rqd->active) )
@@ -3024,12 +3338,14 @@ csched2_init(struct scheduler *ops)
            XENLOG_INFO " load_window_shift: %d\n"
            XENLOG_INFO " underload_balance_tolerance: %d\n"
            XENLOG_INFO " overload_balance_tolerance: %d\n"
-           XENLOG_INFO " runqueues arrangement: %s\n",
+           XENLOG_INFO " runqueues arrangement: %s\n"
+           XENLOG_INFO " core scheduling: %s\n",
            opt_load_precision_shift,
            opt_load_window_shift,
            opt_underload_balance_tolerance,
            opt_overload_balance_tolerance,
-           opt_runqueue_str[opt_runqueue]);
+           opt_runqueue_str[opt_runqueue],
+           opt_coresched ? "enabled" : "disabled");
 
     if ( opt_load_precision_shift < LOADAVG_PRECISION_SHIFT_MIN )
     {
@@ -137,6 +137,16 @@ static inline void vcpu_urgent_count_update(struct vcpu *v)
     }
 }
 
+static inline void sched_hist_add(struct xen_sched_hist *hist, s_time_t delta)
+{
+    uint64_t t = delta > 0 ? (uint64_t)delta >> XEN_SCHED_HIST_SHIFT : 0;
+    unsigned int b = (t >> 32) ? XEN_SCHED_HIST_BUCKETS - 1 : fls((uint32_t)t);
+
+    hist->count[min(b, XEN_SCHED_HIST_BUCKETS - 1U)]++;
+    if ( delta > 0 )
+        hist->total += delta;
+}
+
 static inline void vcpu_runstate_change(
     struct vcpu *v, int new_state, s_time_t new_entry_time)
 {
@@ -150,6 +160,13 @@ static inline void vcpu_runstate_change(
     trace_runstate_change(v, new_state);
 
     delta = new_entry_time - v->runstate.state_entry_time;
+
+    if ( v->runstate.state == RUNSTATE_running )
+        sched_hist_add(&v->slice_hist, delta);
+    else if ( v->runstate.state == RUNSTATE_runnable &&
+              new_state == RUNSTATE_running )
+        sched_hist_add(&v->run_delay_hist, delta);
+
     if ( delta > 0 )
     {
         v->runstate.time[v->runstate.state] += delta;
@@ -173,6 +190,25 @@ void vcpu_runstate_get(struct vcpu *v, struct vcpu_runstate_info *runstate)
         vcpu_schedule_unlock_irq(lock, v);
 }
 
+/* Add the scheduling histograms of v to run_delay and slice. */
+void vcpu_sched_hist_get(struct vcpu *v, struct xen_sched_hist *run_delay,
+                         struct xen_sched_hist *slice)
+{
+    spinlock_t *lock = likely(v == current) ? NULL : vcpu_schedule_lock_irq(v);
+    unsigned int i;
+
+    for ( i = 0; i < XEN_SCHED_HIST_BUCKETS; i++ )
+    {
+        run_delay->count[i] += v->run_delay_hist.count[i];
+        slice->count[i] += v->slice_hist.count[i];
+    }
+    run_delay->total += v->run_delay_hist.total;
+    slice->total += v->slice_hist.total;
+
+    if ( unlikely(lock != NULL) )
+        vcpu_schedule_unlock_irq(lock, v);
+}
+
 uint64_t get_cpu_idle_time(unsigned int cpu)
 {
     struct vcpu_runstate_info state = { 0 };
@@ -89,6 +89,11 @@ struct page_info
         struct {
             /* Do TLBs need flushing for safety before next page use? */
             bool_t need_tlbflush;
+            /*
+             * Buddy heads only: index of the first page in the buddy that
+             * may still need scrubbing, or INVALID_DIRTY_IDX if none does.
+             */
+            unsigned int first_dirty;
         } free;
 
     } u;
@@ -209,6 +214,9 @@ struct page_info
  /* Cleared when the owning guest 'frees' this page. */
 #define _PGC_allocated    PG_shift(1)
 #define PGC_allocated     PG_mask(1, 1)
+ /* Free page still holds a dead guest's data (free pages only). */
+#define _PGC_need_scrub   _PGC_allocated
+#define PGC_need_scrub    PGC_allocated
  /* Page is Xen heap? */
 #define _PGC_xen_heap     PG_shift(2)
 #define PGC_xen_heap      PG_mask(1, 2)
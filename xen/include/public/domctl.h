@@ -1145,6 +1145,42 @@ struct xen_domctl_psr_cat_op {
 typedef struct xen_domctl_psr_cat_op xen_domctl_psr_cat_op_t;
 DEFINE_XEN_GUEST_HANDLE(xen_domctl_psr_cat_op_t);
 
+/*
+ * XEN_DOMCTL_get_sched_hist
+ *
+ * Scheduling latency histograms, always kept by the hypervisor for each
+ * vcpu:
+ *  - run_delay: for how long the vcpu waited, runnable, for a pcpu, each
+ *    time it was given one;
+ *  - slice: for how long the vcpu ran, each time it was given a pcpu.
+ *
+ * Buckets are powers of two: count[0] is the number of events shorter
+ * than 2^XEN_SCHED_HIST_SHIFT ns, count[i] the number of events lasting
+ * [2^(i-1+XEN_SCHED_HIST_SHIFT), 2^(i+XEN_SCHED_HIST_SHIFT)) ns, and the
+ * last bucket also counts everything longer than that.
+ *
+ * The histograms are the ones of a single vcpu, or the sum of the ones of
+ * all the vcpus of the domain, if vcpu is XEN_DOMCTL_SCHED_HIST_ALL.
+ */
+#define XEN_SCHED_HIST_BUCKETS 20
+#define XEN_SCHED_HIST_SHIFT   10
+struct xen_sched_hist {
+    uint64_aligned_t count[XEN_SCHED_HIST_BUCKETS];
+    uint64_aligned_t total;   /* Sum of the length of all the events (ns) */
+};
+typedef struct xen_sched_hist xen_sched_hist_t;
+DEFINE_XEN_GUEST_HANDLE(xen_sched_hist_t);
+
+struct xen_domctl_sched_hist {
+#define XEN_DOMCTL_SCHED_HIST_ALL (~0U)
+    uint32_t vcpu;                                      /* IN */
+    uint32_t pad;
+    XEN_GUEST_HANDLE_64(xen_sched_hist_t) run_delay;    /* OUT */
+    XEN_GUEST_HANDLE_64(xen_sched_hist_t) slice;        /* OUT */
+};
+typedef struct xen_domctl_sched_hist xen_domctl_sched_hist_t;
+DEFINE_XEN_GUEST_HANDLE(xen_domctl_sched_hist_t);
+
 struct xen_domctl {
     uint32_t cmd;
 #define XEN_DOMCTL_createdomain                   1
@@ -1222,6 +1258,7 @@ struct xen_domctl {
 #define XEN_DOMCTL_monitor_op                    77
 #define XEN_DOMCTL_psr_cat_op                    78
 #define XEN_DOMCTL_soft_reset                    79
+#define XEN_DOMCTL_get_sched_hist                80
 #define XEN_DOMCTL_gdbsx_guestmemio            1000
 #define XEN_DOMCTL_gdbsx_pausevcpu             1001
 #define XEN_DOMCTL_gdbsx_unpausevcpu           1002
@@ -1284,6 +1321,7 @@ struct xen_domctl {
         struct xen_domctl_psr_cmt_op        psr_cmt_op;
         struct xen_domctl_monitor_op        monitor_op;
         struct xen_domctl_psr_cat_op        psr_cat_op;
+        struct xen_domctl_sched_hist        sched_hist;
         uint8_t                             pad[128];
     } u;
 };
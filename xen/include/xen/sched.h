@@ -175,6 +175,10 @@ struct vcpu
     /* last time when vCPU is scheduled out */
     uint64_t last_run_time;
 
+    /* Run delay and slice length histograms (XEN_DOMCTL_get_sched_hist). */
+    struct xen_sched_hist run_delay_hist;
+    struct xen_sched_hist slice_hist;
+
     /* Has the FPU been initialised? */
     bool             fpu_initialised;
     /* Has the FPU been used since it was last saved? */
@@ -846,6 +850,8 @@ void restore_vcpu_affinity(struct domain *d);
 int vcpu_pin_override(struct vcpu *v, int cpu);
 
 void vcpu_runstate_get(struct vcpu *v, struct vcpu_runstate_info *runstate);
+void vcpu_sched_hist_get(struct vcpu *v, struct xen_sched_hist *run_delay,
+                         struct xen_sched_hist *slice);
 uint64_t get_cpu_idle_time(unsigned int cpu);
 
 /*
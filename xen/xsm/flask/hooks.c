@@ -657,6 +657,7 @@ static int flask_domctl(struct domain *d, int cmd)
         return current_has_perm(d, SECCLASS_DOMAIN, DOMAIN__GETVCPUCONTEXT);
 
     case XEN_DOMCTL_getvcpuinfo:
+    case XEN_DOMCTL_get_sched_hist:
         return current_has_perm(d, SECCLASS_DOMAIN, DOMAIN__GETVCPUINFO);
 
     case XEN_DOMCTL_settimeoffset: